@@ -38,6 +38,9 @@ extern "C" {
 /** Handle for a projfs filesystem */
 struct projfs;
 
+/** Size of the content hash which may be reported with events */
+#define PROJFS_CONTENT_HASH_SIZE	32	/* SHA-256 digest length */
+
 /** Filesystem event */
 struct projfs_event {
 	struct projfs *fs;
@@ -46,6 +49,21 @@ struct projfs_event {
 	const char *path;
 	const char *target_path;	/* move destination or link target */
 	int fd;				/* file descriptor for projection */
+	const unsigned char *content_hash;	/* SHA-256 of file, or NULL */
+	off_t offset;			/* start of chunk to project */
+	off_t length;			/* length of chunk, or 0 for all */
+};
+
+/** Types of events read from the event queue */
+#define PROJFS_EVENT_PROJ	0x01	/* Projection request */
+#define PROJFS_EVENT_NOTIFY	0x02	/* Event notification */
+#define PROJFS_EVENT_PERM	0x03	/* Permission request */
+
+/** Event read from the event queue, with a token for its reply */
+struct projfs_queued_event {
+	struct projfs_event event;
+	unsigned int type;		/* PROJFS_EVENT_* type */
+	uint64_t token;			/* for projfs_reply_event() */
 };
 
 /** File projection attribute */
@@ -55,6 +73,31 @@ struct projfs_attr {
 	ssize_t size;			/* length of the value data, or -1 */
 };
 
+/**
+ * Reserved projection attribute name for the content version of a
+ * placeholder, such as a blob ID, ETag, or generation number.
+ *
+ * The content version may be supplied when creating placeholders, either
+ * singly or in a batch, and may be updated by batch operations; it may be
+ * read with \p projfs_get_attrs() but not written with \p projfs_set_attrs().
+ * It is retained when a placeholder is populated, and removed once the
+ * file or directory is modified and no longer projected.
+ *
+ * When the filesystem is mounted with the shared=DIR option, an empty
+ * placeholder file whose content version and size match those of a regular
+ * file at the same relative path under DIR will be read from that file,
+ * without a projection request, and its content copied from that file
+ * when it is first written.  The shared layer is never modified, so it
+ * may be populated once and shared read-only by many filesystems.
+ *
+ * A file opened read-only from the shared layer reports the attributes of
+ * its placeholder, but it continues to read the shared content until it is
+ * closed, even if the file is written through another file descriptor in
+ * the meantime; as with overlayfs, only files opened later read the
+ * changed content.
+ */
+#define PROJFS_ATTR_VERSION		"version"
+
 /**
  * Filesystem event handlers
  *
@@ -68,6 +111,17 @@ struct projfs_handlers {
 	 * @return Zero on success or a negated errno(3) code on failure.
 	 * @note When event->mask contains PROJFS_ONDIR, the file
 	 *       descriptor in event->fd will be NULL.
+	 *       If the filesystem was mounted with the chunk_size=KIB
+	 *       option, files larger than KIB kibibytes are projected
+	 *       through a series of events, each with a non-zero
+	 *       event->length, which request that only that many bytes
+	 *       be written starting at event->offset.  These events are
+	 *       handled concurrently by up to chunk_threads=N threads
+	 *       (by default, one per online CPU) and share a file
+	 *       descriptor, so the handler must write with pwrite(2) or
+	 *       similar.  A failed chunk event is retried up to
+	 *       chunk_retries=N times (by default, none), and the file
+	 *       remains unprojected unless all chunks succeed.
 	 */
 	int (*handle_proj_event) (struct projfs_event *event);
 
@@ -78,6 +132,26 @@ struct projfs_handlers {
 	 * @return Zero on success or a negated errno(3) code on failure.
 	 * @note If event->target_path is non-NULL, the event was a
 	 *       rename(2) or link(2) filesystem operation.
+	 *       If the filesystem was mounted with the write-hash option,
+	 *       and a PROJFS_CLOSE_WRITE event's file was written only
+	 *       sequentially from its start through the closed file
+	 *       descriptor, and was neither written nor truncated through
+	 *       any other file descriptor or path within the mount while
+	 *       that descriptor was open, event->content_hash will point
+	 *       to the PROJFS_CONTENT_HASH_SIZE bytes of the SHA-256 digest
+	 *       of the file's content; otherwise it will be NULL.
+	 *       If the filesystem was mounted with the notify_lanes=N
+	 *       option, notifications are handled asynchronously by N
+	 *       threads, each of which delivers the events for the
+	 *       entries of a given set of directories in the order in
+	 *       which they occurred; events for entries in different
+	 *       directories may be handled concurrently.  An event which
+	 *       moves or links an entry into another directory, or
+	 *       creates, deletes, or moves a directory, is ordered with
+	 *       the events for the entries of every directory it changes,
+	 *       including those within a directory it creates or deletes.
+	 *       The event's strings remain valid only until the handler
+	 *       returns.
 	 */
 	int (*handle_notify_event) (struct projfs_event *event);
 
@@ -92,6 +166,29 @@ struct projfs_handlers {
 	 *       rename(2) or link(2) filesystem operation.
 	 */
 	int (*handle_perm_event) (struct projfs_event *event);
+
+	/**
+	 * Handle a batch of projection requests for files.
+	 *
+	 * @param events Array of filesystem projection events.
+	 * @param results Array in which to record the result of each event,
+	 *                as zero on success or a negated errno(3) code on
+	 *                failure; all items are initially zero.
+	 * @param nevents Number of items in the events and results arrays.
+	 * @return Zero on success, or a negated errno(3) code to fail
+	 *         all the events.
+	 * @note This handler is only used if the filesystem was mounted
+	 *       with the proj_batch=MSEC option, in which case projection
+	 *       requests for files from concurrent file operations are
+	 *       gathered for up to MSEC milliseconds and delivered through
+	 *       this handler instead of handle_proj_event(); requests for
+	 *       directories are always delivered through handle_proj_event().
+	 *       Each file remains locked against projection by other file
+	 *       operations until its batch has been handled, but the
+	 *       directory containing it does not.
+	 */
+	int (*handle_proj_batch) (struct projfs_event *events, int *results,
+				  unsigned int nevents);
 };
 
 /**
@@ -111,6 +208,181 @@ struct projfs *projfs_new(const char *lowerdir, const char *mountdir,
  */
 void *projfs_get_user_data(struct projfs *fs);
 
+/**
+ * Report the number of notifications awaiting delivery, or being handled,
+ * in each of the ordered notification lanes of a projfs filesystem mounted
+ * with the notify_lanes option.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[out] depths Array to receive the queue depth of each lane; may be
+ *                    NULL if ndepths is zero.
+ * @param[in] ndepths Number of items in the depths array.
+ * @return Number of notification lanes, which may exceed ndepths, or zero
+ *         if notifications are not being delivered through lanes.
+ */
+unsigned int projfs_get_lane_depths(struct projfs *fs, unsigned int *depths,
+				    unsigned int ndepths);
+
+/** Kinds of heavy hitters tracked with the hot_paths option */
+#define PROJFS_HOT_OPS		0	/* File operations, by count */
+#define PROJFS_HOT_LOCK_WAITS	1	/* Projection state lock contentions */
+#define PROJFS_HOT_UPCALLS	2	/* Handler calls, by microseconds */
+
+/** Path reported by \p projfs_get_hot_paths() */
+struct projfs_hot_path {
+	const char *op;			/* operation or event name */
+	char *path;			/* relative path; free() when done */
+	uint64_t count;			/* estimated total; never too low */
+};
+
+/**
+ * Report the paths most often accessed by file operations, most often
+ * contended while projecting them, or longest waited on for handler calls,
+ * in a projfs filesystem mounted with the hot_paths=N option.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[in] kind One of the PROJFS_HOT_* kinds of heavy hitter.
+ * @param[out] paths Array to receive the heaviest paths of the given kind,
+ *                   heaviest first; the caller must free each path.
+ * @param[in] npaths Number of items in the paths array.
+ * @return Number of items filled, or zero if heavy hitters are not being
+ *         tracked.
+ * @note Each kind is tracked in constant memory, with a count-min sketch
+ *       of every path and a set of the N heaviest (up to 256), so counts
+ *       are estimates which may exceed, but never fall short of, the true
+ *       totals.  Operations are keyed by name and path, lock contentions
+ *       are counted per lock acquisition which had to wait, and handler
+ *       calls are keyed by event type and weighted by the microseconds a
+ *       file operation waited for them.  Tracking adds a locked update to
+ *       every file operation, so it is intended for diagnosis only.
+ */
+unsigned int projfs_get_hot_paths(struct projfs *fs, unsigned int kind,
+				  struct projfs_hot_path *paths,
+				  unsigned int npaths);
+
+/**
+ * Retrieve the event queue file descriptor of a projfs filesystem mounted
+ * with the event_queue option.
+ *
+ * In this mode, no event handlers are called; instead, all events are
+ * queued, and the returned \p eventfd(2) file descriptor becomes readable
+ * whenever unread events are queued, so that it may be monitored with
+ * \p poll(2) or \p epoll(7) in the caller's own event loop.  Queued events
+ * should then be read with \p projfs_read_events().
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @return Event queue file descriptor, or -1 if the filesystem was not
+ *         mounted with the event_queue option.
+ * @note The file descriptor is owned by the library and is closed by
+ *       \p projfs_stop(); it should not be read directly.
+ */
+int projfs_get_event_fd(struct projfs *fs);
+
+/**
+ * Read a batch of events from the event queue of a projfs filesystem
+ * mounted with the event_queue option, in the order they were queued.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[out] events Array in which to return events.
+ * @param[in] nevents Maximum number of events to return.
+ * @return Number of events returned, which may be zero if none are
+ *         queued, or a negated \p errno(3) code on failure.
+ * @note Every event returned must be answered exactly once with
+ *       \p projfs_reply_event(), which may be called from any thread.
+ *       The file operations which caused projection and permission
+ *       requests wait for their replies, and an event's path strings and
+ *       file descriptor remain valid only until it has been answered.
+ *       Once the filesystem begins stopping, those file operations fail
+ *       with EIO instead of waiting, but their events remain valid until
+ *       answered or until \p projfs_stop() completes.
+ */
+int projfs_read_events(struct projfs *fs, struct projfs_queued_event *events,
+		       unsigned int nevents);
+
+/**
+ * Answer an event read with \p projfs_read_events().
+ *
+ * @param[in] token Token of the queued event.
+ * @param[in] result Result of handling the event, as would be returned
+ *                   by the corresponding event handler: zero or a negated
+ *                   \p errno(3) code, or PROJFS_ALLOW or PROJFS_DENY for
+ *                   a permission request.  The result of a notification
+ *                   is ignored.
+ * @return Zero on success or an \p errno(3) code on failure; EINVAL if
+ *         the token was not returned by \p projfs_read_events(), or its
+ *         event has already been answered or released by \p projfs_stop().
+ */
+int projfs_reply_event(uint64_t token, int result);
+
+/** Connection of an out-of-process provider to a projfs filesystem */
+struct projfs_provider;
+
+/**
+ * Connect an out-of-process provider to a projfs filesystem mounted with
+ * the provider_socket=PATH option.
+ *
+ * In this mode, events are queued as with the event_queue option, and
+ * delivered to the connected provider through rings in shared memory;
+ * only one provider may be connected at a time.  Events which are queued
+ * while no provider is connected, or which a provider does not answer
+ * before disconnecting, are delivered once a provider next connects, so
+ * a provider may be restarted without unmounting the filesystem.  Once
+ * the filesystem begins stopping, file operations no longer wait for such
+ * events to be answered, and fail with EIO.
+ *
+ * @param[in] path Path of the filesystem's provider socket.
+ * @return Provider connection, or NULL with \p errno(3) set on failure.
+ */
+struct projfs_provider *projfs_provider_connect(const char *path);
+
+/**
+ * Disconnect an out-of-process provider from a projfs filesystem.
+ *
+ * @param[in] prov Provider connection.
+ * @note Any events read but not yet answered will be delivered again to
+ *       the next provider to connect.
+ */
+void projfs_provider_disconnect(struct projfs_provider *prov);
+
+/**
+ * Retrieve the event file descriptor of a provider connection, which
+ * becomes readable when events are available, as for
+ * \p projfs_get_event_fd().
+ *
+ * @param[in] prov Provider connection.
+ * @return Event file descriptor, owned by the connection.
+ */
+int projfs_provider_get_event_fd(struct projfs_provider *prov);
+
+/**
+ * Read a batch of events through a provider connection, as for
+ * \p projfs_read_events().
+ *
+ * @param[in] prov Provider connection.
+ * @param[out] events Array in which to return events.
+ * @param[in] nevents Maximum number of events to return.
+ * @return Number of events returned, which may be zero if none are
+ *         available, or a negated \p errno(3) code on failure.
+ * @note The event->fs field of each event will be NULL.  The file
+ *       descriptor of a projection request is a duplicate owned by the
+ *       connection, and is closed once the request is answered.
+ */
+int projfs_provider_read_events(struct projfs_provider *prov,
+				struct projfs_queued_event *events,
+				unsigned int nevents);
+
+/**
+ * Answer an event read through a provider connection, as for
+ * \p projfs_reply_event().
+ *
+ * @param[in] prov Provider connection.
+ * @param[in] token Token of the event.
+ * @param[in] result Result of handling the event.
+ * @return Zero on success or an \p errno(3) code on failure.
+ */
+int projfs_provider_reply(struct projfs_provider *prov, uint64_t token,
+			  int result);
+
 /**
  * Start a projfs filesystem.
  * TODO: doxygen
@@ -123,6 +395,50 @@ int projfs_start(struct projfs *fs);
  */
 void *projfs_stop(struct projfs *fs);
 
+/**
+ * Outcome of stopping a projfs filesystem with a deadline; the counts
+ * include those of any earlier attempts to stop the same filesystem.
+ */
+struct projfs_stop_status {
+	/** User data reference as passed to \p projfs_new(), if stopped */
+	void *user_data;
+
+	/** Number of projection and permission requests refused or
+	 *  abandoned while stopping, whose file operations failed with EIO */
+	unsigned int refused;
+
+	/** Number of notifications discarded without being delivered */
+	unsigned int dropped;
+
+	/** Number of event handler calls still running at the deadline */
+	unsigned int running;
+};
+
+/**
+ * Stop a projfs filesystem, waiting no longer than a given time for
+ * event handlers to return.
+ *
+ * New projection and permission requests are refused as soon as the
+ * filesystem begins stopping, and notifications which have not been
+ * delivered by the deadline are discarded.  File operations waiting for
+ * replies from the event queue or an out-of-process provider stop
+ * waiting at once and fail with EIO, so only calls to in-process event
+ * handlers can delay stopping.  Handler calls already in progress cannot
+ * be cancelled, so if any are still running at the deadline, the
+ * filesystem is left partially stopped; once they return, a repeated
+ * call completes.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[in] timeout_msec Maximum time to wait, in milliseconds.
+ * @param[out] status Outcome of the shutdown.
+ * @return Zero once the filesystem is stopped and its handle freed, or
+ *         ETIMEDOUT if handler calls are still running, in which case
+ *         the handle remains valid and this function or
+ *         \p projfs_stop() must be called again to finish stopping.
+ */
+int projfs_stop_timeout(struct projfs *fs, unsigned int timeout_msec,
+			struct projfs_stop_status *status);
+
 /**
  * Create a directory whose contents will be projected until written.
  *
@@ -182,6 +498,8 @@ int projfs_create_proj_symlink(struct projfs *fs, const char *path,
  *       When a requested attribute name matches no defined attributes,
  *       the value buffer will be left unchanged, and the corresponding
  *       size field will be set to -1.
+ *       The PROJFS_ATTR_VERSION name ("version") is reserved for the
+ *       content version of a placeholder, and reads return that version.
  */
 int projfs_get_attrs(struct projfs *fs, const char *path,
 		     struct projfs_attr *attrs, unsigned int nattrs);
@@ -202,7 +520,9 @@ int projfs_get_attrs(struct projfs *fs, const char *path,
  *       unless the supplied value is NULL or its size is 0, in which case
  *       the attribute will be removed.
  *       However, if the requested attribute name matches a reserved name,
- *       EINVAL will be returned.
+ *       EPERM will be returned; the reserved names are "empty", which
+ *       records the projection state, and PROJFS_ATTR_VERSION ("version"),
+ *       which may only be written when creating or updating placeholders.
  *       When a requested attribute name matches no defined attributes, and
  *       the supplied value is non-NULL and its size non-zero, a new attribute
  *       will be created; otherwise, the size field will be set to -1.
@@ -211,6 +531,265 @@ int projfs_get_attrs(struct projfs *fs, const char *path,
 int projfs_set_attrs(struct projfs *fs, const char *path,
 		     struct projfs_attr *attrs, unsigned int nattrs);
 
+/** Placeholder batch operation types */
+#define PROJFS_BATCH_CREATE_DIR		0x01	/* Create projected dir */
+#define PROJFS_BATCH_CREATE_FILE	0x02	/* Create projected file */
+#define PROJFS_BATCH_UPDATE		0x03	/* Update empty placeholder */
+#define PROJFS_BATCH_DELETE		0x04	/* Delete empty placeholder */
+
+/** Placeholder batch operation */
+struct projfs_batch_op {
+	unsigned int type;		/* PROJFS_BATCH_* operation type */
+	const char *path;		/* relative path under mount point */
+	off_t size;			/* file size, for create or update */
+	mode_t mode;			/* file mode, or 0 to retain on update */
+	struct projfs_attr *attrs;	/* projection attributes, or NULL */
+	unsigned int nattrs;		/* number of items in attrs */
+	int result;			/* set to zero or an errno on return */
+};
+
+/**
+ * Apply a batch of placeholder creations, updates, and deletions, such as
+ * those required when switching branches.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[in,out] ops Array of operations to apply; on return, the result
+ *                    field of each item records the outcome of that item.
+ * @param[in] nops Number of items in the ops array.
+ * @param[in] nthreads Maximum number of threads with which to apply the
+ *                     operations, or zero to use one per online CPU.
+ * @return Zero if all operations succeeded, or the \p errno(3) code
+ *         of the first failed operation in the ops array.
+ * @note Updates and deletions apply only to placeholders which are still
+ *       empty; if a placeholder has been populated or modified, the
+ *       operation's result will be EBUSY.
+ *       As an exception, an update which supplies a PROJFS_ATTR_VERSION
+ *       attribute matching that of a populated file succeeds without
+ *       changing the file, since its hydrated content remains current.
+ *       Every update and deletion is checked before any operation is
+ *       applied, so if one conflicts with a populated or modified
+ *       placeholder, or any operation is invalid, no changes are made,
+ *       and the result of each operation which did not fail itself will
+ *       be ECANCELED.
+ *       Once checked, the operations are applied without holding every
+ *       placeholder's lock throughout, which could exhaust the file
+ *       descriptors available to large batches.  So a batch is not fully
+ *       atomic: a placeholder populated by a concurrent file operation
+ *       after the check, or an existing entry at the path of a creation,
+ *       still fails that one operation, as recorded in its result field,
+ *       and those which succeed are not undone.
+ *       Updates replace the file size (for files), any non-zero mode,
+ *       and the given projection attributes, which are written as with
+ *       \p projfs_set_attrs().
+ *       Each affected directory is locked once while its entries are
+ *       changed, and each placeholder while it is updated or deleted, so
+ *       a concurrent file operation which projects either waits for the
+ *       change to complete.  Operations within a directory which needs
+ *       no projection take neither lock, and may observe some of its
+ *       entries changed and others not, or find that an empty
+ *       placeholder has been deleted or replaced.
+ *       Deletions are applied first (deepest paths first), then updates,
+ *       then creations (shallowest paths first), so a batch may replace
+ *       a file with a directory, or create a directory and its contents.
+ *       This function must not be called from within an event handler.
+ */
+int projfs_batch_proj(struct projfs *fs, struct projfs_batch_op *ops,
+		      unsigned int nops, unsigned int nthreads);
+
+/** Projection states of lower filesystem entries */
+#define PROJFS_STATE_EMPTY	0x01	/* Placeholder not yet projected */
+#define PROJFS_STATE_POPULATED	0x02	/* File projected but unmodified */
+#define PROJFS_STATE_MODIFIED	0x04	/* Fully local; no longer projected */
+
+/** Walk flag to report only entries whose projection state is inconsistent */
+#define PROJFS_WALK_FSCK	0x100
+
+/** Inconsistencies reported by a walk with the PROJFS_WALK_FSCK flag */
+#define PROJFS_FSCK_STATE	0x01	/* Unreadable or invalid state */
+#define PROJFS_FSCK_HOLES	0x02	/* Populated file with holes */
+#define PROJFS_FSCK_VERSION	0x04	/* Content version without a state */
+#define PROJFS_FSCK_PARENT	0x08	/* Projected within empty directory */
+
+/** Lower filesystem entry visited by \p projfs_walk() */
+struct projfs_walk_entry {
+	const char *path;		/* relative path under mount point */
+	const struct stat *st;		/* attributes of the lower entry */
+	unsigned int state;		/* PROJFS_STATE_* state, or 0 */
+	unsigned int problems;		/* PROJFS_FSCK_* inconsistencies */
+};
+
+/**
+ * Callback for each entry visited by \p projfs_walk().
+ *
+ * @param entry Entry visited; valid only until the callback returns.
+ * @param data User data as passed to \p projfs_walk().
+ * @return Zero to continue the walk, or an \p errno(3) code to stop it.
+ */
+typedef int (*projfs_walk_func_t)(const struct projfs_walk_entry *entry,
+				  void *data);
+
+/**
+ * Walk a subtree of the lower filesystem with several threads, reporting
+ * each entry and, optionally, its projection state.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[in] subtree Relative path under mount point of the directory
+ *                    whose descendants should be visited, or NULL for all.
+ * @param[in] filter Mask of PROJFS_STATE_* states of the entries to be
+ *                   visited, or zero to visit every entry without reading
+ *                   its state, optionally with the PROJFS_WALK_FSCK flag.
+ * @param[in] callback Function to call for each entry visited.
+ * @param[in] data User data to pass to the callback.
+ * @param[in] nthreads Maximum number of threads with which to walk the
+ *                     tree, or zero to use one per online CPU.
+ * @return Zero on success, or an \p errno(3) code on failure, or the
+ *         non-zero value returned by a callback.
+ * @note The callback may be called concurrently from several threads,
+ *       and in no particular order, except that a directory is visited
+ *       before its entries.  Symlinks have no projection state of their
+ *       own, and are reported as modified.
+ *       With the PROJFS_WALK_FSCK flag, only entries with one or more
+ *       inconsistencies are visited.  A populated file with holes may
+ *       have been only partly written by its provider; a content version
+ *       without a projection state suggests the state was lost, as does
+ *       a populated or modified entry within an empty directory.  Since
+ *       the walk takes no locks, entries changed by concurrent file
+ *       operations may be reported spuriously.  The walk may be made
+ *       whether or not the filesystem has been started.
+ */
+int projfs_walk(struct projfs *fs, const char *subtree, unsigned int filter,
+		projfs_walk_func_t callback, void *data,
+		unsigned int nthreads);
+
+/** Clone flag to reset modified directories to empty placeholders */
+#define PROJFS_CLONE_RESET	0x01
+
+/**
+ * Clone the lower directory of a projected filesystem, so a new filesystem
+ * may be started with the same content and projection states without its
+ * provider projecting that content again.
+ *
+ * @param[in] src Path of the lower directory to be cloned.
+ * @param[in] dst Path of the new lower directory, which must not exist.
+ * @param[in] flags Zero, or PROJFS_CLONE_RESET.
+ * @param[in] nthreads Maximum number of threads with which to copy the
+ *                     tree, or zero to use one per online CPU.
+ * @return Zero on success, or an \p errno(3) code on failure, in which
+ *         case the new lower directory may be incomplete.
+ * @note File content is shared with the source by reference where the
+ *       filesystem supports it, and copied where it does not.  Projection
+ *       states, content versions, and other user xattrs are preserved, as
+ *       are permissions and timestamps, but not ownership, hard links, or
+ *       special files.  The source should not be in use by a running
+ *       filesystem.
+ *       With the PROJFS_CLONE_RESET flag, a directory holding any
+ *       modified files is cloned as an empty placeholder, without any of
+ *       its descendants, so its provider will project it afresh; local
+ *       changes within it are discarded.
+ */
+int projfs_clone_lowerdir(const char *src, const char *dst,
+			  unsigned int flags, unsigned int nthreads);
+
+/**
+ * Hydrate the files listed in an access profile, in the order in which
+ * they were first accessed when the profile was recorded.
+ *
+ * @param[in] fs Projected filesystem handle.
+ * @param[in] profile Path of a profile recorded by a filesystem started
+ *                    with the profile=<path> option, which lists each file
+ *                    as it is hydrated, with the milliseconds since start
+ *                    and the name of the accessing command.
+ * @param[in] nthreads Maximum number of threads with which to hydrate
+ *                     the files, or zero to use one per online CPU.
+ * @return Zero on success, or an \p errno(3) code if the profile could not
+ *         be read; files which could not be hydrated are skipped.
+ * @note The filesystem must have been started, and this function must
+ *       return before it is stopped; callers wanting the files hydrated
+ *       in the background should call it from a thread of their own.
+ *       Files are hydrated by opening them through the mount point, so
+ *       their parent directories are projected as usual, and no files are
+ *       recorded in a profile when hydrated this way.
+ */
+int projfs_prefetch_profile(struct projfs *fs, const char *profile,
+			    unsigned int nthreads);
+
+/** Compression codecs for projected file content */
+#define PROJFS_CODEC_NONE	0x00	/* Uncompressed data */
+#define PROJFS_CODEC_ZLIB	0x01	/* zlib stream */
+#define PROJFS_CODEC_GIT_ZLIB	0x02	/* Git loose object (zlib) */
+#define PROJFS_CODEC_ZSTD	0x03	/* Zstandard frames */
+
+/**
+ * Decompress file content read from a file descriptor into the file
+ * being projected by a projection event.
+ *
+ * @param[in] event Filesystem projection event of a file.
+ * @param[in] fd File descriptor from which to read compressed content
+ *               until end of file, such as a pipe or socket.
+ * @param[in] codec PROJFS_CODEC_* compression codec of the content.
+ * @return Zero on success or an \p errno(3) code on failure.
+ * @note The decompressed content is written into event->fd, starting at
+ *       event->offset and extending for event->length bytes, or to the
+ *       end of the placeholder file if event->length is zero.  If the
+ *       decompressed content is shorter or longer than that, or is
+ *       corrupt, EIO will be returned.
+ *       For PROJFS_CODEC_GIT_ZLIB, the content is a zlib-compressed Git
+ *       blob object, whose header is checked against the placeholder
+ *       file size and is not written.  Git objects can not be split
+ *       into chunks, so if the filesystem was mounted with the
+ *       chunk_size=KIB option, any file large enough to be projected
+ *       in chunks must be written with another codec; EINVAL will be
+ *       returned for any chunk event, i.e., if event->length is
+ *       non-zero.
+ *       For PROJFS_CODEC_ZSTD, the content may consist of several
+ *       consecutive frames.
+ *       If a codec is not supported by this build of the library,
+ *       EOPNOTSUPP will be returned.
+ *       This function may only be called from within a projection event
+ *       handler.
+ */
+int projfs_write_compressed(const struct projfs_event *event, int fd,
+			    unsigned int codec);
+
+/**
+ * Decompress file content from a buffer into the file being projected by a
+ * projection event, as with \p projfs_write_compressed().
+ *
+ * @param[in] event Filesystem projection event of a file.
+ * @param[in] buf Buffer containing the compressed content.
+ * @param[in] len Length of the compressed content.
+ * @param[in] codec PROJFS_CODEC_* compression codec of the content.
+ * @return Zero on success or an \p errno(3) code on failure.
+ */
+int projfs_write_compressed_buf(const struct projfs_event *event,
+				const void *buf, size_t len,
+				unsigned int codec);
+
+/**
+ * Reconstruct file content from locally available base content and a
+ * binary delta, writing it into the file being projected by a projection
+ * event.
+ *
+ * @param[in] event Filesystem projection event of a file.
+ * @param[in] base_fd File descriptor of the base content, such as a
+ *                    previous version of the file in a local cache or
+ *                    another working tree; must support \p pread(2).
+ * @param[in] delta Buffer containing the delta, in Git's pack file delta
+ *                  format.
+ * @param[in] len Length of the delta.
+ * @return Zero on success or an \p errno(3) code on failure.
+ * @note The delta's base size must match the size of the base file, and
+ *       its result size must match the range written, as described for
+ *       \p projfs_write_compressed(); otherwise, or if the delta is
+ *       corrupt, EIO will be returned.
+ *       Ranges copied from the base file are copied with
+ *       \p copy_file_range(2) where possible.
+ *       This function may only be called from within a projection event
+ *       handler.
+ */
+int projfs_write_delta(const struct projfs_event *event, int base_fd,
+		       const void *delta, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,381 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "projfs.h"
+
+/*
+ * Decompress data supplied by a projection event handler directly into the
+ * placeholder file (or chunk of a file) being projected, verifying that
+ * the decompressed size exactly matches that of the placeholder.
+ */
+
+#define DECOMP_IN_BUF_SIZE (256 * 1024)
+#define DECOMP_OUT_BUF_SIZE (1024 * 1024)
+
+#define GIT_HEADER_MAX_LEN 32
+
+struct decomp_src {
+	int fd;				/* -1 if reading from buf */
+	const unsigned char *buf;
+	size_t len;
+	unsigned char *in;		/* read buffer for fd */
+};
+
+struct decomp_dst {
+	int fd;
+	off_t off;			/* next write offset */
+	off_t end;			/* expected end offset */
+	int git_header;			/* 1 while reading Git header */
+	char header[GIT_HEADER_MAX_LEN];
+	size_t header_len;
+};
+
+/**
+ * Read the next block of compressed input.
+ *
+ * @return number of bytes read, 0 at end of input, or -1 with errno set
+ */
+static ssize_t read_src(struct decomp_src *src, const unsigned char **data)
+{
+	ssize_t len;
+
+	if (src->fd == -1) {
+		*data = src->buf;
+		len = src->len;
+		src->buf += len;
+		src->len = 0;
+		return len;
+	}
+
+	do {
+		len = read(src->fd, src->in, DECOMP_IN_BUF_SIZE);
+	} while (len == -1 && errno == EINTR);
+
+	*data = src->in;
+	return len;
+}
+
+/**
+ * Parse a Git object header such as "blob 1234", and check that its size
+ * matches the expected size.
+ *
+ * @return 0 or an errno
+ */
+static int check_git_header(struct decomp_dst *dst)
+{
+	char *size = memchr(dst->header, ' ', dst->header_len);
+	char *end;
+	unsigned long long val;
+
+	if (size == NULL || strncmp(dst->header, "blob ", 5) != 0)
+		return EIO;
+
+	errno = 0;
+	val = strtoull(size + 1, &end, 10);
+	if (errno != 0 || end == size + 1 || *end != '\0')
+		return EIO;
+
+	if (val != (unsigned long long)(dst->end - dst->off))
+		return EIO;
+
+	return 0;
+}
+
+/**
+ * Write a block of decompressed output to the placeholder, consuming any
+ * leading Git object header first.
+ *
+ * @return 0 or an errno; EIO if output exceeds the expected size
+ */
+static int write_dst(struct decomp_dst *dst, const unsigned char *data,
+		     size_t len)
+{
+	ssize_t res;
+
+	while (dst->git_header && len > 0) {
+		char c = *data++;
+
+		--len;
+		if (dst->header_len == GIT_HEADER_MAX_LEN)
+			return EIO;
+		dst->header[dst->header_len++] = c;
+		if (c == '\0') {
+			dst->git_header = 0;
+			res = check_git_header(dst);
+			if (res != 0)
+				return res;
+		}
+	}
+
+	if ((off_t)len > dst->end - dst->off)
+		return EIO;
+
+	while (len > 0) {
+		res = pwrite(dst->fd, data, len, dst->off);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data += res;
+		len -= res;
+		dst->off += res;
+	}
+
+	return 0;
+}
+
+static int copy_stream(struct decomp_src *src, struct decomp_dst *dst)
+{
+	const unsigned char *data;
+	ssize_t len;
+	int res;
+
+	while ((len = read_src(src, &data)) > 0) {
+		res = write_dst(dst, data, len);
+		if (res != 0)
+			return res;
+	}
+
+	return (len == -1) ? errno : 0;
+}
+
+#ifdef HAVE_ZLIB
+static int inflate_stream(struct decomp_src *src, struct decomp_dst *dst)
+{
+	unsigned char *out;
+	const unsigned char *data;
+	z_stream zs;
+	ssize_t len;
+	int zres = Z_OK;
+	int res = 0;
+
+	out = malloc(DECOMP_OUT_BUF_SIZE);
+	if (out == NULL)
+		return errno;
+
+	memset(&zs, 0, sizeof(zs));
+	zs.avail_out = DECOMP_OUT_BUF_SIZE;
+	if (inflateInit(&zs) != Z_OK) {
+		free(out);
+		return ENOMEM;
+	}
+
+	while (zres != Z_STREAM_END) {
+		// read more input unless output may still be pending
+		if (zs.avail_in == 0 && zs.avail_out != 0) {
+			len = read_src(src, &data);
+			if (len == -1) {
+				res = errno;
+				break;
+			}
+			if (len == 0) {		// truncated stream
+				res = EIO;
+				break;
+			}
+			zs.next_in = (unsigned char *)data;
+			zs.avail_in = len;
+		}
+
+		zs.next_out = out;
+		zs.avail_out = DECOMP_OUT_BUF_SIZE;
+		zres = inflate(&zs, Z_NO_FLUSH);
+		// Z_BUF_ERROR just indicates more input is required
+		if (zres != Z_OK && zres != Z_STREAM_END &&
+		    zres != Z_BUF_ERROR) {
+			res = (zres == Z_MEM_ERROR) ? ENOMEM : EIO;
+			break;
+		}
+
+		res = write_dst(dst, out, DECOMP_OUT_BUF_SIZE - zs.avail_out);
+		if (res != 0)
+			break;
+	}
+
+	inflateEnd(&zs);
+	free(out);
+	return res;
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+static int zstd_stream(struct decomp_src *src, struct decomp_dst *dst)
+{
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer out;
+	ZSTD_DStream *ds;
+	size_t zres = 0;
+	int full = 0;
+	ssize_t len;
+	int res = 0;
+
+	out.dst = malloc(DECOMP_OUT_BUF_SIZE);
+	if (out.dst == NULL)
+		return errno;
+	out.size = DECOMP_OUT_BUF_SIZE;
+
+	ds = ZSTD_createDStream();
+	if (ds == NULL || ZSTD_isError(ZSTD_initDStream(ds))) {
+		res = ENOMEM;
+		goto out_free;
+	}
+
+	// consecutive frames are decompressed in turn until input ends
+	for (;;) {
+		// read more input unless output may still be pending
+		if (in.pos == in.size && !full) {
+			const unsigned char *data;
+
+			len = read_src(src, &data);
+			if (len == -1) {
+				res = errno;
+				break;
+			}
+			if (len == 0) {
+				if (zres != 0)	// truncated frame
+					res = EIO;
+				break;
+			}
+			in.src = data;
+			in.size = len;
+			in.pos = 0;
+		}
+
+		out.pos = 0;
+		zres = ZSTD_decompressStream(ds, &out, &in);
+		if (ZSTD_isError(zres)) {
+			res = EIO;
+			break;
+		}
+
+		full = (out.pos == out.size);
+		res = write_dst(dst, out.dst, out.pos);
+		if (res != 0)
+			break;
+	}
+
+out_free:
+	ZSTD_freeDStream(ds);
+	free(out.dst);
+	return res;
+}
+#endif /* HAVE_ZSTD */
+
+static int write_compressed(const struct projfs_event *event,
+			    struct decomp_src *src, unsigned int codec)
+{
+	struct decomp_dst dst;
+	struct stat st;
+	int res;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.fd = event->fd;
+	dst.off = event->offset;
+	if (event->length > 0) {
+		dst.end = event->offset + event->length;
+	} else {
+		if (fstat(event->fd, &st) == -1)
+			return errno;
+		dst.end = st.st_size;
+	}
+
+	switch (codec) {
+	case PROJFS_CODEC_NONE:
+		res = copy_stream(src, &dst);
+		break;
+	case PROJFS_CODEC_GIT_ZLIB:
+		// Git objects are not chunked, so header gives whole size
+		if (event->offset != 0 || event->length > 0)
+			return EINVAL;
+		dst.git_header = 1;
+		/* fall through */
+	case PROJFS_CODEC_ZLIB:
+#ifdef HAVE_ZLIB
+		res = inflate_stream(src, &dst);
+		break;
+#else
+		return EOPNOTSUPP;
+#endif
+	case PROJFS_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+		res = zstd_stream(src, &dst);
+		break;
+#else
+		return EOPNOTSUPP;
+#endif
+	default:
+		return EINVAL;
+	}
+
+	if (res == 0 && (dst.git_header || dst.off != dst.end))
+		res = EIO;
+
+	return res;
+}
+
+int projfs_write_compressed(const struct projfs_event *event, int fd,
+			    unsigned int codec)
+{
+	struct decomp_src src;
+	int res;
+
+	src.fd = fd;
+	src.in = malloc(DECOMP_IN_BUF_SIZE);
+	if (src.in == NULL)
+		return errno;
+
+	res = write_compressed(event, &src, codec);
+
+	free(src.in);
+	return res;
+}
+
+int projfs_write_compressed_buf(const struct projfs_event *event,
+				const void *buf, size_t len,
+				unsigned int codec)
+{
+	struct decomp_src src;
+
+	src.fd = -1;
+	src.buf = buf;
+	src.len = len;
+	src.in = NULL;
+
+	return write_compressed(event, &src, codec);
+}
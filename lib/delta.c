@@ -0,0 +1,251 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "projfs.h"
+
+/*
+ * Reconstruct the content of a placeholder file (or chunk of a file) from
+ * locally available base content and a binary delta in Git's format, as
+ * used in pack files: a header giving the base and result sizes, followed
+ * by instructions either to copy a range from the base or to insert
+ * literal data from the delta itself.
+ */
+
+#define DELTA_COPY_BUF_SIZE (256 * 1024)
+
+// copy instruction with a zero size encodes this size
+#define DELTA_COPY_DEFAULT_SIZE 0x10000
+
+struct delta_dst {
+	int base_fd;
+	int fd;
+	off_t off;			/* next write offset */
+	off_t end;			/* expected end offset */
+	char *buf;			/* fallback copy buffer */
+	int copy_range;			/* 0 once copy_file_range() fails */
+};
+
+/**
+ * Parse a variable-length size from a Git delta header.
+ *
+ * @return 0 or EIO if the delta is truncated or the size overflows
+ */
+static int read_delta_size(const unsigned char **data,
+			   const unsigned char *end, uint64_t *size)
+{
+	unsigned int shift = 0;
+	unsigned char c;
+
+	*size = 0;
+	do {
+		if (*data == end || shift > 63)
+			return EIO;
+		c = *(*data)++;
+		*size |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+static int write_insert(struct delta_dst *dst, const unsigned char *data,
+			size_t len)
+{
+	ssize_t res;
+
+	while (len > 0) {
+		res = pwrite(dst->fd, data, len, dst->off);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data += res;
+		len -= res;
+		dst->off += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy a range of the base content into the placeholder, using
+ * copy_file_range() where the filesystems support it so that data may be
+ * shared or copied in-kernel.
+ *
+ * @return 0 or an errno
+ */
+static int write_copy(struct delta_dst *dst, off_t src_off, size_t len)
+{
+	ssize_t res;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (dst->copy_range && len > 0) {
+		loff_t off_in = src_off, off_out = dst->off;
+
+		res = copy_file_range(dst->base_fd, &off_in, dst->fd, &off_out,
+				      len, 0);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			// fall back to copying via buffer below
+			if (errno == ENOSYS || errno == EXDEV ||
+			    errno == EINVAL || errno == EOPNOTSUPP) {
+				dst->copy_range = 0;
+				break;
+			}
+			return errno;
+		}
+		if (res == 0)		// base shorter than expected
+			return EIO;
+		src_off += res;
+		len -= res;
+		dst->off += res;
+	}
+#endif
+
+	if (len > 0 && dst->buf == NULL) {
+		dst->buf = malloc(DELTA_COPY_BUF_SIZE);
+		if (dst->buf == NULL)
+			return errno;
+	}
+	while (len > 0) {
+		size_t n = (len < DELTA_COPY_BUF_SIZE) ? len
+						       : DELTA_COPY_BUF_SIZE;
+		int err;
+
+		res = pread(dst->base_fd, dst->buf, n, src_off);
+		if (res <= 0) {
+			if (res == -1 && errno == EINTR)
+				continue;
+			return (res == 0) ? EIO : errno;
+		}
+		err = write_insert(dst, (unsigned char *)dst->buf, res);
+		if (err != 0)
+			return err;
+		src_off += res;
+		len -= res;
+	}
+
+	return 0;
+}
+
+static int apply_delta(struct delta_dst *dst, const unsigned char *data,
+		       const unsigned char *end, uint64_t base_size)
+{
+	while (data < end) {
+		unsigned char cmd = *data++;
+		uint64_t off = 0, len = 0;
+		int i, res;
+
+		if (cmd & 0x80) {
+			// bits 0-3 select offset bytes, bits 4-6 size bytes
+			for (i = 0; i < 7; ++i) {
+				if (!(cmd & (1 << i)))
+					continue;
+				if (data == end)
+					return EIO;
+				if (i < 4)
+					off |= (uint64_t)*data++ << (i * 8);
+				else
+					len |= (uint64_t)*data++
+					       << ((i - 4) * 8);
+			}
+			if (len == 0)
+				len = DELTA_COPY_DEFAULT_SIZE;
+
+			if (off + len > base_size ||
+			    (off_t)len > dst->end - dst->off)
+				return EIO;
+			res = write_copy(dst, off, len);
+		} else if (cmd != 0) {
+			len = cmd;
+			if (len > (uint64_t)(end - data) ||
+			    (off_t)len > dst->end - dst->off)
+				return EIO;
+			res = write_insert(dst, data, len);
+			data += len;
+		} else {
+			// reserved instruction
+			return EIO;
+		}
+		if (res != 0)
+			return res;
+	}
+
+	return 0;
+}
+
+int projfs_write_delta(const struct projfs_event *event, int base_fd,
+		       const void *delta, size_t len)
+{
+	const unsigned char *data = delta;
+	const unsigned char *end = data + len;
+	uint64_t base_size, result_size;
+	struct delta_dst dst;
+	struct stat st;
+	int res;
+
+	res = read_delta_size(&data, end, &base_size);
+	if (res == 0)
+		res = read_delta_size(&data, end, &result_size);
+	if (res != 0)
+		return res;
+
+	if (fstat(base_fd, &st) == -1)
+		return errno;
+	if ((uint64_t)st.st_size != base_size)
+		return EIO;
+
+	dst.base_fd = base_fd;
+	dst.fd = event->fd;
+	dst.off = event->offset;
+	if (event->length > 0) {
+		dst.end = event->offset + event->length;
+	} else {
+		if (fstat(event->fd, &st) == -1)
+			return errno;
+		dst.end = st.st_size;
+	}
+	dst.buf = NULL;
+	dst.copy_range = 1;
+
+	if (result_size != (uint64_t)(dst.end - dst.off))
+		return EIO;
+
+	res = apply_delta(&dst, data, end, base_size);
+	if (res == 0 && dst.off != dst.end)
+		res = EIO;
+
+	free(dst.buf);
+	return res;
+}
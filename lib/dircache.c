@@ -0,0 +1,542 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dircache.h"
+
+/*
+ * We cache the paths of lower directories which are known to be fully
+ * local (i.e., in the "modified" projection state), so that file operations
+ * on their entries need not open each directory and read its projection
+ * state xattr.  Because a directory's projection state only ever advances
+ * to this final state, an entry remains valid until its directory is
+ * removed or renamed, at which point the caller must remove it, along with
+ * the entries of all its subdirectories, from the cache.
+ *
+ * The cache may be saved to a snapshot file when the filesystem is
+ * unmounted and reloaded when it is next mounted.  Each record in the
+ * snapshot holds a directory's inode number and ctime, which will both
+ * change if the directory is replaced, and the latter of which will change
+ * if its projection state xattr is altered, so we validate loaded entries
+ * against the lower filesystem on their first lookup and discard any which
+ * no longer match.  The snapshot is a simple sequence of fixed-size records
+ * and padded paths, which we map into memory when loading it.
+ *
+ * The table itself is a chained hash of path strings, using the FNV-1a
+ * hash function, whose bucket array is doubled in size whenever its load
+ * factor would exceed one.  A reader-writer lock permits concurrent lookups
+ * from FUSE threads, which should greatly outnumber insertions.
+ */
+
+struct dircache_entry {
+	struct dircache_entry *next;
+	uint32_t hash;
+	int verified;			/* 0 if loaded but not validated */
+	uint64_t ino;
+	struct timespec ctime;
+	char path[];
+};
+
+struct dircache {
+	struct dircache_entry **buckets;
+	unsigned int size;		/* always a power of two */
+	unsigned int used;
+	unsigned long gen;		/* incremented by each removal */
+	pthread_rwlock_t lock;
+};
+
+#define DEFAULT_CACHE_SIZE 64
+
+#define SNAPSHOT_MAGIC "PROJFSDC"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+	char magic[SNAPSHOT_MAGIC_LEN];
+	uint32_t version;
+	uint32_t count;
+	uint64_t size;			/* total size of snapshot */
+};
+
+// each record is followed by its NUL-terminated path, padded to 8 bytes
+struct snapshot_record {
+	uint64_t ino;
+	int64_t ctime_sec;
+	uint32_t ctime_nsec;
+	uint32_t len;			/* path length, excluding NUL */
+};
+
+#define SNAPSHOT_PAD(n) (((n) + 7) & ~(size_t)7)
+
+// FNV-1a offset basis and prime
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+static uint32_t hash_path(const char *path)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	while (*path != '\0') {
+		hash ^= (unsigned char)*path++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static struct dircache_entry **find_entry(struct dircache *cache,
+					  const char *path, uint32_t hash)
+{
+	struct dircache_entry **entry;
+
+	entry = &cache->buckets[hash & (cache->size - 1)];
+	while (*entry != NULL) {
+		if ((*entry)->hash == hash && strcmp((*entry)->path, path) == 0)
+			break;
+		entry = &(*entry)->next;
+	}
+
+	return entry;
+}
+
+static int resize_cache(struct dircache *cache, unsigned int new_size)
+{
+	struct dircache_entry **buckets, *entry, *next;
+	unsigned int i;
+
+	buckets = calloc(new_size, sizeof(*buckets));
+	if (buckets == NULL)
+		return -1;
+
+	for (i = 0; i < cache->size; ++i) {
+		for (entry = cache->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (new_size - 1)];
+			buckets[entry->hash & (new_size - 1)] = entry;
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->size = new_size;
+
+	return 0;
+}
+
+static struct dircache_entry *add_entry(struct dircache *cache,
+					const char *path, uint32_t hash)
+{
+	struct dircache_entry *entry, **bucket;
+	size_t len = strlen(path) + 1;
+
+	// keep working with the current table if we can't grow it
+	if (cache->used + 1 > cache->size)
+		(void)resize_cache(cache, cache->size * 2);
+
+	entry = malloc(sizeof(*entry) + len);
+	if (entry == NULL)
+		return NULL;
+
+	memcpy(entry->path, path, len);
+	entry->hash = hash;
+	entry->verified = 1;
+
+	bucket = &cache->buckets[hash & (cache->size - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	++cache->used;
+
+	return entry;
+}
+
+static void remove_entry(struct dircache *cache, struct dircache_entry **entry)
+{
+	struct dircache_entry *next = (*entry)->next;
+
+	free(*entry);
+	*entry = next;
+	--cache->used;
+}
+
+struct dircache *dircache_create(void)
+{
+	struct dircache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->buckets = calloc(DEFAULT_CACHE_SIZE, sizeof(*cache->buckets));
+	if (cache->buckets == NULL)
+		goto out_cache;
+	cache->size = DEFAULT_CACHE_SIZE;
+
+	if (pthread_rwlock_init(&cache->lock, NULL) != 0)
+		goto out_buckets;
+
+	return cache;
+
+out_buckets:
+	free(cache->buckets);
+out_cache:
+	free(cache);
+	return NULL;
+}
+
+void dircache_destroy(struct dircache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->size; ++i) {
+		while (cache->buckets[i] != NULL)
+			remove_entry(cache, &cache->buckets[i]);
+	}
+
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+/**
+ * Return the cache's current generation, which should be read before
+ * checking a directory's projection state and then passed to
+ * dircache_insert(), so that the directory is not cached if it may have
+ * been removed in the interim.
+ */
+unsigned long dircache_gen(struct dircache *cache)
+{
+	unsigned long gen;
+
+	pthread_rwlock_rdlock(&cache->lock);
+	gen = cache->gen;
+	pthread_rwlock_unlock(&cache->lock);
+
+	return gen;
+}
+
+static int match_stat(const struct stat *st, uint64_t ino,
+		      const struct timespec *ctime)
+{
+	return (S_ISDIR(st->st_mode) && st->st_ino == ino &&
+		st->st_ctim.tv_sec == ctime->tv_sec &&
+		st->st_ctim.tv_nsec == ctime->tv_nsec);
+}
+
+/**
+ * Check whether a directory is known to be fully local, validating the
+ * entry against the lower filesystem if it was loaded from a snapshot
+ * and has not yet been looked up.
+ *
+ * @return 1 if the directory is cached, or 0 otherwise
+ */
+int dircache_lookup(struct dircache *cache, int dirfd, const char *path)
+{
+	struct dircache_entry **entry;
+	uint32_t hash = hash_path(path);
+	struct timespec ctime;
+	struct stat st;
+	uint64_t ino;
+	int valid;
+
+	pthread_rwlock_rdlock(&cache->lock);
+	entry = find_entry(cache, path, hash);
+	if (*entry == NULL) {
+		pthread_rwlock_unlock(&cache->lock);
+		return 0;
+	}
+	valid = (*entry)->verified;
+	ino = (*entry)->ino;
+	ctime = (*entry)->ctime;
+	pthread_rwlock_unlock(&cache->lock);
+
+	if (valid)
+		return 1;
+
+	valid = (fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+		 match_stat(&st, ino, &ctime));
+
+	pthread_rwlock_wrlock(&cache->lock);
+	entry = find_entry(cache, path, hash);
+	if (*entry != NULL && !(*entry)->verified) {
+		if (valid)
+			(*entry)->verified = 1;
+		else
+			remove_entry(cache, entry);
+	}
+	pthread_rwlock_unlock(&cache->lock);
+
+	return valid;
+}
+
+/**
+ * Record that a directory is fully local, unless any directories have
+ * been removed from the cache since the given generation was read.
+ *
+ * @return 0, or -1 if memory allocation fails
+ */
+int dircache_insert(struct dircache *cache, const char *path,
+		    unsigned long gen)
+{
+	struct dircache_entry **entry;
+	uint32_t hash = hash_path(path);
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&cache->lock);
+	if (gen != cache->gen)
+		goto out;
+
+	entry = find_entry(cache, path, hash);
+	if (*entry != NULL)
+		(*entry)->verified = 1;
+	else if (add_entry(cache, path, hash) == NULL)
+		ret = -1;
+
+out:
+	pthread_rwlock_unlock(&cache->lock);
+	return ret;
+}
+
+/**
+ * Remove a directory which has been removed or renamed from the cache,
+ * along with any of its subdirectories.
+ */
+void dircache_remove(struct dircache *cache, const char *path)
+{
+	struct dircache_entry **entry;
+	size_t len = strlen(path);
+	unsigned int i;
+
+	pthread_rwlock_wrlock(&cache->lock);
+	++cache->gen;
+
+	for (i = 0; i < cache->size; ++i) {
+		entry = &cache->buckets[i];
+		while (*entry != NULL) {
+			const char *p = (*entry)->path;
+
+			if (strncmp(p, path, len) == 0 &&
+			    (p[len] == '\0' || p[len] == '/'))
+				remove_entry(cache, entry);
+			else
+				entry = &(*entry)->next;
+		}
+	}
+
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * Load entries from a snapshot file, to be validated on their first
+ * lookup.  A missing snapshot is not an error.
+ *
+ * @return 0, or -1 on failure (with errno set to EINVAL if the snapshot
+ *         is invalid)
+ */
+int dircache_load(struct dircache *cache, int dirfd, const char *name)
+{
+	const struct snapshot_header *header;
+	const struct snapshot_record *record;
+	struct dircache_entry *entry;
+	const char *map, *path;
+	struct stat st;
+	size_t off;
+	uint32_t i;
+	int fd, ret = 0;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : -1;
+
+	if (fstat(fd, &st) == -1) {
+		ret = -1;
+		goto out_close;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		errno = EINVAL;
+		ret = -1;
+		goto out_close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -1;
+		goto out_close;
+	}
+
+	header = (const struct snapshot_header *)map;
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->size != (uint64_t)st.st_size) {
+		errno = EINVAL;
+		ret = -1;
+		goto out_unmap;
+	}
+
+	pthread_rwlock_wrlock(&cache->lock);
+	off = sizeof(*header);
+	for (i = 0; i < header->count; ++i) {
+		record = (const struct snapshot_record *)(map + off);
+		path = (const char *)(record + 1);
+		if (off + sizeof(*record) > (size_t)st.st_size ||
+		    record->len >= (size_t)st.st_size - off - sizeof(*record) ||
+		    path[record->len] != '\0' ||
+		    strlen(path) != record->len) {
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		off += sizeof(*record) + SNAPSHOT_PAD(record->len + 1);
+
+		if (*find_entry(cache, path, hash_path(path)) != NULL)
+			continue;
+		entry = add_entry(cache, path, hash_path(path));
+		if (entry == NULL) {
+			ret = -1;
+			break;
+		}
+		entry->verified = 0;
+		entry->ino = record->ino;
+		entry->ctime.tv_sec = record->ctime_sec;
+		entry->ctime.tv_nsec = record->ctime_nsec;
+	}
+	pthread_rwlock_unlock(&cache->lock);
+
+out_unmap:
+	munmap((void *)map, st.st_size);
+out_close:
+	close(fd);
+	return ret;
+}
+
+static int append_record(char **buf, size_t *off, size_t *alloc,
+			 const char *path, const struct stat *st)
+{
+	struct snapshot_record *record;
+	size_t len = strlen(path);
+	size_t rec_size = sizeof(*record) + SNAPSHOT_PAD(len + 1);
+	char *new_buf;
+
+	while (*off + rec_size > *alloc) {
+		new_buf = realloc(*buf, *alloc * 2);
+		if (new_buf == NULL)
+			return -1;
+		*buf = new_buf;
+		*alloc *= 2;
+	}
+
+	record = (struct snapshot_record *)(*buf + *off);
+	record->ino = st->st_ino;
+	record->ctime_sec = st->st_ctim.tv_sec;
+	record->ctime_nsec = st->st_ctim.tv_nsec;
+	record->len = len;
+	memset(record + 1, 0, rec_size - sizeof(*record));
+	memcpy(record + 1, path, len);
+	*off += rec_size;
+
+	return 0;
+}
+
+#define SNAPSHOT_BUF_SIZE 65536
+
+/**
+ * Save all cached entries which still match the lower filesystem to a
+ * snapshot file, replacing any existing snapshot.
+ *
+ * @return 0, or -1 on failure
+ */
+int dircache_save(struct dircache *cache, int dirfd, const char *name)
+{
+	struct snapshot_header *header;
+	struct dircache_entry *entry;
+	size_t off, alloc = SNAPSHOT_BUF_SIZE;
+	struct stat st;
+	char *buf;
+	unsigned int i;
+	uint32_t count = 0;
+	int fd, ret = 0;
+
+	buf = malloc(alloc);
+	if (buf == NULL)
+		return -1;
+
+	/* create the snapshot before reading the ctimes of any entries, as
+	 * this may change the ctime of the directory which contains it
+	 */
+	fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		    0600);
+	if (fd == -1) {
+		ret = -1;
+		goto out_free;
+	}
+
+	off = sizeof(*header);
+	pthread_rwlock_rdlock(&cache->lock);
+	for (i = 0; i < cache->size && ret == 0; ++i) {
+		for (entry = cache->buckets[i]; entry != NULL;
+		     entry = entry->next) {
+			if (fstatat(dirfd, entry->path, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1 ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+			// skip loaded entries which are no longer valid
+			if (!entry->verified &&
+			    !match_stat(&st, entry->ino, &entry->ctime))
+				continue;
+
+			ret = append_record(&buf, &off, &alloc, entry->path,
+					    &st);
+			if (ret == -1)
+				break;
+			++count;
+		}
+	}
+	pthread_rwlock_unlock(&cache->lock);
+	if (ret == -1)
+		goto out_close;
+
+	header = (struct snapshot_header *)buf;
+	memcpy(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	header->version = SNAPSHOT_VERSION;
+	header->count = count;
+	header->size = off;
+
+	// a snapshot truncated or left longer than its size will be ignored
+	if (pwrite(fd, buf, off, 0) != (ssize_t)off ||
+	    ftruncate(fd, off) == -1)
+		ret = -1;
+
+out_close:
+	close(fd);
+out_free:
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+struct dircache;
+
+struct dircache *dircache_create(void);
+void dircache_destroy(struct dircache *cache);
+
+unsigned long dircache_gen(struct dircache *cache);
+int dircache_lookup(struct dircache *cache, int dirfd, const char *path);
+int dircache_insert(struct dircache *cache, const char *path,
+		    unsigned long gen);
+void dircache_remove(struct dircache *cache, const char *path);
+
+int dircache_load(struct dircache *cache, int dirfd, const char *name);
+int dircache_save(struct dircache *cache, int dirfd, const char *name);
+
+#endif /* _DIRCACHE_H */
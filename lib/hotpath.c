@@ -0,0 +1,285 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hotpath.h"
+#include "projfs.h"
+
+/*
+ * We estimate how often each operation is applied to each path with a
+ * count-min sketch, a small fixed grid of counters in which each row is
+ * indexed by a different hash of the operation and path; since keys may
+ * share counters, a key's smallest counter is an upper bound on its true
+ * count.  We use conservative updates, raising only those counters which
+ * are below the key's new estimate, which reduces the overcounting of
+ * infrequent keys.
+ *
+ * Alongside the sketch we keep the heaviest keys seen so far in a min-heap
+ * of a fixed size, ordered by their estimated counts, so that a key whose
+ * estimate exceeds that of the lightest key in the heap replaces it.  The
+ * heap is small, so we find keys within it by a linear scan.  Both the
+ * sketch and the heap are protected by a single mutex.
+ */
+
+#define HOTPATH_DEPTH 4
+#define HOTPATH_WIDTH 2048		// power of two
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct hotpath_entry {
+	uint64_t count;
+	uint64_t hash;
+	const char *op;			/* static string */
+	char *path;
+};
+
+struct hotpath {
+	pthread_mutex_t mutex;
+	uint64_t sketch[HOTPATH_DEPTH][HOTPATH_WIDTH];
+	unsigned int size;		/* maximum entries in heap */
+	unsigned int nentries;
+	struct hotpath_entry heap[];	/* lightest entry first */
+};
+
+struct hotpath *hotpath_create(unsigned int size)
+{
+	struct hotpath *hot;
+
+	if (size == 0 || size > HOTPATH_MAX_SIZE)
+		size = HOTPATH_MAX_SIZE;
+
+	hot = calloc(1, sizeof(*hot) + size * sizeof(struct hotpath_entry));
+	if (hot == NULL)
+		return NULL;
+
+	if (pthread_mutex_init(&hot->mutex, NULL) > 0) {
+		free(hot);
+		return NULL;
+	}
+	hot->size = size;
+
+	return hot;
+}
+
+void hotpath_destroy(struct hotpath *hot)
+{
+	unsigned int i;
+
+	if (hot == NULL)
+		return;
+
+	for (i = 0; i < hot->nentries; ++i)
+		free(hot->heap[i].path);
+	pthread_mutex_destroy(&hot->mutex);
+	free(hot);
+}
+
+static uint64_t hash_key(const char *op, const char *path)
+{
+	uint64_t hash = FNV_OFFSET_BASIS;
+	const unsigned char *s;
+
+	for (s = (const unsigned char *)op; *s != '\0'; ++s)
+		hash = (hash ^ *s) * FNV_PRIME;
+	hash *= FNV_PRIME;		// separate op from path
+	for (s = (const unsigned char *)path; *s != '\0'; ++s)
+		hash = (hash ^ *s) * FNV_PRIME;
+
+	return hash;
+}
+
+/**
+ * Add a weight to a key's counters in the sketch.
+ *
+ * @return the key's new estimated count
+ */
+static uint64_t update_sketch(struct hotpath *hot, uint64_t hash,
+			      uint64_t weight)
+{
+	// derive each row's index from two halves of the hash
+	uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+	unsigned int idx[HOTPATH_DEPTH];
+	uint64_t count = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < HOTPATH_DEPTH; ++i) {
+		idx[i] = (h1 + i * h2) & (HOTPATH_WIDTH - 1);
+		if (hot->sketch[i][idx[i]] < count)
+			count = hot->sketch[i][idx[i]];
+	}
+
+	count += weight;
+	for (i = 0; i < HOTPATH_DEPTH; ++i) {
+		if (hot->sketch[i][idx[i]] < count)
+			hot->sketch[i][idx[i]] = count;
+	}
+
+	return count;
+}
+
+/* Restore the heap order after an entry's count has increased */
+static void sift_down(struct hotpath *hot, unsigned int i)
+{
+	struct hotpath_entry tmp;
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < hot->nentries) {
+		if (child + 1 < hot->nentries &&
+		    hot->heap[child + 1].count < hot->heap[child].count)
+			++child;
+		if (hot->heap[i].count <= hot->heap[child].count)
+			break;
+
+		tmp = hot->heap[i];
+		hot->heap[i] = hot->heap[child];
+		hot->heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void sift_up(struct hotpath *hot, unsigned int i)
+{
+	struct hotpath_entry tmp;
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (hot->heap[parent].count <= hot->heap[i].count)
+			break;
+
+		tmp = hot->heap[i];
+		hot->heap[i] = hot->heap[parent];
+		hot->heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+void hotpath_add(struct hotpath *hot, const char *op, const char *path,
+		 uint64_t weight)
+{
+	uint64_t hash = hash_key(op, path);
+	struct hotpath_entry *entry;
+	uint64_t count;
+	unsigned int i;
+	char *dup;
+
+	pthread_mutex_lock(&hot->mutex);
+
+	count = update_sketch(hot, hash, weight);
+
+	for (i = 0; i < hot->nentries; ++i) {
+		entry = &hot->heap[i];
+		if (entry->hash == hash && strcmp(entry->op, op) == 0 &&
+		    strcmp(entry->path, path) == 0) {
+			entry->count = count;
+			sift_down(hot, i);
+			goto out;
+		}
+	}
+
+	// only displace the lightest entry with a heavier one
+	if (hot->nentries == hot->size && count <= hot->heap[0].count)
+		goto out;
+
+	dup = strdup(path);
+	if (dup == NULL)
+		goto out;		// best effort
+
+	if (hot->nentries < hot->size) {
+		i = hot->nentries++;
+	} else {
+		i = 0;
+		free(hot->heap[0].path);
+	}
+	entry = &hot->heap[i];
+	entry->count = count;
+	entry->hash = hash;
+	entry->op = op;
+	entry->path = dup;
+	if (i == 0)
+		sift_down(hot, 0);
+	else
+		sift_up(hot, i);
+
+out:
+	pthread_mutex_unlock(&hot->mutex);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct hotpath_entry *ea = a, *eb = b;
+
+	if (ea->count != eb->count)
+		return (ea->count > eb->count) ? -1 : 1;
+	return strcmp(ea->path, eb->path);
+}
+
+/**
+ * Report the heaviest keys, heaviest first, with copies of their paths
+ * which the caller must free.
+ *
+ * @return number of keys reported, which is less than npaths only if
+ *         fewer keys are known or memory is exhausted
+ */
+unsigned int hotpath_get(struct hotpath *hot, struct projfs_hot_path *paths,
+			 unsigned int npaths)
+{
+	struct hotpath_entry *entries;
+	unsigned int i, nentries;
+
+	entries = malloc(hot->size * sizeof(*entries));
+	if (entries == NULL)
+		return 0;
+
+	pthread_mutex_lock(&hot->mutex);
+	nentries = hot->nentries;
+	for (i = 0; i < nentries; ++i) {
+		entries[i] = hot->heap[i];
+		entries[i].path = strdup(hot->heap[i].path);
+		if (entries[i].path == NULL) {
+			nentries = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hot->mutex);
+
+	qsort(entries, nentries, sizeof(*entries), compare_entries);
+
+	for (i = 0; i < nentries; ++i) {
+		if (i < npaths) {
+			paths[i].op = entries[i].op;
+			paths[i].path = entries[i].path;
+			paths[i].count = entries[i].count;
+		} else {
+			free(entries[i].path);
+		}
+	}
+
+	free(entries);
+	return (nentries < npaths) ? nentries : npaths;
+}
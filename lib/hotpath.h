@@ -0,0 +1,40 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HOTPATH_H
+#define _HOTPATH_H
+
+#include <stdint.h>
+
+#define HOTPATH_MAX_SIZE 256
+
+struct hotpath;
+struct projfs_hot_path;
+
+struct hotpath *hotpath_create(unsigned int size);
+void hotpath_destroy(struct hotpath *hot);
+
+void hotpath_add(struct hotpath *hot, const char *op, const char *path,
+		 uint64_t weight);
+unsigned int hotpath_get(struct hotpath *hot, struct projfs_hot_path *paths,
+			 unsigned int npaths);
+
+#endif /* _HOTPATH_H */
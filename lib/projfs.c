@@ -31,17 +31,28 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <attr/xattr.h>
+#include <linux/fs.h>
 #include <unistd.h>
 
+#include "dircache.h"
 #include "fdtable.h"
+#include "hotpath.h"
 #include "projfs.h"
+#include "provider.h"
+#include "sha256.h"
+#include "uring.h"
+#include "workpool.h"
 
 #define FUSE_USE_VERSION 32
 #include <fuse3/fuse.h>
@@ -53,6 +64,87 @@
 struct projfs_config {
 	int initial;
 	char *log;
+	int write_hash;
+	char *shared;
+	unsigned int proj_batch_msec;
+	unsigned int chunk_kib;
+	unsigned int chunk_threads;
+	unsigned int chunk_retries;
+	int event_queue;
+	char *provider_socket;
+	unsigned int notify_lanes;
+	int warm_start;
+	char *profile;
+	unsigned int hot_paths;
+};
+
+/* Pending file projection request, queued for a batched upcall */
+struct proj_batch_req {
+	struct projfs_event event;
+	int result;
+	int done;
+	struct proj_batch_req *next;
+};
+
+/* Queue of file projection requests gathered during a batching window */
+struct proj_batch {
+	pthread_mutex_t mutex;
+	pthread_cond_t full;		/* signalled when queue is full */
+	pthread_cond_t done;		/* broadcast when requests handled */
+	struct proj_batch_req *reqs;	/* newest request first */
+	unsigned int count;
+	int collecting;			/* 1 if a thread will send the queue */
+};
+
+/* Event awaiting delivery through projfs_read_events() and a reply */
+struct event_queue_req {
+	struct projfs_queued_event qev;
+	int result;
+	int wait;			/* 1 if sender waits for reply */
+	int done;
+	int read;			/* 1 once read by the provider */
+	int abandoned;			/* 1 if sender stopped waiting */
+	struct lane_join *join;		/* NULL unless in several lanes */
+	struct event_queue_req *next;
+};
+
+/* Slot in the table of tokens given out with queued events */
+struct event_token {
+	struct event_queue_req *req;	/* NULL if slot is free */
+	uint32_t gen;			/* advanced when slot is released */
+	uint32_t next_free;
+};
+
+/* Queue of events for providers which poll for events */
+struct event_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t done;		/* broadcast when replies received */
+	struct event_queue_req *head;	/* oldest unread event first */
+	struct event_queue_req **tail;
+	int fd;				/* eventfd, or -1 if not enabled */
+	int stopping;			/* 1 once senders may not wait */
+};
+
+/* Notification ordered in several lanes, linked once into each of them */
+struct lane_join {
+	struct event_queue_req *event;	/* link holding the event itself */
+	unsigned int arrivals;		/* lanes which have reached it */
+	unsigned int nlinks;
+	unsigned int refs;		/* links not yet freed */
+	int delivered;
+};
+
+/* Notifications delivered in order by a dedicated thread */
+struct event_lane {
+	struct projfs *fs;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;		/* signalled when events are added */
+	struct event_queue_req *head;	/* oldest undelivered event first */
+	struct event_queue_req **tail;
+	unsigned int depth;		/* events queued or being handled */
+	unsigned int max_depth;
+	int stop;
+	pthread_t thread_id;
 };
 
 #define PROJFS_OPT(t, p, v) { t, offsetof(struct projfs_config, p), v }
@@ -64,9 +156,45 @@ static struct fuse_opt projfs_opts[] = {
 	PROJFS_OPT("log=%s",	log, 0),
 	PROJFS_OPT("--log=%s",	log, 0),
 
+	PROJFS_OPT("write_hash",	write_hash, 1),
+	PROJFS_OPT("--write-hash",	write_hash, 1),
+
+	PROJFS_OPT("shared=%s",		shared, 0),
+	PROJFS_OPT("--shared=%s",	shared, 0),
+
+	PROJFS_OPT("proj_batch=%u",	proj_batch_msec, 0),
+	PROJFS_OPT("--proj-batch=%u",	proj_batch_msec, 0),
+
+	PROJFS_OPT("chunk_size=%u",	chunk_kib, 0),
+	PROJFS_OPT("--chunk-size=%u",	chunk_kib, 0),
+	PROJFS_OPT("chunk_threads=%u",	chunk_threads, 0),
+	PROJFS_OPT("--chunk-threads=%u", chunk_threads, 0),
+	PROJFS_OPT("chunk_retries=%u",	chunk_retries, 0),
+	PROJFS_OPT("--chunk-retries=%u", chunk_retries, 0),
+
+	PROJFS_OPT("event_queue",	event_queue, 1),
+	PROJFS_OPT("--event-queue",	event_queue, 1),
+
+	PROJFS_OPT("provider_socket=%s",	provider_socket, 0),
+	PROJFS_OPT("--provider-socket=%s",	provider_socket, 0),
+
+	PROJFS_OPT("notify_lanes=%u",	notify_lanes, 0),
+	PROJFS_OPT("--notify-lanes=%u",	notify_lanes, 0),
+
+	PROJFS_OPT("warm_start",	warm_start, 1),
+	PROJFS_OPT("--warm-start",	warm_start, 1),
+
+	PROJFS_OPT("profile=%s",	profile, 0),
+	PROJFS_OPT("--profile=%s",	profile, 0),
+
+	PROJFS_OPT("hot_paths=%u",	hot_paths, 0),
+	PROJFS_OPT("--hot-paths=%u",	hot_paths, 0),
+
 	FUSE_OPT_END
 };
 
+#define HOT_PATH_KINDS (PROJFS_HOT_UPCALLS + 1)
+
 struct projfs {
 	char *lowerdir;
 	char *mountdir;
@@ -75,11 +203,36 @@ struct projfs {
 	struct fuse_args args;
 	struct projfs_config config;
 	pthread_mutex_t mutex;
+	pthread_cond_t loop_exit;	/* signalled once loop_done is set */
+	int loop_done;
+	pthread_cond_t fuse_idle;	/* signalled once fuse_users is 0 */
+	unsigned int fuse_users;	/* batch invalidations using fuse */
+	atomic_int stopping;
+	atomic_uint upcalls_running;	/* handler calls awaited by file ops */
+	atomic_uint upcalls_refused;
+	unsigned int notify_dropped;	/* discarded by drain_event_lanes() */
+	struct proj_batch proj_batch;
+	struct event_queue event_queue;
+	struct event_lane *event_lanes;
+	unsigned int nlanes;		/* 0 if notifications not laned */
+	pthread_mutex_t lane_join_mutex;
+	pthread_cond_t lane_joined;	/* broadcast when joint event sent */
+	struct provider_bridge *provider_bridge;
+	struct fuse *fuse;
 	struct fuse_session *session;
 	FILE *log_file;
+	FILE *profile_file;		/* NULL unless recording a profile */
+	struct timespec profile_start;
 	int lowerdir_fd;
 	pthread_t thread_id;
 	struct fdtable *fdtable;
+	struct dircache *dircache;	/* NULL unless warm_start */
+	struct hotpath *hot_paths[HOT_PATH_KINDS];	/* or NULL if unused */
+	_Atomic(struct write_hash *) *write_hashes;	/* indexed by fd */
+	pthread_mutex_t write_inodes_mutex;
+	struct write_inode *write_inodes;	/* of open write_hashes */
+	int shared_fd;
+	atomic_uchar *shared_fds;	/* indexed by fd, or NULL if no layer */
 	int error;
 };
 
@@ -89,6 +242,7 @@ struct projfs_dir {
 	DIR *dir;
 	long loc;
 	struct dirent *ent;
+	int root;		/* lowerdir itself, with its private files */
 };
 
 // NOTE: only functional within a FUSE file operation!
@@ -240,1899 +394,6287 @@ static void log_close(struct projfs *fs)
 		fclose(fs->log_file);
 }
 
+#define PROC_COMM_PATH_FMT "/proc/%d/comm"
+#define MAX_PROC_COMM_PATH_LEN \
+	(sizeof(PROC_COMM_PATH_FMT) + INT_FMT_LEN - 3)
+
+#define PROC_COMM_BUF_SIZE 32
+
+static int profile_open(struct projfs *fs)
+{
+	if (fs->config.profile == NULL)
+		return 0;
+
+	fs->profile_file = fopen(fs->config.profile, "w");
+	if (fs->profile_file == NULL) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "error opening profile file: %s: %s",
+			   strerror(errno), fs->config.profile);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &fs->profile_start);
+
+	return 0;
+}
+
+static void profile_close(struct projfs *fs)
+{
+	if (fs->profile_file != NULL) {
+		fclose(fs->profile_file);
+		fs->profile_file = NULL;
+	}
+}
+
 /**
- * @return 0 or a negative errno
+ * Record the first access to a file in the profile, if one is enabled, as
+ * a line with the milliseconds elapsed since the filesystem started, the
+ * command name of the accessing process, and the file's path.
+ *
+ * NOTE: only functional within a FUSE file operation!
+ *
+ * @param path path of the file within lowerdir
  */
-static int send_event(projfs_handler_t handler, uint64_t mask, pid_t pid,
-		      const char *path, const char *target_path,
-		      int fd, int perm)
+static void profile_record_fuse_context(const char *path)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	char comm_path[MAX_PROC_COMM_PATH_LEN + 1];
+	char comm[PROC_COMM_BUF_SIZE] = "";
+	struct timespec now;
+	unsigned long msec;
+	FILE *file;
+	char *s;
+
+	if (fs->profile_file == NULL || strchr(path, '\n') != NULL)
+		return;
+
+	// our own accesses are those of projfs_prefetch_profile()
+	if (get_fuse_context_tgid() == getpid())
+		return;
+
+	// do not report IO or parsing errors
+	sprintf(comm_path, PROC_COMM_PATH_FMT, fuse_get_context()->pid);
+	file = fopen(comm_path, "r");
+	if (file != NULL) {
+		if (fgets(comm, sizeof(comm), file) == NULL)
+			comm[0] = '\0';
+		fclose(file);
+	}
+	comm[strcspn(comm, "\n")] = '\0';
+	for (s = comm; *s != '\0'; ++s) {
+		if (*s == '\t')
+			*s = ' ';
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = (now.tv_sec - fs->profile_start.tv_sec) * 1000 +
+	       (now.tv_nsec - fs->profile_start.tv_nsec) / 1000000;
+
+	fprintf(fs->profile_file, "%lu\t%s\t%s\n", msec, comm, path);
+}
+
+static int init_event_queue(struct event_queue *queue, int enable)
 {
-	struct projfs_event event;
 	int err;
 
-	if (handler == NULL)
+	queue->head = NULL;
+	queue->tail = &queue->head;
+	queue->fd = -1;
+	queue->stopping = 0;
+	if (!enable)
 		return 0;
 
-	if (pid == 0)
-		pid = get_fuse_context_tgid();
-
-	event.fs = get_fuse_context_projfs();
-	event.mask = mask;
-	event.pid = pid;
-	event.path = path;
-	event.target_path = target_path;
-	event.fd = fd;
+	err = pthread_mutex_init(&queue->mutex, NULL);
+	if (err > 0)
+		return err;
+	err = pthread_cond_init(&queue->done, NULL);
+	if (err > 0)
+		goto out_mutex;
 
-	err = handler(&event);
-	if (err < 0) {
-		log_printf_fuse_context("event handler failed: %s; "
-					"mask 0x%04" PRIx64 "-%08" PRIx64 ", "
-					"pid %d, path %s%s%s",
-					strerror(-err),
-					mask >> 32, mask & 0xFFFFFFFF,
-					pid, path,
-					(target_path == NULL)
-						? "" : ", target path ",
-					(target_path == NULL)
-						? "" : target_path);
-	}
-	else if (perm) {
-		err = (err == PROJFS_ALLOW) ? 0 : -EPERM;
+	queue->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (queue->fd == -1) {
+		err = errno;
+		goto out_cond;
 	}
+	return 0;
 
+out_cond:
+	pthread_cond_destroy(&queue->done);
+out_mutex:
+	pthread_mutex_destroy(&queue->mutex);
 	return err;
 }
 
+/*
+ * Tokens given out with queued events index a table shared by all
+ * filesystems, since projfs_reply_event() is not passed a filesystem
+ * handle.  A token holds its slot's index and generation, and the
+ * generation is advanced whenever the slot is released, so a token which
+ * was never given out, or has already been answered, is rejected rather
+ * than dereferenced.
+ */
+
+#define EVENT_TOKENS_INIT_SIZE 64
+#define EVENT_TOKEN_NONE UINT32_MAX
+
+static pthread_mutex_t event_tokens_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct event_token *event_tokens;
+static uint32_t event_tokens_size;
+static uint32_t event_tokens_free = EVENT_TOKEN_NONE;
+
 /**
- * @return 0 or a negative errno
+ * Assign a token to a queued event request, growing the token table if
+ * no slot is free.  Must be called with event_tokens_mutex held.
+ *
+ * @return 0 or an errno
  */
-static int send_proj_event(uint64_t mask, const char *path, int fd)
+static int alloc_event_token(struct event_queue_req *req)
 {
-	projfs_handler_t handler =
-		get_fuse_context_projfs()->handlers.handle_proj_event;
+	struct event_token *tokens;
+	uint32_t i, size;
+
+	if (event_tokens_free == EVENT_TOKEN_NONE) {
+		size = (event_tokens_size == 0) ? EVENT_TOKENS_INIT_SIZE
+						: event_tokens_size * 2;
+		if (size <= event_tokens_size || size == EVENT_TOKEN_NONE)
+			return ENOMEM;
+
+		tokens = realloc(event_tokens, size * sizeof(*tokens));
+		if (tokens == NULL)
+			return ENOMEM;
+
+		for (i = size; i-- > event_tokens_size; ) {
+			tokens[i].req = NULL;
+			tokens[i].gen = 0;
+			tokens[i].next_free = event_tokens_free;
+			event_tokens_free = i;
+		}
+		event_tokens = tokens;
+		event_tokens_size = size;
+	}
+
+	i = event_tokens_free;
+	event_tokens_free = event_tokens[i].next_free;
+	event_tokens[i].req = req;
 
-	return send_event(handler, mask, 0, path, NULL, fd, 0);
+	// zero is never a valid token
+	req->qev.token = ((uint64_t)event_tokens[i].gen << 32) | (i + 1);
+	return 0;
 }
 
 /**
- * @return 0 or a negative errno
+ * Must be called with event_tokens_mutex held.
  */
-static int send_notify_event(uint64_t mask, pid_t pid, const char *path,
-			     const char *target_path)
+static void release_event_token(uint32_t idx)
 {
-	projfs_handler_t handler =
-		get_fuse_context_projfs()->handlers.handle_notify_event;
-
-	return send_event(handler, mask, pid, path, target_path, 0, 0);
+	event_tokens[idx].req = NULL;
+	++event_tokens[idx].gen;
+	event_tokens[idx].next_free = event_tokens_free;
+	event_tokens_free = idx;
 }
 
 /**
- * @return 0 or a negative errno
+ * Must be called with event_tokens_mutex held.
+ *
+ * @return request given the token, or NULL if the token is not current
  */
-static int send_perm_event(uint64_t mask, const char *path,
-			   const char *target_path)
+static struct event_queue_req *find_event_token(uint64_t token,
+						uint32_t *idx)
 {
-	projfs_handler_t handler =
-		get_fuse_context_projfs()->handlers.handle_perm_event;
-
-	return send_event(handler, mask, 0, path, target_path, 0, 1);
-}
+	uint32_t i = (uint32_t)token - 1;
 
-#define PROJ_XATTR_PRE_NAME "user.projection."
-#define PROJ_XATTR_PRE_LEN (sizeof(PROJ_XATTR_PRE_NAME) - 1)
+	if (i >= event_tokens_size || event_tokens[i].req == NULL ||
+	    event_tokens[i].gen != (uint32_t)(token >> 32))
+		return NULL;
 
-#define PROJ_STATE_XATTR_NAME PROJ_XATTR_PRE_NAME"empty"
+	*idx = i;
+	return event_tokens[i].req;
+}
 
-static int xattr_name_has_prefix(const char *name)
+static void free_event_queue_req(struct event_queue_req *req)
 {
-	if (strncmp(name, PROJ_XATTR_PRE_NAME, PROJ_XATTR_PRE_LEN) == 0)
-		return 1;
-
-	return 0;
+	if (req->qev.type == PROJFS_EVENT_PROJ)
+		close(req->qev.event.fd);
+	free(req);
 }
 
-static int xattr_name_is_reserved(const char *name)
+/**
+ * Fail the file operations waiting for replies to queued events, and any
+ * which would queue more, so the FUSE loop may exit even if no provider
+ * will answer them.  Events already queued remain valid until answered,
+ * or until the queue is destroyed.
+ */
+static void stop_event_queue(struct event_queue *queue)
 {
-	if (strcmp(name, PROJ_STATE_XATTR_NAME) == 0)
-		return 1;
-	// add other reserved names as they are defined
+	if (queue->fd == -1)
+		return;
 
-	return 0;
+	pthread_mutex_lock(&queue->mutex);
+	queue->stopping = 1;
+	pthread_cond_broadcast(&queue->done);
+	pthread_mutex_unlock(&queue->mutex);
 }
 
-static int get_xattr(int fd, const char *name, void *value, ssize_t *size)
+/**
+ * @return number of unread notifications discarded
+ */
+static unsigned int destroy_event_queue(struct event_queue *queue)
 {
-	if (fgetxattr(fd, name, value, *size) == -1) {
-		if (errno != ENOATTR)
-			return -1;
-		*size = -1;
+	struct event_queue_req *req;
+	unsigned int dropped = 0;
+	uint32_t i;
+
+	if (queue->fd == -1)
+		return 0;
+
+	for (req = queue->head; req != NULL; req = req->next) {
+		if (!req->wait)
+			++dropped;
 	}
-	return 0;
+
+	/* once the FUSE loop exits, no sender still waits, so release all
+	 * remaining requests, whether read or not, and fail stale tokens
+	 */
+	pthread_mutex_lock(&event_tokens_mutex);
+	for (i = 0; i < event_tokens_size; ++i) {
+		req = event_tokens[i].req;
+		if (req == NULL || &req->qev.event.fs->event_queue != queue)
+			continue;
+		release_event_token(i);
+		free_event_queue_req(req);
+	}
+	pthread_mutex_unlock(&event_tokens_mutex);
+
+	close(queue->fd);
+	pthread_cond_destroy(&queue->done);
+	pthread_mutex_destroy(&queue->mutex);
+
+	return dropped;
 }
 
-static int set_xattr(int fd, const char *name, const void *value,
-		     ssize_t *size, int flags)
+/**
+ * Allocate a queued notification request, copying the event's strings
+ * since the sender does not wait for the event to be handled.
+ *
+ * @return request, or NULL with errno set
+ */
+static struct event_queue_req *copy_event_queue_req(
+						struct projfs_event *event)
 {
-	if (value == NULL || *size == 0) {
-		if (fremovexattr(fd, name) == -1) {
-			if (errno != ENOATTR)
-				return -1;
-			*size = -1;
-		}
-		return 0;
+	struct event_queue_req *req;
+	size_t path_len, target_len = 0, hash_len = 0;
+	char *p;
+
+	path_len = strlen(event->path) + 1;
+	if (event->target_path != NULL)
+		target_len = strlen(event->target_path) + 1;
+	if (event->content_hash != NULL)
+		hash_len = PROJFS_CONTENT_HASH_SIZE;
+
+	req = malloc(sizeof(*req) + path_len + target_len + hash_len);
+	if (req == NULL)
+		return NULL;
+
+	req->qev.event = *event;
+	p = (char *)(req + 1);
+	req->qev.event.path = memcpy(p, event->path, path_len);
+	p += path_len;
+	if (target_len > 0) {
+		req->qev.event.target_path =
+			memcpy(p, event->target_path, target_len);
+		p += target_len;
 	}
+	if (hash_len > 0)
+		req->qev.event.content_hash =
+			memcpy(p, event->content_hash, hash_len);
 
-	return fsetxattr(fd, name, value, *size, flags);
+	return req;
 }
 
-enum proj_state {
-	PROJ_STATE_ERROR = -1,	/* invalid state */
-	PROJ_STATE_EMPTY,	/* unopened (sparse file with metadata) */
-	PROJ_STATE_POPULATED,	/* unmodified (hydrated with data) */
-	PROJ_STATE_MODIFIED	/* no longer projected (fully local) */
-};
+/**
+ * Queue an event for delivery through projfs_read_events(), signalling
+ * the queue's eventfd if the queue was empty.  Unless the event is a
+ * notification, wait for its reply, or until the filesystem is stopping.
+ *
+ * Every request is copied, and a projection request keeps its own file
+ * descriptor, since a provider may still answer it after its sender has
+ * stopped waiting.
+ *
+ * @return 0 or a negative errno, or a permission response
+ */
+static int queue_event(struct projfs *fs, struct projfs_event *event,
+		       unsigned int type)
+{
+	struct event_queue *queue = &fs->event_queue;
+	struct event_queue_req *req;
+	int wait = (type != PROJFS_EVENT_NOTIFY);
+	uint64_t val = 1;
+	int err;
 
-#define PROJ_STATE_XATTR_VALUE_EMPTY 'y'
-#define PROJ_STATE_XATTR_VALUE_POPULATED 'n'
-/* The PROJ_STATE_XATTR_NAME xattr is removed for the MODIFIED state. */
+	req = copy_event_queue_req(event);
+	if (req == NULL)
+		return -errno;
+	req->qev.type = type;
+	req->result = 0;
+	req->wait = wait;
+	req->done = 0;
+	req->read = 0;
+	req->abandoned = 0;
+	req->next = NULL;
+
+	if (type == PROJFS_EVENT_PROJ) {
+		req->qev.event.fd = fcntl(event->fd, F_DUPFD_CLOEXEC, 0);
+		if (req->qev.event.fd == -1) {
+			err = errno;
+			free(req);
+			return -err;
+		}
+	}
 
-static enum proj_state get_proj_state_xattr(int fd)
-{
-	char value;
-	ssize_t size = sizeof(value);
+	pthread_mutex_lock(&event_tokens_mutex);
+	pthread_mutex_lock(&queue->mutex);
+	if (wait && queue->stopping) {
+		atomic_fetch_add(&fs->upcalls_refused, 1);
+		err = EIO;
+		goto out_unlock;
+	}
+	err = alloc_event_token(req);
+	if (err > 0)
+		goto out_unlock;
 
-	if (get_xattr(fd, PROJ_STATE_XATTR_NAME, &value, &size) == -1)
-		return PROJ_STATE_ERROR;
+	// eventfd stays readable until the queue is emptied
+	if (queue->head == NULL &&
+	    write(queue->fd, &val, sizeof(val)) == -1) {
+		err = errno;
+		release_event_token((uint32_t)req->qev.token - 1);
+		goto out_unlock;
+	}
+	*queue->tail = req;
+	queue->tail = &req->next;
+	pthread_mutex_unlock(&event_tokens_mutex);
 
-	if (size == -1)
-		return PROJ_STATE_MODIFIED;
+	// notifications may be replied to and freed once unlocked
+	if (!wait) {
+		pthread_mutex_unlock(&queue->mutex);
+		return 0;
+	}
 
-	switch (value) {
-	case PROJ_STATE_XATTR_VALUE_POPULATED:
-		return PROJ_STATE_POPULATED;
-	case PROJ_STATE_XATTR_VALUE_EMPTY:
-		return PROJ_STATE_EMPTY;
-	default:
-		errno = EINVAL;
-		return PROJ_STATE_ERROR;
+	while (!req->done && !queue->stopping)
+		pthread_cond_wait(&queue->done, &queue->mutex);
+	if (!req->done) {
+		// leave the request to be released by its reply, or on stop
+		req->abandoned = 1;
+		pthread_mutex_unlock(&queue->mutex);
+		atomic_fetch_add(&fs->upcalls_refused, 1);
+		return -EIO;
 	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	err = req->result;
+	free_event_queue_req(req);
+	return err;
+
+out_unlock:
+	pthread_mutex_unlock(&queue->mutex);
+	pthread_mutex_unlock(&event_tokens_mutex);
+	free_event_queue_req(req);
+	return -err;
 }
 
-static int set_proj_state_xattr(int fd, enum proj_state state, int flags)
+static void deliver_lane_event(struct event_lane *lane,
+			       struct projfs_event *event)
 {
-	char value;
-	void *valuep = &value;
-	ssize_t size = sizeof(value);
+	int err;
 
-	switch (state) {
-	case PROJ_STATE_POPULATED:
-		value = PROJ_STATE_XATTR_VALUE_POPULATED;
-		break;
-	case PROJ_STATE_EMPTY:
-		value = PROJ_STATE_XATTR_VALUE_EMPTY;
-		break;
-	case PROJ_STATE_MODIFIED:
-		valuep = NULL;
-		size = 0;
-		break;
-	default:
-	case PROJ_STATE_ERROR:
-		errno = EINVAL;
-		return -1;
+	err = lane->fs->handlers.handle_notify_event(event);
+	if (err < 0) {
+		log_printf(lane->fs, LOG_STDERR_NONE,
+			   "event handler failed: %s; "
+			   "mask 0x%04" PRIx64 "-%08" PRIx64 ", "
+			   "pid %d, path %s%s%s",
+			   strerror(-err),
+			   event->mask >> 32, event->mask & 0xFFFFFFFF,
+			   event->pid, event->path,
+			   (event->target_path == NULL)
+				? "" : ", target path ",
+			   (event->target_path == NULL)
+				? "" : event->target_path);
 	}
-
-	return set_xattr(fd, PROJ_STATE_XATTR_NAME, valuep, &size, flags);
 }
 
-struct proj_state_lock {
-	int lock_fd;
-	enum proj_state state;
-};
-
 /**
- * Acquires a lock on path and populates the supplied proj_state_lock argument
- * with the open and locked fd, and state based on the
- * PROJ_STATE_XATTR_NAME xattr.
- *
- * @param state_lock structure to fill out (zeroed by this function)
- * @param path path relative to lowerdir to lock and open
- * @param flags file flags with which to open the locked fd
- * @return 0 or an errno
+ * Wait at an event which orders several lanes until each of them has
+ * reached it, so that it is delivered after all earlier events and before
+ * all later ones in every one of those lanes.  The last lane to reach the
+ * event delivers it.  The caller frees its own link once this returns.
  */
-static int acquire_proj_state_lock(struct proj_state_lock *state_lock,
-				   const char *path, int flags)
+static void join_lane_event(struct event_lane *lane,
+			    struct event_queue_req *req)
 {
-	enum proj_state state;
-	int err, wait_ms;
-	struct timespec ts;
+	struct projfs *fs = lane->fs;
+	struct lane_join *join = req->join;
+	int last_ref;
+
+	pthread_mutex_lock(&fs->lane_join_mutex);
+	if (++join->arrivals == join->nlinks) {
+		pthread_mutex_unlock(&fs->lane_join_mutex);
+		deliver_lane_event(lane, &join->event->qev.event);
+		pthread_mutex_lock(&fs->lane_join_mutex);
+		join->delivered = 1;
+		pthread_cond_broadcast(&fs->lane_joined);
+	}
+	while (!join->delivered)
+		pthread_cond_wait(&fs->lane_joined, &fs->lane_join_mutex);
+	last_ref = (--join->refs == 0);
+	pthread_mutex_unlock(&fs->lane_join_mutex);
 
-	memset(state_lock, 0, sizeof(*state_lock));
+	if (last_ref)
+		free(join);
+}
 
-	state_lock->lock_fd = openat(get_fuse_context_lowerdir_fd(),
-				     path, flags);
-	if (state_lock->lock_fd == -1)
-		return errno;
-
-	wait_ms = PROJ_WAIT_MSEC;
+static void *event_lane_loop(void *data)
+{
+	struct event_lane *lane = data;
+	struct event_queue_req *req;
 
-retry_flock:
-	// TODO: may conflict with locks held by clients; use internal locks
-	err = flock(state_lock->lock_fd, LOCK_EX | LOCK_NB);
-	if (err == -1) {
-		if (errno == EWOULDBLOCK && wait_ms > 0) {
-			/* sleep 100ms, retry */
-			ts.tv_sec = 0;
-			ts.tv_nsec = 1000 * 1000 * 100;
-			nanosleep(&ts, NULL);
-			wait_ms -= 100;
-			goto retry_flock;
-		}
+	pthread_mutex_lock(&lane->mutex);
+	while (1) {
+		// deliver any remaining events before stopping
+		while (lane->head == NULL && !lane->stop)
+			pthread_cond_wait(&lane->ready, &lane->mutex);
+		req = lane->head;
+		if (req == NULL)
+			break;
+		lane->head = req->next;
+		if (lane->head == NULL)
+			lane->tail = &lane->head;
+		pthread_mutex_unlock(&lane->mutex);
 
-		err = errno;
-		goto out_close;
-	}
+		if (req->join == NULL)
+			deliver_lane_event(lane, &req->qev.event);
+		else
+			join_lane_event(lane, req);
+		free(req);
 
-	state = get_proj_state_xattr(state_lock->lock_fd);
-	if (state == PROJ_STATE_ERROR) {
-		err = errno;
-		goto out_close;
+		pthread_mutex_lock(&lane->mutex);
+		--lane->depth;
 	}
+	pthread_mutex_unlock(&lane->mutex);
 
-	state_lock->state = state;
-	return 0;
-
-out_close:
-	close(state_lock->lock_fd);
-	state_lock->lock_fd = -1;
-	return err;
+	return NULL;
 }
 
-/**
- * Closes the open fd associated with state_lock, which in turn releases any
- * locks associated with the lock_fd.
- *
- * @param state_lock projection state structure to clean up
- */
-static void release_proj_state_lock(struct proj_state_lock *state_lock)
+static void stop_event_lanes(struct projfs *fs, unsigned int nlanes)
 {
-	if (state_lock->lock_fd == -1)
+	struct event_lane *lane;
+	unsigned int i;
+
+	if (fs->event_lanes == NULL)
 		return;
 
-	close(state_lock->lock_fd);
-	state_lock->lock_fd = -1;
+	/* a lane waiting at an event which orders it with later lanes is
+	 * released once they reach the event, as they are not yet stopped
+	 */
+	for (i = 0; i < nlanes; ++i) {
+		lane = &fs->event_lanes[i];
+
+		pthread_mutex_lock(&lane->mutex);
+		lane->stop = 1;
+		pthread_cond_signal(&lane->ready);
+		pthread_mutex_unlock(&lane->mutex);
+		pthread_join(lane->thread_id, NULL);
+
+		log_printf(fs, LOG_STDERR_NONE,
+			   "notification lane %u: max depth %u",
+			   i, lane->max_depth);
+
+		pthread_cond_destroy(&lane->ready);
+		pthread_mutex_destroy(&lane->mutex);
+	}
+
+	pthread_cond_destroy(&fs->lane_joined);
+	pthread_mutex_destroy(&fs->lane_join_mutex);
+	free(fs->event_lanes);
+	fs->event_lanes = NULL;
+	fs->nlanes = 0;
 }
 
 /**
- * Projects a path by notifying the provider with the given event mask.  If the
- * provider succeeds, updates the projection state on the path.
+ * Start a thread for each ordered notification lane, unless lanes are
+ * not configured or notifications are queued for the provider instead.
  *
- * @param state_lock current projection state and lock held on inode
- * @param fd file descriptor of inode whose projection state should be updated
- * @param path the path of the inode whose projection state should be updated
- * @param isdir 1 if the path is a directory; 0 otherwise
- * @param state projection state to which the inode should be updated
  * @return 0 or an errno
  */
-static int project_locked_path(struct proj_state_lock *state_lock, int fd,
-			       const char *path, int isdir,
-			       enum proj_state state)
+static int start_event_lanes(struct projfs *fs)
 {
-	int res;
-
-	if (isdir || state == PROJ_STATE_POPULATED) {
-		uint64_t event_mask = PROJFS_CREATE;
+	unsigned int nlanes = fs->config.notify_lanes;
+	struct event_lane *lane;
+	unsigned int i;
+	int err;
 
-		if (isdir)
-			event_mask |= PROJFS_ONDIR;
-		res = send_proj_event(event_mask, path, fd);
-	} else {
-		res = send_perm_event(PROJFS_OPEN_PERM, path, NULL);
-	}
+	if (nlanes == 0 || fs->handlers.handle_notify_event == NULL)
+		return 0;
 
-	if (res < 0)
-		return -res;
+	fs->event_lanes = calloc(nlanes, sizeof(struct event_lane));
+	if (fs->event_lanes == NULL)
+		return errno;
 
-	if (state == PROJ_STATE_POPULATED) {
-		res = set_proj_state_xattr(fd, state, XATTR_REPLACE);
-	} else {
-		res = set_proj_state_xattr(fd, state, 0);
+	err = pthread_mutex_init(&fs->lane_join_mutex, NULL);
+	if (err > 0)
+		goto out_free;
+	err = pthread_cond_init(&fs->lane_joined, NULL);
+	if (err > 0)
+		goto out_join_mutex;
+
+	for (i = 0; i < nlanes; ++i) {
+		lane = &fs->event_lanes[i];
+		lane->fs = fs;
+		lane->tail = &lane->head;
+
+		err = pthread_mutex_init(&lane->mutex, NULL);
+		if (err > 0)
+			goto out_lanes;
+		err = pthread_cond_init(&lane->ready, NULL);
+		if (err > 0)
+			goto out_mutex;
+		err = pthread_create(&lane->thread_id, NULL, event_lane_loop,
+				     lane);
+		if (err > 0)
+			goto out_cond;
 	}
 
-	if (res == -1)
-		return errno;
-
-	state_lock->state = state;
+	fs->nlanes = nlanes;
 	return 0;
+
+out_cond:
+	pthread_cond_destroy(&lane->ready);
+out_mutex:
+	pthread_mutex_destroy(&lane->mutex);
+out_lanes:
+	stop_event_lanes(fs, i);
+	return err;
+
+out_join_mutex:
+	pthread_mutex_destroy(&fs->lane_join_mutex);
+out_free:
+	free(fs->event_lanes);
+	fs->event_lanes = NULL;
+	return err;
 }
 
+#define LANE_JOIN_MAX 4
+
 /**
- * Return a copy of path with the last component removed (e.g. "x/y/z" will
- * yield "x/y").  If path has only one component, returns ".".
- *
- * The caller is responsible for freeing the returned string.
- *
- * @param path path to get parent directory of
- * @return name of parent of path; may be NULL if strdup or strndup fails
+ * @return index of the lane for the entries of the directory named by
+ *         the first len characters of path
  */
-static char *get_path_parent(char const *path)
+static unsigned int get_lane_index(struct projfs *fs, const char *path,
+				   size_t len)
 {
-	const char *last = strrchr(path, '/');
-	if (!last)
-		return strdup(".");
-	else
-		return strndup(path, last - path);
+	uint32_t hash = 2166136261u;		// FNV-1a
+
+	while (len-- > 0) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+
+	return hash % fs->nlanes;
 }
 
-/*
- * Returns 1 if file descriptor's mode was changed; 0 otherwise.
- */
-static int fchmod_user_write(int fd, mode_t mode, int set)
+static void add_event_lane(struct projfs *fs, const char *path, size_t len,
+			   unsigned int *idxs, unsigned int *nidxs)
 {
-	if (mode & S_IWUSR)
-		return 0;
-	mode = set ? (mode | S_IWUSR) : (mode & ~S_IWUSR);
-	if (fchmod(fd, mode) == -1)
-		return 0;
-	return 1;
+	unsigned int idx = get_lane_index(fs, path, len);
+	unsigned int i;
+
+	// keep indices sorted, so lanes are always locked in the same order
+	for (i = *nidxs; i > 0 && idxs[i - 1] >= idx; --i) {
+		if (idxs[i - 1] == idx)
+			return;
+	}
+	memmove(&idxs[i + 1], &idxs[i], (*nidxs - i) * sizeof(*idxs));
+	idxs[i] = idx;
+	++*nidxs;
 }
 
-static int fchmod_user_write_stat(int fd, struct stat *st, int set)
+static void add_event_lanes(struct projfs *fs, const char *path, int isdir,
+			    unsigned int *idxs, unsigned int *nidxs)
 {
-	if (st->st_uid != geteuid())
-		return 0;
-	return fchmod_user_write(fd, st->st_mode, set);
+	const char *end = strrchr(path, '/');
+
+	add_event_lane(fs, path, (end == NULL) ? 0 : end - path, idxs, nidxs);
+	if (isdir)
+		add_event_lane(fs, path, strlen(path), idxs, nidxs);
 }
 
 /**
- * Project a directory. Takes the path, and a flag indicating whether the
- * directory is the parent of the path, or the path itself.
+ * Select the lanes for an event by hashing the parent directories of its
+ * paths, and of a directory the paths themselves, so that the events for
+ * the entries of any one directory are delivered in order.  An event which
+ * moves or links an entry into another directory, or creates, deletes, or
+ * moves a directory, is ordered in the lanes of every directory it changes.
  *
- * @param op op name (for debugging)
- * @param path path within lowerdir (from make_relative_path())
- * @param parent 1 if we should look at the parent directory containing path, 0
- *               if we look at path itself
- * @return 0 or an errno
+ * @return number of lanes, with their indices in ascending order
  */
-static int project_dir(const char *op, const char *path, int parent)
+static unsigned int get_event_lanes(struct projfs *fs,
+				    const struct projfs_event *event,
+				    unsigned int *idxs)
 {
-	struct proj_state_lock state_lock;
-	char *lock_path;
-	struct stat st;
-	int log = 0;
-	int reset_mode, lock_fd;
-	int res;
+	int isdir = ((event->mask & PROJFS_ONDIR) != 0);
+	unsigned int nidxs = 0;
 
-	if (parent)
-		lock_path = get_path_parent(path);
-	else
-		lock_path = strdup(path);
-	if (lock_path == NULL)
-		return errno;
+	add_event_lanes(fs, event->path, isdir, idxs, &nidxs);
+	if (event->target_path != NULL)
+		add_event_lanes(fs, event->target_path, isdir, idxs, &nidxs);
 
-	res = acquire_proj_state_lock(&state_lock, lock_path,
-				      O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-	if (res != 0)
-		goto out;
+	return nidxs;
+}
 
-	if (state_lock.state != PROJ_STATE_EMPTY)
-		goto out_release;
+/**
+ * Queue a notification for delivery by its lanes' threads, copying the
+ * event's strings since the sender does not wait for the event.  If the
+ * event is ordered in several lanes, it is linked into each of them at
+ * once, so that no two events can be linked in opposite orders.
+ *
+ * @return 0 or a negative errno
+ */
+static int lane_event(struct projfs *fs, struct projfs_event *event)
+{
+	struct event_queue_req *links[LANE_JOIN_MAX];
+	unsigned int idxs[LANE_JOIN_MAX];
+	struct lane_join *join;
+	struct event_lane *lane;
+	unsigned int nlinks, i;
 
-	// fsetxattr() requires S_IWUSR, so check and temporarily set if needed
-	lock_fd = state_lock.lock_fd;
-	if (fstat(lock_fd, &st) == -1) {
-		res = errno;
-		goto out_release;
+	nlinks = get_event_lanes(fs, event, idxs);
+
+	links[0] = copy_event_queue_req(event);
+	if (links[0] == NULL)
+		return -errno;
+	links[0]->join = NULL;
+
+	if (nlinks > 1) {
+		join = malloc(sizeof(*join));
+		if (join == NULL)
+			goto out_free;
+		join->event = links[0];
+		join->arrivals = 0;
+		join->nlinks = nlinks;
+		join->refs = nlinks;
+		join->delivered = 0;
+		links[0]->join = join;
+
+		for (i = 1; i < nlinks; ++i) {
+			links[i] = calloc(1, sizeof(*links[i]));
+			if (links[i] == NULL)
+				goto out_links;
+			links[i]->join = join;
+		}
 	}
-	reset_mode = fchmod_user_write_stat(lock_fd, &st, 1);
 
-	// directories skip intermediate state; either empty or fully local
-	res = project_locked_path(&state_lock, lock_fd, lock_path, 1,
-				  PROJ_STATE_MODIFIED);
-	log = (res == 0);
+	for (i = 0; i < nlinks; ++i)
+		pthread_mutex_lock(&fs->event_lanes[idxs[i]].mutex);
+	for (i = 0; i < nlinks; ++i) {
+		lane = &fs->event_lanes[idxs[i]];
+
+		links[i]->next = NULL;
+		*lane->tail = links[i];
+		lane->tail = &links[i]->next;
+		if (++lane->depth > lane->max_depth)
+			lane->max_depth = lane->depth;
+		pthread_cond_signal(&lane->ready);
+	}
+	for (i = 0; i < nlinks; ++i)
+		pthread_mutex_unlock(&fs->event_lanes[idxs[i]].mutex);
 
-	if (reset_mode)
-		 fchmod_user_write_stat(lock_fd, &st, 0);
+	return 0;
 
-out_release:
-	release_proj_state_lock(&state_lock);
+out_links:
+	while (--i > 0)
+		free(links[i]);
+	free(join);
+out_free:
+	free(links[0]);
+	return -ENOMEM;
+}
 
-	if (log) {
-		log_printf_fuse_context("directory projected to "
-					"'modified' state in '%s' op: %s",
-					op, lock_path);
+unsigned int projfs_get_lane_depths(struct projfs *fs, unsigned int *depths,
+				    unsigned int ndepths)
+{
+	struct event_lane *lane;
+	unsigned int i;
+
+	for (i = 0; i < fs->nlanes && i < ndepths; ++i) {
+		lane = &fs->event_lanes[i];
+
+		pthread_mutex_lock(&lane->mutex);
+		depths[i] = lane->depth;
+		pthread_mutex_unlock(&lane->mutex);
 	}
 
-out:
-	free(lock_path);
+	return fs->nlanes;
+}
 
-	return res;
+unsigned int projfs_get_hot_paths(struct projfs *fs, unsigned int kind,
+				  struct projfs_hot_path *paths,
+				  unsigned int npaths)
+{
+	if (kind >= HOT_PATH_KINDS || fs->hot_paths[kind] == NULL)
+		return 0;
+
+	return hotpath_get(fs->hot_paths[kind], paths, npaths);
 }
 
-#define PROC_SELF_FD_PATH_FMT "/proc/self/fd/%d"
-#define MAX_PROC_SELF_FD_PATH_LEN \
-	(sizeof(PROC_SELF_FD_PATH_FMT) + INT_FMT_LEN - 3)
+/**
+ * Set a deadline the given number of milliseconds from now, measured with
+ * the monotonic clock.
+ */
+static void get_deadline(struct timespec *deadline, unsigned int msec)
+{
+	long nsec;
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	nsec = deadline->tv_nsec + msec % 1000 * 1000000L;
+	deadline->tv_sec += msec / 1000 + nsec / 1000000000L;
+	deadline->tv_nsec = nsec % 1000000000L;
+}
+
+static int deadline_passed(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec > deadline->tv_sec ||
+		(now.tv_sec == deadline->tv_sec &&
+		 now.tv_nsec >= deadline->tv_nsec));
+}
+
+#define LANE_DRAIN_POLL_NSEC 10000000L
 
 /**
- * Project a file. Takes the lower path.
+ * Wait for the notification lanes to empty, and once the deadline passes,
+ * discard any notifications which have not yet been delivered, except
+ * those ordered in several lanes.
  *
- * @param op op name (for debugging)
- * @param path the lower path (from lowerpath)
- * @param state the projection state to apply (populated or modified)
- * @return 0 or an errno
+ * @param dropped incremented by the number of notifications discarded
+ * @return number of notifications still being handled
  */
-static int project_file(const char *op, const char *path,
-			enum proj_state state)
+static unsigned int drain_event_lanes(struct projfs *fs,
+				      const struct timespec *deadline,
+				      unsigned int *dropped)
 {
-	char self_fd_path[MAX_PROC_SELF_FD_PATH_LEN + 1];
-	struct proj_state_lock state_lock;
-	struct stat st;
-	int reset_mode = 0;
-	int log = 0;
-	int lock_fd;
-	int fd, res;
+	const struct timespec poll = { 0, LANE_DRAIN_POLL_NSEC };
+	struct event_queue_req *req, *next, **tail;
+	struct event_lane *lane;
+	unsigned int i, depth;
 
-	if (state != PROJ_STATE_POPULATED && state != PROJ_STATE_MODIFIED)
-		return EINVAL;
+	while (1) {
+		depth = 0;
+		for (i = 0; i < fs->nlanes; ++i) {
+			lane = &fs->event_lanes[i];
 
-	/* Pass O_NOFOLLOW so we receive ELOOP if path is an existing symlink,
-	 * which we want to ignore.
-	 */
-	res = acquire_proj_state_lock(&state_lock, path,
-				      O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
-	if (res != 0) {
-		if (res == ELOOP)
+			pthread_mutex_lock(&lane->mutex);
+			depth += lane->depth;
+			pthread_mutex_unlock(&lane->mutex);
+		}
+		if (depth == 0)
 			return 0;
-		else
-			return res;
+		if (deadline_passed(deadline))
+			break;
+		nanosleep(&poll, NULL);
 	}
 
-	lock_fd = state_lock.lock_fd;
-	if (fstat(lock_fd, &st) == -1) {
-		res = errno;
-		goto out_release;
+	/* each lane's thread has already dequeued the event it is handling;
+	 * events ordered in several lanes are kept, since another lane may
+	 * already be waiting at one, and are delivered once reached
+	 */
+	depth = 0;
+	for (i = 0; i < fs->nlanes; ++i) {
+		lane = &fs->event_lanes[i];
+
+		pthread_mutex_lock(&lane->mutex);
+		tail = &lane->head;
+		for (req = lane->head; req != NULL; req = next) {
+			next = req->next;
+			if (req->join != NULL) {
+				*tail = req;
+				tail = &req->next;
+				continue;
+			}
+			free(req);
+			--lane->depth;
+			++*dropped;
+		}
+		*tail = NULL;
+		lane->tail = tail;
+		depth += lane->depth;
+		pthread_mutex_unlock(&lane->mutex);
 	}
-	else if (!S_ISREG(st.st_mode)) {
-		if (S_ISDIR(st.st_mode))
-			res = EISDIR;
-		else
-			res = 0;
-		goto out_release;
+
+	return depth;
+}
+
+/**
+ * Account for a handler call which a file operation must wait for, unless
+ * the filesystem is stopping, in which case the call is refused.
+ *
+ * @param start set to the time the call begins, if handler calls are timed
+ * @return 0, or -EIO if the call is refused
+ */
+static int begin_upcall(struct projfs *fs, struct timespec *start)
+{
+	atomic_fetch_add(&fs->upcalls_running, 1);
+	if (!atomic_load(&fs->stopping)) {
+		if (fs->hot_paths[PROJFS_HOT_UPCALLS] != NULL)
+			clock_gettime(CLOCK_MONOTONIC, start);
+		return 0;
 	}
 
-	// check after fstat() because we need to return EISDIR if not a file
-	if (state_lock.state == state ||
-	    state_lock.state == PROJ_STATE_MODIFIED) {
-		goto out_release;
+	atomic_fetch_sub(&fs->upcalls_running, 1);
+	atomic_fetch_add(&fs->upcalls_refused, 1);
+	return -EIO;
+}
+
+/**
+ * Account for the end of a handler call started with begin_upcall(),
+ * adding the time a file operation waited for it to its path's total.
+ */
+static void end_upcall(struct projfs *fs, const char *op, const char *path,
+		       const struct timespec *start)
+{
+	struct hotpath *hot = fs->hot_paths[PROJFS_HOT_UPCALLS];
+	struct timespec now;
+	int64_t usec;
+
+	if (hot != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usec = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+		       (now.tv_nsec - start->tv_nsec) / 1000;
+		hotpath_add(hot, op, path, usec);
 	}
 
-	// TODO: for non-Linux, may need to use other technique to reopen file
-	sprintf(self_fd_path, PROC_SELF_FD_PATH_FMT, lock_fd);
-	fd = open(self_fd_path, O_WRONLY | O_NONBLOCK);
-	if (fd == -1) {
-		res = errno;
-		reset_mode = fchmod_user_write_stat(lock_fd, &st, 1);
-		if (!reset_mode)
-			goto out_release;
-		res = 0;
+	atomic_fetch_sub(&fs->upcalls_running, 1);
+}
 
-		fd = open(self_fd_path, O_WRONLY | O_NONBLOCK);
-		if (fd == -1) {
-			res = errno;
-			goto out_release;
-		}
-	}
+/**
+ * @return 0 or a negative errno
+ */
+static int send_event(projfs_handler_t handler, uint64_t mask, pid_t pid,
+		      const char *path, const char *target_path,
+		      int fd, const unsigned char *content_hash,
+		      unsigned int type)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	int queued = (fs->event_queue.fd != -1);
+	struct projfs_event event;
+	struct timespec start;
+	int err;
 
-	// hydrate empty placeholder file
-	if (state_lock.state == PROJ_STATE_EMPTY) {
-		res = project_locked_path(&state_lock, fd, path, 0,
-					  PROJ_STATE_POPULATED);
-		log = (res == 0);
+	if (handler == NULL && !queued)
+		return 0;
 
-		if (res == 0) {
-			struct timespec times[2];
+	if (type != PROJFS_EVENT_NOTIFY) {
+		err = begin_upcall(fs, &start);
+		if (err < 0)
+			return err;
+	}
 
-			times[0].tv_nsec = UTIME_OMIT;
-			memcpy(&times[1], &st.st_mtim, sizeof(times[1]));
+	if (pid == 0)
+		pid = get_fuse_context_tgid();
 
-			futimens(lock_fd, times);		// best effort
-		}
+	event.fs = fs;
+	event.mask = mask;
+	event.pid = pid;
+	event.path = path;
+	event.target_path = target_path;
+	event.fd = fd;
+	event.content_hash = content_hash;
+	event.offset = 0;
+	event.length = 0;
+
+	if (type == PROJFS_EVENT_NOTIFY && fs->nlanes > 0)
+		err = lane_event(fs, &event);
+	else if (queued)
+		err = queue_event(fs, &event, type);
+	else
+		err = handler(&event);
+	if (type != PROJFS_EVENT_NOTIFY)
+		end_upcall(fs, (type == PROJFS_EVENT_PERM) ? "perm" : "proj",
+			   path, &start);
+	if (err < 0) {
+		log_printf_fuse_context("event handler failed: %s; "
+					"mask 0x%04" PRIx64 "-%08" PRIx64 ", "
+					"pid %d, path %s%s%s",
+					strerror(-err),
+					mask >> 32, mask & 0xFFFFFFFF,
+					pid, path,
+					(target_path == NULL)
+						? "" : ", target path ",
+					(target_path == NULL)
+						? "" : target_path);
 	}
-
-	// if requested, convert hydrated file to fully local, modified file
-	if (res == 0 && state_lock.state == PROJ_STATE_POPULATED &&
-	    state == PROJ_STATE_MODIFIED) {
-		res = project_locked_path(&state_lock, fd, path, 0, state);
-		log = (res == 0);
+	else if (type == PROJFS_EVENT_PERM) {
+		err = (err == PROJFS_ALLOW) ? 0 : -EPERM;
 	}
 
-	if (reset_mode)
-		fchmod_user_write_stat(lock_fd, &st, 0);	// best effort
-
-	close(fd);
-
-out_release:
-	release_proj_state_lock(&state_lock);
+	return err;
+}
 
-	if (log) {
-		log_printf_fuse_context("file projected to '%s' state "
-					"in '%s' op: %s",
-					(state == PROJ_STATE_POPULATED)
-						? "populated" : "modified",
-					op, path);
-	}
+/**
+ * @return 0 or a negative errno
+ */
+static int send_proj_event(uint64_t mask, const char *path, int fd)
+{
+	projfs_handler_t handler =
+		get_fuse_context_projfs()->handlers.handle_proj_event;
 
-	return res;
+	return send_event(handler, mask, 0, path, NULL, fd, NULL,
+			  PROJFS_EVENT_PROJ);
 }
 
 /**
- * Makes a path from FUSE usable as a relative path to lowerdir_fd.  Removes
- * any leading forward slashes.  If the resulting path is empty, returns ".".
- * */
-static inline const char *make_relative_path(const char *path)
+ * @return given number of threads, or one per online CPU if zero
+ */
+static unsigned int get_nthreads(unsigned int nthreads)
 {
-	while (*path == '/')
-		++path;
-	if (*path == '\0')
-		path = ".";
-	return path;
+	long nprocs;
+
+	if (nthreads > 0)
+		return nthreads;
+
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	return (nprocs > 0) ? nprocs : 1;
 }
 
-// filesystem ops
+struct proj_chunk_ctx {
+	struct projfs *fs;
+	projfs_handler_t handler;
+	struct projfs_event event;	/* template for chunk events */
+	off_t size;
+	off_t chunk_size;
+	unsigned int retries;
+	pthread_mutex_t mutex;
+	off_t err_offset;		/* offset of first failed chunk */
+	int err;
+};
 
-static int projfs_op_getattr(char const *path, struct stat *attr,
-                             struct fuse_file_info *fi)
+static void proj_chunk(void *data, size_t idx)
 {
-	int res;
+	struct proj_chunk_ctx *ctx = data;
+	struct projfs_event event = ctx->event;
+	unsigned int tries;
+	int err;
 
-	if (fi)
-		res = fstat(fi->fh, attr);
-	else {
-		path = make_relative_path(path);
-		if (strcmp(path, ".") != 0) {
-			res = project_dir("getattr", path, 1);
-			if (res)
-				return -res;
-		}
-		res = fstatat(get_fuse_context_lowerdir_fd(), path, attr,
-			      AT_SYMLINK_NOFOLLOW);
+	// skip remaining chunks once any has failed
+	pthread_mutex_lock(&ctx->mutex);
+	err = ctx->err;
+	pthread_mutex_unlock(&ctx->mutex);
+	if (err < 0)
+		return;
+
+	event.offset = (off_t)idx * ctx->chunk_size;
+	event.length = ctx->size - event.offset;
+	if (event.length > ctx->chunk_size)
+		event.length = ctx->chunk_size;
+
+	for (tries = 0; ; ++tries) {
+		err = ctx->handler(&event);
+		if (err >= 0 || tries >= ctx->retries)
+			break;
 	}
-	return res == -1 ? -errno : 0;
+	if (err >= 0)
+		return;
+
+	log_printf(ctx->fs, LOG_STDERR_NONE,
+		   "chunk event handler failed: %s; "
+		   "mask 0x%04" PRIx64 "-%08" PRIx64 ", "
+		   "pid %d, path %s, offset %jd, length %jd",
+		   strerror(-err), event.mask >> 32, event.mask & 0xFFFFFFFF,
+		   event.pid, event.path,
+		   (intmax_t)event.offset, (intmax_t)event.length);
+
+	pthread_mutex_lock(&ctx->mutex);
+	if (ctx->err == 0 || event.offset < ctx->err_offset) {
+		ctx->err = err;
+		ctx->err_offset = event.offset;
+	}
+	pthread_mutex_unlock(&ctx->mutex);
 }
 
-static int projfs_op_readlink(char const *path, char *buf, size_t size)
+/**
+ * Send a file projection request as a series of events, each for one chunk
+ * of the file, which are handled in parallel by a pool of threads.  Failed
+ * chunk events are retried up to the configured number of times.
+ *
+ * @return 0 or a negative errno of the first failed chunk
+ */
+static int send_proj_chunk_events(uint64_t mask, const char *path, int fd,
+				  off_t size)
 {
-	int res;
+	struct projfs *fs = get_fuse_context_projfs();
+	struct proj_chunk_ctx ctx;
+	struct timespec start;
+	size_t nchunks;
+	int err;
 
-	path = make_relative_path(path);
-	res = project_dir("readlink", path, 1);
-	if (res)
-		return -res;
-	res = readlinkat(get_fuse_context_lowerdir_fd(), path, buf, size - 1);
-	if (res == -1)
-		return -errno;
-	buf[res] = 0;
-	return 0;
-}
+	err = begin_upcall(fs, &start);
+	if (err < 0)
+		return err;
 
-static int projfs_op_link(char const *src, char const *dst)
-{
-	int lowerdir_fd;
-	int res;
+	err = pthread_mutex_init(&ctx.mutex, NULL);
+	if (err > 0) {
+		end_upcall(fs, "proj", path, &start);
+		return -err;
+	}
 
-	/* NOTE: We require lowerdir to be a directory, so this should
-	 *       fail when src is an empty path, as we expect.
-	 */
-	src = make_relative_path(src);
-	res = project_dir("link", src, 1);
-	if (res)
-		return -res;
+	ctx.fs = fs;
+	ctx.handler = fs->handlers.handle_proj_event;
+	ctx.event.fs = fs;
+	ctx.event.mask = mask;
+	ctx.event.pid = get_fuse_context_tgid();
+	ctx.event.path = path;
+	ctx.event.target_path = NULL;
+	ctx.event.fd = fd;
+	ctx.event.content_hash = NULL;
+	ctx.size = size;
+	ctx.chunk_size = (off_t)fs->config.chunk_kib * 1024;
+	ctx.retries = fs->config.chunk_retries;
+	ctx.err_offset = 0;
+	ctx.err = 0;
+
+	nchunks = (size + ctx.chunk_size - 1) / ctx.chunk_size;
+	workpool_run(get_nthreads(fs->config.chunk_threads), nchunks,
+		     proj_chunk, &ctx);
+
+	pthread_mutex_destroy(&ctx.mutex);
+	end_upcall(fs, "proj", path, &start);
+	return ctx.err;
+}
 
-	/* hydrate the source file before adding a hard link to it, otherwise
-	 * a user could access the newly created link and end up modifying the
-	 * non-hydrated placeholder */
-	res = project_file("link", src, PROJ_STATE_POPULATED);
-	if (res)
-		return -res;
+#define PROJ_BATCH_MAX_EVENTS 256
 
-	dst = make_relative_path(dst);
-	res = project_dir("link2", dst, 1);
-	if (res)
-		return -res;
+static int init_proj_batch(struct proj_batch *batch)
+{
+	pthread_condattr_t attr;
+	int err;
 
-	lowerdir_fd = get_fuse_context_lowerdir_fd();
-	res = linkat(lowerdir_fd, src, lowerdir_fd, dst, 0);
-	if (res == -1)
-		return -errno;
+	err = pthread_mutex_init(&batch->mutex, NULL);
+	if (err > 0)
+		return err;
 
-	// do not report event handler errors after successful link op
-	(void)send_notify_event(PROJFS_CREATE | PROJFS_ONLINK, 0, src, dst);
+	err = pthread_condattr_init(&attr);
+	if (err > 0)
+		goto out_mutex;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&batch->full, &attr);
+	if (err > 0)
+		goto out_attr;
+	err = pthread_cond_init(&batch->done, &attr);
+	if (err > 0)
+		goto out_full;
+	pthread_condattr_destroy(&attr);
+
+	batch->reqs = NULL;
+	batch->count = 0;
+	batch->collecting = 0;
 	return 0;
+
+out_full:
+	pthread_cond_destroy(&batch->full);
+out_attr:
+	pthread_condattr_destroy(&attr);
+out_mutex:
+	pthread_mutex_destroy(&batch->mutex);
+	return err;
 }
 
-static void *projfs_op_init(struct fuse_conn_info *conn,
-                            struct fuse_config *cfg)
+static void destroy_proj_batch(struct proj_batch *batch)
 {
-	(void)conn;
+	pthread_cond_destroy(&batch->done);
+	pthread_cond_destroy(&batch->full);
+	pthread_mutex_destroy(&batch->mutex);
+}
 
-	cfg->entry_timeout = 0;
-	cfg->attr_timeout = 0;
-	cfg->negative_timeout = 0;
-	cfg->use_ino = 1;
+/**
+ * Deliver a list of queued projection requests to the batch handler,
+ * recording each request's result.
+ */
+static void deliver_proj_batch(struct projfs *fs, struct proj_batch_req *reqs,
+			       unsigned int count)
+{
+	struct projfs_event *events;
+	struct proj_batch_req *req;
+	unsigned int i;
+	int *results;
+	int err;
 
-	return get_fuse_context_projfs();
-}
+	events = calloc(count, sizeof(*events));
+	results = calloc(count, sizeof(*results));
+	if (events == NULL || results == NULL) {
+		for (req = reqs; req != NULL; req = req->next)
+			req->result = -ENOMEM;
+		goto out;
+	}
 
-#define has_write_mode(fi) ((fi)->flags & (O_WRONLY | O_RDWR))
+	// deliver events in order of arrival
+	for (i = count, req = reqs; req != NULL; req = req->next)
+		events[--i] = req->event;
 
-static int projfs_op_flush(char const *path, struct fuse_file_info *fi)
-{
-	int res, err;
+	err = fs->handlers.handle_proj_batch(events, results, count);
 
-	res = close(dup(fi->fh));
-	err = errno;		// errno may be changed by fdtable realloc
+	for (i = count, req = reqs; req != NULL; req = req->next) {
+		req->result = (err < 0) ? err : results[--i];
+		if (req->result >= 0)
+			continue;
 
-	if (has_write_mode(fi)) {
-		// do not report table realloc errors after successful close op
-		(void)fdtable_replace(get_fuse_context_projfs()->fdtable,
-				      fi->fh, get_fuse_context_tgid());
+		log_printf_fuse_context("batch event handler failed: %s; "
+					"mask 0x%04" PRIx64 "-%08" PRIx64 ", "
+					"pid %d, path %s",
+					strerror(-req->result),
+					req->event.mask >> 32,
+					req->event.mask & 0xFFFFFFFF,
+					req->event.pid, req->event.path);
 	}
 
-	return res == -1 ? -err : 0;
+out:
+	free(results);
+	free(events);
 }
 
-static int projfs_op_fsync(char const *path, int datasync,
-                           struct fuse_file_info *fi)
+/**
+ * Queue a file projection request to be delivered, together with any
+ * others made by concurrent file operations within the configured batching
+ * window, through the batch projection handler, and wait for its result.
+ *
+ * The first thread to queue a request waits for the window to close, or for
+ * the queue to fill, and then delivers all queued requests; other threads
+ * simply wait for their requests to be handled.
+ *
+ * @return 0 or a negative errno
+ */
+static int send_proj_batch_event(uint64_t mask, const char *path, int fd)
 {
-	int res;
-
-	(void)path;
-	if (datasync)
-		res = fdatasync(fi->fh);
-	else
-		res = fsync(fi->fh);
-	return res == -1 ? -errno : 0;
-}
+	struct projfs *fs = get_fuse_context_projfs();
+	struct proj_batch *batch = &fs->proj_batch;
+	struct proj_batch_req req, *reqs, *next;
+	struct timespec deadline, start;
+	unsigned int count;
+	int err;
 
-#define enforce_user_read(m) ((m) | S_IRUSR);
+	err = begin_upcall(fs, &start);
+	if (err < 0)
+		return err;
+
+	req.event.fs = fs;
+	req.event.mask = mask;
+	req.event.pid = get_fuse_context_tgid();
+	req.event.path = path;
+	req.event.target_path = NULL;
+	req.event.fd = fd;
+	req.event.content_hash = NULL;
+	req.event.offset = 0;
+	req.event.length = 0;
+	req.result = 0;
+	req.done = 0;
+
+	pthread_mutex_lock(&batch->mutex);
+	req.next = batch->reqs;
+	batch->reqs = &req;
+	++batch->count;
+
+	if (batch->collecting) {
+		if (batch->count >= PROJ_BATCH_MAX_EVENTS)
+			pthread_cond_signal(&batch->full);
+		while (!req.done)
+			pthread_cond_wait(&batch->done, &batch->mutex);
+		pthread_mutex_unlock(&batch->mutex);
+		end_upcall(fs, "proj", path, &start);
+		return req.result;
+	}
 
-static int projfs_op_mknod(char const *path, mode_t mode, dev_t rdev)
-{
-	int res;
+	// collect requests until the window closes or the queue is full
+	batch->collecting = 1;
+	get_deadline(&deadline, fs->config.proj_batch_msec);
+	while (batch->count < PROJ_BATCH_MAX_EVENTS &&
+	       pthread_cond_timedwait(&batch->full, &batch->mutex,
+				      &deadline) != ETIMEDOUT);
+
+	reqs = batch->reqs;
+	count = batch->count;
+	batch->reqs = NULL;
+	batch->count = 0;
+	batch->collecting = 0;
+	pthread_mutex_unlock(&batch->mutex);
+
+	deliver_proj_batch(fs, reqs, count);
+
+	pthread_mutex_lock(&batch->mutex);
+	for (; reqs != NULL; reqs = next) {
+		next = reqs->next;	// request may be freed once done is set
+		reqs->done = 1;
+	}
+	pthread_cond_broadcast(&batch->done);
+	pthread_mutex_unlock(&batch->mutex);
 
-	(void)rdev;
+	end_upcall(fs, "proj", path, &start);
+	return req.result;
+}
 
-	path = make_relative_path(path);
-	res = project_dir("mknod", path, 1);
-	if (res)
-		return -res;
+/**
+ * @return 0 or a negative errno
+ */
+static int send_notify_event(uint64_t mask, pid_t pid, const char *path,
+			     const char *target_path)
+{
+	projfs_handler_t handler =
+		get_fuse_context_projfs()->handlers.handle_notify_event;
 
-	mode = enforce_user_read(mode);
-	if (S_ISFIFO(mode))
-		res = mkfifoat(get_fuse_context_lowerdir_fd(), path, mode);
-	else
-		return -ENOSYS;
-	return res == -1 ? -errno : 0;
+	return send_event(handler, mask, pid, path, target_path, 0, NULL,
+			  PROJFS_EVENT_NOTIFY);
 }
 
-static int projfs_op_symlink(char const *link, char const *path)
+/**
+ * @return 0 or a negative errno
+ */
+static int send_close_write_event(pid_t pid, const char *path,
+				  const unsigned char *content_hash)
 {
-	int res;
+	projfs_handler_t handler =
+		get_fuse_context_projfs()->handlers.handle_notify_event;
 
-	path = make_relative_path(path);
-	res = project_dir("symlink", path, 1);
-	if (res)
-		return -res;
-	res = symlinkat(link, get_fuse_context_lowerdir_fd(), path);
-	return res == -1 ? -errno : 0;
+	return send_event(handler, PROJFS_CLOSE_WRITE, pid, path, NULL, 0,
+			  content_hash, PROJFS_EVENT_NOTIFY);
 }
 
-static int projfs_op_create(char const *path, mode_t mode,
-                            struct fuse_file_info *fi)
-{
-	/* FUSE sets fi.flags = O_CREAT | O_EXCL | O_WRONLY in fuse_lib_mknod,
-	 * untouched in fuse_lib_create where it comes straight from
-	 * FUSE_CREATE.  In Linux 4.9 at least, we never hit a codepath where
-	 * we send FUSE_CREATE without first checking that O_CREAT is set.
-	 * There's no guarantee O_EXCL (or O_TRUNC) are set, though, so we need
-	 * to hydrate it if it exists. */
+/**
+ * @return 0 or a negative errno
+ */
+static int send_perm_event(uint64_t mask, const char *path,
+			   const char *target_path)
+{
+	projfs_handler_t handler =
+		get_fuse_context_projfs()->handlers.handle_perm_event;
 
-	int flags = fi->flags & ~O_NOFOLLOW;
-	int res;
-	int fd;
+	return send_event(handler, mask, 0, path, target_path, 0, NULL,
+			  PROJFS_EVENT_PERM);
+}
 
-	path = make_relative_path(path);
-	res = project_dir("create", path, 1);
-	if (res)
-		return -res;
-	res = project_file("create", path, PROJ_STATE_POPULATED);
-	if (res && res != ENOENT)
-		return -res;
+#define PROJ_XATTR_PRE_NAME "user.projection."
+#define PROJ_XATTR_PRE_LEN (sizeof(PROJ_XATTR_PRE_NAME) - 1)
 
-	mode = enforce_user_read(mode);
-	fd = openat(get_fuse_context_lowerdir_fd(), path, flags, mode);
-	if (fd == -1)
-		return -errno;
-	fi->fh = fd;
+#define PROJ_STATE_XATTR_NAME PROJ_XATTR_PRE_NAME"empty"
+#define PROJ_VERSION_XATTR_NAME PROJ_XATTR_PRE_NAME PROJFS_ATTR_VERSION
 
-	if (has_write_mode(fi)) {
-		// do not report table realloc errors after successful open op
-		(void)fdtable_insert(get_fuse_context_projfs()->fdtable,
-				     fd, get_fuse_context_tgid());
-	 }
+static int xattr_name_has_prefix(const char *name)
+{
+	if (strncmp(name, PROJ_XATTR_PRE_NAME, PROJ_XATTR_PRE_LEN) == 0)
+		return 1;
 
-	// do not report event handler errors after successful open op
-	(void)send_notify_event(PROJFS_CREATE, 0, path, NULL);
 	return 0;
 }
 
-static int projfs_op_open(char const *path, struct fuse_file_info *fi)
+static int xattr_name_is_reserved(const char *name)
 {
-	int flags = fi->flags & ~O_NOFOLLOW;
-	int res;
-	int fd;
-
-	path = make_relative_path(path);
-	res = project_dir("open", path, 1);
-	if (res)
-		return -res;
-
-	/* Per above, allow hydration to fail with ENOENT; if the file
-	 * operation should fail for that reason (i.e. O_CREAT is not specified
-	 * and the file doesn't exist), we'll return the failure from openat(2)
-	 * below.
-	 */
-	res = project_file("open", path,
-			   has_write_mode(fi) ? PROJ_STATE_MODIFIED
-					      : PROJ_STATE_POPULATED);
-	if (res) {
-		// if path was a directory, try projecting it instead
-		if (res == EISDIR)
-			res = project_dir("open", path, 0);
-		if (res != ENOENT)
-			return -res;
-	}
+	if (strcmp(name, PROJ_STATE_XATTR_NAME) == 0)
+		return 1;
+	if (strcmp(name, PROJ_VERSION_XATTR_NAME) == 0)
+		return 1;
+	// add other reserved names as they are defined
 
-	fd = openat(get_fuse_context_lowerdir_fd(), path, flags);
-	if (fd == -1)
-		return -errno;
+	return 0;
+}
 
-	if (has_write_mode(fi)) {
-		// do not report table realloc errors after successful open op
-		(void)fdtable_insert(get_fuse_context_projfs()->fdtable,
-				     fd, get_fuse_context_tgid());
+static int get_xattr(int fd, const char *name, void *value, ssize_t *size)
+{
+	if (fgetxattr(fd, name, value, *size) == -1) {
+		if (errno != ENOATTR)
+			return -1;
+		*size = -1;
 	}
-
-	fi->fh = fd;
 	return 0;
 }
 
-static int projfs_op_statfs(char const *path, struct statvfs *buf)
+static int set_xattr(int fd, const char *name, const void *value,
+		     ssize_t *size, int flags)
 {
-	int res;
+	if (value == NULL || *size == 0) {
+		if (fremovexattr(fd, name) == -1) {
+			if (errno != ENOATTR)
+				return -1;
+			*size = -1;
+		}
+		return 0;
+	}
 
-	(void)path;
-	// TODO: should we return our own filesystem's global info?
-	res = fstatvfs(get_fuse_context_lowerdir_fd(), buf);
-	return res == -1 ? -errno : 0;
+	return fsetxattr(fd, name, value, *size, flags);
 }
 
-static int projfs_op_read_buf(char const *path, struct fuse_bufvec **bufp,
-			      size_t size, off_t off,
-			      struct fuse_file_info *fi)
-{
-	struct fuse_bufvec *src = malloc(sizeof(*src));
+enum proj_state {
+	PROJ_STATE_ERROR = -1,	/* invalid state */
+	PROJ_STATE_EMPTY,	/* unopened (sparse file with metadata) */
+	PROJ_STATE_POPULATED,	/* unmodified (hydrated with data) */
+	PROJ_STATE_MODIFIED	/* no longer projected (fully local) */
+};
 
-	(void) path;
+#define PROJ_STATE_XATTR_VALUE_EMPTY 'y'
+#define PROJ_STATE_XATTR_VALUE_POPULATED 'n'
+/* The PROJ_STATE_XATTR_NAME xattr is removed for the MODIFIED state. */
 
-	if (!src)
-		return -errno;
+/**
+ * @return projection state for an xattr value, or PROJ_STATE_ERROR with
+ *         errno set to EINVAL if the value is invalid
+ */
+static enum proj_state parse_proj_state(char value)
+{
+	switch (value) {
+	case PROJ_STATE_XATTR_VALUE_POPULATED:
+		return PROJ_STATE_POPULATED;
+	case PROJ_STATE_XATTR_VALUE_EMPTY:
+		return PROJ_STATE_EMPTY;
+	default:
+		errno = EINVAL;
+		return PROJ_STATE_ERROR;
+	}
+}
 
-	*src = FUSE_BUFVEC_INIT(size);
+static enum proj_state get_proj_state_xattr(int fd)
+{
+	char value;
+	ssize_t size = sizeof(value);
 
-	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-	src->buf[0].fd = fi->fh;
-	src->buf[0].pos = off;
+	if (get_xattr(fd, PROJ_STATE_XATTR_NAME, &value, &size) == -1)
+		return PROJ_STATE_ERROR;
 
-	*bufp = src;
+	if (size == -1)
+		return PROJ_STATE_MODIFIED;
 
-	return 0;
+	return parse_proj_state(value);
 }
 
-static int projfs_op_write_buf(char const *path, struct fuse_bufvec *src,
-			       off_t off, struct fuse_file_info *fi)
+static int set_proj_state_xattr(int fd, enum proj_state state, int flags)
 {
-	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+	char value;
+	void *valuep = &value;
+	ssize_t size = sizeof(value);
 
-	(void)path;
-	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-	buf.buf[0].fd = fi->fh;
-	buf.buf[0].pos = off;
+	switch (state) {
+	case PROJ_STATE_POPULATED:
+		value = PROJ_STATE_XATTR_VALUE_POPULATED;
+		break;
+	case PROJ_STATE_EMPTY:
+		value = PROJ_STATE_XATTR_VALUE_EMPTY;
+		break;
+	case PROJ_STATE_MODIFIED:
+		valuep = NULL;
+		size = 0;
+		break;
+	default:
+	case PROJ_STATE_ERROR:
+		errno = EINVAL;
+		return -1;
+	}
 
-	return fuse_buf_copy(&buf, src, FUSE_BUF_SPLICE_NONBLOCK);
+	return set_xattr(fd, PROJ_STATE_XATTR_NAME, valuep, &size, flags);
 }
 
-static int projfs_op_release(char const *path, struct fuse_file_info *fi)
-{
-	int res, err;
-	pid_t pid = 0;
+struct proj_state_lock {
+	struct projfs *fs;
+	const char *path;		/* valid until lock_proj_state() */
+	int flags;			/* flags with which lock_fd opened */
+	int lock_fd;
+	enum proj_state state;
+	unsigned long cache_gen;	/* dircache generation before open */
+};
 
-	res = close(fi->fh);
-	err = errno;		// errno may be changed by fdtable realloc
+/**
+ * Opens path and populates the supplied proj_state_lock argument with the
+ * open but unlocked fd, and state based on the PROJ_STATE_XATTR_NAME xattr.
+ *
+ * The state read without a lock may be used to skip locking when no
+ * projection is required, because an inode's projection state only ever
+ * advances (from empty to populated to modified), so a state which needs
+ * no transition cannot later be found to need one.  Otherwise, the caller
+ * must call lock_proj_state() and check the state again.
+ *
+ * Note that this holds for the inode, not the path: projfs_batch_proj()
+ * may delete an empty placeholder, or replace it with a new one, while
+ * holding only the locks of the placeholder and its parent directory,
+ * neither of which a caller skipping the lock takes.  Batches never
+ * remove or replace an entry which has been populated or modified,
+ * however, so a path found not to need projection will not be replaced
+ * by one which does, except by a client's own file operations.
+ *
+ * @param state_lock structure to fill out (zeroed by this function)
+ * @param fs projfs filesystem handle
+ * @param path path relative to lowerdir to open
+ * @param flags file flags with which to open the fd
+ * @return 0 or an errno
+ */
+static int open_proj_state(struct proj_state_lock *state_lock,
+			   struct projfs *fs, const char *path, int flags)
+{
+	enum proj_state state;
+	int err;
 
-	if (has_write_mode(fi)) {
-		// do not report table realloc errors after successful close op
-		(void)fdtable_remove(get_fuse_context_projfs()->fdtable,
-				     fi->fh, &pid);
-	}
+	memset(state_lock, 0, sizeof(*state_lock));
+	state_lock->fs = fs;
+	state_lock->path = path;
+	state_lock->flags = flags;
 
-	// return value is ignored by libfuse, but be consistent anyway
-	if (res == -1)
-		return -err;
+	state_lock->lock_fd = openat(fs->lowerdir_fd, path, flags);
+	if (state_lock->lock_fd == -1)
+		return errno;
 
-	if (has_write_mode(fi)) {
-		// do not report event handler errors after successful close op
-		(void)send_notify_event(PROJFS_CLOSE_WRITE, pid,
-					make_relative_path(path), NULL);
+	state = get_proj_state_xattr(state_lock->lock_fd);
+	if (state == PROJ_STATE_ERROR) {
+		err = errno;
+		close(state_lock->lock_fd);
+		state_lock->lock_fd = -1;
+		return err;
 	}
+
+	state_lock->state = state;
 	return 0;
 }
 
-static int projfs_op_unlink(char const *path)
+static void count_lock_wait(const struct proj_state_lock *state_lock)
 {
-	int res;
-
-	path = make_relative_path(path);
-	res = send_perm_event(PROJFS_DELETE_PERM, path, NULL);
-	if (res < 0)
-		return res;
-	res = project_dir("unlink", path, 1);
-	if (res)
-		return -res;
-
-	res = unlinkat(get_fuse_context_lowerdir_fd(), path, 0);
-	if (res == -1)
-		return -errno;
+	struct hotpath *hot;
 
-	// do not report event handler errors after successful unlink op
-	(void)send_notify_event(PROJFS_DELETE, 0, path, NULL);
-	return 0;
+	hot = state_lock->fs->hot_paths[PROJFS_HOT_LOCK_WAITS];
+	if (hot != NULL)
+		hotpath_add(hot, "lock", state_lock->path, 1);
 }
 
-static int projfs_op_mkdir(char const *path, mode_t mode)
+/**
+ * Check that a path still refers to the inode of the fd opened for it by
+ * open_proj_state().
+ *
+ * @param state_lock structure filled out by open_proj_state()
+ * @return 0 if so, EAGAIN if the path refers to another inode, ENOENT if it
+ *         no longer exists, or another errno
+ */
+static int check_proj_state_path(const struct proj_state_lock *state_lock)
 {
-	int res;
+	struct stat fd_st, path_st;
 
-	path = make_relative_path(path);
-	res = project_dir("mkdir", path, 1);
-	if (res)
-		return -res;
+	if (fstat(state_lock->lock_fd, &fd_st) == -1 ||
+	    fstatat(state_lock->fs->lowerdir_fd, state_lock->path, &path_st,
+		    AT_SYMLINK_NOFOLLOW) == -1)
+		return errno;
 
-	mode = enforce_user_read(mode);
-	res = mkdirat(get_fuse_context_lowerdir_fd(), path, mode);
-	if (res == -1)
-		return -errno;
+	if (fd_st.st_dev != path_st.st_dev || fd_st.st_ino != path_st.st_ino)
+		return EAGAIN;
 
-	// do not report event handler errors after successful mkdir op
-	(void)send_notify_event(PROJFS_CREATE | PROJFS_ONDIR, 0, path, NULL);
 	return 0;
 }
 
-static int projfs_op_rmdir(char const *path)
+/**
+ * Acquires a lock on the fd opened by open_proj_state() and updates the
+ * state in the supplied proj_state_lock argument, which may have changed
+ * before the lock was acquired.  On failure, the fd is closed.
+ *
+ * If the path was deleted or replaced by projfs_batch_proj() before the
+ * lock was acquired, the fd no longer refers to the path's inode, so it is
+ * reopened and locked again, or ENOENT is returned if the path is gone.
+ *
+ * If the lock is contended, the wait is counted against the path when
+ * tracking the paths with the most lock waits.
+ *
+ * @param state_lock structure filled out by open_proj_state()
+ * @return 0 or an errno
+ */
+static int lock_proj_state(struct proj_state_lock *state_lock)
 {
-	int res;
+	enum proj_state state;
+	int err, fd, wait_ms;
+	struct timespec ts;
+
+	wait_ms = PROJ_WAIT_MSEC;
+
+retry_flock:
+	// TODO: may conflict with locks held by clients; use internal locks
+	err = flock(state_lock->lock_fd, LOCK_EX | LOCK_NB);
+	if (err == -1) {
+		if (errno == EWOULDBLOCK && wait_ms > 0) {
+			if (wait_ms == PROJ_WAIT_MSEC)
+				count_lock_wait(state_lock);
+
+			/* sleep 100ms, retry */
+			ts.tv_sec = 0;
+			ts.tv_nsec = 1000 * 1000 * 100;
+			nanosleep(&ts, NULL);
+			wait_ms -= 100;
+			goto retry_flock;
+		}
+
+		err = errno;
+		goto out_close;
+	}
+
+	err = check_proj_state_path(state_lock);
+	if (err == EAGAIN) {
+		fd = openat(state_lock->fs->lowerdir_fd, state_lock->path,
+			    state_lock->flags);
+		if (fd == -1) {
+			err = errno;
+			goto out_close;
+		}
+		close(state_lock->lock_fd);
+		state_lock->lock_fd = fd;
+		goto retry_flock;
+	}
+	else if (err != 0)
+		goto out_close;
+
+	state = get_proj_state_xattr(state_lock->lock_fd);
+	if (state == PROJ_STATE_ERROR) {
+		err = errno;
+		goto out_close;
+	}
+
+	state_lock->state = state;
+	return 0;
+
+out_close:
+	close(state_lock->lock_fd);
+	state_lock->lock_fd = -1;
+	return err;
+}
+
+/**
+ * Acquires a lock on path and populates the supplied proj_state_lock argument
+ * with the open and locked fd, and state based on the
+ * PROJ_STATE_XATTR_NAME xattr.
+ *
+ * @param state_lock structure to fill out (zeroed by this function)
+ * @param fs projfs filesystem handle
+ * @param path path relative to lowerdir to lock and open
+ * @param flags file flags with which to open the locked fd
+ * @return 0 or an errno
+ */
+static int acquire_proj_state_lock(struct proj_state_lock *state_lock,
+				   struct projfs *fs, const char *path,
+				   int flags)
+{
+	int err;
+
+	err = open_proj_state(state_lock, fs, path, flags);
+	if (err != 0)
+		return err;
+
+	return lock_proj_state(state_lock);
+}
+
+/**
+ * Closes the open fd associated with state_lock, which in turn releases any
+ * locks associated with the lock_fd.
+ *
+ * @param state_lock projection state structure to clean up
+ */
+static void release_proj_state_lock(struct proj_state_lock *state_lock)
+{
+	if (state_lock->lock_fd == -1)
+		return;
+
+	close(state_lock->lock_fd);
+	state_lock->lock_fd = -1;
+}
+
+/**
+ * Projects a path by notifying the provider with the given event mask.  If the
+ * provider succeeds, updates the projection state on the path.
+ *
+ * @param state_lock current projection state and lock held on inode
+ * @param fd file descriptor of inode whose projection state should be updated
+ * @param path the path of the inode whose projection state should be updated
+ * @param isdir 1 if the path is a directory; 0 otherwise
+ * @param state projection state to which the inode should be updated
+ * @return 0 or an errno
+ */
+static int project_locked_path(struct proj_state_lock *state_lock, int fd,
+			       const char *path, int isdir,
+			       enum proj_state state)
+{
+	int res;
+
+	if (isdir || state == PROJ_STATE_POPULATED) {
+		struct projfs *fs = get_fuse_context_projfs();
+		uint64_t event_mask = PROJFS_CREATE;
+		struct stat st;
+
+		if (isdir)
+			event_mask |= PROJFS_ONDIR;
+
+		// split large files into chunks, or batch small ones,
+		// if requested
+		if (!isdir && fs->config.chunk_kib > 0 &&
+		    fs->handlers.handle_proj_event != NULL &&
+		    fstat(fd, &st) == 0 &&
+		    st.st_size > (off_t)fs->config.chunk_kib * 1024)
+			res = send_proj_chunk_events(event_mask, path, fd,
+						     st.st_size);
+		else if (!isdir && fs->config.proj_batch_msec > 0 &&
+			 fs->handlers.handle_proj_batch != NULL)
+			res = send_proj_batch_event(event_mask, path, fd);
+		else
+			res = send_proj_event(event_mask, path, fd);
+	} else {
+		res = send_perm_event(PROJFS_OPEN_PERM, path, NULL);
+	}
 
-	path = make_relative_path(path);
-	res = send_perm_event(PROJFS_DELETE_PERM | PROJFS_ONDIR, path, NULL);
 	if (res < 0)
-		return res;
-	res = project_dir("rmdir", path, 1);
-	if (res)
 		return -res;
 
-	res = unlinkat(get_fuse_context_lowerdir_fd(), path, AT_REMOVEDIR);
-	if (res == -1)
-		return -errno;
+	if (state == PROJ_STATE_POPULATED) {
+		res = set_proj_state_xattr(fd, state, XATTR_REPLACE);
+	} else {
+		res = set_proj_state_xattr(fd, state, 0);
+	}
+
+	if (res == -1)
+		return errno;
+
+	// content no longer matches any projected version once modified
+	if (state == PROJ_STATE_MODIFIED) {
+		ssize_t size = 0;
+
+		res = set_xattr(fd, PROJ_VERSION_XATTR_NAME, NULL, &size, 0);
+		if (res == -1)
+			return errno;
+	}
+
+	state_lock->state = state;
+	return 0;
+}
+
+/**
+ * Return a copy of path with the last component removed (e.g. "x/y/z" will
+ * yield "x/y").  If path has only one component, returns ".".
+ *
+ * The caller is responsible for freeing the returned string.
+ *
+ * @param path path to get parent directory of
+ * @return name of parent of path; may be NULL if strdup or strndup fails
+ */
+static char *get_path_parent(char const *path)
+{
+	const char *last = strrchr(path, '/');
+	if (!last)
+		return strdup(".");
+	else
+		return strndup(path, last - path);
+}
+
+static unsigned int get_path_depth(const char *path)
+{
+	unsigned int depth = 0;
+
+	while ((path = strchr(path, '/')) != NULL) {
+		++depth;
+		++path;
+	}
+
+	return depth;
+}
+
+/*
+ * Returns 1 if file descriptor's mode was changed; 0 otherwise.
+ */
+static int fchmod_user_write(int fd, mode_t mode, int set)
+{
+	if (mode & S_IWUSR)
+		return 0;
+	mode = set ? (mode | S_IWUSR) : (mode & ~S_IWUSR);
+	if (fchmod(fd, mode) == -1)
+		return 0;
+	return 1;
+}
+
+static int fchmod_user_write_stat(int fd, struct stat *st, int set)
+{
+	if (st->st_uid != geteuid())
+		return 0;
+	return fchmod_user_write(fd, st->st_mode, set);
+}
+
+/**
+ * Open and lock a directory if it may need to be projected.
+ *
+ * @param state_lock structure to fill out; its lock_fd will be -1 if the
+ *                   directory does not need to be projected
+ * @param path path of the directory within lowerdir
+ * @return 0 or an errno
+ */
+static int lock_proj_dir(struct proj_state_lock *state_lock, const char *path)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	unsigned long cache_gen = 0;
+	int res;
+
+	// skip directories already known to be fully local
+	if (fs->dircache != NULL) {
+		if (dircache_lookup(fs->dircache, fs->lowerdir_fd, path)) {
+			memset(state_lock, 0, sizeof(*state_lock));
+			state_lock->lock_fd = -1;
+			return 0;
+		}
+		cache_gen = dircache_gen(fs->dircache);
+	}
+
+	res = open_proj_state(state_lock, fs, path,
+			      O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (res != 0)
+		return res;
+	state_lock->cache_gen = cache_gen;
+
+	// only lock directories which may need to be projected
+	if (state_lock->state != PROJ_STATE_EMPTY)
+		goto out_release;
+
+	res = lock_proj_state(state_lock);
+	if (res != 0)
+		return res;
+
+	if (state_lock->state != PROJ_STATE_EMPTY)
+		goto out_release;
+
+	return 0;
+
+out_release:
+	if (fs->dircache != NULL && state_lock->state == PROJ_STATE_MODIFIED)
+		(void)dircache_insert(fs->dircache, path,
+				      state_lock->cache_gen);	// best effort
+	release_proj_state_lock(state_lock);
+	return 0;
+}
+
+/**
+ * Project a directory locked by lock_proj_dir().
+ *
+ * @param op op name (for debugging)
+ * @param state_lock current projection state and lock held on directory
+ * @param path path of the directory within lowerdir
+ * @return 0 or an errno
+ */
+static int project_locked_dir(const char *op,
+			      struct proj_state_lock *state_lock,
+			      const char *path)
+{
+	int lock_fd = state_lock->lock_fd;
+	int reset_mode;
+	struct stat st;
+	int res;
+
+	// fsetxattr() requires S_IWUSR, so check and temporarily set if needed
+	if (fstat(lock_fd, &st) == -1)
+		return errno;
+	reset_mode = fchmod_user_write_stat(lock_fd, &st, 1);
+
+	// directories skip intermediate state; either empty or fully local
+	res = project_locked_path(state_lock, lock_fd, path, 1,
+				  PROJ_STATE_MODIFIED);
+
+	if (reset_mode)
+		 fchmod_user_write_stat(lock_fd, &st, 0);
+
+	if (res == 0) {
+		struct dircache *cache = get_fuse_context_projfs()->dircache;
+
+		if (cache != NULL)
+			(void)dircache_insert(cache, path,
+					      state_lock->cache_gen);
+		log_printf_fuse_context("directory projected to "
+					"'modified' state in '%s' op: %s",
+					op, path);
+	}
+
+	return res;
+}
+
+/**
+ * Project a directory. Takes the path, and a flag indicating whether the
+ * directory is the parent of the path, or the path itself.
+ *
+ * @param op op name (for debugging)
+ * @param path path within lowerdir (from make_relative_path())
+ * @param parent 1 if we should look at the parent directory containing path, 0
+ *               if we look at path itself
+ * @return 0 or an errno
+ */
+static int project_dir(const char *op, const char *path, int parent)
+{
+	struct proj_state_lock state_lock;
+	char *lock_path;
+	int res;
+
+	if (parent)
+		lock_path = get_path_parent(path);
+	else
+		lock_path = strdup(path);
+	if (lock_path == NULL)
+		return errno;
+
+	res = lock_proj_dir(&state_lock, lock_path);
+	if (res == 0 && state_lock.lock_fd != -1) {
+		res = project_locked_dir(op, &state_lock, lock_path);
+		release_proj_state_lock(&state_lock);
+	}
+
+	free(lock_path);
+	return res;
+}
+
+#define PROC_SELF_FD_PATH_FMT "/proc/self/fd/%d"
+#define MAX_PROC_SELF_FD_PATH_LEN \
+	(sizeof(PROC_SELF_FD_PATH_FMT) + INT_FMT_LEN - 3)
+
+#define PROJ_VERSION_MAX_LEN 256
+
+/**
+ * Open the hydrated content of an empty placeholder file from the shared
+ * layer, if one is configured and it holds a regular file at the same path
+ * with the same size and content version as the placeholder.
+ *
+ * @param fd file descriptor of the placeholder file
+ * @param path path relative to lowerdir and the shared layer
+ * @return read-only file descriptor of the shared file, or -1 if none
+ */
+static int open_shared_file(int fd, const char *path)
+{
+	int shared_dir_fd = get_fuse_context_projfs()->shared_fd;
+	char version[PROJ_VERSION_MAX_LEN];
+	char shared_version[PROJ_VERSION_MAX_LEN];
+	ssize_t len, shared_len;
+	struct stat st, shared_st;
+	int shared_fd;
+
+	if (shared_dir_fd == -1)
+		return -1;
+
+	// without a content version, we can't know the shared file is current
+	len = fgetxattr(fd, PROJ_VERSION_XATTR_NAME, version, sizeof(version));
+	if (len <= 0)
+		return -1;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
+
+	shared_fd = openat(shared_dir_fd, path,
+			   O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (shared_fd == -1)
+		return -1;
+
+	shared_len = fgetxattr(shared_fd, PROJ_VERSION_XATTR_NAME,
+			       shared_version, sizeof(shared_version));
+	if (shared_len != len || memcmp(shared_version, version, len) != 0)
+		goto out_close;
+	if (fstat(shared_fd, &shared_st) == -1 ||
+	    !S_ISREG(shared_st.st_mode) || shared_st.st_size != st.st_size)
+		goto out_close;
+
+	return shared_fd;
+
+out_close:
+	close(shared_fd);
+	return -1;
+}
+
+/**
+ * Open an empty placeholder file's content from the shared layer for
+ * reading, leaving the placeholder itself unhydrated.
+ *
+ * @param path path within lowerdir (from make_relative_path())
+ * @return read-only file descriptor of the shared file, or -1 if none
+ */
+static int open_shared_placeholder(const char *path)
+{
+	struct proj_state_lock state_lock;
+	int fd = -1;
+
+	if (get_fuse_context_projfs()->shared_fd == -1)
+		return -1;
+
+	if (open_proj_state(&state_lock, get_fuse_context_projfs(), path,
+			    O_RDONLY | O_NOFOLLOW | O_NONBLOCK) != 0)
+		return -1;
+
+	if (state_lock.state == PROJ_STATE_EMPTY) {
+		if (lock_proj_state(&state_lock) != 0)
+			return -1;
+		if (state_lock.state == PROJ_STATE_EMPTY)
+			fd = open_shared_file(state_lock.lock_fd, path);
+	}
+
+	release_proj_state_lock(&state_lock);
+	return fd;
+}
+
+/**
+ * Record whether a file descriptor was opened from the shared layer, so
+ * that attribute operations on it apply to the lower placeholder instead.
+ *
+ * @param fd file descriptor
+ * @param shared 1 if opened from the shared layer, 0 once closed
+ * @return 0, or -1 if the file descriptor can't be recorded
+ */
+static int set_shared_fd(int fd, int shared)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+
+	if (fs->shared_fds == NULL || fd < 0 || fd >= MAX_TABLE_SIZE)
+		return -1;
+	atomic_store(&fs->shared_fds[fd], shared);
+	return 0;
+}
+
+static int is_shared_fd(int fd)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+
+	if (fs->shared_fds == NULL || fd < 0 || fd >= MAX_TABLE_SIZE)
+		return 0;
+	return atomic_load(&fs->shared_fds[fd]);
+}
+
+#define COPY_BUF_SIZE (64 * 1024)
+
+/**
+ * Copy the content of one file to another, by reference if the filesystem
+ * supports copy_file_range(2) that way, or via a buffer if not.
+ *
+ * @param src_fd readable file descriptor of the source file
+ * @param dst_fd writable file descriptor of the destination file
+ * @param size number of bytes to copy from the start of the file
+ * @return 0 or an errno
+ */
+static int copy_file_data(int src_fd, int dst_fd, off_t size)
+{
+	char *buf = NULL;
+	off_t off = 0;
+	ssize_t len;
+	int res = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (off < size) {
+		loff_t off_in = off, off_out = off;
+
+		len = copy_file_range(src_fd, &off_in, dst_fd, &off_out,
+				      size - off, 0);
+		if (len == -1) {
+			// fall back to copying via buffer below
+			if (errno == ENOSYS || errno == EXDEV ||
+			    errno == EINVAL || errno == EOPNOTSUPP)
+				break;
+			return errno;
+		}
+		if (len == 0)
+			break;
+		off += len;
+	}
+#endif
+
+	if (off < size) {
+		buf = malloc(COPY_BUF_SIZE);
+		if (buf == NULL)
+			return errno;
+	}
+	while (off < size) {
+		len = pread(src_fd, buf, COPY_BUF_SIZE, off);
+		if (len <= 0) {
+			res = (len == 0) ? EIO : errno;
+			break;
+		}
+		if (pwrite(dst_fd, buf, len, off) != len) {
+			res = (errno > 0) ? errno : EIO;
+			break;
+		}
+		off += len;
+	}
+
+	free(buf);
+	return res;
+}
+
+/**
+ * Copy up the content of an empty placeholder file from the shared layer.
+ *
+ * @param lock_fd locked file descriptor of the placeholder file
+ * @param fd writable file descriptor of the placeholder file
+ * @param path path within lowerdir (from make_relative_path())
+ * @return 0, ENOENT if the shared layer has no matching content, or an errno
+ */
+static int copy_shared_file(int lock_fd, int fd, const char *path)
+{
+	struct stat st;
+	int shared_fd, res;
+
+	shared_fd = open_shared_file(lock_fd, path);
+	if (shared_fd == -1)
+		return ENOENT;
+
+	if (fstat(shared_fd, &st) == -1)
+		res = errno;
+	else
+		res = copy_file_data(shared_fd, fd, st.st_size);
+
+	close(shared_fd);
+	return res;
+}
+
+/**
+ * Open and lock a file if it may need to be projected to the given state.
+ *
+ * @param state_lock structure to fill out; its lock_fd will be -1 if the
+ *                   file does not need to be projected, or is a symlink
+ *                   or other non-regular, non-directory file
+ * @param path path of the file within lowerdir
+ * @param state the projection state to apply (populated or modified)
+ * @param st stat structure to fill out for a file which is locked
+ * @return 0 or an errno; EISDIR if path is a directory
+ */
+static int lock_proj_file(struct proj_state_lock *state_lock,
+			  const char *path, enum proj_state state,
+			  struct stat *st)
+{
+	int res;
+
+	/* Pass O_NOFOLLOW so we receive ELOOP if path is an existing symlink,
+	 * which we want to ignore.
+	 */
+	res = open_proj_state(state_lock, get_fuse_context_projfs(),
+			      path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (res != 0) {
+		if (res == ELOOP)
+			return 0;
+		else
+			return res;
+	}
+
+	if (fstat(state_lock->lock_fd, st) == -1) {
+		res = errno;
+		goto out_release;
+	}
+	else if (!S_ISREG(st->st_mode)) {
+		if (S_ISDIR(st->st_mode))
+			res = EISDIR;
+		goto out_release;
+	}
+
+	/* check after fstat() because we need to return EISDIR if not a file;
+	 * only lock files which may need to be projected, and check again
+	 * once locked
+	 */
+	if (state_lock->state == state ||
+	    state_lock->state == PROJ_STATE_MODIFIED) {
+		goto out_release;
+	}
+
+	res = lock_proj_state(state_lock);
+	if (res != 0)
+		return res;
+
+	if (state_lock->state == state ||
+	    state_lock->state == PROJ_STATE_MODIFIED) {
+		goto out_release;
+	}
+
+	return 0;
+
+out_release:
+	release_proj_state_lock(state_lock);
+	return res;
+}
+
+/**
+ * Project a file locked by lock_proj_file().
+ *
+ * @param op op name (for debugging)
+ * @param state_lock current projection state and lock held on file
+ * @param path path of the file within lowerdir
+ * @param state the projection state to apply (populated or modified)
+ * @param st file status from lock_proj_file()
+ * @return 0 or an errno
+ */
+static int project_locked_file(const char *op,
+			       struct proj_state_lock *state_lock,
+			       const char *path, enum proj_state state,
+			       struct stat *st)
+{
+	char self_fd_path[MAX_PROC_SELF_FD_PATH_LEN + 1];
+	int lock_fd = state_lock->lock_fd;
+	int reset_mode = 0;
+	int log = 0;
+	int fd, res = 0;
+
+	// TODO: for non-Linux, may need to use other technique to reopen file
+	sprintf(self_fd_path, PROC_SELF_FD_PATH_FMT, lock_fd);
+	fd = open(self_fd_path, O_WRONLY | O_NONBLOCK);
+	if (fd == -1) {
+		res = errno;
+		reset_mode = fchmod_user_write_stat(lock_fd, st, 1);
+		if (!reset_mode)
+			return res;
+		res = 0;
+
+		fd = open(self_fd_path, O_WRONLY | O_NONBLOCK);
+		if (fd == -1)
+			return errno;
+	}
+
+	// hydrate empty placeholder file, from the shared layer if possible
+	if (state_lock->state == PROJ_STATE_EMPTY) {
+		res = copy_shared_file(lock_fd, fd, path);
+		if (res == 0) {
+			if (set_proj_state_xattr(fd, PROJ_STATE_POPULATED,
+						 XATTR_REPLACE) == -1)
+				res = errno;
+			else
+				state_lock->state = PROJ_STATE_POPULATED;
+		} else if (res == ENOENT) {
+			res = project_locked_path(state_lock, fd, path, 0,
+						  PROJ_STATE_POPULATED);
+		}
+		log = (res == 0);
+		if (res == 0)
+			profile_record_fuse_context(path);
+
+		if (res == 0) {
+			struct timespec times[2];
+
+			times[0].tv_nsec = UTIME_OMIT;
+			memcpy(&times[1], &st->st_mtim, sizeof(times[1]));
+
+			futimens(lock_fd, times);		// best effort
+		}
+	}
+
+	// if requested, convert hydrated file to fully local, modified file
+	if (res == 0 && state_lock->state == PROJ_STATE_POPULATED &&
+	    state == PROJ_STATE_MODIFIED) {
+		res = project_locked_path(state_lock, fd, path, 0, state);
+		log = (res == 0);
+	}
+
+	if (reset_mode)
+		fchmod_user_write_stat(lock_fd, st, 0);	// best effort
+
+	close(fd);
+
+	if (log) {
+		log_printf_fuse_context("file projected to '%s' state "
+					"in '%s' op: %s",
+					(state == PROJ_STATE_POPULATED)
+						? "populated" : "modified",
+					op, path);
+	}
+
+	return res;
+}
+
+/**
+ * Project a file. Takes the lower path.
+ *
+ * @param op op name (for debugging)
+ * @param path the lower path (from lowerpath)
+ * @param state the projection state to apply (populated or modified)
+ * @return 0 or an errno
+ */
+static int project_file(const char *op, const char *path,
+			enum proj_state state)
+{
+	struct proj_state_lock state_lock;
+	struct stat st;
+	int res;
+
+	if (state != PROJ_STATE_POPULATED && state != PROJ_STATE_MODIFIED)
+		return EINVAL;
+
+	res = lock_proj_file(&state_lock, path, state, &st);
+	if (res == 0 && state_lock.lock_fd != -1) {
+		res = project_locked_file(op, &state_lock, path, state, &st);
+		release_proj_state_lock(&state_lock);
+	}
+
+	return res;
+}
+
+#define PROJ_PLAN_MAX_ITEMS 4
+
+/* A projection required by a file operation */
+struct proj_plan_item {
+	char *path;
+	int isdir;
+	enum proj_state state;		/* requested state of a file */
+	int res;			/* 0 or an errno, once run */
+	struct proj_state_lock state_lock;
+	struct stat st;
+};
+
+/* The set of projections required by a file operation */
+struct proj_plan {
+	const char *op;
+	int res;
+	unsigned int count;
+	struct proj_plan_item items[PROJ_PLAN_MAX_ITEMS];
+};
+
+static void init_proj_plan(struct proj_plan *plan, const char *op)
+{
+	plan->op = op;
+	plan->res = 0;
+	plan->count = 0;
+}
+
+/**
+ * Add a projection to a plan, merging it with any existing projection of
+ * the same path, and taking ownership of the allocated path.  If path is
+ * NULL or the plan is full, the plan's result is set to errno or EINVAL,
+ * respectively, so that run_proj_plan() fails.
+ *
+ * @return plan item, or NULL if path is NULL or the plan is full
+ */
+static struct proj_plan_item *add_proj_plan_item(struct proj_plan *plan,
+						 char *path, int isdir,
+						 enum proj_state state)
+{
+	struct proj_plan_item *item;
+	unsigned int i;
+
+	if (path == NULL) {
+		if (plan->res == 0)
+			plan->res = errno;
+		return NULL;
+	}
+
+	for (i = 0; i < plan->count; ++i) {
+		item = &plan->items[i];
+		if (item->isdir == isdir && strcmp(item->path, path) == 0) {
+			if (state > item->state)
+				item->state = state;
+			free(path);
+			return item;
+		}
+	}
+
+	if (plan->count == PROJ_PLAN_MAX_ITEMS) {
+		if (plan->res == 0)
+			plan->res = EINVAL;
+		free(path);
+		return NULL;
+	}
+
+	item = &plan->items[plan->count++];
+	item->path = path;
+	item->isdir = isdir;
+	item->state = state;
+	item->res = 0;
+	item->state_lock.lock_fd = -1;
+	return item;
+}
+
+/**
+ * Add the projection of a directory to a plan.  Takes the path, and a flag
+ * indicating whether the directory is the parent of the path, or the path
+ * itself, as for project_dir().
+ *
+ * @return plan item, or NULL if memory allocation fails
+ */
+static struct proj_plan_item *add_proj_plan_dir(struct proj_plan *plan,
+						const char *path, int parent)
+{
+	char *lock_path = parent ? get_path_parent(path) : strdup(path);
+
+	return add_proj_plan_item(plan, lock_path, 1, PROJ_STATE_MODIFIED);
+}
+
+/**
+ * Add the projection of a file to a plan, as for project_file().
+ *
+ * @return plan item, or NULL if memory allocation fails
+ */
+static struct proj_plan_item *add_proj_plan_file(struct proj_plan *plan,
+						 const char *path,
+						 enum proj_state state)
+{
+	return add_proj_plan_item(plan, strdup(path), 0, state);
+}
+
+static unsigned int get_proj_plan_depth(const char *path)
+{
+	return (strcmp(path, ".") == 0) ? 0 : get_path_depth(path) + 1;
+}
+
+static int cmp_proj_plan_items(const void *a, const void *b)
+{
+	const struct proj_plan_item *x = *(const struct proj_plan_item **)a;
+	const struct proj_plan_item *y = *(const struct proj_plan_item **)b;
+	unsigned int x_depth = get_proj_plan_depth(x->path);
+	unsigned int y_depth = get_proj_plan_depth(y->path);
+
+	if (x_depth != y_depth)
+		return (x_depth < y_depth) ? -1 : 1;
+
+	return strcmp(x->path, y->path);
+}
+
+/**
+ * Run all the projections in a plan, acquiring the locks of those paths
+ * which need to be projected in a single ordered walk, and releasing the
+ * locks of files together once all are projected.
+ *
+ * Locks are always acquired from the shallowest paths to the deepest, and
+ * in path order at the same depth, so that concurrent operations cannot
+ * deadlock and directories are projected before the entries within them
+ * are opened.  A directory's lock is released as soon as it has been
+ * projected, since file operations never lock a projected directory
+ * again, so that no directory remains locked while the provider hydrates
+ * a file, which may include waiting for a batch window.
+ *
+ * The walk stops at the first failure, except that a file item which is
+ * missing or a directory records ENOENT or EISDIR in its res field and
+ * the walk continues, leaving the operation to handle it.
+ *
+ * The plan is consumed by this function, except for the res fields of
+ * its items.
+ *
+ * @param plan plan of projections
+ * @return 0 or an errno
+ */
+static int run_proj_plan(struct proj_plan *plan)
+{
+	struct proj_plan_item *order[PROJ_PLAN_MAX_ITEMS];
+	struct proj_plan_item *item;
+	unsigned int i;
+	int res = plan->res;
+
+	for (i = 0; i < plan->count; ++i)
+		order[i] = &plan->items[i];
+	qsort(order, plan->count, sizeof(*order), cmp_proj_plan_items);
+
+	for (i = 0; res == 0 && i < plan->count; ++i) {
+		item = order[i];
+
+		if (item->isdir) {
+			res = lock_proj_dir(&item->state_lock, item->path);
+			if (res == 0 && item->state_lock.lock_fd != -1) {
+				res = project_locked_dir(plan->op,
+							 &item->state_lock,
+							 item->path);
+				release_proj_state_lock(&item->state_lock);
+			}
+		} else {
+			res = lock_proj_file(&item->state_lock, item->path,
+					     item->state, &item->st);
+			if (res == 0 && item->state_lock.lock_fd != -1) {
+				res = project_locked_file(plan->op,
+							  &item->state_lock,
+							  item->path,
+							  item->state,
+							  &item->st);
+			}
+		}
+
+		item->res = res;
+		if (!item->isdir && (res == ENOENT || res == EISDIR))
+			res = 0;
+	}
+
+	for (i = 0; i < plan->count; ++i) {
+		item = &plan->items[i];
+		release_proj_state_lock(&item->state_lock);
+		free(item->path);
+		item->path = NULL;
+	}
+
+	return res;
+}
+
+/* names of the library's own files in lowerdir, hidden from readdir;
+ * temporary entries may be created in any directory, but the cache
+ * snapshot exists only in lowerdir itself
+ */
+#define PROJ_PRIVATE_NAME_PRE ".libprojfs-"
+
+#define PROJ_TMP_NAME_PRE PROJ_PRIVATE_NAME_PRE "tmp-"
+#define PROJ_TMP_NAME_PRE_LEN (sizeof(PROJ_TMP_NAME_PRE) - 1)
+#define PROJ_CACHE_NAME PROJ_PRIVATE_NAME_PRE "cache"
+
+/**
+ * @param name directory entry name
+ * @param root 1 if the entry is in lowerdir itself; 0 otherwise
+ * @return 1 if the entry is private to the library, 0 if not
+ */
+static inline int is_private_name(const char *name, int root)
+{
+	return strncmp(name, PROJ_TMP_NAME_PRE, PROJ_TMP_NAME_PRE_LEN) == 0 ||
+	       (root && strcmp(name, PROJ_CACHE_NAME) == 0);
+}
+
+/**
+ * Check whether a path names the cache snapshot or a temporary entry,
+ * which file operations must neither find, create, nor replace.
+ *
+ * @param path path within lowerdir (from make_relative_path())
+ * @return 1 if the path is private to the library, 0 if not
+ */
+static inline int is_private_path(const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	if (name == NULL)
+		return is_private_name(path, 1);
+	return is_private_name(name + 1, 0);
+}
+
+/**
+ * Makes a path from FUSE usable as a relative path to lowerdir_fd.  Removes
+ * any leading forward slashes.  If the resulting path is empty, returns ".".
+ * */
+static inline const char *make_relative_path(const char *path)
+{
+	while (*path == '/')
+		++path;
+	if (*path == '\0')
+		path = ".";
+	return path;
+}
+
+/**
+ * Counts a file operation against its path, if tracking the busiest paths.
+ */
+static void count_op(const char *op, const char *path)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	struct hotpath *hot = fs->hot_paths[PROJFS_HOT_OPS];
+
+	if (hot != NULL && path != NULL)
+		hotpath_add(hot, op, make_relative_path(path), 1);
+}
+
+// filesystem ops
+
+static int projfs_op_getattr(char const *path, struct stat *attr,
+                             struct fuse_file_info *fi)
+{
+	int res;
+
+	count_op("getattr", path);
+	// report the placeholder's attributes, not the shared file's
+	if (fi && !is_shared_fd(fi->fh))
+		res = fstat(fi->fh, attr);
+	else {
+		path = make_relative_path(path);
+		// hide the cache snapshot, so the kernel never finds it
+		if (is_private_path(path))
+			return -ENOENT;
+		if (strcmp(path, ".") != 0) {
+			res = project_dir("getattr", path, 1);
+			if (res)
+				return -res;
+		}
+		res = fstatat(get_fuse_context_lowerdir_fd(), path, attr,
+			      AT_SYMLINK_NOFOLLOW);
+	}
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_readlink(char const *path, char *buf, size_t size)
+{
+	int res;
+
+	count_op("readlink", path);
+	path = make_relative_path(path);
+	res = project_dir("readlink", path, 1);
+	if (res)
+		return -res;
+	res = readlinkat(get_fuse_context_lowerdir_fd(), path, buf, size - 1);
+	if (res == -1)
+		return -errno;
+	buf[res] = 0;
+	return 0;
+}
+
+static int projfs_op_link(char const *src, char const *dst)
+{
+	struct proj_plan plan;
+	struct proj_plan_item *src_item;
+	int lowerdir_fd;
+	int res;
+
+	count_op("link", src);
+	/* NOTE: We require lowerdir to be a directory, so this should
+	 *       fail when src is an empty path, as we expect.
+	 */
+	src = make_relative_path(src);
+	dst = make_relative_path(dst);
+	if (is_private_path(src))
+		return -ENOENT;
+	if (is_private_path(dst))
+		return -EPERM;
+
+	init_proj_plan(&plan, "link");
+	add_proj_plan_dir(&plan, src, 1);
+
+	/* hydrate the source file before adding a hard link to it, otherwise
+	 * a user could access the newly created link and end up modifying the
+	 * non-hydrated placeholder */
+	src_item = add_proj_plan_file(&plan, src, PROJ_STATE_POPULATED);
+
+	add_proj_plan_dir(&plan, dst, 1);
+
+	res = run_proj_plan(&plan);
+	if (res)
+		return -res;
+	if (src_item->res)
+		return -src_item->res;
+
+	lowerdir_fd = get_fuse_context_lowerdir_fd();
+	res = linkat(lowerdir_fd, src, lowerdir_fd, dst, 0);
+	if (res == -1)
+		return -errno;
+
+	// do not report event handler errors after successful link op
+	(void)send_notify_event(PROJFS_CREATE | PROJFS_ONLINK, 0, src, dst);
+	return 0;
+}
+
+static void *projfs_op_init(struct fuse_conn_info *conn,
+                            struct fuse_config *cfg)
+{
+	(void)conn;
+
+	cfg->entry_timeout = 0;
+	cfg->attr_timeout = 0;
+	cfg->negative_timeout = 0;
+	cfg->use_ino = 1;
+
+	return get_fuse_context_projfs();
+}
+
+#define has_write_mode(fi) ((fi)->flags & (O_WRONLY | O_RDWR))
+
+/* Count of the content changes made to an inode open with write hashes,
+ * through any file descriptor or path.
+ */
+struct write_inode {
+	dev_t dev;
+	ino_t ino;
+	atomic_ulong changes;
+	unsigned int refs;		/* write hashes open on the inode */
+	struct write_inode *next;
+};
+
+/* Incremental SHA-256 digest of the content written through a file
+ * descriptor, which remains valid only while all writes are sequential
+ * from the start of the file, and no content changes are made to the
+ * file other than through the descriptor.
+ */
+struct write_hash {
+	pthread_mutex_t mutex;
+	off_t len;
+	int valid;
+	struct write_inode *inode;
+	unsigned long start_changes;	/* inode's changes when opened */
+	unsigned long changes;		/* changes through this descriptor */
+	struct sha256_ctx ctx;
+};
+
+/**
+ * Find the write hash inode record of a file; the caller must hold the
+ * write_inodes_mutex.
+ *
+ * @return inode record, or NULL if no write hash is open on the file
+ */
+static struct write_inode *find_write_inode(struct projfs *fs,
+					    const struct stat *st)
+{
+	struct write_inode *inode;
+
+	for (inode = fs->write_inodes; inode != NULL; inode = inode->next) {
+		if (inode->dev == st->st_dev && inode->ino == st->st_ino)
+			break;
+	}
+	return inode;
+}
+
+/**
+ * Count a content change made to an open file, such as a truncation by
+ * path, so that the write hashes of any file descriptors open on the same
+ * file are invalidated when those are closed.
+ *
+ * @param fd file descriptor through which the change was made
+ */
+static void count_write_change(int fd)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	struct write_inode *inode;
+	struct stat st;
+
+	if (fs->write_hashes == NULL || fstat(fd, &st) == -1)
+		return;
+
+	pthread_mutex_lock(&fs->write_inodes_mutex);
+	inode = find_write_inode(fs, &st);
+	if (inode != NULL)
+		atomic_fetch_add(&inode->changes, 1);
+	pthread_mutex_unlock(&fs->write_inodes_mutex);
+}
+
+static struct write_hash *get_write_hash(int fd)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+
+	if (fs->write_hashes == NULL || fd < 0 || fd >= MAX_TABLE_SIZE)
+		return NULL;
+	return atomic_load(&fs->write_hashes[fd]);
+}
+
+static void start_write_hash(int fd)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	struct write_inode *inode;
+	struct write_hash *wh;
+	struct stat st;
+
+	if (fs->write_hashes == NULL || fd < 0 || fd >= MAX_TABLE_SIZE)
+		return;
+
+	// on failure, just report no hash when the file is closed
+	if (fstat(fd, &st) == -1)
+		return;
+	wh = malloc(sizeof(*wh));
+	if (wh == NULL)
+		return;
+	if (pthread_mutex_init(&wh->mutex, NULL) > 0) {
+		free(wh);
+		return;
+	}
+	wh->len = 0;
+	wh->valid = 1;
+	wh->changes = 0;
+	sha256_init(&wh->ctx);
+
+	pthread_mutex_lock(&fs->write_inodes_mutex);
+	inode = find_write_inode(fs, &st);
+	if (inode == NULL) {
+		inode = malloc(sizeof(*inode));
+		if (inode == NULL) {
+			pthread_mutex_unlock(&fs->write_inodes_mutex);
+			pthread_mutex_destroy(&wh->mutex);
+			free(wh);
+			return;
+		}
+		inode->dev = st.st_dev;
+		inode->ino = st.st_ino;
+		atomic_init(&inode->changes, 0);
+		inode->refs = 0;
+		inode->next = fs->write_inodes;
+		fs->write_inodes = inode;
+	}
+	++inode->refs;
+	wh->inode = inode;
+	wh->start_changes = atomic_load(&inode->changes);
+	pthread_mutex_unlock(&fs->write_inodes_mutex);
+
+	atomic_store(&fs->write_hashes[fd], wh);
+}
+
+/**
+ * Count a content change made through a file descriptor, both against its
+ * own write hash and against any others open on the same file.
+ */
+static void count_write_hash_change(int fd)
+{
+	struct write_hash *wh = get_write_hash(fd);
+
+	if (wh == NULL) {
+		count_write_change(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&wh->mutex);
+	++wh->changes;
+	atomic_fetch_add(&wh->inode->changes, 1);
+	pthread_mutex_unlock(&wh->mutex);
+}
+
+static void put_write_inode(struct projfs *fs, struct write_inode *inode)
+{
+	struct write_inode **prev;
+
+	pthread_mutex_lock(&fs->write_inodes_mutex);
+	if (--inode->refs == 0) {
+		for (prev = &fs->write_inodes; *prev != inode;
+		     prev = &(*prev)->next)
+			;
+		*prev = inode->next;
+		free(inode);
+	}
+	pthread_mutex_unlock(&fs->write_inodes_mutex);
+}
+
+static void invalidate_write_hash(int fd, off_t len)
+{
+	struct write_hash *wh = get_write_hash(fd);
+
+	if (wh == NULL)
+		return;
+
+	pthread_mutex_lock(&wh->mutex);
+	if (len != wh->len)
+		wh->valid = 0;
+	pthread_mutex_unlock(&wh->mutex);
+}
+
+/**
+ * Remove the write hash state of a file descriptor, which must still be
+ * open, and complete its digest if the file's content was fully hashed.
+ *
+ * @return 1 if digest was written, otherwise 0
+ */
+static int finish_write_hash(int fd, unsigned char *digest)
+{
+	struct projfs *fs = get_fuse_context_projfs();
+	struct write_hash *wh;
+	unsigned long changes;
+	struct stat st;
+	int res = 0;
+
+	if (fs->write_hashes == NULL || fd < 0 || fd >= MAX_TABLE_SIZE)
+		return 0;
+	wh = atomic_exchange(&fs->write_hashes[fd], NULL);
+	if (wh == NULL)
+		return 0;
+
+	// any changes not made through this descriptor invalidate its hash
+	changes = atomic_load(&wh->inode->changes) - wh->start_changes;
+	if (wh->valid && changes == wh->changes &&
+	    fstat(fd, &st) == 0 && st.st_size == wh->len) {
+		sha256_final(&wh->ctx, digest);
+		res = 1;
+	}
+
+	put_write_inode(fs, wh->inode);
+	pthread_mutex_destroy(&wh->mutex);
+	free(wh);
+	return res;
+}
+
+/**
+ * Write a buffer vector while adding its data to a write hash, if the write
+ * continues sequentially from the end of the hashed data.
+ *
+ * @return number of bytes written or a negative errno
+ */
+static ssize_t write_buf_hash(struct write_hash *wh, struct fuse_bufvec *dst,
+			      struct fuse_bufvec *src, off_t off)
+{
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+	struct fuse_buf *buf = &src->buf[0];
+	void *data = NULL;
+	ssize_t res;
+
+	pthread_mutex_lock(&wh->mutex);
+	if (!wh->valid || off != wh->len) {
+		wh->valid = 0;
+		pthread_mutex_unlock(&wh->mutex);
+		res = fuse_buf_copy(dst, src, FUSE_BUF_SPLICE_NONBLOCK);
+		if (res > 0)
+			count_write_hash_change(dst->buf[0].fd);
+		return res;
+	}
+
+	// gather the data into memory unless it is already in a single buffer
+	if (src->count == 1 && src->idx == 0 && src->off == 0 &&
+	    !(buf->flags & FUSE_BUF_IS_FD)) {
+		res = fuse_buf_copy(dst, src, FUSE_BUF_SPLICE_NONBLOCK);
+		if (res > 0)
+			sha256_update(&wh->ctx, buf->mem, res);
+	} else {
+		data = malloc(mem.buf[0].size);
+		if (data == NULL) {
+			res = -errno;
+			goto out;
+		}
+		mem.buf[0].mem = data;
+		res = fuse_buf_copy(&mem, src, 0);
+		if (res < 0)
+			goto out;
+		mem.buf[0].size = res;
+
+		res = fuse_buf_copy(dst, &mem, 0);
+		if (res > 0)
+			sha256_update(&wh->ctx, data, res);
+	}
+
+out:
+	if (res < 0)
+		wh->valid = 0;
+	else
+		wh->len += res;
+	if (res > 0) {
+		++wh->changes;
+		atomic_fetch_add(&wh->inode->changes, 1);
+	}
+	pthread_mutex_unlock(&wh->mutex);
+	free(data);
+	return res;
+}
+
+static int projfs_op_flush(char const *path, struct fuse_file_info *fi)
+{
+	int res, err;
+
+	count_op("flush", path);
+	res = close(dup(fi->fh));
+	err = errno;		// errno may be changed by fdtable realloc
+
+	if (has_write_mode(fi)) {
+		// do not report table realloc errors after successful close op
+		(void)fdtable_replace(get_fuse_context_projfs()->fdtable,
+				      fi->fh, get_fuse_context_tgid());
+	}
+
+	return res == -1 ? -err : 0;
+}
+
+static int projfs_op_fsync(char const *path, int datasync,
+                           struct fuse_file_info *fi)
+{
+	int res;
+
+	count_op("fsync", path);
+	if (datasync)
+		res = fdatasync(fi->fh);
+	else
+		res = fsync(fi->fh);
+	return res == -1 ? -errno : 0;
+}
+
+#define enforce_user_read(m) ((m) | S_IRUSR);
+
+static int projfs_op_mknod(char const *path, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	count_op("mknod", path);
+	(void)rdev;
+
+	path = make_relative_path(path);
+	if (is_private_path(path))
+		return -EPERM;
+	res = project_dir("mknod", path, 1);
+	if (res)
+		return -res;
+
+	mode = enforce_user_read(mode);
+	if (S_ISFIFO(mode))
+		res = mkfifoat(get_fuse_context_lowerdir_fd(), path, mode);
+	else
+		return -ENOSYS;
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_symlink(char const *link, char const *path)
+{
+	int res;
+
+	count_op("symlink", path);
+	path = make_relative_path(path);
+	if (is_private_path(path))
+		return -EPERM;
+	res = project_dir("symlink", path, 1);
+	if (res)
+		return -res;
+	res = symlinkat(link, get_fuse_context_lowerdir_fd(), path);
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_create(char const *path, mode_t mode,
+                            struct fuse_file_info *fi)
+{
+	/* FUSE sets fi.flags = O_CREAT | O_EXCL | O_WRONLY in fuse_lib_mknod,
+	 * untouched in fuse_lib_create where it comes straight from
+	 * FUSE_CREATE.  In Linux 4.9 at least, we never hit a codepath where
+	 * we send FUSE_CREATE without first checking that O_CREAT is set.
+	 * There's no guarantee O_EXCL (or O_TRUNC) are set, though, so we need
+	 * to hydrate it if it exists. */
+
+	int flags = fi->flags & ~O_NOFOLLOW;
+	int res;
+	int fd;
+
+	count_op("create", path);
+	path = make_relative_path(path);
+	if (is_private_path(path))
+		return -EPERM;
+	res = project_dir("create", path, 1);
+	if (res)
+		return -res;
+	res = project_file("create", path, PROJ_STATE_POPULATED);
+	if (res && res != ENOENT)
+		return -res;
+
+	mode = enforce_user_read(mode);
+	fd = openat(get_fuse_context_lowerdir_fd(), path, flags, mode);
+	if (fd == -1)
+		return -errno;
+	fi->fh = fd;
+	if (flags & O_TRUNC)
+		count_write_change(fd);
+
+	if (has_write_mode(fi)) {
+		// do not report table realloc errors after successful open op
+		(void)fdtable_insert(get_fuse_context_projfs()->fdtable,
+				     fd, get_fuse_context_tgid());
+		start_write_hash(fd);
+	 }
+
+	// do not report event handler errors after successful open op
+	(void)send_notify_event(PROJFS_CREATE, 0, path, NULL);
+	return 0;
+}
+
+static int projfs_op_open(char const *path, struct fuse_file_info *fi)
+{
+	int flags = fi->flags & ~O_NOFOLLOW;
+	int res;
+	int fd;
+
+	count_op("open", path);
+	path = make_relative_path(path);
+	if (is_private_path(path))
+		return -ENOENT;
+	res = project_dir("open", path, 1);
+	if (res)
+		return -res;
+
+	// read unhydrated content from the shared layer, if available
+	if (!has_write_mode(fi) && !(flags & O_TRUNC)) {
+		fd = open_shared_placeholder(path);
+		if (fd != -1 && set_shared_fd(fd, 1) == 0) {
+			fi->fh = fd;
+			return 0;
+		}
+		if (fd != -1)
+			close(fd);
+	}
+
+	/* Per above, allow hydration to fail with ENOENT; if the file
+	 * operation should fail for that reason (i.e. O_CREAT is not specified
+	 * and the file doesn't exist), we'll return the failure from openat(2)
+	 * below.
+	 */
+	res = project_file("open", path,
+			   has_write_mode(fi) ? PROJ_STATE_MODIFIED
+					      : PROJ_STATE_POPULATED);
+	if (res) {
+		// if path was a directory, try projecting it instead
+		if (res == EISDIR)
+			res = project_dir("open", path, 0);
+		if (res != ENOENT)
+			return -res;
+	}
+
+	fd = openat(get_fuse_context_lowerdir_fd(), path, flags);
+	if (fd == -1)
+		return -errno;
+	if (flags & O_TRUNC)
+		count_write_change(fd);
+
+	if (has_write_mode(fi)) {
+		// do not report table realloc errors after successful open op
+		(void)fdtable_insert(get_fuse_context_projfs()->fdtable,
+				     fd, get_fuse_context_tgid());
+		start_write_hash(fd);
+	}
+
+	fi->fh = fd;
+	return 0;
+}
+
+static int projfs_op_statfs(char const *path, struct statvfs *buf)
+{
+	int res;
+
+	count_op("statfs", path);
+	// TODO: should we return our own filesystem's global info?
+	res = fstatvfs(get_fuse_context_lowerdir_fd(), buf);
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_read_buf(char const *path, struct fuse_bufvec **bufp,
+			      size_t size, off_t off,
+			      struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src = malloc(sizeof(*src));
+
+	count_op("read", path);
+	if (!src)
+		return -errno;
+
+	*src = FUSE_BUFVEC_INIT(size);
+
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = off;
+
+	*bufp = src;
+
+	return 0;
+}
+
+static int projfs_op_write_buf(char const *path, struct fuse_bufvec *src,
+			       off_t off, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+	struct write_hash *wh = get_write_hash(fi->fh);
+	ssize_t res;
+
+	count_op("write", path);
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fi->fh;
+	buf.buf[0].pos = off;
+
+	if (wh != NULL)
+		return write_buf_hash(wh, &buf, src, off);
+
+	res = fuse_buf_copy(&buf, src, FUSE_BUF_SPLICE_NONBLOCK);
+	if (res > 0)
+		count_write_change(fi->fh);
+	return res;
+}
+
+static int projfs_op_release(char const *path, struct fuse_file_info *fi)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	int res, err, hashed = 0;
+	pid_t pid = 0;
+
+	count_op("release", path);
+	if (has_write_mode(fi))
+		hashed = finish_write_hash(fi->fh, digest);
+	else if (is_shared_fd(fi->fh))
+		set_shared_fd(fi->fh, 0);	// before the fd may be reused
+
+	res = close(fi->fh);
+	err = errno;		// errno may be changed by fdtable realloc
+
+	if (has_write_mode(fi)) {
+		// do not report table realloc errors after successful close op
+		(void)fdtable_remove(get_fuse_context_projfs()->fdtable,
+				     fi->fh, &pid);
+	}
+
+	// return value is ignored by libfuse, but be consistent anyway
+	if (res == -1)
+		return -err;
+
+	if (has_write_mode(fi)) {
+		// do not report event handler errors after successful close op
+		(void)send_close_write_event(pid, make_relative_path(path),
+					     hashed ? digest : NULL);
+	}
+	return 0;
+}
+
+static int projfs_op_unlink(char const *path)
+{
+	int res;
+
+	count_op("unlink", path);
+	path = make_relative_path(path);
+	if (is_private_path(path))
+		return -ENOENT;
+	res = send_perm_event(PROJFS_DELETE_PERM, path, NULL);
+	if (res < 0)
+		return res;
+	res = project_dir("unlink", path, 1);
+	if (res)
+		return -res;
+
+	res = unlinkat(get_fuse_context_lowerdir_fd(), path, 0);
+	if (res == -1)
+		return -errno;
+
+	// do not report event handler errors after successful unlink op
+	(void)send_notify_event(PROJFS_DELETE, 0, path, NULL);
+	return 0;
+}
+
+static int projfs_op_mkdir(char const *path, mode_t mode)
+{
+	int res;
+
+	count_op("mkdir", path);
+	path = make_relative_path(path);
+	if (is_private_path(path))
+		return -EPERM;
+	res = project_dir("mkdir", path, 1);
+	if (res)
+		return -res;
+
+	mode = enforce_user_read(mode);
+	res = mkdirat(get_fuse_context_lowerdir_fd(), path, mode);
+	if (res == -1)
+		return -errno;
+
+	// do not report event handler errors after successful mkdir op
+	(void)send_notify_event(PROJFS_CREATE | PROJFS_ONDIR, 0, path, NULL);
+	return 0;
+}
+
+/**
+ * Remove any temporary entries left in a directory by placeholder creations
+ * which never completed, such as when a provider exits between creating a
+ * temporary directory and renaming it into place.
+ *
+ * @param lowerdir_fd lower directory file descriptor
+ * @param path path of the directory, relative to lowerdir
+ * @return number of entries removed, or -1 on error with errno set
+ */
+static int remove_tmp_entries(int lowerdir_fd, const char *path)
+{
+	struct dirent *ent;
+	DIR *dir;
+	int fd, count = 0;
+
+	fd = openat(lowerdir_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1)
+		return -1;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (!is_private_name(ent->d_name, 0))
+			continue;
+		// only placeholder directories are created under these names
+		if (unlinkat(fd, ent->d_name, AT_REMOVEDIR) == 0)
+			++count;
+	}
+
+	closedir(dir);
+	return count;
+}
+
+static int projfs_op_rmdir(char const *path)
+{
+	struct dircache *cache;
+	int lowerdir_fd;
+	int res;
+
+	count_op("rmdir", path);
+	path = make_relative_path(path);
+	res = send_perm_event(PROJFS_DELETE_PERM | PROJFS_ONDIR, path, NULL);
+	if (res < 0)
+		return res;
+	res = project_dir("rmdir", path, 1);
+	if (res)
+		return -res;
+
+	lowerdir_fd = get_fuse_context_lowerdir_fd();
+	res = unlinkat(lowerdir_fd, path, AT_REMOVEDIR);
+	// a directory which appears empty may hold leftover temporary entries
+	if (res == -1 && errno == ENOTEMPTY &&
+	    remove_tmp_entries(lowerdir_fd, path) > 0)
+		res = unlinkat(lowerdir_fd, path, AT_REMOVEDIR);
+	if (res == -1)
+		return -errno;
+
+	cache = get_fuse_context_projfs()->dircache;
+	if (cache != NULL)
+		dircache_remove(cache, path);
+
+	// do not report event handler errors after successful rmdir op
+	(void)send_notify_event(PROJFS_DELETE | PROJFS_ONDIR, 0, path, NULL);
+	return 0;
+}
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+static int projfs_op_rename(char const *src, char const *dst,
+                            unsigned int flags)
+{
+	struct proj_plan plan;
+	struct proj_plan_item *src_item;
+	struct dircache *cache;
+	uint64_t dir_mask = 0;
+	int lowerdir_fd;
+	int res;
+
+	count_op("rename", src);
+	src = make_relative_path(src);
+	dst = make_relative_path(dst);
+	if (is_private_path(src))
+		return -ENOENT;
+	if (is_private_path(dst))
+		return -EPERM;
+
+	init_proj_plan(&plan, "rename");
+	add_proj_plan_dir(&plan, src, 1);
+	// always convert to fully local file before renaming
+	src_item = add_proj_plan_file(&plan, src, PROJ_STATE_MODIFIED);
+	add_proj_plan_dir(&plan, dst, 1);
+
+	res = run_proj_plan(&plan);
+	if (res)
+		return -res;
+	if (src_item->res == EISDIR)
+		dir_mask = PROJFS_ONDIR;
+	else if (src_item->res)
+		return -src_item->res;
+
+	res = send_perm_event(PROJFS_MOVE_PERM | dir_mask, src, dst);
+	if (res < 0)
+		return res;
+
+	// TODO: for non Linux, use renameat(); fail if flags != 0
+	lowerdir_fd = get_fuse_context_lowerdir_fd();
+	res = syscall(SYS_renameat2, lowerdir_fd, src, lowerdir_fd, dst,
+		      flags);
+	if (res == -1)
+		return -errno;
+
+	// cached paths under a moved or replaced directory are now invalid
+	cache = get_fuse_context_projfs()->dircache;
+	if (cache != NULL && (dir_mask || (flags & RENAME_EXCHANGE))) {
+		dircache_remove(cache, src);
+		dircache_remove(cache, dst);
+	}
+
+	// do not report event handler errors after successful rename op
+	(void)send_notify_event(PROJFS_MOVE | dir_mask, 0, src, dst);
+	return 0;
+}
+
+static int projfs_op_opendir(char const *path, struct fuse_file_info *fi)
+{
+	int flags = O_DIRECTORY | O_NOFOLLOW | O_RDONLY;
+	struct proj_plan plan;
+	struct projfs_dir *d;
+	int fd;
+	int res = 0;
+	int err = 0;
+
+	count_op("opendir", path);
+	path = make_relative_path(path);
+	init_proj_plan(&plan, "opendir");
+	add_proj_plan_dir(&plan, path, 1);
+	add_proj_plan_dir(&plan, path, 0);
+	res = run_proj_plan(&plan);
+	if (res)
+		return -res;
+
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		res = -1;
+		goto out;
+	}
+
+	fd = openat(get_fuse_context_lowerdir_fd(), path, flags);
+	if (fd == -1) {
+		res = -1;
+		goto out_free;
+	}
+	d->root = (strcmp(path, ".") == 0);
+
+	d->dir = fdopendir(fd);
+	if (!d->dir) {
+		res = -1;
+		err = errno;
+		goto out_close;
+	}
+
+	fi->fh = (uintptr_t)d;
+	goto out;
+
+out_close:
+	close(fd);	// report fopendir() error and ignore any from close()
+out_free:
+	free(d);
+out:
+	return res == -1 ? -(err > 0 ? err : errno) : res;
+}
+
+/**
+ * @return next directory entry not private to the library, or NULL at
+ *         the end of the directory or with errno set on failure
+ */
+static struct dirent *next_dir_entry(struct projfs_dir *d)
+{
+	if (d->ent != NULL)
+		return d->ent;
+
+	do {
+		errno = 0;
+		d->ent = readdir(d->dir);
+	} while (d->ent != NULL && is_private_name(d->ent->d_name, d->root));
+
+	return d->ent;
+}
+
+#define READDIR_PLUS_BATCH 32
+
+struct readdir_plus_entry {
+	char name[NAME_MAX + 1];
+	off_t off;
+	ino_t ino;
+	unsigned char type;
+};
+
+/**
+ * List directory entries with their attributes, which we fetch for each
+ * batch of entries together rather than one at a time.
+ *
+ * @return 0 or an errno
+ */
+static int readdir_plus(struct projfs_dir *d, void *buf,
+			fuse_fill_dir_t filler)
+{
+	struct readdir_plus_entry ents[READDIR_PLUS_BATCH];
+	const char *names[READDIR_PLUS_BATCH];
+	struct stat attrs[READDIR_PLUS_BATCH];
+	int results[READDIR_PLUS_BATCH];
+	enum fuse_fill_dir_flags filled;
+	struct dirent *ent;
+	unsigned int i, n;
+	int err;
+
+	do {
+		err = 0;
+		for (n = 0; n < READDIR_PLUS_BATCH; ++n) {
+			ent = next_dir_entry(d);
+			if (ent == NULL) {
+				err = errno;
+				break;
+			}
+			strcpy(ents[n].name, ent->d_name);
+			ents[n].off = ent->d_off;
+			ents[n].ino = ent->d_ino;
+			ents[n].type = ent->d_type;
+			names[n] = ents[n].name;
+			d->ent = NULL;
+		}
+
+		// TODO: break and report errors from stat?
+		uring_stat_batch(dirfd(d->dir), names, n, attrs, results);
+
+		for (i = 0; i < n; ++i) {
+			filled = FUSE_FILL_DIR_PLUS;
+			if (results[i] != 0) {
+				memset(&attrs[i], 0, sizeof(attrs[i]));
+				attrs[i].st_ino = ents[i].ino;
+				attrs[i].st_mode = ents[i].type << 12;
+				filled = 0;
+			}
+
+			if (filler(buf, ents[i].name, &attrs[i], ents[i].off,
+				   filled)) {
+				// resume after the last entry filled
+				seekdir(d->dir, d->loc);
+				return 0;
+			}
+			d->loc = ents[i].off;
+		}
+	} while (n == READDIR_PLUS_BATCH);
+
+	return err;
+}
+
+static int projfs_op_readdir(char const *path, void *buf,
+                             fuse_fill_dir_t filler, off_t off,
+                             struct fuse_file_info *fi,
+                             enum fuse_readdir_flags flags)
+{
+	struct projfs_dir *d = (struct projfs_dir *)fi->fh;
+	struct dirent *ent;
+	struct stat attr;
+
+	count_op("readdir", path);
+	if (off != d->loc) {
+		seekdir(d->dir, off);
+		d->ent = NULL;
+		d->loc = off;
+	}
+
+	/* the entries hidden by next_dir_entry() include placeholder
+	 * directories still being prepared, and the warm start cache snapshot
+	 */
+	if (flags & FUSE_READDIR_PLUS)
+		return -readdir_plus(d, buf, filler);
+
+	while ((ent = next_dir_entry(d)) != NULL) {
+		memset(&attr, 0, sizeof(attr));
+		attr.st_ino = ent->d_ino;
+		attr.st_mode = ent->d_type << 12;
+
+		if (filler(buf, ent->d_name, &attr, ent->d_off, 0))
+			return 0;
+
+		d->loc = ent->d_off;
+		d->ent = NULL;
+	}
+
+	return -errno;
+}
+
+static int projfs_op_releasedir(char const *path, struct fuse_file_info *fi)
+{
+	struct projfs_dir *d = (struct projfs_dir *)fi->fh;
+	int res = closedir(d->dir);
+
+	count_op("releasedir", path);
+	free(d);
+	// return value is ignored by libfuse, but be consistent anyway
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_chmod(char const *path, mode_t mode,
+                           struct fuse_file_info *fi)
+{
+	int res;
+
+	count_op("chmod", path);
+	mode = enforce_user_read(mode);
+
+	if (fi && !is_shared_fd(fi->fh))
+		res = fchmod(fi->fh, mode);
+	else {
+		path = make_relative_path(path);
+		res = project_dir("chmod", path, 1);
+		if (res)
+			return -res;
+		res = fchmodat(get_fuse_context_lowerdir_fd(), path, mode, 0);
+	}
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_chown(char const *path, uid_t uid, gid_t gid,
+                           struct fuse_file_info *fi)
+{
+	int res;
+
+	count_op("chown", path);
+	if (fi && !is_shared_fd(fi->fh))
+		res = fchown(fi->fh, uid, gid);
+	else {
+		path = make_relative_path(path);
+		res = project_dir("chown", path, 1);
+		if (res)
+			return -res;
+		// disallow chown() on lowerdir itself, so no AT_EMPTY_PATH
+		res = fchownat(get_fuse_context_lowerdir_fd(), path, uid, gid,
+			       AT_SYMLINK_NOFOLLOW);
+	}
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_truncate(char const *path, off_t off,
+                              struct fuse_file_info *fi)
+{
+	int res, err = 0;
+
+	count_op("truncate", path);
+	if (fi) {
+		invalidate_write_hash(fi->fh, off);
+		res = ftruncate(fi->fh, off);
+		if (res == 0)
+			count_write_hash_change(fi->fh);
+	} else {
+		int fd;
+
+		path = make_relative_path(path);
+		res = project_dir("truncate", path, 1);
+		if (res)
+			return -res;
+		// convert to fully local file before truncating
+		res = project_file("truncate", path, PROJ_STATE_MODIFIED);
+		if (res)
+			return -res;
+
+		fd = openat(get_fuse_context_lowerdir_fd(), path, O_WRONLY);
+		if (fd == -1) {
+			res = -1;
+			goto out;
+		}
+		res = ftruncate(fd, off);
+		if (res == -1)
+			err = errno;
+		else
+			count_write_change(fd);
+		// report error from close() unless prior ftruncate() error
+		if (close(fd) == -1)
+			res = -1;
+	}
+out:
+	return res == -1 ? -(err > 0 ? err : errno) : 0;
+}
+
+static int projfs_op_utimens(char const *path, const struct timespec tv[2],
+                             struct fuse_file_info *fi)
+{
+	int res;
+
+	count_op("utimens", path);
+	if (fi && !is_shared_fd(fi->fh))
+		res = futimens(fi->fh, tv);
+	else {
+		path = make_relative_path(path);
+		res = project_dir("utimens", path, 1);
+		if (res)
+			return -res;
+		res = utimensat(get_fuse_context_lowerdir_fd(), path, tv,
+				AT_SYMLINK_NOFOLLOW);
+	}
+	return res == -1 ? -errno : 0;
+}
+
+
+static int projfs_op_setxattr(char const *path, char const *name,
+                              char const *value, size_t size, int flags)
+{
+	int res = -1;
+	int err = 0;
+	int fd;
+
+	count_op("setxattr", path);
+	if (xattr_name_has_prefix(name))
+		return -EPERM;
+
+	path = make_relative_path(path);
+	res = project_dir("setxattr", path, 1);
+	if (res)
+		return -res;
+
+	fd = openat(get_fuse_context_lowerdir_fd(), path,
+		    O_WRONLY | O_NONBLOCK);
+	if (fd == -1)
+		goto out;
+	res = fsetxattr(fd, name, value, size, flags);
+	if (res == -1)
+		err = errno;
+	// report error from close() unless prior fsetxattr() error
+	if (close(fd) == -1)
+		res = -1;
+out:
+	return res == -1 ? -(err > 0 ? err : errno) : 0;
+}
+
+static int projfs_op_getxattr(char const *path, char const *name,
+                              char *value, size_t size)
+{
+	ssize_t res = -1;
+	int err = 0;
+	int fd;
+
+	count_op("getxattr", path);
+	path = make_relative_path(path);
+	res = project_dir("getxattr", path, 1);
+	if (res)
+		return -res;
+
+	fd = openat(get_fuse_context_lowerdir_fd(), path,
+		    O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		goto out;
+	res = fgetxattr(fd, name, value, size);
+	if (res == -1)
+		err = errno;
+	// report error from close() unless prior fgetxattr() error
+	if (close(fd) == -1)
+		res = -1;
+out:
+	return res == -1 ? -(err > 0 ? err : errno) : res;
+}
+
+static int projfs_op_listxattr(char const *path, char *list, size_t size)
+{
+	ssize_t res = -1;
+	int err = 0;
+	int fd;
+
+	count_op("listxattr", path);
+	path = make_relative_path(path);
+	res = project_dir("listxattr", path, 1);
+	if (res)
+		return -res;
+
+	fd = openat(get_fuse_context_lowerdir_fd(), path,
+		    O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		goto out;
+	res = flistxattr(fd, list, size);
+	if (res == -1)
+		err = errno;
+	// report error from close() unless prior flistxattr() error
+	if (close(fd) == -1)
+		res = -1;
+out:
+	return res == -1 ? -(err > 0 ? err : errno) : res;
+}
+
+static int projfs_op_removexattr(char const *path, char const *name)
+{
+	int res = -1;
+	int err = 0;
+	int fd;
+
+	count_op("removexattr", path);
+	if (xattr_name_has_prefix(name))
+		return -EPERM;
+
+	path = make_relative_path(path);
+	res = project_dir("removexattr", path, 1);
+	if (res)
+		return -res;
+
+	fd = openat(get_fuse_context_lowerdir_fd(), path,
+		    O_WRONLY | O_NONBLOCK);
+	if (fd == -1)
+		goto out;
+	res = fremovexattr(fd, name);
+	if (res == -1)
+		err = errno;
+	// report error from close() unless prior fremovexattr() error
+	if (close(fd) == -1)
+		res = -1;
+out:
+	return res == -1 ? -(err > 0 ? err : errno) : 0;
+}
+
+static int projfs_op_access(char const *path, int mode)
+{
+	int res;
+
+	count_op("access", path);
+	path = make_relative_path(path);
+	res = project_dir("access", path, 1);
+	if (res)
+		return -res;
+	res = faccessat(get_fuse_context_lowerdir_fd(), path, mode,
+			AT_SYMLINK_NOFOLLOW);
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_flock(char const *path, struct fuse_file_info *fi, int op)
+{
+	int res = flock(fi->fh, op);
+
+	count_op("flock", path);
+	return res == -1 ? -errno : 0;
+}
+
+static int projfs_op_fallocate(char const *path, int mode, off_t off,
+                               off_t len, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int res;
+
+	count_op("fallocate", path);
+	/* files opened for writing have already been projected, so every
+	 * mode may be applied directly to the lower file
+	 */
+	if (mode == 0)
+		res = posix_fallocate(fi->fh, off, len);
+	else
+		res = (fallocate(fi->fh, mode, off, len) == -1) ? errno : 0;
+	if (res > 0)
+		return -res;
+
+	// only preallocation leaves the content unchanged, up to its size
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		invalidate_write_hash(fi->fh, -1);
+	else if (mode == 0)
+		invalidate_write_hash(fi->fh, (fstat(fi->fh, &st) == -1)
+					      ? -1 : st.st_size);
+	if (mode != FALLOC_FL_KEEP_SIZE)
+		count_write_hash_change(fi->fh);
+	return 0;
+}
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+/**
+ * The kernel only forwards SEEK_DATA and SEEK_HOLE requests.  Files are
+ * projected in full when opened, unless read from the shared layer, so the
+ * open file's holes are always those of its content, and any placeholder
+ * left sparse by projfs_create_proj_file() has already been hydrated.
+ */
+static off_t projfs_op_lseek(char const *path, off_t off, int whence,
+			     struct fuse_file_info *fi)
+{
+	off_t res;
+
+	count_op("lseek", path);
+	res = lseek(fi->fh, off, whence);
+	return res == -1 ? -errno : res;
+}
+#endif
+
+static struct fuse_operations projfs_ops = {
+	.getattr	= projfs_op_getattr,
+	.readlink	= projfs_op_readlink,
+	.mknod		= projfs_op_mknod,
+	.mkdir		= projfs_op_mkdir,
+	.unlink		= projfs_op_unlink,
+	.rmdir		= projfs_op_rmdir,
+	.symlink	= projfs_op_symlink,
+	.rename		= projfs_op_rename,
+	.link		= projfs_op_link,
+	.chmod		= projfs_op_chmod,
+	.chown		= projfs_op_chown,
+	.truncate	= projfs_op_truncate,
+	.open		= projfs_op_open,
+	.statfs		= projfs_op_statfs,
+	.flush		= projfs_op_flush,
+	.release	= projfs_op_release,
+	.fsync		= projfs_op_fsync,
+	.setxattr	= projfs_op_setxattr,
+	.getxattr	= projfs_op_getxattr,
+	.listxattr	= projfs_op_listxattr,
+	.removexattr	= projfs_op_removexattr,
+	.opendir	= projfs_op_opendir,
+	.readdir	= projfs_op_readdir,
+	.releasedir	= projfs_op_releasedir,
+	.init		= projfs_op_init,
+	.access		= projfs_op_access,
+	.create		= projfs_op_create,
+	.utimens	= projfs_op_utimens,
+	.write_buf	= projfs_op_write_buf,
+	.read_buf	= projfs_op_read_buf,
+	.flock		= projfs_op_flock,
+	.fallocate	= projfs_op_fallocate,
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+	.lseek		= projfs_op_lseek,
+#endif
+	// copy_file_range
+};
+
+static void projfs_set_session(struct projfs *fs, struct fuse *fuse,
+			       struct fuse_session *se)
+{
+	if (fs == NULL)
+		return;
+
+	pthread_mutex_lock(&fs->mutex);
+	// wait for batch_invalidate() to finish with any prior session
+	while (fs->fuse_users > 0)
+		pthread_cond_wait(&fs->fuse_idle, &fs->mutex);
+	fs->fuse = fuse;
+	fs->session = se;
+	pthread_mutex_unlock(&fs->mutex);
+}
+
+struct projfs *projfs_new(const char *lowerdir, const char *mountdir,
+		const struct projfs_handlers *handlers,
+		size_t handlers_size, void *user_data,
+		int argc, const char **argv)
+{
+	struct projfs *fs = NULL;
+	pthread_condattr_t attr;
+	size_t len;
+	int i, err;
+
+	// TODO: prevent failure with relative lowerdir
+	if (lowerdir == NULL) {
+		log_printf(fs, LOG_STDERR_ONLY, "no lowerdir specified");
+		goto out;
+	}
+
+	// TODO: debug failure to exit when given a relative mountdir
+	if (mountdir == NULL) {
+		log_printf(fs, LOG_STDERR_ONLY, "no mountdir specified");
+		goto out;
+	}
+
+	if (sizeof(struct projfs_handlers) < handlers_size) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "warning: library too old, some handlers "
+			   "may be ignored");
+		handlers_size = sizeof(struct projfs_handlers);
+	}
+
+	fs = calloc(1, sizeof(struct projfs));
+	if (fs == NULL) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "failed to allocate projfs object");
+		goto out;
+	}
+
+	fs->lowerdir = strdup(lowerdir);
+	if (fs->lowerdir == NULL) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "failed to allocate lower path");
+		goto out_handle;
+	}
+	len = strlen(fs->lowerdir);
+	if (len && fs->lowerdir[len - 1] == '/')
+		fs->lowerdir[len - 1] = 0;
+
+	fs->mountdir = strdup(mountdir);
+	if (fs->mountdir == NULL) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "failed to allocate mount path");
+		goto out_lower;
+	}
+	len = strlen(fs->mountdir);
+	if (len && fs->mountdir[len - 1] == '/')
+		fs->mountdir[len - 1] = 0;
+
+	if (handlers != NULL)
+		memcpy(&fs->handlers, handlers, handlers_size);
+
+	fs->user_data = user_data;
+
+	if (pthread_mutex_init(&fs->mutex, NULL) > 0)
+		goto out_mount;
+
+	if (pthread_condattr_init(&attr) > 0)
+		goto out_mutex;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&fs->loop_exit, &attr);
+	pthread_condattr_destroy(&attr);
+	if (err > 0)
+		goto out_mutex;
+
+	if (pthread_cond_init(&fs->fuse_idle, NULL) > 0)
+		goto out_cond;
+
+	if (init_proj_batch(&fs->proj_batch) > 0)
+		goto out_idle;
+
+	fs->fdtable = fdtable_create();
+	if (fs->fdtable == NULL) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "failed to allocate file descriptor table");
+		goto out_batch;
+	}
+
+	if (fuse_opt_add_arg(&fs->args, "projfs") != 0) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "failed to allocate argument");
+		goto out_fdtable;
+	}
+
+	for (i = 0; i < argc; ++i) {
+		if (fuse_opt_add_arg(&fs->args, argv[i]) != 0) {
+			log_printf(fs, LOG_STDERR_ONLY,
+				   "failed to allocate argument");
+			goto out_fdtable;
+		}
+	}
+
+	if (fuse_opt_parse(&fs->args, &fs->config, projfs_opts, NULL) == -1) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "unable to parse arguments");
+		goto out_fdtable;
+	}
+
+	if (fs->config.write_hash) {
+		fs->write_hashes = calloc(MAX_TABLE_SIZE,
+					  sizeof(*fs->write_hashes));
+		if (fs->write_hashes == NULL) {
+			log_printf(fs, LOG_STDERR_ONLY,
+				   "failed to allocate write hash table");
+			goto out_fdtable;
+		}
+		if (pthread_mutex_init(&fs->write_inodes_mutex, NULL) > 0) {
+			log_printf(fs, LOG_STDERR_ONLY,
+				   "failed to initialize write hash mutex");
+			free(fs->write_hashes);
+			goto out_fdtable;
+		}
+	}
+
+	// external providers receive events through the event queue
+	if (fs->config.provider_socket != NULL)
+		fs->config.event_queue = 1;
+
+	if (init_event_queue(&fs->event_queue, fs->config.event_queue) > 0) {
+		log_printf(fs, LOG_STDERR_ONLY,
+			   "failed to create event queue");
+		goto out_hashes;
+	}
+
+	// handlers are not called once events are queued instead
+	if (fs->config.event_queue)
+		memset(&fs->handlers, 0, sizeof(fs->handlers));
+
+	if (fs->config.warm_start) {
+		fs->dircache = dircache_create();
+		if (fs->dircache == NULL) {
+			log_printf(fs, LOG_STDERR_ONLY,
+				   "failed to allocate directory cache");
+			goto out_queue;
+		}
+	}
+
+	if (fs->config.hot_paths > 0) {
+		for (i = 0; i < HOT_PATH_KINDS; ++i) {
+			fs->hot_paths[i] = hotpath_create(fs->config.hot_paths);
+			if (fs->hot_paths[i] == NULL) {
+				log_printf(fs, LOG_STDERR_ONLY,
+					   "failed to allocate hot path "
+					   "tracker");
+				goto out_hot_paths;
+			}
+		}
+	}
+
+	return fs;
+
+out_hot_paths:
+	for (i = 0; i < HOT_PATH_KINDS; ++i)
+		hotpath_destroy(fs->hot_paths[i]);
+	if (fs->dircache != NULL)
+		dircache_destroy(fs->dircache);
+out_queue:
+	destroy_event_queue(&fs->event_queue);
+out_hashes:
+	if (fs->write_hashes != NULL) {
+		pthread_mutex_destroy(&fs->write_inodes_mutex);
+		free(fs->write_hashes);
+	}
+out_fdtable:
+	fuse_opt_free_args(&fs->args);
+	fdtable_destroy(fs->fdtable);
+out_batch:
+	destroy_proj_batch(&fs->proj_batch);
+out_idle:
+	pthread_cond_destroy(&fs->fuse_idle);
+out_cond:
+	pthread_cond_destroy(&fs->loop_exit);
+out_mutex:
+	pthread_mutex_destroy(&fs->mutex);
+out_mount:
+	free(fs->mountdir);
+out_lower:
+	free(fs->lowerdir);
+out_handle:
+	free(fs);
+out:
+	return NULL;
+}
+
+void *projfs_get_user_data(struct projfs *fs)
+{
+	return fs->user_data;
+}
+
+int projfs_get_event_fd(struct projfs *fs)
+{
+	// the queue is read by the bridge to any external provider
+	if (fs->config.provider_socket != NULL)
+		return -1;
+
+	return fs->event_queue.fd;
+}
+
+int projfs_read_events(struct projfs *fs, struct projfs_queued_event *events,
+		       unsigned int nevents)
+{
+	struct event_queue *queue = &fs->event_queue;
+	struct event_queue_req *req;
+	unsigned int n = 0;
+	uint64_t val;
+
+	if (queue->fd == -1)
+		return -EINVAL;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (n < nevents && queue->head != NULL) {
+		req = queue->head;
+		queue->head = req->next;
+		req->read = 1;
+		events[n++] = req->qev;
+	}
+
+	/* reset the eventfd counter once all events have been read; this
+	 * can only fail with EAGAIN if the counter is already zero
+	 */
+	if (queue->head == NULL) {
+		queue->tail = &queue->head;
+		if (read(queue->fd, &val, sizeof(val)) == -1)
+			val = 0;
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return n;
+}
+
+int projfs_reply_event(uint64_t token, int result)
+{
+	struct event_queue_req *req;
+	struct event_queue *queue;
+	uint32_t idx;
+	int wait;
+
+	/* hold the token table lock until the queue is unlocked, so the
+	 * filesystem cannot be stopped and its queue destroyed meanwhile
+	 */
+	pthread_mutex_lock(&event_tokens_mutex);
+	req = find_event_token(token, &idx);
+	if (req == NULL) {
+		pthread_mutex_unlock(&event_tokens_mutex);
+		return EINVAL;
+	}
+
+	queue = &req->qev.event.fs->event_queue;
+	pthread_mutex_lock(&queue->mutex);
+	// unread events are still linked in the queue
+	if (!req->read) {
+		pthread_mutex_unlock(&queue->mutex);
+		pthread_mutex_unlock(&event_tokens_mutex);
+		return EINVAL;
+	}
+	release_event_token(idx);
+
+	// a waiting sender may return as soon as the queue is unlocked
+	wait = (req->wait && !req->abandoned);
+	if (wait) {
+		req->result = result;
+		req->done = 1;
+		pthread_cond_broadcast(&queue->done);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	pthread_mutex_unlock(&event_tokens_mutex);
+
+	if (!wait)
+		free_event_queue_req(req);
+	return 0;
+}
+
+#define SPARSE_TEST_FILENAME ".libprojfs-sparse-test"
+#define SPARSE_TEST_SIZE_BYTES 1048576
+
+/**
+ * Test that using ftruncate to create a sparse file works.
+ *
+ * @return 1 if sparse files function as expected, 0 if not, -1 if an error
+ * occurred during testing (in which case errno is set).
+ */
+static int test_sparse_support(int lowerdir_fd)
+{
+	struct stat attrs;
+	int fd, res;
+
+	fd = openat(lowerdir_fd, SPARSE_TEST_FILENAME,
+		    (O_CREAT | O_TRUNC | O_RDWR), 0600);
+	if (fd == -1)
+		return -1;
+
+	res = fstat(fd, &attrs);
+	if (res == -1)
+		goto err_close;
+
+	if (attrs.st_size != 0) {
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	res = ftruncate(fd, SPARSE_TEST_SIZE_BYTES);
+	if (res == -1)
+		goto err_close;
+
+	res = fstat(fd, &attrs);
+	if (res == -1)
+		goto err_close;
+
+	if (attrs.st_size != SPARSE_TEST_SIZE_BYTES) {
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	res = attrs.st_blocks == 0;
+
+	goto close;
+
+err_close:
+	res = -1;
+
+close:
+	close(fd);
+	unlinkat(lowerdir_fd, SPARSE_TEST_FILENAME, 0);
+
+	return res;
+}
+
+static void *projfs_loop(void *data)
+{
+	struct projfs *fs = (struct projfs *)data;
+	struct fuse_loop_config loop;
+	struct fuse *fuse;
+	struct fuse_session *se;
+	int res = 0;
+	int err;
+
+	// TODO: verify the way we're setting signal handlers on the underlying
+	// session works correctly when using the high-level API
+
+	fs->shared_fd = -1;
+
+	/* open lower directory file descriptor to resolve relative paths
+	 * in file ops
+	 */
+	fs->lowerdir_fd = open(fs->lowerdir,
+			       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fs->lowerdir_fd == -1) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "failed to open lowerdir: %s: %s",
+			   fs->lowerdir, strerror(errno));
+		res = 1;
+		goto out;
+	}
+
+	if (get_proj_state_xattr(fs->lowerdir_fd) == PROJ_STATE_ERROR &&
+	    errno == ENOTSUP) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "xattr support check on lowerdir failed: %s: %s",
+			fs->lowerdir, strerror(errno));
+		res = 2;
+		goto out_close;
+	}
+
+	res = test_sparse_support(fs->lowerdir_fd);
+	if (res == -1) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "unable to test sparse file support: %s/%s: %s",
+			   fs->lowerdir, SPARSE_TEST_FILENAME,
+			   strerror(errno));
+		res = 3;
+		goto out_close;
+	} else if (res == 0) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "sparse files may not be supported by "
+			   "lower filesystem: %s", fs->lowerdir);
+	} else if (res == 1) {
+		res = 0;
+	}
+
+	if (fs->config.shared != NULL) {
+		fs->shared_fd = open(fs->config.shared,
+				     O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fs->shared_fd == -1) {
+			log_printf(fs, LOG_STDERR_FALLBACK,
+				   "failed to open shared layer: %s: %s",
+				   fs->config.shared, strerror(errno));
+			res = 9;
+			goto out_close;
+		}
+
+		fs->shared_fds = calloc(MAX_TABLE_SIZE,
+					sizeof(*fs->shared_fds));
+		if (fs->shared_fds == NULL) {
+			log_printf(fs, LOG_STDERR_FALLBACK,
+				   "failed to allocate shared layer table");
+			res = 9;
+			goto out_close;
+		}
+	}
+
+	/* load the cache snapshot from our last unmount, if any; its entries
+	 * are validated on first use, so any changes made to lowerdir since
+	 * then, including by the initial option below, are detected
+	 */
+	if (fs->dircache != NULL &&
+	    dircache_load(fs->dircache, fs->lowerdir_fd,
+			  PROJ_CACHE_NAME) == -1) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "ignoring cache snapshot: %s/%s: %s",
+			   fs->lowerdir, PROJ_CACHE_NAME, strerror(errno));
+	}
+
+	if (fs->config.initial == 1) {
+		if (set_proj_state_xattr(fs->lowerdir_fd,
+					 PROJ_STATE_EMPTY, 0) == -1) {
+			log_printf(fs, LOG_STDERR_FALLBACK,
+				   "could not set projection flag "
+				   "xattr: %s: %s",
+				   fs->lowerdir, strerror(errno));
+			res = 4;
+			goto out_close;
+		}
+	}
+
+	fuse = fuse_new(&fs->args, &projfs_ops, sizeof(projfs_ops), fs);
+	if (fuse == NULL) {
+		res = 5;
+		goto out_close;
+	}
+
+	se = fuse_get_session(fuse);
+	projfs_set_session(fs, fuse, se);
+
+	// TODO: defer all signal handling to user, once we remove FUSE
+	if (fuse_set_signal_handlers(se) != 0) {
+		res = 6;
+		goto out_session;
+	}
+
+	// TODO: mount with x-gvfs-hide option and maybe others for KDE, etc.
+	/* NOTE: a live mount can not be handed off to another process
+	 *       with the high-level FUSE API; see docs/design.md
+	 */
+	if (fuse_mount(fuse, fs->mountdir) != 0) {
+		res = 7;
+		goto out_signal;
+	}
+
+	// TODO: support configs; ideally libfuse's full suite
+	loop.clone_fd = 0;
+	loop.max_idle_threads = 10;
+
+	// TODO: output strsignal() only for dev purposes
+	if ((err = fuse_loop_mt(fuse, &loop)) != 0) {
+		if (err > 0) {
+			log_printf(fs, LOG_STDERR_FALLBACK, "%s signal",
+				   strsignal(err));
+		}
+		res = 8;
+	}
+
+	fuse_session_unmount(se);
+
+	// file ops are complete, so the cache may now be saved
+	if (fs->dircache != NULL &&
+	    dircache_save(fs->dircache, fs->lowerdir_fd,
+			  PROJ_CACHE_NAME) == -1) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "failed to save cache snapshot: %s/%s: %s",
+			   fs->lowerdir, PROJ_CACHE_NAME, strerror(errno));
+	}
+out_signal:
+	fuse_remove_signal_handlers(se);
+out_session:
+	projfs_set_session(fs, NULL, NULL);
+	fuse_session_destroy(se);
+out_close:
+	if (fs->shared_fd != -1) {
+		close(fs->shared_fd);
+		fs->shared_fd = -1;
+	}
+	free(fs->shared_fds);
+	fs->shared_fds = NULL;
+	if (close(fs->lowerdir_fd) == -1) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "failed to close lowerdir: %s: %s",
+			   fs->lowerdir, strerror(errno));
+	}
+	fs->lowerdir_fd = 0;
+out:
+	fs->error = res;
+
+	pthread_mutex_lock(&fs->mutex);
+	fs->loop_done = 1;
+	pthread_cond_broadcast(&fs->loop_exit);
+	pthread_mutex_unlock(&fs->mutex);
+
+	pthread_exit(NULL);
+}
+
+int projfs_start(struct projfs *fs)
+{
+	sigset_t oldset;
+	sigset_t newset;
+	pthread_t thread_id;
+	int res;
+
+	if (log_open(fs) != 0)
+		return -1;
+	if (profile_open(fs) != 0) {
+		log_close(fs);
+		return -1;
+	}
+
+	// TODO: override stack size per fuse_start_thread()?
+
+	// TODO: defer all signal handling to user, once we remove FUSE
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGTERM);
+	sigaddset(&newset, SIGINT);
+	sigaddset(&newset, SIGHUP);
+	sigaddset(&newset, SIGQUIT);
+	// TODO: handle error from pthread_sigmask()
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+
+	if (fs->config.provider_socket != NULL) {
+		fs->provider_bridge =
+			provider_bridge_start(fs, fs->config.provider_socket,
+					      fs->event_queue.fd);
+		if (fs->provider_bridge == NULL) {
+			res = errno;
+			pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+			log_printf(fs, LOG_STDERR_FALLBACK,
+				   "failed to listen for provider: %s: %s",
+				   fs->config.provider_socket, strerror(res));
+			goto out_close;
+		}
+	}
+
+	res = start_event_lanes(fs);
+	if (res > 0) {
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "error creating notification lanes: %s",
+			   strerror(res));
+		goto out_bridge;
+	}
+
+	res = pthread_create(&thread_id, NULL, projfs_loop, fs);
+
+	// TODO: report error from pthread_sigmask() but don't return -1
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (res != 0) {
+		log_printf(fs, LOG_STDERR_FALLBACK,
+			   "error creating thread: %s", strerror(res));
+		goto out_lanes;
+	}
+
+	fs->thread_id = thread_id;
+	return 0;
+
+out_lanes:
+	stop_event_lanes(fs, fs->nlanes);
+out_bridge:
+	provider_bridge_stop(fs->provider_bridge);
+	fs->provider_bridge = NULL;
+out_close:
+	profile_close(fs);
+	log_close(fs);
+	return -1;
+}
+
+/**
+ * Ask the FUSE loop to exit, and refuse any further upcalls which file
+ * operations would wait for, failing those already waiting for replies to
+ * queued events.
+ */
+static void begin_stop(struct projfs *fs)
+{
+	struct stat buf;
+
+	atomic_store(&fs->stopping, 1);
+
+	// no provider may answer, so do not wait for one
+	stop_event_queue(&fs->event_queue);
+
+	pthread_mutex_lock(&fs->mutex);
+	if (fs->session != NULL)
+		fuse_session_exit(fs->session);
+	pthread_mutex_unlock(&fs->mutex);
+
+	/* could send a USR1 signal and have a no-op handler installed by
+	 * projfs_loop(), but this is a simpler way to trigger fuse_do_work()
+	 * to exit, which semaphores fuse_session_loop_mt() to exit as well;
+	 * we can ignore any errors
+	 */
+	stat(fs->mountdir, &buf);
+}
+
+/**
+ * Wait for the FUSE loop thread to exit, which it does once all in-flight
+ * file operations are complete, and join it.
+ *
+ * @param deadline time after which to stop waiting; NULL to wait forever
+ * @return 0, or ETIMEDOUT if the thread is still running
+ */
+static int wait_loop_exit(struct projfs *fs, const struct timespec *deadline)
+{
+	int err = 0;
+
+	if (!fs->thread_id)
+		return 0;
+
+	pthread_mutex_lock(&fs->mutex);
+	while (!fs->loop_done && err != ETIMEDOUT) {
+		if (deadline == NULL)
+			pthread_cond_wait(&fs->loop_exit, &fs->mutex);
+		else
+			err = pthread_cond_timedwait(&fs->loop_exit,
+						     &fs->mutex, deadline);
+	}
+	if (fs->loop_done)
+		err = 0;
+	pthread_mutex_unlock(&fs->mutex);
+	if (err > 0)
+		return err;
+
+	pthread_join(fs->thread_id, NULL);
+	fs->thread_id = 0;
+	return 0;
+}
+
+/**
+ * Release all resources of a filesystem whose FUSE loop has exited.
+ *
+ * @return number of notifications discarded without being delivered
+ */
+static unsigned int finish_stop(struct projfs *fs)
+{
+	unsigned int dropped;
+	int i;
+
+	provider_bridge_stop(fs->provider_bridge);
+
+	// deliver any notifications still waiting in their lanes
+	stop_event_lanes(fs, fs->nlanes);
+
+	if (fs->error > 0) {
+		// TODO: translate projfs_loop() codes into messages
+		log_printf(fs, LOG_STDERR_ONLY, "error from event loop: %d",
+			   fs->error);
+	}
+
+	profile_close(fs);
+	log_close(fs);
+
+	fuse_opt_free_args(&fs->args);
+
+	fdtable_destroy(fs->fdtable);
+
+	if (fs->write_hashes != NULL) {
+		for (i = 0; i < MAX_TABLE_SIZE; ++i) {
+			struct write_hash *wh;
+
+			wh = atomic_load(&fs->write_hashes[i]);
+			if (wh == NULL)
+				continue;
+			pthread_mutex_destroy(&wh->mutex);
+			free(wh);
+		}
+		while (fs->write_inodes != NULL) {
+			struct write_inode *inode = fs->write_inodes;
+
+			fs->write_inodes = inode->next;
+			free(inode);
+		}
+		pthread_mutex_destroy(&fs->write_inodes_mutex);
+		free(fs->write_hashes);
+	}
+
+	if (fs->dircache != NULL)
+		dircache_destroy(fs->dircache);
+	for (i = 0; i < HOT_PATH_KINDS; ++i)
+		hotpath_destroy(fs->hot_paths[i]);
+	dropped = destroy_event_queue(&fs->event_queue);
+	destroy_proj_batch(&fs->proj_batch);
+	pthread_cond_destroy(&fs->fuse_idle);
+	pthread_cond_destroy(&fs->loop_exit);
+	pthread_mutex_destroy(&fs->mutex);
+
+	free(fs->mountdir);
+	free(fs->lowerdir);
+
+	free(fs);
+	return dropped;
+}
+
+void *projfs_stop(struct projfs *fs)
+{
+	void *user_data = fs->user_data;
+
+	begin_stop(fs);
+	wait_loop_exit(fs, NULL);
+	finish_stop(fs);
+
+	return user_data;
+}
+
+int projfs_stop_timeout(struct projfs *fs, unsigned int timeout_msec,
+			struct projfs_stop_status *status)
+{
+	struct timespec deadline;
+	void *user_data = fs->user_data;
+	int err;
+
+	get_deadline(&deadline, timeout_msec);
+	memset(status, 0, sizeof(*status));
+
+	begin_stop(fs);
+
+	/* the cache snapshot, if any, is saved by projfs_loop() once
+	 * the filesystem is unmounted, before the thread exits
+	 */
+	err = wait_loop_exit(fs, &deadline);
+	if (err > 0) {
+		status->running = atomic_load(&fs->upcalls_running);
+	} else {
+		status->running = drain_event_lanes(fs, &deadline,
+						    &fs->notify_dropped);
+		if (status->running > 0)
+			err = ETIMEDOUT;
+	}
+
+	status->refused = atomic_load(&fs->upcalls_refused);
+	status->dropped = fs->notify_dropped;
+	if (err > 0)
+		return err;
+
+	status->dropped += finish_stop(fs);
+	status->user_data = user_data;
+	return 0;
+}
+
+static int check_safe_rel_path(const char *path)
+{
+	const char *s = path;
+	const char *t;
+
+	if (path == NULL || *path == '/')
+		return 0;
+
+	while ((s = strstr(s, "..")) != NULL) {
+		t = s + 2;
+		if ((*t == '\0' || *t == '/') &&
+		    (s == path || *(s - 1) == '/'))
+			return 0;
+		s += 2;
+	}
+
+	return 1;
+}
+
+static char *make_user_xattr_name(const char *segments)
+{
+	char *name;
+
+	name = malloc(PROJ_XATTR_PRE_LEN + strlen(segments) + 1);
+	if (name == NULL)
+		return NULL;
+
+	memcpy(name, PROJ_XATTR_PRE_NAME, PROJ_XATTR_PRE_LEN);
+	strcpy(name + PROJ_XATTR_PRE_LEN, segments);
+
+	return name;
+}
+
+#define PROJ_XATTR_READ 0x00
+#define PROJ_XATTR_WRITE 0x01
+#define PROJ_XATTR_CREATE 0x02
+#define PROJ_XATTR_VERSION 0x04	/* permit writing the version xattr */
+
+static int iter_user_xattrs(int fd, struct projfs_attr *attrs,
+			    unsigned int nattrs, unsigned int flags)
+{
+	int set_flags = (flags & PROJ_XATTR_CREATE) ? XATTR_CREATE : 0;
+	int res;
+	unsigned int i;
+
+	if (attrs == NULL)
+		return 0;
+
+	for (i = 0; i < nattrs; i++) {
+		char *name;
+		struct projfs_attr *attr = &attrs[i];
+
+		name = make_user_xattr_name(attr->name);
+		if (name == NULL)
+			return errno;
+
+		if (flags & PROJ_XATTR_WRITE) {
+			// do not permit alteration of our reserved xattrs
+			if (xattr_name_is_reserved(name) &&
+			    ((flags & PROJ_XATTR_VERSION) == 0 ||
+			     strcmp(name, PROJ_VERSION_XATTR_NAME) != 0)) {
+				errno = EPERM;
+				res = -1;
+			} else {
+				res = set_xattr(fd, name,
+						attr->value, &attr->size,
+						set_flags);
+			}
+		} else {
+			res = get_xattr(fd, name, attr->value, &attr->size);
+		}
+
+		free(name);
+		if (res == -1)
+			return errno;
+	}
 
-	// do not report event handler errors after successful rmdir op
-	(void)send_notify_event(PROJFS_DELETE | PROJFS_ONDIR, 0, path, NULL);
 	return 0;
 }
 
-static int projfs_op_rename(char const *src, char const *dst,
-                            unsigned int flags)
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+#define PROJ_TMP_NAME_FMT PROJ_TMP_NAME_PRE "%ld-%ld"
+
+/**
+ * Return a path for a temporary directory entry in the same parent directory
+ * as the given path, which may be renamed into place once prepared.
+ *
+ * The caller is responsible for freeing the returned string.
+ *
+ * @param path path of the entry to be created
+ * @return temporary path; may be NULL if memory allocation fails
+ */
+static char *make_tmp_path(const char *path)
 {
-	uint64_t dir_mask = 0;
-	int lowerdir_fd;
+	struct timespec ts;
+	char *parent, *tmp_path;
 	int res;
 
-	src = make_relative_path(src);
-	res = project_dir("rename", src, 1);
-	if (res)
-		return -res;
-	// always convert to fully local file before renaming
-	res = project_file("rename", src, PROJ_STATE_MODIFIED);
-	if (res == EISDIR)
-		dir_mask = PROJFS_ONDIR;
-	else if (res)
-		return -res;
+	parent = get_path_parent(path);
+	if (parent == NULL)
+		return NULL;
 
-	dst = make_relative_path(dst);
-	res = project_dir("rename2", dst, 1);
-	if (res)
-		return -res;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	res = asprintf(&tmp_path, "%s/" PROJ_TMP_NAME_FMT, parent,
+		       (long)syscall(SYS_gettid), (long)ts.tv_nsec);
+	free(parent);
 
-	res = send_perm_event(PROJFS_MOVE_PERM | dir_mask, src, dst);
-	if (res < 0)
-		return res;
+	return (res == -1) ? NULL : tmp_path;
+}
 
-	// TODO: for non Linux, use renameat(); fail if flags != 0
-	lowerdir_fd = get_fuse_context_lowerdir_fd();
-	res = syscall(SYS_renameat2, lowerdir_fd, src, lowerdir_fd, dst,
-		      flags);
-	if (res == -1)
-		return -errno;
+/**
+ * Rename a prepared temporary directory into place, failing with EEXIST
+ * rather than replacing any existing entry.
+ *
+ * @return 0 or an errno
+ */
+static int rename_tmp_path(int lowerdir_fd, const char *tmp_path,
+			   const char *path)
+{
+	struct stat st;
+
+	// TODO: for non Linux, use renameat() as in the fallback case below
+	if (syscall(SYS_renameat2, lowerdir_fd, tmp_path, lowerdir_fd, path,
+		    RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL)
+		return errno;
+
+	/* lower filesystem lacks RENAME_NOREPLACE, and renameat() would
+	 * replace an existing empty directory, so check first (not atomic)
+	 */
+	if (fstatat(lowerdir_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		return EEXIST;
+	if (renameat(lowerdir_fd, tmp_path, lowerdir_fd, path) == -1)
+		return errno;
 
-	// do not report event handler errors after successful rename op
-	(void)send_notify_event(PROJFS_MOVE | dir_mask, 0, src, dst);
 	return 0;
 }
 
-static int projfs_op_opendir(char const *path, struct fuse_file_info *fi)
+int projfs_create_proj_dir(struct projfs *fs, const char *path, mode_t mode,
+			   struct projfs_attr *attrs, unsigned int nattrs)
 {
-	int flags = O_DIRECTORY | O_NOFOLLOW | O_RDONLY;
-	struct projfs_dir *d;
-	int fd;
-	int res = 0;
-	int err = 0;
+	char *tmp_path;
+	int reset_mode;
+	int fd, res;
 
-	path = make_relative_path(path);
-	res = project_dir("opendir", path, 1);
-	if (res)
-		return -res;
-	res = project_dir("opendir2", path, 0);
-	if (res)
-		return -res;
+	if (!check_safe_rel_path(path))
+		return EINVAL;
 
-	d = calloc(1, sizeof(*d));
-	if (!d) {
-		res = -1;
-		goto out;
+	/* prepare the placeholder under a temporary name and rename it into
+	 * place once its xattrs are set, so concurrent ops never observe a
+	 * directory without a projection state
+	 */
+	tmp_path = make_tmp_path(path);
+	if (tmp_path == NULL)
+		return errno;
+
+	mode = enforce_user_read(mode);
+	if (mkdirat(fs->lowerdir_fd, tmp_path, mode) == -1) {
+		res = errno;
+		goto out_free;
 	}
 
-	fd = openat(get_fuse_context_lowerdir_fd(), path, flags);
+	fd = openat(fs->lowerdir_fd, tmp_path,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
 	if (fd == -1) {
-		res = -1;
-		goto out_free;
+		res = errno;
+		goto out_rmdir;
 	}
 
-	d->dir = fdopendir(fd);
-	if (!d->dir) {
-		res = -1;
-		err = errno;
+	reset_mode = fchmod_user_write(fd, mode, 1);
+	if (set_proj_state_xattr(fd, PROJ_STATE_EMPTY, XATTR_CREATE) == -1) {
+		res = errno;
+		goto out_mode;
+	}
+
+	res = iter_user_xattrs(fd, attrs, nattrs,
+			       PROJ_XATTR_WRITE | PROJ_XATTR_CREATE |
+			       PROJ_XATTR_VERSION);
+
+out_mode:
+	if (reset_mode)
+		reset_mode = fchmod_user_write(fd, mode, 0);
+	close(fd);
+	if (res == 0)
+		res = rename_tmp_path(fs->lowerdir_fd, tmp_path, path);
+out_rmdir:
+	if (res > 0)
+		unlinkat(fs->lowerdir_fd, tmp_path, AT_REMOVEDIR); // best effort
+out_free:
+	free(tmp_path);
+	return res;
+}
+
+/**
+ * Open an unnamed temporary file in the parent directory of path, which
+ * may be linked into place once prepared.
+ *
+ * @return file descriptor, or -1 with errno set; errno will be EOPNOTSUPP
+ *         or EISDIR if O_TMPFILE is not supported by the lower filesystem
+ */
+static int open_tmpfile(int lowerdir_fd, const char *path, mode_t mode)
+{
+	char *parent;
+	int fd, err;
+
+	parent = get_path_parent(path);
+	if (parent == NULL)
+		return -1;
+
+	fd = openat(lowerdir_fd, parent, O_TMPFILE | O_WRONLY, mode);
+	err = errno;
+	free(parent);
+
+	errno = err;
+	return fd;
+}
+
+/**
+ * Link an unnamed temporary file from open_tmpfile() into place, failing
+ * with EEXIST if the path already exists.
+ *
+ * @return 0 or an errno
+ */
+static int link_tmpfile(int lowerdir_fd, int fd, const char *path)
+{
+	char self_fd_path[MAX_PROC_SELF_FD_PATH_LEN + 1];
+
+	// AT_EMPTY_PATH requires CAP_DAC_READ_SEARCH, so use /proc instead
+	sprintf(self_fd_path, PROC_SELF_FD_PATH_FMT, fd);
+	if (linkat(AT_FDCWD, self_fd_path, lowerdir_fd, path,
+		   AT_SYMLINK_FOLLOW) == -1)
+		return errno;
+
+	return 0;
+}
+
+int projfs_create_proj_file(struct projfs *fs, const char *path, off_t size,
+			    mode_t mode, struct projfs_attr *attrs,
+			    unsigned int nattrs)
+{
+	int reset_mode, tmpfile = 1;
+	int fd, res;
+
+	if (!check_safe_rel_path(path))
+		return EINVAL;
+
+	/* prepare the placeholder in an unnamed temporary file and link it
+	 * into place once its size and xattrs are set, so concurrent ops
+	 * never observe a file without a projection state
+	 */
+	mode = enforce_user_read(mode);
+	fd = open_tmpfile(fs->lowerdir_fd, path, mode);
+	if (fd == -1) {
+		if (errno != EOPNOTSUPP && errno != EISDIR)
+			return errno;
+
+		// fall back to preparing the placeholder in place
+		tmpfile = 0;
+		fd = openat(fs->lowerdir_fd, path,
+			    O_WRONLY | O_CREAT | O_EXCL, mode);
+		if (fd == -1)
+			return errno;
+	}
+
+	if (ftruncate(fd, size) == -1) {
+		res = errno;
 		goto out_close;
 	}
 
-	fi->fh = (uintptr_t)d;
-	goto out;
+	reset_mode = fchmod_user_write(fd, mode, 1);
+	if (set_proj_state_xattr(fd, PROJ_STATE_EMPTY, XATTR_CREATE) == -1) {
+		res = errno;
+		goto out_mode;
+	}
+
+	res = iter_user_xattrs(fd, attrs, nattrs,
+			       PROJ_XATTR_WRITE | PROJ_XATTR_CREATE |
+			       PROJ_XATTR_VERSION);
+
+out_mode:
+	if (reset_mode)
+		reset_mode = fchmod_user_write(fd, mode, 0);
+	if (res == 0 && tmpfile)
+		res = link_tmpfile(fs->lowerdir_fd, fd, path);
+out_close:
+	close(fd);
+	if (res > 0 && !tmpfile)
+		unlinkat(fs->lowerdir_fd, path, 0);	// best effort
+	return res;
+}
+
+int projfs_create_proj_symlink(struct projfs *fs, const char *path,
+			       const char *target)
+{
+	int res;
+
+	if (!check_safe_rel_path(path))
+		return EINVAL;
+
+	res = symlinkat(target, fs->lowerdir_fd, path);
+	if (res == -1)
+		return errno;
+
+	return 0;
+}
+
+static int iter_attrs(struct projfs *fs, const char *path,
+		      struct projfs_attr *attrs, unsigned int nattrs,
+		      unsigned int flags)
+{
+	int fd, res;
+	struct stat st;
+
+	if (!check_safe_rel_path(path) || attrs == NULL)
+		return EINVAL;
+
+	if (nattrs == 0)
+		return 0;
+
+	fd = openat(fs->lowerdir_fd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1)
+		return errno;
+
+	if (fstat(fd, &st) == -1) {
+		res = errno;
+		goto out_close;
+	}
+
+	if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))
+		res = iter_user_xattrs(fd, attrs, nattrs, flags);
+	else
+		res = EPERM;
 
 out_close:
-	close(fd);	// report fopendir() error and ignore any from close()
-out_free:
-	free(d);
-out:
-	return res == -1 ? -(err > 0 ? err : errno) : res;
+	close(fd);
+	return res;
 }
 
-static int projfs_op_readdir(char const *path, void *buf,
-                             fuse_fill_dir_t filler, off_t off,
-                             struct fuse_file_info *fi,
-                             enum fuse_readdir_flags flags)
+int projfs_get_attrs(struct projfs *fs, const char *path,
+		     struct projfs_attr *attrs, unsigned int nattrs)
 {
-	int err = 0;
-	struct projfs_dir *d = (struct projfs_dir *)fi->fh;
-
-	(void)path;
+	return iter_attrs(fs, path, attrs, nattrs, PROJ_XATTR_READ);
+}
 
-	if (off != d->loc) {
-		seekdir(d->dir, off);
-		d->ent = NULL;
-		d->loc = off;
-	}
+int projfs_set_attrs(struct projfs *fs, const char *path,
+		     struct projfs_attr *attrs, unsigned int nattrs)
+{
+	return iter_attrs(fs, path, attrs, nattrs, PROJ_XATTR_WRITE);
+}
 
-	while (1) {
-		struct stat attr;
-		enum fuse_fill_dir_flags filled = 0;
+enum batch_pass {
+	BATCH_PASS_DELETE = 0,
+	BATCH_PASS_UPDATE,
+	BATCH_PASS_CREATE
+};
 
-		if (!d->ent) {
-			errno = 0;
-			d->ent = readdir(d->dir);
-			if (!d->ent) {
-				err = errno;
-				break;
-			}
-		}
+struct batch_entry {
+	struct projfs_batch_op *op;
+	enum batch_pass pass;
+	unsigned int depth;
+	size_t parent_len;
+};
 
-		if (flags & FUSE_READDIR_PLUS) {
-			int res = fstatat(
-					dirfd(d->dir), d->ent->d_name, &attr,
-					AT_SYMLINK_NOFOLLOW);
-			// TODO: break and report errors from fstatat()?
-			if (res != -1)
-				filled = FUSE_FILL_DIR_PLUS;
-		}
-		if (filled == 0) {
-			memset(&attr, 0, sizeof(attr));
-			attr.st_ino = d->ent->d_ino;
-			attr.st_mode = d->ent->d_type << 12;
-		}
+/* entries sharing a pass, a depth, and a parent directory */
+struct batch_group {
+	struct batch_entry *entries;
+	unsigned int count;
+	int changed;		/* entries were created or deleted */
+};
 
-		if (filler(buf, d->ent->d_name, &attr, d->ent->d_off, filled))
-			break;
+struct batch_ctx {
+	struct projfs *fs;
+	struct batch_group *groups;
+};
 
-		d->loc = d->ent->d_off;
-		d->ent = NULL;
+static int get_batch_pass(unsigned int type, enum batch_pass *pass)
+{
+	switch (type) {
+	case PROJFS_BATCH_DELETE:
+		*pass = BATCH_PASS_DELETE;
+		break;
+	case PROJFS_BATCH_UPDATE:
+		*pass = BATCH_PASS_UPDATE;
+		break;
+	case PROJFS_BATCH_CREATE_DIR:
+	case PROJFS_BATCH_CREATE_FILE:
+		*pass = BATCH_PASS_CREATE;
+		break;
+	default:
+		return -1;
 	}
 
-	return -err;
+	return 0;
 }
 
-static int projfs_op_releasedir(char const *path, struct fuse_file_info *fi)
+static size_t get_path_parent_len(const char *path)
 {
-	struct projfs_dir *d = (struct projfs_dir *)fi->fh;
-	int res = closedir(d->dir);
+	const char *last = strrchr(path, '/');
 
-	(void)path;
-	free(d);
-	// return value is ignored by libfuse, but be consistent anyway
-	return res == -1 ? -errno : 0;
+	return (last == NULL) ? 0 : last - path;
 }
 
-static int projfs_op_chmod(char const *path, mode_t mode,
-                           struct fuse_file_info *fi)
+static int cmp_batch_level(const struct batch_entry *x,
+			   const struct batch_entry *y)
 {
 	int res;
 
-	mode = enforce_user_read(mode);
+	if (x->pass != y->pass)
+		return (x->pass < y->pass) ? -1 : 1;
 
-	if (fi)
-		res = fchmod(fi->fh, mode);
-	else {
-		path = make_relative_path(path);
-		res = project_dir("chmod", path, 1);
-		if (res)
-			return -res;
-		res = fchmodat(get_fuse_context_lowerdir_fd(), path, mode, 0);
+	if (x->depth != y->depth) {
+		// delete the deepest paths first, but create the shallowest
+		res = (x->depth < y->depth) ? -1 : 1;
+		return (x->pass == BATCH_PASS_DELETE) ? -res : res;
 	}
-	return res == -1 ? -errno : 0;
+
+	return 0;
 }
 
-static int projfs_op_chown(char const *path, uid_t uid, gid_t gid,
-                           struct fuse_file_info *fi)
+static int cmp_batch_entries(const void *a, const void *b)
 {
+	const struct batch_entry *x = a;
+	const struct batch_entry *y = b;
+	size_t len;
 	int res;
-	if (fi)
-		res = fchown(fi->fh, uid, gid);
-	else {
-		path = make_relative_path(path);
-		res = project_dir("chown", path, 1);
-		if (res)
-			return -res;
-		// disallow chown() on lowerdir itself, so no AT_EMPTY_PATH
-		res = fchownat(get_fuse_context_lowerdir_fd(), path, uid, gid,
-			       AT_SYMLINK_NOFOLLOW);
-	}
-	return res == -1 ? -errno : 0;
+
+	res = cmp_batch_level(x, y);
+	if (res != 0)
+		return res;
+
+	len = (x->parent_len < y->parent_len) ? x->parent_len : y->parent_len;
+	res = memcmp(x->op->path, y->op->path, len);
+	if (res != 0 || x->parent_len == y->parent_len)
+		return res;
+
+	return (x->parent_len < y->parent_len) ? -1 : 1;
 }
 
-static int projfs_op_truncate(char const *path, off_t off,
-                              struct fuse_file_info *fi)
+/**
+ * Check whether the content version recorded for a placeholder matches
+ * that supplied in an array of projection attributes.
+ *
+ * @return 1 if the versions match, 0 if they differ, if no version was
+ *         supplied or recorded, or if an error occurred
+ */
+static int match_proj_version(int fd, const struct projfs_attr *attrs,
+			      unsigned int nattrs)
 {
-	int res, err = 0;
-	if (fi)
-		res = ftruncate(fi->fh, off);
-	else {
-		int fd;
-
-		path = make_relative_path(path);
-		res = project_dir("truncate", path, 1);
-		if (res)
-			return -res;
-		// convert to fully local file before truncating
-		res = project_file("truncate", path, PROJ_STATE_MODIFIED);
-		if (res)
-			return -res;
+	const struct projfs_attr *attr = NULL;
+	unsigned int i;
+	char *value;
+	ssize_t size;
+	int match;
 
-		fd = openat(get_fuse_context_lowerdir_fd(), path, O_WRONLY);
-		if (fd == -1) {
-			res = -1;
-			goto out;
+	for (i = 0; attrs != NULL && i < nattrs; ++i) {
+		if (strcmp(attrs[i].name, PROJFS_ATTR_VERSION) == 0) {
+			attr = &attrs[i];
+			break;
 		}
-		res = ftruncate(fd, off);
-		if (res == -1)
-			err = errno;
-		// report error from close() unless prior ftruncate() error
-		if (close(fd) == -1)
-			res = -1;
 	}
-out:
-	return res == -1 ? -(err > 0 ? err : errno) : 0;
+	if (attr == NULL || attr->value == NULL || attr->size <= 0)
+		return 0;
+
+	value = malloc(attr->size);
+	if (value == NULL)
+		return 0;
+
+	// ERANGE from a longer recorded version is also a mismatch
+	size = fgetxattr(fd, PROJ_VERSION_XATTR_NAME, value, attr->size);
+	match = (size == attr->size &&
+		 memcmp(value, attr->value, size) == 0);
+
+	free(value);
+	return match;
 }
 
-static int projfs_op_utimens(char const *path, const struct timespec tv[2],
-                             struct fuse_file_info *fi)
+/**
+ * Lock the placeholder of an update or delete operation, and check
+ * whether it may be changed.
+ *
+ * @param state_lock structure to fill out; locked only if 0 is returned
+ *                   and *current is 0, so the placeholder may be changed
+ * @param fs projfs handle
+ * @param op update or delete operation
+ * @param current set to 1 if the operation needs no change, either since
+ *                the path is a symlink to be deleted, or since it is a
+ *                populated file whose content version matches that of an
+ *                update; 0 otherwise
+ * @return 0, EBUSY if the placeholder has been populated or modified, or
+ *         another errno
+ */
+static int lock_batch_placeholder(struct proj_state_lock *state_lock,
+				  struct projfs *fs,
+				  const struct projfs_batch_op *op,
+				  int *current)
 {
 	int res;
-	if (fi)
-		res = futimens(fi->fh, tv);
-	else {
-		path = make_relative_path(path);
-		res = project_dir("utimens", path, 1);
-		if (res)
-			return -res;
-		res = utimensat(get_fuse_context_lowerdir_fd(), path, tv,
-				AT_SYMLINK_NOFOLLOW);
+
+	*current = 0;
+	res = acquire_proj_state_lock(state_lock, fs, op->path,
+				      O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (res != 0) {
+		// symlinks have no projection state and may always be removed
+		if (res == ELOOP && op->type == PROJFS_BATCH_DELETE) {
+			*current = 1;
+			return 0;
+		}
+		return res;
 	}
-	return res == -1 ? -errno : 0;
+
+	if (state_lock->state == PROJ_STATE_POPULATED &&
+	    op->type == PROJFS_BATCH_UPDATE &&
+	    match_proj_version(state_lock->lock_fd, op->attrs, op->nattrs)) {
+		*current = 1;	// hydrated content remains current
+		res = 0;
+	} else if (state_lock->state != PROJ_STATE_EMPTY) {
+		res = EBUSY;
+	}
+
+	if (res != 0 || *current)
+		release_proj_state_lock(state_lock);
+	return res;
 }
 
+/**
+ * Check that the placeholder of an update or delete operation may be
+ * changed, without changing it.
+ *
+ * @param fs projfs handle
+ * @param op update or delete operation
+ * @return 0, EBUSY if the placeholder has been populated or modified, or
+ *         another errno
+ */
+static int check_batch_placeholder(struct projfs *fs,
+				   const struct projfs_batch_op *op)
+{
+	struct proj_state_lock state_lock;
+	int current, res;
+
+	res = lock_batch_placeholder(&state_lock, fs, op, &current);
+	if (res == 0 && !current)
+		release_proj_state_lock(&state_lock);
+	return res;
+}
 
-static int projfs_op_setxattr(char const *path, char const *name,
-                              char const *value, size_t size, int flags)
+/**
+ * Update or delete an empty placeholder, failing with EBUSY if the
+ * placeholder has been populated or modified, unless it is a populated
+ * file whose content version matches that of an update.
+ *
+ * @param fs projfs handle
+ * @param op update or delete operation
+ * @return 0 or an errno
+ */
+static int batch_proj_placeholder(struct projfs *fs,
+				  const struct projfs_batch_op *op)
 {
-	int res = -1;
-	int err = 0;
-	int fd;
+	char self_fd_path[MAX_PROC_SELF_FD_PATH_LEN + 1];
+	struct proj_state_lock state_lock;
+	struct stat st;
+	int reset_mode = 0;
+	int lock_fd, fd;
+	int current, res;
 
-	if (xattr_name_has_prefix(name))
-		return -EPERM;
+	res = lock_batch_placeholder(&state_lock, fs, op, &current);
+	if (res != 0)
+		return res;
+	if (current) {
+		if (op->type == PROJFS_BATCH_DELETE &&
+		    unlinkat(fs->lowerdir_fd, op->path, 0) == -1)
+			return errno;
+		return 0;
+	}
 
-	path = make_relative_path(path);
-	res = project_dir("setxattr", path, 1);
-	if (res)
-		return -res;
+	lock_fd = state_lock.lock_fd;
 
-	fd = openat(get_fuse_context_lowerdir_fd(), path,
-		    O_WRONLY | O_NONBLOCK);
-	if (fd == -1)
-		goto out;
-	res = fsetxattr(fd, name, value, size, flags);
-	if (res == -1)
-		err = errno;
-	// report error from close() unless prior fsetxattr() error
-	if (close(fd) == -1)
-		res = -1;
-out:
-	return res == -1 ? -(err > 0 ? err : errno) : 0;
-}
+	if (fstat(lock_fd, &st) == -1) {
+		res = errno;
+		goto out_release;
+	}
 
-static int projfs_op_getxattr(char const *path, char const *name,
-                              char *value, size_t size)
-{
-	ssize_t res = -1;
-	int err = 0;
-	int fd;
+	if (op->type == PROJFS_BATCH_DELETE) {
+		if (unlinkat(fs->lowerdir_fd, op->path,
+			     S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) == -1)
+			res = errno;
+		goto out_release;
+	}
 
-	path = make_relative_path(path);
-	res = project_dir("getxattr", path, 1);
-	if (res)
-		return -res;
+	// fsetxattr() requires S_IWUSR, so check and temporarily set if needed
+	reset_mode = fchmod_user_write_stat(lock_fd, &st, 1);
 
-	fd = openat(get_fuse_context_lowerdir_fd(), path,
-		    O_RDONLY | O_NONBLOCK);
-	if (fd == -1)
-		goto out;
-	res = fgetxattr(fd, name, value, size);
-	if (res == -1)
-		err = errno;
-	// report error from close() unless prior fgetxattr() error
-	if (close(fd) == -1)
-		res = -1;
-out:
-	return res == -1 ? -(err > 0 ? err : errno) : res;
-}
+	if (S_ISREG(st.st_mode)) {
+		// TODO: for non-Linux, may need to use other technique
+		sprintf(self_fd_path, PROC_SELF_FD_PATH_FMT, lock_fd);
+		fd = open(self_fd_path, O_WRONLY | O_NONBLOCK);
+		if (fd == -1) {
+			res = errno;
+			goto out_mode;
+		}
+		if (ftruncate(fd, op->size) == -1)
+			res = errno;
+		close(fd);
+		if (res != 0)
+			goto out_mode;
+	}
 
-static int projfs_op_listxattr(char const *path, char *list, size_t size)
-{
-	ssize_t res = -1;
-	int err = 0;
-	int fd;
+	res = iter_user_xattrs(lock_fd, op->attrs, op->nattrs,
+			       PROJ_XATTR_WRITE | PROJ_XATTR_VERSION);
+	if (res == 0 && op->mode != 0) {
+		mode_t mode = op->mode & ~S_IFMT;
 
-	path = make_relative_path(path);
-	res = project_dir("listxattr", path, 1);
-	if (res)
-		return -res;
+		mode = enforce_user_read(mode);
+		if (fchmod(lock_fd, mode) == -1)
+			res = errno;
+		else
+			reset_mode = 0;
+	}
+
+out_mode:
+	if (reset_mode)
+		fchmod_user_write_stat(lock_fd, &st, 0);	// best effort
+out_release:
+	release_proj_state_lock(&state_lock);
+	return res;
+}
 
-	fd = openat(get_fuse_context_lowerdir_fd(), path,
-		    O_RDONLY | O_NONBLOCK);
-	if (fd == -1)
-		goto out;
-	res = flistxattr(fd, list, size);
-	if (res == -1)
-		err = errno;
-	// report error from close() unless prior flistxattr() error
-	if (close(fd) == -1)
-		res = -1;
-out:
-	return res == -1 ? -(err > 0 ? err : errno) : res;
+static int batch_proj_op(struct projfs *fs, const struct projfs_batch_op *op)
+{
+	switch (op->type) {
+	case PROJFS_BATCH_CREATE_DIR:
+		return projfs_create_proj_dir(fs, op->path, op->mode,
+					      op->attrs, op->nattrs);
+	case PROJFS_BATCH_CREATE_FILE:
+		return projfs_create_proj_file(fs, op->path, op->size,
+					       op->mode, op->attrs,
+					       op->nattrs);
+	default:
+		return batch_proj_placeholder(fs, op);
+	}
 }
 
-static int projfs_op_removexattr(char const *path, char const *name)
+static void batch_check_group(void *data, size_t idx)
 {
-	int res = -1;
-	int err = 0;
-	int fd;
+	struct batch_ctx *ctx = (struct batch_ctx *)data;
+	struct batch_group *group = &ctx->groups[idx];
+	unsigned int i;
 
-	if (xattr_name_has_prefix(name))
-		return -EPERM;
+	if (group->entries[0].pass == BATCH_PASS_CREATE)
+		return;
 
-	path = make_relative_path(path);
-	res = project_dir("removexattr", path, 1);
-	if (res)
-		return -res;
+	for (i = 0; i < group->count; ++i) {
+		struct projfs_batch_op *op = group->entries[i].op;
 
-	fd = openat(get_fuse_context_lowerdir_fd(), path,
-		    O_WRONLY | O_NONBLOCK);
-	if (fd == -1)
-		goto out;
-	res = fremovexattr(fd, name);
-	if (res == -1)
-		err = errno;
-	// report error from close() unless prior fremovexattr() error
-	if (close(fd) == -1)
-		res = -1;
-out:
-	return res == -1 ? -(err > 0 ? err : errno) : 0;
+		op->result = check_batch_placeholder(ctx->fs, op);
+	}
 }
 
-static int projfs_op_access(char const *path, int mode)
+static void batch_proj_group(void *data, size_t idx)
 {
+	struct batch_ctx *ctx = (struct batch_ctx *)data;
+	struct batch_group *group = &ctx->groups[idx];
+	struct proj_state_lock dir_lock;
+	char *parent;
+	unsigned int i;
 	int res;
 
-	path = make_relative_path(path);
-	res = project_dir("access", path, 1);
-	if (res)
-		return -res;
-	res = faccessat(get_fuse_context_lowerdir_fd(), path, mode,
-			AT_SYMLINK_NOFOLLOW);
-	return res == -1 ? -errno : 0;
-}
+	parent = get_path_parent(group->entries[0].op->path);
+	if (parent == NULL) {
+		res = errno;
+		goto out_fail;
+	}
 
-static int projfs_op_flock(char const *path, struct fuse_file_info *fi, int op)
-{
-	int res = flock(fi->fh, op);
+	/* hold the parent directory's lock, as taken by project_dir() in
+	 * file ops on its entries, while we apply this group's operations
+	 */
+	res = acquire_proj_state_lock(&dir_lock, ctx->fs, parent,
+				      O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	free(parent);
+	if (res != 0)
+		goto out_fail;
 
-	(void)path;
-	return res == -1 ? -errno : 0;
+	for (i = 0; i < group->count; ++i) {
+		struct batch_entry *entry = &group->entries[i];
+
+		entry->op->result = batch_proj_op(ctx->fs, entry->op);
+		if (entry->op->result == 0 && entry->pass != BATCH_PASS_UPDATE)
+			group->changed = 1;
+	}
+
+	release_proj_state_lock(&dir_lock);
+	return;
+
+out_fail:
+	for (i = 0; i < group->count; ++i)
+		group->entries[i].op->result = res;
 }
 
-static int projfs_op_fallocate(char const *path, int mode, off_t off,
-                               off_t len, struct fuse_file_info *fi)
+#ifdef HAVE_FUSE_INVALIDATE_PATH
+static void invalidate_path(struct fuse *fuse, const char *path, size_t len)
 {
-	(void)path;
-	if (mode)
-		return -EOPNOTSUPP;
-	return -posix_fallocate(fi->fh, off, len);
-}
+	char *fuse_path;
 
-static struct fuse_operations projfs_ops = {
-	.getattr	= projfs_op_getattr,
-	.readlink	= projfs_op_readlink,
-	.mknod		= projfs_op_mknod,
-	.mkdir		= projfs_op_mkdir,
-	.unlink		= projfs_op_unlink,
-	.rmdir		= projfs_op_rmdir,
-	.symlink	= projfs_op_symlink,
-	.rename		= projfs_op_rename,
-	.link		= projfs_op_link,
-	.chmod		= projfs_op_chmod,
-	.chown		= projfs_op_chown,
-	.truncate	= projfs_op_truncate,
-	.open		= projfs_op_open,
-	.statfs		= projfs_op_statfs,
-	.flush		= projfs_op_flush,
-	.release	= projfs_op_release,
-	.fsync		= projfs_op_fsync,
-	.setxattr	= projfs_op_setxattr,
-	.getxattr	= projfs_op_getxattr,
-	.listxattr	= projfs_op_listxattr,
-	.removexattr	= projfs_op_removexattr,
-	.opendir	= projfs_op_opendir,
-	.readdir	= projfs_op_readdir,
-	.releasedir	= projfs_op_releasedir,
-	.init		= projfs_op_init,
-	.access		= projfs_op_access,
-	.create		= projfs_op_create,
-	.utimens	= projfs_op_utimens,
-	.write_buf	= projfs_op_write_buf,
-	.read_buf	= projfs_op_read_buf,
-	.flock		= projfs_op_flock,
-	.fallocate	= projfs_op_fallocate,
-	// copy_file_range
-};
+	fuse_path = malloc(len + 2);
+	if (fuse_path == NULL)
+		return;		// best effort
 
-static void projfs_set_session(struct projfs *fs, struct fuse_session *se)
+	fuse_path[0] = '/';
+	memcpy(fuse_path + 1, path, len);
+	fuse_path[len + 1] = '\0';
+
+	// ignore errors, including ENOENT for paths unknown to the kernel
+	(void)fuse_invalidate_path(fuse, fuse_path);
+	free(fuse_path);
+}
+#endif
+
+/**
+ * Invalidate any kernel caches for the paths changed by a batch, and
+ * for the directories to which entries were added or from which they
+ * were removed, in a single pass.
+ *
+ * The kernel may need to wait for file operations to complete before
+ * it can drop its caches, so fs->mutex is held only while taking a use
+ * of the session, which keeps it from being destroyed meanwhile.
+ */
+static void batch_invalidate(struct projfs *fs, struct batch_group *groups,
+			     unsigned int ngroups)
 {
-	if (fs == NULL)
+#ifdef HAVE_FUSE_INVALIDATE_PATH
+	struct fuse *fuse;
+	unsigned int i, j;
+
+	pthread_mutex_lock(&fs->mutex);
+	fuse = fs->fuse;
+	if (fuse != NULL)
+		++fs->fuse_users;
+	pthread_mutex_unlock(&fs->mutex);
+	if (fuse == NULL)
 		return;
 
+	for (i = 0; i < ngroups; ++i) {
+		struct batch_group *group = &groups[i];
+
+		for (j = 0; j < group->count; ++j) {
+			const struct projfs_batch_op *op =
+				group->entries[j].op;
+
+			if (op->result == 0)
+				invalidate_path(fuse, op->path,
+						strlen(op->path));
+		}
+		if (group->changed)
+			invalidate_path(fuse, group->entries[0].op->path,
+					group->entries[0].parent_len);
+	}
+
 	pthread_mutex_lock(&fs->mutex);
-	fs->session = se;
+	if (--fs->fuse_users == 0)
+		pthread_cond_broadcast(&fs->fuse_idle);
 	pthread_mutex_unlock(&fs->mutex);
+#else
+	(void)fs;
+	(void)groups;
+	(void)ngroups;
+#endif
 }
 
-struct projfs *projfs_new(const char *lowerdir, const char *mountdir,
-		const struct projfs_handlers *handlers,
-		size_t handlers_size, void *user_data,
-		int argc, const char **argv)
+int projfs_batch_proj(struct projfs *fs, struct projfs_batch_op *ops,
+		      unsigned int nops, unsigned int nthreads)
 {
-	struct projfs *fs = NULL;
-	size_t len;
-	int i;
+	struct batch_entry *entries;
+	struct batch_group *groups;
+	struct batch_ctx ctx;
+	unsigned int nentries = 0, ngroups = 0;
+	unsigned int i, end;
+	int res = 0;
 
-	// TODO: prevent failure with relative lowerdir
-	if (lowerdir == NULL) {
-		log_printf(fs, LOG_STDERR_ONLY, "no lowerdir specified");
-		goto out;
-	}
+	if (nops == 0)
+		return 0;
+	if (ops == NULL)
+		return EINVAL;
 
-	// TODO: debug failure to exit when given a relative mountdir
-	if (mountdir == NULL) {
-		log_printf(fs, LOG_STDERR_ONLY, "no mountdir specified");
-		goto out;
-	}
+	nthreads = get_nthreads(nthreads);
 
-	if (sizeof(struct projfs_handlers) < handlers_size) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "warning: library too old, some handlers "
-			   "may be ignored");
-		handlers_size = sizeof(struct projfs_handlers);
-	}
+	entries = calloc(nops, sizeof(*entries));
+	if (entries == NULL)
+		return errno;
 
-	fs = calloc(1, sizeof(struct projfs));
-	if (fs == NULL) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "failed to allocate projfs object");
-		goto out;
+	groups = calloc(nops, sizeof(*groups));
+	if (groups == NULL) {
+		res = errno;
+		goto out_entries;
 	}
 
-	fs->lowerdir = strdup(lowerdir);
-	if (fs->lowerdir == NULL) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "failed to allocate lower path");
-		goto out_handle;
-	}
-	len = strlen(fs->lowerdir);
-	if (len && fs->lowerdir[len - 1] == '/')
-		fs->lowerdir[len - 1] = 0;
+	for (i = 0; i < nops; ++i) {
+		struct projfs_batch_op *op = &ops[i];
+		struct batch_entry *entry = &entries[nentries];
 
-	fs->mountdir = strdup(mountdir);
-	if (fs->mountdir == NULL) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "failed to allocate mount path");
-		goto out_lower;
+		op->result = 0;
+		if (!check_safe_rel_path(op->path) ||
+		    get_batch_pass(op->type, &entry->pass) == -1) {
+			op->result = EINVAL;
+			continue;
+		}
+
+		entry->op = op;
+		entry->depth = get_path_depth(op->path);
+		entry->parent_len = get_path_parent_len(op->path);
+		++nentries;
 	}
-	len = strlen(fs->mountdir);
-	if (len && fs->mountdir[len - 1] == '/')
-		fs->mountdir[len - 1] = 0;
 
-	if (handlers != NULL)
-		memcpy(&fs->handlers, handlers, handlers_size);
+	qsort(entries, nentries, sizeof(*entries), cmp_batch_entries);
 
-	fs->user_data = user_data;
+	for (i = 0; i < nentries; ++i) {
+		if (i == 0 || cmp_batch_entries(&entries[i - 1],
+						&entries[i]) != 0) {
+			groups[ngroups++].entries = &entries[i];
+		}
+		++groups[ngroups - 1].count;
+	}
 
-	if (pthread_mutex_init(&fs->mutex, NULL) > 0)
-		goto out_mount;
+	ctx.fs = fs;
+	ctx.groups = groups;
 
-	fs->fdtable = fdtable_create();
-	if (fs->fdtable == NULL) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "failed to allocate file descriptor table");
-		goto out_mutex;
+	/* check every placeholder to be updated or deleted before changing
+	 * any, so that a conflict leaves the whole batch unapplied
+	 */
+	workpool_run(nthreads, ngroups, batch_check_group, &ctx);
+	for (i = 0; i < nops; ++i) {
+		if (ops[i].result != 0) {
+			res = ops[i].result;
+			break;
+		}
+	}
+	if (res != 0) {
+		for (i = 0; i < nops; ++i) {
+			if (ops[i].result == 0)
+				ops[i].result = ECANCELED;
+		}
+		goto out_groups;
 	}
 
-	if (fuse_opt_add_arg(&fs->args, "projfs") != 0) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "failed to allocate argument");
-		goto out_fdtable;
+	/* groups within a level (pass and depth) are independent and may be
+	 * applied in parallel, but each level must complete before the next
+	 */
+	for (i = 0; i < ngroups; i = end) {
+		end = i + 1;
+		while (end < ngroups &&
+		       cmp_batch_level(groups[i].entries,
+				       groups[end].entries) == 0)
+			++end;
+
+		ctx.groups = &groups[i];
+		workpool_run(nthreads, end - i, batch_proj_group, &ctx);
 	}
 
-	for (i = 0; i < argc; ++i) {
-		if (fuse_opt_add_arg(&fs->args, argv[i]) != 0) {
-			log_printf(fs, LOG_STDERR_ONLY,
-				   "failed to allocate argument");
-			goto out_fdtable;
+	batch_invalidate(fs, groups, ngroups);
+
+	for (i = 0; i < nops; ++i) {
+		if (ops[i].result != 0) {
+			res = ops[i].result;
+			break;
 		}
 	}
 
-	if (fuse_opt_parse(&fs->args, &fs->config, projfs_opts, NULL) == -1) {
-		log_printf(fs, LOG_STDERR_ONLY,
-			   "unable to parse arguments");
-		goto out_fdtable;
-	}
+out_groups:
+	free(groups);
+out_entries:
+	free(entries);
+	return res;
+}
 
-	return fs;
+#define WALK_BATCH 32
 
-out_fdtable:
-	fuse_opt_free_args(&fs->args);
-	fdtable_destroy(fs->fdtable);
+#define PROJFS_STATE_MASK (PROJFS_STATE_EMPTY | PROJFS_STATE_POPULATED | \
+			   PROJFS_STATE_MODIFIED)
 
-out_mutex:
-	pthread_mutex_destroy(&fs->mutex);
-out_mount:
-	free(fs->mountdir);
-out_lower:
-	free(fs->lowerdir);
-out_handle:
-	free(fs);
-out:
-	return NULL;
+/* Directory waiting to be listed by a walk thread */
+struct walk_dir {
+	struct walk_dir *next;
+	enum proj_state state;		/* PROJ_STATE_ERROR if not read */
+	char path[];			/* relative to lowerdir */
+};
+
+struct walk_ctx {
+	int (*list_dir)(struct walk_ctx *ctx, const struct walk_dir *dir);
+	int lowerdir_fd;
+	int clone_fd;			/* destination of a lowerdir clone */
+	unsigned int filter;		/* PROJFS_WALK_* or PROJFS_CLONE_* */
+	projfs_walk_func_t callback;
+	void *data;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;
+	struct walk_dir *dirs;		/* stack of directories to list */
+	unsigned int busy;		/* threads listing a directory */
+	int err;			/* first failure, ends the walk */
+};
+
+/**
+ * Queue a directory to be listed by the next idle walk thread.
+ *
+ * @return 0 or an errno
+ */
+static int push_walk_dir(struct walk_ctx *ctx, const char *path,
+			 enum proj_state state)
+{
+	size_t len = strlen(path) + 1;
+	struct walk_dir *dir;
+
+	dir = malloc(sizeof(*dir) + len);
+	if (dir == NULL)
+		return errno;
+	dir->state = state;
+	memcpy(dir->path, path, len);
+
+	pthread_mutex_lock(&ctx->mutex);
+	dir->next = ctx->dirs;
+	ctx->dirs = dir;
+	pthread_cond_signal(&ctx->ready);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	return 0;
 }
 
-void *projfs_get_user_data(struct projfs *fs)
-{
-	return fs->user_data;
+// read xattrs through the directory's /proc link, resolving only the name
+static ssize_t lgetxattr_at(int dirfd, const char *name, const char *xname,
+			    void *value, size_t size)
+{
+	char path[MAX_PROC_SELF_FD_PATH_LEN + PATH_MAX + 1];
+
+	sprintf(path, PROC_SELF_FD_PATH_FMT "/%s", dirfd, name);
+	return lgetxattr(path, xname, value, size);
+}
+
+static enum proj_state get_proj_state_at(int dirfd, const char *name)
+{
+	char value;
+
+	if (lgetxattr_at(dirfd, name, PROJ_STATE_XATTR_NAME,
+			 &value, sizeof(value)) == -1) {
+		if (errno == ENOATTR)
+			return PROJ_STATE_MODIFIED;
+		return PROJ_STATE_ERROR;
+	}
+
+	return parse_proj_state(value);
+}
+
+static int has_holes_at(int dirfd, const char *name, off_t size)
+{
+	off_t hole;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1)
+		return 0;
+	hole = lseek(fd, 0, SEEK_HOLE);
+	close(fd);
+
+	return (hole != -1 && hole < size);
 }
 
-#define SPARSE_TEST_FILENAME ".libprojfs-sparse-test"
-#define SPARSE_TEST_SIZE_BYTES 1048576
-
 /**
- * Test that using ftruncate to create a sparse file works.
- *
- * @return 1 if sparse files function as expected, 0 if not, -1 if an error
- * occurred during testing (in which case errno is set).
+ * @return PROJFS_FSCK_* flags for any inconsistencies in the projection
+ *         state of a directory entry
  */
-static int test_sparse_support(int lowerdir_fd)
+static unsigned int check_walk_entry(const struct walk_dir *dir, int dirfd,
+				     const char *name, const struct stat *st,
+				     enum proj_state state)
 {
-	struct stat attrs;
-	int fd, res;
+	unsigned int problems = 0;
 
-	fd = openat(lowerdir_fd, SPARSE_TEST_FILENAME,
-		    (O_CREAT | O_TRUNC | O_RDWR), 0600);
-	if (fd == -1)
-		return -1;
+	// directories are never populated, only modified
+	if (state == PROJ_STATE_ERROR ||
+	    (state == PROJ_STATE_POPULATED && S_ISDIR(st->st_mode)))
+		return PROJFS_FSCK_STATE;
 
-	res = fstat(fd, &attrs);
-	if (res == -1)
-		goto err_close;
+	if (state == PROJ_STATE_POPULATED && S_ISREG(st->st_mode) &&
+	    has_holes_at(dirfd, name, st->st_size))
+		problems |= PROJFS_FSCK_HOLES;
 
-	if (attrs.st_size != 0) {
-		errno = EINVAL;
-		goto err_close;
-	}
+	// the version is removed once an entry is modified
+	if (state == PROJ_STATE_MODIFIED &&
+	    lgetxattr_at(dirfd, name, PROJ_VERSION_XATTR_NAME, NULL, 0) != -1)
+		problems |= PROJFS_FSCK_VERSION;
 
-	res = ftruncate(fd, SPARSE_TEST_SIZE_BYTES);
-	if (res == -1)
-		goto err_close;
+	/* file ops project a directory before any of its entries, but
+	 * providers may create symlinks, which have no state, in it
+	 */
+	if (dir->state == PROJ_STATE_EMPTY && state != PROJ_STATE_EMPTY &&
+	    !S_ISLNK(st->st_mode))
+		problems |= PROJFS_FSCK_PARENT;
 
-	res = fstat(fd, &attrs);
-	if (res == -1)
-		goto err_close;
+	return problems;
+}
 
-	if (attrs.st_size != SPARSE_TEST_SIZE_BYTES) {
-		errno = EINVAL;
-		goto err_close;
-	}
+/**
+ * Report a directory entry to the walk's callback, if it passes the walk's
+ * filter, and then queue it to be listed if it is a directory.
+ *
+ * @return 0 or an errno, or the callback's non-zero result
+ */
+static int walk_entry(struct walk_ctx *ctx, const struct walk_dir *dir,
+		      int dirfd, const char *name, const struct stat *st)
+{
+	enum proj_state state = PROJ_STATE_ERROR;
+	unsigned int mask = ctx->filter & PROJFS_STATE_MASK;
+	struct projfs_walk_entry entry;
+	char *path;
+	int res = 0;
 
-	res = attrs.st_blocks == 0;
+	if (strcmp(dir->path, ".") == 0)
+		path = strdup(name);
+	else if (asprintf(&path, "%s/%s", dir->path, name) == -1)
+		path = NULL;
+	if (path == NULL)
+		return ENOMEM;
 
-	goto close;
+	// only read the projection state if required
+	if (ctx->filter != 0)
+		state = get_proj_state_at(dirfd, name);
 
-err_close:
-	res = -1;
+	entry.path = path;
+	entry.st = st;
+	entry.state = (state == PROJ_STATE_ERROR) ? 0 : 1 << state;
+	entry.problems = 0;
+	if (ctx->filter & PROJFS_WALK_FSCK)
+		entry.problems = check_walk_entry(dir, dirfd, name, st, state);
 
-close:
-	close(fd);
-	unlinkat(lowerdir_fd, SPARSE_TEST_FILENAME, 0);
+	if ((mask == 0 || (entry.state & mask)) &&
+	    (!(ctx->filter & PROJFS_WALK_FSCK) || entry.problems != 0))
+		res = ctx->callback(&entry, ctx->data);
+
+	if (res == 0 && S_ISDIR(st->st_mode))
+		res = push_walk_dir(ctx, path, state);
 
+	free(path);
 	return res;
 }
 
-static void *projfs_loop(void *data)
+/**
+ * Read the next batch of entry names from a directory, skipping "." and
+ * ".." and our private entries.
+ *
+ * @param d directory stream to read
+ * @param root 1 if the directory is lowerdir itself; 0 otherwise
+ * @param names_buf buffer for up to WALK_BATCH names
+ * @param names array to fill out with pointers to each name read
+ * @param err set to an errno if reading fails
+ * @return number of names read, which is less than WALK_BATCH only at the
+ *         end of the directory or on failure
+ */
+static unsigned int read_dir_batch(DIR *d, int root,
+				   char names_buf[][NAME_MAX + 1],
+				   const char **names, int *err)
 {
-	struct projfs *fs = (struct projfs *)data;
-	struct fuse_loop_config loop;
-	struct fuse *fuse;
-	struct fuse_session *se;
-	int res = 0;
-	int err;
-
-	// TODO: verify the way we're setting signal handlers on the underlying
-	// session works correctly when using the high-level API
+	struct dirent *ent;
+	unsigned int n = 0;
 
-	/* open lower directory file descriptor to resolve relative paths
-	 * in file ops
-	 */
-	fs->lowerdir_fd = open(fs->lowerdir,
-			       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-	if (fs->lowerdir_fd == -1) {
-		log_printf(fs, LOG_STDERR_FALLBACK,
-			   "failed to open lowerdir: %s: %s",
-			   fs->lowerdir, strerror(errno));
-		res = 1;
-		goto out;
+	while (n < WALK_BATCH) {
+		errno = 0;
+		ent = readdir(d);
+		if (ent == NULL) {
+			*err = errno;
+			break;
+		}
+		if (strcmp(ent->d_name, ".") == 0 ||
+		    strcmp(ent->d_name, "..") == 0 ||
+		    is_private_name(ent->d_name, root))
+			continue;
+
+		strcpy(names_buf[n], ent->d_name);
+		names[n] = names_buf[n];
+		++n;
 	}
 
-	if (get_proj_state_xattr(fs->lowerdir_fd) == PROJ_STATE_ERROR &&
-	    errno == ENOTSUP) {
-		log_printf(fs, LOG_STDERR_FALLBACK,
-			   "xattr support check on lowerdir failed: %s: %s",
-			fs->lowerdir, strerror(errno));
-		res = 2;
-		goto out_close;
-	}
+	return n;
+}
 
-	res = test_sparse_support(fs->lowerdir_fd);
-	if (res == -1) {
-		log_printf(fs, LOG_STDERR_FALLBACK,
-			   "unable to test sparse file support: %s/%s: %s",
-			   fs->lowerdir, SPARSE_TEST_FILENAME,
-			   strerror(errno));
-		res = 3;
-		goto out_close;
-	} else if (res == 0) {
-		log_printf(fs, LOG_STDERR_FALLBACK,
-			   "sparse files may not be supported by "
-			   "lower filesystem: %s", fs->lowerdir);
-	} else if (res == 1) {
-		res = 0;
-	}
+/**
+ * List a directory, reporting its entries and queueing its subdirectories,
+ * and fetching the attributes of each batch of entries together.
+ *
+ * @return 0 or an errno, or a callback's non-zero result
+ */
+static int walk_dir_entries(struct walk_ctx *ctx, const struct walk_dir *dir)
+{
+	char names_buf[WALK_BATCH][NAME_MAX + 1];
+	const char *names[WALK_BATCH];
+	struct stat attrs[WALK_BATCH];
+	int results[WALK_BATCH];
+	int root = (strcmp(dir->path, ".") == 0);
+	unsigned int i, n;
+	DIR *d;
+	int fd, res = 0;
+
+	fd = openat(ctx->lowerdir_fd, dir->path,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : errno;	// removed meanwhile
 
-	if (fs->config.initial == 1) {
-		if (set_proj_state_xattr(fs->lowerdir_fd,
-					 PROJ_STATE_EMPTY, 0) == -1) {
-			log_printf(fs, LOG_STDERR_FALLBACK,
-				   "could not set projection flag "
-				   "xattr: %s: %s",
-				   fs->lowerdir, strerror(errno));
-			res = 4;
-			goto out_close;
-		}
+	d = fdopendir(fd);
+	if (d == NULL) {
+		res = errno;
+		close(fd);
+		return res;
 	}
 
-	fuse = fuse_new(&fs->args, &projfs_ops, sizeof(projfs_ops), fs);
-	if (fuse == NULL) {
-		res = 5;
-		goto out_close;
-	}
+	do {
+		n = read_dir_batch(d, root, names_buf, names, &res);
+		uring_stat_batch(fd, names, n, attrs, results);
+
+		for (i = 0; i < n && res == 0; ++i) {
+			if (results[i] == ENOENT)
+				continue;		// removed meanwhile
+			res = results[i];
+			if (res == 0)
+				res = walk_entry(ctx, dir, fd, names[i],
+						 &attrs[i]);
+		}
+	} while (res == 0 && n == WALK_BATCH);
 
-	se = fuse_get_session(fuse);
-	projfs_set_session(fs, se);
+	closedir(d);
+	return res;
+}
 
-	// TODO: defer all signal handling to user, once we remove FUSE
-	if (fuse_set_signal_handlers(se) != 0) {
-		res = 6;
-		goto out_session;
-	}
+static void *walk_thread(void *data)
+{
+	struct walk_ctx *ctx = (struct walk_ctx *)data;
+	struct walk_dir *dir;
+	int res;
 
-	// TODO: mount with x-gvfs-hide option and maybe others for KDE, etc.
-	if (fuse_mount(fuse, fs->mountdir) != 0) {
-		res = 7;
-		goto out_signal;
-	}
+	pthread_mutex_lock(&ctx->mutex);
+	while (1) {
+		// the walk is complete once no thread may queue more dirs
+		while (ctx->dirs == NULL && ctx->busy > 0 && ctx->err == 0)
+			pthread_cond_wait(&ctx->ready, &ctx->mutex);
+		if (ctx->dirs == NULL || ctx->err != 0)
+			break;
 
-	// TODO: support configs; ideally libfuse's full suite
-	loop.clone_fd = 0;
-	loop.max_idle_threads = 10;
+		dir = ctx->dirs;
+		ctx->dirs = dir->next;
+		++ctx->busy;
+		pthread_mutex_unlock(&ctx->mutex);
 
-	// TODO: output strsignal() only for dev purposes
-	if ((err = fuse_loop_mt(fuse, &loop)) != 0) {
-		if (err > 0) {
-			log_printf(fs, LOG_STDERR_FALLBACK, "%s signal",
-				   strsignal(err));
-		}
-		res = 8;
-	}
+		res = ctx->list_dir(ctx, dir);
+		free(dir);
 
-	fuse_session_unmount(se);
-out_signal:
-	fuse_remove_signal_handlers(se);
-out_session:
-	projfs_set_session(fs, NULL);
-	fuse_session_destroy(se);
-out_close:
-	if (close(fs->lowerdir_fd) == -1) {
-		log_printf(fs, LOG_STDERR_FALLBACK,
-			   "failed to close lowerdir: %s: %s",
-			   fs->lowerdir, strerror(errno));
+		pthread_mutex_lock(&ctx->mutex);
+		--ctx->busy;
+		if (res != 0 && ctx->err == 0)
+			ctx->err = res;
+		if (ctx->busy == 0 || ctx->err != 0)
+			pthread_cond_broadcast(&ctx->ready);
 	}
-	fs->lowerdir_fd = 0;
-out:
-	fs->error = res;
+	pthread_mutex_unlock(&ctx->mutex);
 
-	pthread_exit(NULL);
+	return NULL;
 }
 
-int projfs_start(struct projfs *fs)
+/**
+ * Walk a tree from a root directory until every directory queued has been
+ * listed, or one listing fails, with the calling thread and up to
+ * nthreads - 1 others.
+ *
+ * @param ctx walk context, with all but the queue and its locks set
+ * @param root path of the root directory relative to ctx->lowerdir_fd
+ * @param state projection state of the root directory, if read
+ * @param nthreads maximum number of threads to list directories
+ * @return 0 or an errno, or a callback's non-zero result
+ */
+static int run_walk(struct walk_ctx *ctx, const char *root,
+		    enum proj_state state, unsigned int nthreads)
 {
-	sigset_t oldset;
-	sigset_t newset;
-	pthread_t thread_id;
+	struct walk_dir *dir;
+	pthread_t *threads;
+	unsigned int i, nstarted = 0;
 	int res;
 
-	if (log_open(fs) != 0)
-		return -1;
+	ctx->dirs = NULL;
+	ctx->busy = 0;
+	ctx->err = 0;
 
-	// TODO: override stack size per fuse_start_thread()?
+	res = pthread_mutex_init(&ctx->mutex, NULL);
+	if (res > 0)
+		return res;
+	res = pthread_cond_init(&ctx->ready, NULL);
+	if (res > 0)
+		goto out_mutex;
 
-	// TODO: defer all signal handling to user, once we remove FUSE
-	sigemptyset(&newset);
-	sigaddset(&newset, SIGTERM);
-	sigaddset(&newset, SIGINT);
-	sigaddset(&newset, SIGHUP);
-	sigaddset(&newset, SIGQUIT);
-	// TODO: handle error from pthread_sigmask()
-	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	res = push_walk_dir(ctx, root, state);
+	if (res > 0)
+		goto out_cond;
 
-	res = pthread_create(&thread_id, NULL, projfs_loop, fs);
+	// this thread also walks, so failure to start others is harmless
+	threads = calloc(nthreads - 1, sizeof(pthread_t));
+	for (i = 0; threads != NULL && i < nthreads - 1; ++i) {
+		if (pthread_create(&threads[i], NULL, walk_thread, ctx) > 0)
+			break;
+		++nstarted;
+	}
+	walk_thread(ctx);
+	for (i = 0; i < nstarted; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	// directories remain queued only if the walk failed
+	while ((dir = ctx->dirs) != NULL) {
+		ctx->dirs = dir->next;
+		free(dir);
+	}
+	res = ctx->err;
 
-	// TODO: report error from pthread_sigmask() but don't return -1
-	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+out_cond:
+	pthread_cond_destroy(&ctx->ready);
+out_mutex:
+	pthread_mutex_destroy(&ctx->mutex);
+	return res;
+}
 
-	if (res != 0) {
-		log_printf(fs, LOG_STDERR_FALLBACK,
-			   "error creating thread: %s", strerror(res));
-		goto out_close;
-	}
+int projfs_walk(struct projfs *fs, const char *subtree, unsigned int filter,
+		projfs_walk_func_t callback, void *data,
+		unsigned int nthreads)
+{
+	enum proj_state state = PROJ_STATE_ERROR;
+	struct walk_ctx ctx;
+	int res = 0;
 
-	fs->thread_id = thread_id;
-	return 0;
+	if (subtree == NULL || *subtree == '\0')
+		subtree = ".";
+	if (!check_safe_rel_path(subtree) || callback == NULL)
+		return EINVAL;
+	if (strlen(subtree) >= PATH_MAX)
+		return ENAMETOOLONG;
 
-out_close:
-	log_close(fs);
-	return -1;
+	// the lower directory is only held open while the filesystem runs
+	ctx.lowerdir_fd = open(fs->lowerdir,
+			       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (ctx.lowerdir_fd == -1)
+		return errno;
+	ctx.list_dir = walk_dir_entries;
+	ctx.filter = filter;
+	ctx.callback = callback;
+	ctx.data = data;
+
+	if (filter & PROJFS_WALK_FSCK) {
+		state = get_proj_state_at(ctx.lowerdir_fd, subtree);
+		if (state == PROJ_STATE_ERROR && errno != EINVAL &&
+		    errno != ERANGE)
+			res = errno;
+	}
+	if (res == 0)
+		res = run_walk(&ctx, subtree, state, get_nthreads(nthreads));
+
+	close(ctx.lowerdir_fd);
+	return res;
 }
 
-void *projfs_stop(struct projfs *fs)
+/**
+ * Copy all user xattrs, including projection states and content versions,
+ * from one file to another.
+ *
+ * @return 0 or an errno
+ */
+static int copy_user_xattrs(int src_fd, int dst_fd)
 {
-	struct stat buf;
-	void *user_data;
-
-	pthread_mutex_lock(&fs->mutex);
-	if (fs->session != NULL)
-		fuse_session_exit(fs->session);
-	pthread_mutex_unlock(&fs->mutex);
-	// TODO: barrier/fence to ensure all CPUs see exit flag?
+	char *list, *name, *value = NULL;
+	ssize_t list_size, size, value_size = 0;
+	int res = 0;
 
-	/* could send a USR1 signal and have a no-op handler installed by
-	 * projfs_loop(), but this is a simpler way to trigger fuse_do_work()
-	 * to exit, which semaphores fuse_session_loop_mt() to exit as well;
-	 * we can ignore any errors
-	 */
-	stat(fs->mountdir, &buf);
+	list_size = flistxattr(src_fd, NULL, 0);
+	if (list_size <= 0)
+		return (list_size == -1) ? errno : 0;
 
-	// TODO: use pthread_tryjoin_np() in a loop if avail (AC_CHECK_FUNCS)
-	if (fs->thread_id) {
-		pthread_join(fs->thread_id, NULL);
+	list = malloc(list_size);
+	if (list == NULL)
+		return errno;
+	list_size = flistxattr(src_fd, list, list_size);
+	if (list_size == -1) {
+		res = errno;
+		goto out_free;
 	}
 
-	if (fs->error > 0) {
-		// TODO: translate projfs_loop() codes into messages
-		log_printf(fs, LOG_STDERR_ONLY, "error from event loop: %d",
-			   fs->error);
+	for (name = list; name < list + list_size;
+	     name += strlen(name) + 1) {
+		if (strncmp(name, "user.", 5) != 0)
+			continue;
+
+		size = fgetxattr(src_fd, name, NULL, 0);
+		if (size > value_size) {
+			free(value);
+			value = malloc(size);
+			if (value == NULL) {
+				res = errno;
+				break;
+			}
+			value_size = size;
+		}
+		if (size != -1)
+			size = fgetxattr(src_fd, name, value, size);
+		if (size == -1 ||
+		    fsetxattr(dst_fd, name, value, size, XATTR_CREATE) == -1) {
+			res = errno;
+			break;
+		}
 	}
 
-	log_close(fs);
+	free(value);
+out_free:
+	free(list);
+	return res;
+}
+
+static int clone_file(int src_dirfd, int dst_dirfd, const char *name,
+		      const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	int src_fd, dst_fd, res = 0;
 
-	fuse_opt_free_args(&fs->args);
+	src_fd = openat(src_dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (src_fd == -1)
+		return (errno == ENOENT) ? 0 : errno;	// removed meanwhile
 
-	fdtable_destroy(fs->fdtable);
+	// allow xattrs to be written until the permissions are set below
+	dst_fd = openat(dst_dirfd, name, O_WRONLY | O_CREAT | O_EXCL,
+			S_IRUSR | S_IWUSR);
+	if (dst_fd == -1) {
+		res = errno;
+		goto out_close;
+	}
 
-	pthread_mutex_destroy(&fs->mutex);
+	// empty placeholders have no content, and others share it if able
+	if (get_proj_state_xattr(src_fd) == PROJ_STATE_EMPTY) {
+		if (ftruncate(dst_fd, st->st_size) == -1)
+			res = errno;
+	} else if (ioctl(dst_fd, FICLONE, src_fd) == -1) {
+		res = copy_file_data(src_fd, dst_fd, st->st_size);
+	}
 
-	free(fs->mountdir);
-	free(fs->lowerdir);
+	if (res == 0)
+		res = copy_user_xattrs(src_fd, dst_fd);
+	if (res == 0 && (fchmod(dst_fd, st->st_mode & 07777) == -1 ||
+			 futimens(dst_fd, times) == -1))
+		res = errno;
 
-	user_data = fs->user_data;
-	free(fs);
-	return user_data;
+	close(dst_fd);
+out_close:
+	close(src_fd);
+	return res;
 }
 
-static int check_safe_rel_path(const char *path)
+static int clone_symlink(int src_dirfd, int dst_dirfd, const char *name,
+			 const struct stat *st)
 {
-	const char *s = path;
-	const char *t;
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	char target[PATH_MAX];
+	ssize_t len;
 
-	if (path == NULL || *path == '/')
-		return 0;
+	len = readlinkat(src_dirfd, name, target, sizeof(target) - 1);
+	if (len == -1)
+		return (errno == ENOENT) ? 0 : errno;	// removed meanwhile
+	target[len] = '\0';
 
-	while ((s = strstr(s, "..")) != NULL) {
-		t = s + 2;
-		if ((*t == '\0' || *t == '/') &&
-		    (s == path || *(s - 1) == '/'))
-			return 0;
-		s += 2;
-	}
+	if (symlinkat(target, dst_dirfd, name) == -1 ||
+	    utimensat(dst_dirfd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+		return errno;
 
-	return 1;
+	return 0;
 }
 
-static char *make_user_xattr_name(const char *segments)
+/**
+ * Create the clone of a directory, with its xattrs, and queue it to have
+ * its entries cloned.  Its permissions and timestamps are set only once
+ * those entries have been created.
+ *
+ * @return 0 or an errno
+ */
+static int clone_dir(struct walk_ctx *ctx, const struct walk_dir *dir,
+		     int src_dirfd, int dst_dirfd, const char *name)
 {
-	char *name;
+	char *path;
+	int src_fd, dst_fd, res;
 
-	name = malloc(PROJ_XATTR_PRE_LEN + strlen(segments) + 1);
-	if (name == NULL)
-		return NULL;
+	src_fd = openat(src_dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (src_fd == -1)
+		return (errno == ENOENT) ? 0 : errno;	// removed meanwhile
 
-	memcpy(name, PROJ_XATTR_PRE_NAME, PROJ_XATTR_PRE_LEN);
-	strcpy(name + PROJ_XATTR_PRE_LEN, segments);
+	if (mkdirat(dst_dirfd, name, S_IRWXU) == -1) {
+		res = errno;
+		goto out_close;
+	}
+	dst_fd = openat(dst_dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dst_fd == -1) {
+		res = errno;
+		goto out_close;
+	}
+	res = copy_user_xattrs(src_fd, dst_fd);
+	close(dst_fd);
+	if (res > 0)
+		goto out_close;
 
-	return name;
-}
+	if (strcmp(dir->path, ".") == 0)
+		path = strdup(name);
+	else if (asprintf(&path, "%s/%s", dir->path, name) == -1)
+		path = NULL;
+	if (path == NULL) {
+		res = ENOMEM;
+		goto out_close;
+	}
+	res = push_walk_dir(ctx, path, PROJ_STATE_ERROR);
+	free(path);
 
-#define PROJ_XATTR_READ 0x00
-#define PROJ_XATTR_WRITE 0x01
-#define PROJ_XATTR_CREATE 0x02
+out_close:
+	close(src_fd);
+	return res;
+}
 
-static int iter_user_xattrs(int fd, struct projfs_attr *attrs,
-			    unsigned int nattrs, unsigned int flags)
+/**
+ * Check whether a directory holds any modified regular files.
+ *
+ * @param d directory stream to read
+ * @param fd file descriptor of the directory
+ * @param root 1 if the directory is lowerdir itself; 0 otherwise
+ * @return 1 if so, 0 if not, or -1 on error, with errno set
+ */
+static int has_modified_files(DIR *d, int fd, int root)
 {
-	int set_flags = (flags & PROJ_XATTR_CREATE) ? XATTR_CREATE : 0;
-	int res;
-	unsigned int i;
-
-	if (attrs == NULL)
-		return 0;
-
-	for (i = 0; i < nattrs; i++) {
-		char *name;
-		struct projfs_attr *attr = &attrs[i];
-
-		name = make_user_xattr_name(attr->name);
-		if (name == NULL)
-			return errno;
+	struct dirent *ent;
+	struct stat st;
+	int res = 0;
 
-		if (flags & PROJ_XATTR_WRITE) {
-			// do not permit alteration of our reserved xattrs
-			if (xattr_name_is_reserved(name)) {
-				errno = EPERM;
-				res = -1;
-			} else {
-				res = set_xattr(fd, name,
-						attr->value, &attr->size,
-						set_flags);
-			}
-		} else {
-			res = get_xattr(fd, name, attr->value, &attr->size);
+	while (res == 0) {
+		errno = 0;
+		ent = readdir(d);
+		if (ent == NULL) {
+			if (errno > 0)
+				return -1;
+			break;
+		}
+		if (is_private_name(ent->d_name, root))
+			continue;
+		if (ent->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, ent->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1)
+				continue;		// removed meanwhile
+			if (!S_ISREG(st.st_mode))
+				continue;
+		} else if (ent->d_type != DT_REG) {
+			continue;
 		}
 
-		free(name);
-		if (res == -1)
-			return errno;
+		if (get_proj_state_at(fd, ent->d_name) == PROJ_STATE_MODIFIED)
+			res = 1;
 	}
 
-	return 0;
+	rewinddir(d);
+	return res;
 }
 
-int projfs_create_proj_dir(struct projfs *fs, const char *path, mode_t mode,
-			   struct projfs_attr *attrs, unsigned int nattrs)
+/**
+ * Clone the entries of a directory, fetching the attributes of each batch
+ * of entries together, and then set the clone's permissions and timestamps.
+ *
+ * @return 0 or an errno
+ */
+static int clone_dir_entries(struct walk_ctx *ctx, const struct walk_dir *dir)
 {
-	int reset_mode;
-	int fd, res;
-
-	if (!check_safe_rel_path(path))
-		return EINVAL;
-
-	mode = enforce_user_read(mode);
-	if (mkdirat(fs->lowerdir_fd, path, mode) == -1)
-		return errno;
-
-	fd = openat(fs->lowerdir_fd, path,
-		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-	if (fd == -1)
-		return errno;
+	char names_buf[WALK_BATCH][NAME_MAX + 1];
+	const char *names[WALK_BATCH];
+	struct stat attrs[WALK_BATCH], st;
+	struct timespec times[2];
+	int results[WALK_BATCH];
+	int root = (strcmp(dir->path, ".") == 0);
+	unsigned int i, n;
+	DIR *d;
+	int src_fd, dst_fd, res = 0;
+
+	src_fd = openat(ctx->lowerdir_fd, dir->path,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (src_fd == -1)
+		return (errno == ENOENT) ? 0 : errno;	// removed meanwhile
+
+	d = fdopendir(src_fd);
+	if (d == NULL) {
+		res = errno;
+		close(src_fd);
+		return res;
+	}
 
-	reset_mode = fchmod_user_write(fd, mode, 1);
-	if (set_proj_state_xattr(fd, PROJ_STATE_EMPTY, XATTR_CREATE) == -1) {
+	dst_fd = openat(ctx->clone_fd, dir->path,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dst_fd == -1) {
 		res = errno;
-		goto out_mode;
+		goto out_close;
 	}
 
-	res = iter_user_xattrs(fd, attrs, nattrs,
-			       PROJ_XATTR_WRITE | PROJ_XATTR_CREATE);
+	// the provider will project a reset directory's entries afresh
+	if (ctx->filter & PROJFS_CLONE_RESET) {
+		res = has_modified_files(d, src_fd, root);
+		if (res == -1) {
+			res = errno;
+			goto out_close_dst;
+		}
+		if (res == 1) {
+			res = 0;
+			if (set_proj_state_xattr(dst_fd, PROJ_STATE_EMPTY,
+						 0) == -1)
+				res = errno;
+			goto out_attrs;
+		}
+	}
 
-out_mode:
-	if (reset_mode)
-		reset_mode = fchmod_user_write(fd, mode, 0);
-	close(fd);
+	do {
+		n = read_dir_batch(d, root, names_buf, names, &res);
+		uring_stat_batch(src_fd, names, n, attrs, results);
+
+		for (i = 0; i < n && res == 0; ++i) {
+			if (results[i] == ENOENT)
+				continue;		// removed meanwhile
+			res = results[i];
+			if (res > 0)
+				break;
+
+			switch (attrs[i].st_mode & S_IFMT) {
+			case S_IFDIR:
+				res = clone_dir(ctx, dir, src_fd, dst_fd,
+						names[i]);
+				break;
+			case S_IFREG:
+				res = clone_file(src_fd, dst_fd, names[i],
+						 &attrs[i]);
+				break;
+			case S_IFLNK:
+				res = clone_symlink(src_fd, dst_fd, names[i],
+						    &attrs[i]);
+				break;
+			default:
+				// other file types cannot be projected
+				break;
+			}
+		}
+	} while (res == 0 && n == WALK_BATCH);
+
+out_attrs:
+	if (res == 0 && fstat(src_fd, &st) == 0) {
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		if (fchmod(dst_fd, st.st_mode & 07777) == -1 ||
+		    futimens(dst_fd, times) == -1)
+			res = errno;
+	}
+out_close_dst:
+	close(dst_fd);
+out_close:
+	closedir(d);
 	return res;
 }
 
-int projfs_create_proj_file(struct projfs *fs, const char *path, off_t size,
-			    mode_t mode, struct projfs_attr *attrs,
-			    unsigned int nattrs)
+int projfs_clone_lowerdir(const char *src, const char *dst,
+			  unsigned int flags, unsigned int nthreads)
 {
-	int reset_mode;
-	int fd, res;
+	struct walk_ctx ctx;
+	int res;
 
-	if (!check_safe_rel_path(path))
+	if (src == NULL || dst == NULL)
 		return EINVAL;
 
-	mode = enforce_user_read(mode);
-	fd = openat(fs->lowerdir_fd, path, O_WRONLY | O_CREAT | O_EXCL, mode);
-	if (fd == -1)
+	ctx.lowerdir_fd = open(src, O_RDONLY | O_DIRECTORY);
+	if (ctx.lowerdir_fd == -1)
 		return errno;
 
-	if (ftruncate(fd, size) == -1) {
+	// the new lower directory is writable until its entries are cloned
+	if (mkdir(dst, S_IRWXU) == -1) {
 		res = errno;
 		goto out_close;
 	}
-
-	reset_mode = fchmod_user_write(fd, mode, 1);
-	if (set_proj_state_xattr(fd, PROJ_STATE_EMPTY, XATTR_CREATE) == -1) {
+	ctx.clone_fd = open(dst, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (ctx.clone_fd == -1) {
 		res = errno;
-		goto out_mode;
+		goto out_close;
 	}
+	ctx.list_dir = clone_dir_entries;
+	ctx.filter = flags;
+	ctx.callback = NULL;
+	ctx.data = NULL;
 
-	res = iter_user_xattrs(fd, attrs, nattrs,
-			       PROJ_XATTR_WRITE | PROJ_XATTR_CREATE);
+	res = copy_user_xattrs(ctx.lowerdir_fd, ctx.clone_fd);
+	if (res == 0)
+		res = run_walk(&ctx, ".", PROJ_STATE_ERROR,
+			       get_nthreads(nthreads));
 
-out_mode:
-	if (reset_mode)
-		reset_mode = fchmod_user_write(fd, mode, 0);
+	close(ctx.clone_fd);
 out_close:
-	close(fd);
-	if (res > 0)
-		unlinkat(fs->lowerdir_fd, path, 0);	// best effort
+	close(ctx.lowerdir_fd);
 	return res;
 }
 
-int projfs_create_proj_symlink(struct projfs *fs, const char *path,
-			       const char *target)
+/* File to be hydrated ahead of use, from an access profile */
+struct prefetch_file {
+	unsigned long msec;		/* first access since start */
+	size_t line;			/* position in profile */
+	char *path;
+};
+
+struct prefetch_ctx {
+	struct projfs *fs;
+	int mount_fd;
+	struct prefetch_file *files;
+};
+
+static int compare_prefetch_files(const void *a, const void *b)
 {
-	int res;
+	const struct prefetch_file *fa = a, *fb = b;
 
-	if (!check_safe_rel_path(path))
+	if (fa->msec != fb->msec)
+		return (fa->msec < fb->msec) ? -1 : 1;
+	return (fa->line < fb->line) ? -1 : (fa->line > fb->line);
+}
+
+/**
+ * Parse a line of an access profile, as written by
+ * profile_record_fuse_context(), removing its trailing newline.
+ *
+ * @return 0 or EINVAL
+ */
+static int parse_profile_line(char *line, struct prefetch_file *file)
+{
+	char *s;
+
+	errno = 0;
+	file->msec = strtoul(line, &s, 10);
+	if (errno > 0 || s == line || *s != '\t')
 		return EINVAL;
 
-	res = symlinkat(target, fs->lowerdir_fd, path);
-	if (res == -1)
-		return errno;
+	// skip the command name, which is informational only
+	s = strchr(s + 1, '\t');
+	if (s == NULL)
+		return EINVAL;
+
+	file->path = s + 1;
+	file->path[strcspn(file->path, "\n")] = '\0';
+	if (*file->path == '\0' || !check_safe_rel_path(file->path))
+		return EINVAL;
 
 	return 0;
 }
 
-static int iter_attrs(struct projfs *fs, const char *path,
-		      struct projfs_attr *attrs, unsigned int nattrs,
-		      unsigned int flags)
+/**
+ * Read an access profile, returning its files in order of first access.
+ *
+ * @return 0 or an errno
+ */
+static int read_profile(const char *profile, struct prefetch_file **files,
+			size_t *nfiles)
 {
-	int fd, res;
-	struct stat st;
+	struct prefetch_file *list = NULL, *tmp, file;
+	size_t alloc = 0, n = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *f;
+	int res = 0;
 
-	if (!check_safe_rel_path(path) || attrs == NULL)
-		return EINVAL;
+	f = fopen(profile, "r");
+	if (f == NULL)
+		return errno;
 
-	if (nattrs == 0)
-		return 0;
+	while (getline(&line, &line_size, f) != -1) {
+		res = parse_profile_line(line, &file);
+		if (res > 0)
+			break;
 
-	fd = openat(fs->lowerdir_fd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
-	if (fd == -1)
-		return errno;
+		if (n == alloc) {
+			alloc = (alloc == 0) ? 64 : alloc * 2;
+			tmp = realloc(list, alloc * sizeof(*list));
+			if (tmp == NULL) {
+				res = errno;
+				break;
+			}
+			list = tmp;
+		}
 
-	if (fstat(fd, &st) == -1) {
-		res = errno;
-		goto out_close;
+		file.line = n;
+		file.path = strdup(file.path);
+		if (file.path == NULL) {
+			res = errno;
+			break;
+		}
+		list[n++] = file;
 	}
+	if (res == 0 && ferror(f))
+		res = EIO;
 
-	if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))
-		res = iter_user_xattrs(fd, attrs, nattrs, flags);
-	else
-		res = EPERM;
+	free(line);
+	fclose(f);
 
-out_close:
-	close(fd);
-	return res;
+	if (res > 0) {
+		while (n > 0)
+			free(list[--n].path);
+		free(list);
+		return res;
+	}
+
+	qsort(list, n, sizeof(*list), compare_prefetch_files);
+	*files = list;
+	*nfiles = n;
+	return 0;
 }
 
-int projfs_get_attrs(struct projfs *fs, const char *path,
-		     struct projfs_attr *attrs, unsigned int nattrs)
+static void prefetch_file(void *data, size_t idx)
 {
-	return iter_attrs(fs, path, attrs, nattrs, PROJ_XATTR_READ);
+	struct prefetch_ctx *ctx = data;
+	int fd;
+
+	if (atomic_load(&ctx->fs->stopping))
+		return;
+
+	// opening a placeholder through the mount point hydrates it
+	fd = openat(ctx->mount_fd, ctx->files[idx].path,
+		    O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd != -1)
+		close(fd);			// errors are not reported
 }
 
-int projfs_set_attrs(struct projfs *fs, const char *path,
-		     struct projfs_attr *attrs, unsigned int nattrs)
+int projfs_prefetch_profile(struct projfs *fs, const char *profile,
+			    unsigned int nthreads)
 {
-	return iter_attrs(fs, path, attrs, nattrs, PROJ_XATTR_WRITE);
+	struct prefetch_ctx ctx;
+	size_t i, nfiles = 0;
+	int res;
+
+	if (profile == NULL)
+		return EINVAL;
+
+	res = read_profile(profile, &ctx.files, &nfiles);
+	if (res > 0)
+		return res;
+
+	ctx.fs = fs;
+	ctx.mount_fd = open(fs->mountdir, O_RDONLY | O_DIRECTORY);
+	if (ctx.mount_fd == -1) {
+		res = errno;
+		goto out_free;
+	}
+
+	// files accessed soonest are hydrated first
+	workpool_run(get_nthreads(nthreads), nfiles, prefetch_file, &ctx);
+
+	close(ctx.mount_fd);
+out_free:
+	for (i = 0; i < nfiles; ++i)
+		free(ctx.files[i].path);
+	free(ctx.files);
+	return res;
 }
@@ -0,0 +1,933 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "projfs.h"
+#include "provider.h"
+
+/*
+ * Out-of-process providers connect to a UNIX socket on which the library
+ * listens.  On connection, the library sends the provider a shared memory
+ * region and a pair of eventfds: events are passed to the provider through
+ * a single-producer, single-consumer ring in the shared region, and its
+ * replies are returned through another, with each eventfd used to wake the
+ * consumer of a ring only when it is about to sleep.  File descriptors of
+ * projection targets are passed over the socket itself.
+ *
+ * Events read from the filesystem's event queue remain in flight until the
+ * provider replies; if the provider disconnects, they are sent again to the
+ * next provider to connect.
+ */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define PROV_MAGIC 0x6a6f7270		/* "proj" */
+#define PROV_VERSION 1
+
+// ring size, and so also the maximum number of events in flight
+#define PROV_RING_SLOTS 256
+#define PROV_RING_MASK (PROV_RING_SLOTS - 1)
+
+#define PROV_CACHE_LINE 64
+
+struct prov_ring_hdr {
+	_Alignas(PROV_CACHE_LINE) _Atomic uint32_t head; /* next to consume */
+	_Alignas(PROV_CACHE_LINE) _Atomic uint32_t tail; /* next to produce */
+	_Atomic uint32_t waiting;	/* 1 if consumer may sleep */
+};
+
+struct prov_event_slot {
+	uint32_t idx;			/* in-flight index, used as token */
+	uint32_t type;
+	uint64_t mask;
+	int64_t offset;
+	int64_t length;
+	int32_t pid;
+	uint8_t has_fd;
+	uint8_t has_hash;
+	uint16_t target_off;		/* offset of target path, or 0 */
+	unsigned char content_hash[PROJFS_CONTENT_HASH_SIZE];
+	char paths[2 * PATH_MAX];	/* path and target path */
+};
+
+struct prov_reply_slot {
+	uint32_t idx;
+	int32_t result;
+};
+
+struct prov_shm {
+	struct prov_ring_hdr events_hdr;
+	struct prov_ring_hdr replies_hdr;
+	struct prov_reply_slot replies[PROV_RING_SLOTS];
+	struct prov_event_slot events[PROV_RING_SLOTS];
+};
+
+/* Sent on connection, with the shared memory and eventfd descriptors */
+struct prov_setup {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t shm_size;
+};
+
+#define PROV_SETUP_NFDS 3
+
+struct prov_inflight {
+	struct projfs_queued_event qev;
+	uint64_t seq;			/* order in which events were read */
+	int in_use;
+	int sent;			/* 1 if sent to current provider */
+};
+
+struct provider_bridge {
+	struct projfs *fs;
+	char *path;
+	int listen_fd;
+	int event_fd;			/* filesystem event queue */
+	int stop_fd;
+	int conn_fd;			/* -1 if no provider connected */
+	struct prov_shm *shm;
+	int events_efd;
+	int replies_efd;
+	struct prov_inflight inflight[PROV_RING_SLOTS];
+	unsigned int ninflight;
+	uint64_t seq;
+	pthread_t thread_id;
+};
+
+/* Provider's copy of an event, valid until the provider replies */
+struct prov_local {
+	struct projfs_queued_event qev;
+	char path[PATH_MAX];
+	char target_path[PATH_MAX];
+	unsigned char content_hash[PROJFS_CONTENT_HASH_SIZE];
+	int has_fd;
+	int in_use;
+};
+
+struct projfs_provider {
+	int sock_fd;
+	struct prov_shm *shm;
+	int events_efd;
+	int replies_efd;
+	pthread_mutex_t read_mutex;
+	pthread_mutex_t reply_mutex;
+	struct prov_local local[PROV_RING_SLOTS];
+};
+
+/**
+ * Publish the slot at the tail of a ring, waking the consumer if it may
+ * be sleeping.
+ */
+static void ring_publish(struct prov_ring_hdr *hdr, int efd)
+{
+	uint32_t tail = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+	uint64_t val = 1;
+
+	atomic_store(&hdr->tail, tail + 1);
+	if (atomic_exchange(&hdr->waiting, 0) &&
+	    write(efd, &val, sizeof(val)) == -1)
+		return;			// only fails if counter would overflow
+}
+
+/**
+ * Prepare for the consumer of a ring to sleep until it is woken through
+ * the ring's eventfd.
+ *
+ * @return 1 if the ring is empty and the consumer may sleep; 0 otherwise
+ */
+static int ring_wait(struct prov_ring_hdr *hdr)
+{
+	atomic_store(&hdr->waiting, 1);
+	if (atomic_load(&hdr->tail) ==
+	    atomic_load_explicit(&hdr->head, memory_order_relaxed))
+		return 1;
+
+	atomic_store(&hdr->waiting, 0);
+	return 0;
+}
+
+static void drain_eventfd(int efd)
+{
+	uint64_t val;
+
+	if (read(efd, &val, sizeof(val)) == -1)
+		return;			// EAGAIN if already drained
+}
+
+/**
+ * Send a message over a socket, with an optional array of file descriptors.
+ *
+ * @return 0 or an errno
+ */
+static int send_fds(int sock_fd, const void *buf, size_t len,
+		    const int *fds, unsigned int nfds)
+{
+	char cbuf[CMSG_SPACE(PROV_SETUP_NFDS * sizeof(int))];
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	while (sendmsg(sock_fd, &msg, MSG_NOSIGNAL) == -1) {
+		if (errno != EINTR)
+			return errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Receive a message of the given length from a socket, along with exactly
+ * the given number of file descriptors.
+ *
+ * @return 0 or an errno; EPROTO if the message is malformed
+ */
+static int recv_fds(int sock_fd, void *buf, size_t len,
+		    int *fds, unsigned int nfds)
+{
+	char cbuf[CMSG_SPACE(PROV_SETUP_NFDS * sizeof(int))];
+	struct iovec iov = { buf, len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	unsigned int n = 0, i;
+	ssize_t res;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		res = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1)
+		return errno;
+	if (res == 0)
+		return ECONNRESET;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS) {
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+	}
+
+	if ((size_t)res != len || n != nfds ||
+	    (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		for (i = 0; i < n && i < nfds; ++i)
+			close(fds[i]);
+		return EPROTO;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy an in-flight event into the next slot of the event ring, passing
+ * its file descriptor over the socket first if it is a file projection
+ * request.
+ *
+ * @return 0 or an errno
+ */
+static int send_event_slot(struct provider_bridge *bridge, unsigned int idx)
+{
+	struct prov_inflight *inflight = &bridge->inflight[idx];
+	struct projfs_event *event = &inflight->qev.event;
+	struct prov_ring_hdr *hdr = &bridge->shm->events_hdr;
+	struct prov_event_slot *slot;
+	uint32_t tail;
+	size_t len;
+	int res;
+
+	tail = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+	slot = &bridge->shm->events[tail & PROV_RING_MASK];
+
+	slot->idx = idx;
+	slot->type = inflight->qev.type;
+	slot->mask = event->mask;
+	slot->offset = event->offset;
+	slot->length = event->length;
+	slot->pid = event->pid;
+	slot->has_fd = (inflight->qev.type == PROJFS_EVENT_PROJ &&
+			!(event->mask & PROJFS_ONDIR));
+	slot->has_hash = (event->content_hash != NULL);
+	if (slot->has_hash)
+		memcpy(slot->content_hash, event->content_hash,
+		       PROJFS_CONTENT_HASH_SIZE);
+
+	// path lengths were checked when the event was read
+	len = strlen(event->path) + 1;
+	memcpy(slot->paths, event->path, len);
+	slot->target_off = 0;
+	if (event->target_path != NULL) {
+		slot->target_off = len;
+		strcpy(slot->paths + len, event->target_path);
+	}
+
+	if (slot->has_fd) {
+		uint32_t msg = idx;
+
+		res = send_fds(bridge->conn_fd, &msg, sizeof(msg),
+			       &event->fd, 1);
+		if (res != 0)
+			return res;
+	}
+
+	ring_publish(hdr, bridge->events_efd);
+	inflight->sent = 1;
+	return 0;
+}
+
+/**
+ * Read events from the filesystem's event queue into free in-flight
+ * entries, and send them to the provider.
+ *
+ * @return 0 or an errno if the provider could not be sent an event
+ */
+static int read_bridge_events(struct provider_bridge *bridge)
+{
+	struct projfs_queued_event qevs[PROV_RING_SLOTS];
+	struct projfs_event *event;
+	unsigned int idx = 0;
+	int i, n, res = 0;
+
+	n = projfs_read_events(bridge->fs, qevs,
+			       PROV_RING_SLOTS - bridge->ninflight);
+	for (i = 0; i < n; ++i) {
+		event = &qevs[i].event;
+		if (strlen(event->path) >= PATH_MAX ||
+		    (event->target_path != NULL &&
+		     strlen(event->target_path) >= PATH_MAX)) {
+			projfs_reply_event(qevs[i].token, -ENAMETOOLONG);
+			continue;
+		}
+
+		while (bridge->inflight[idx].in_use)
+			++idx;
+		bridge->inflight[idx].qev = qevs[i];
+		bridge->inflight[idx].seq = bridge->seq++;
+		bridge->inflight[idx].in_use = 1;
+		bridge->inflight[idx].sent = 0;
+		++bridge->ninflight;
+
+		// events not sent now will be sent to the next provider
+		if (res == 0)
+			res = send_event_slot(bridge, idx);
+	}
+
+	return res;
+}
+
+/**
+ * Pass the replies from the provider back to the filesystem's event queue.
+ */
+static void read_bridge_replies(struct provider_bridge *bridge)
+{
+	struct prov_ring_hdr *hdr = &bridge->shm->replies_hdr;
+	struct prov_reply_slot *slot;
+	struct prov_inflight *inflight;
+	uint32_t head;
+
+	drain_eventfd(bridge->replies_efd);
+
+	head = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	while (head != atomic_load(&hdr->tail)) {
+		slot = &bridge->shm->replies[head & PROV_RING_MASK];
+		if (slot->idx < PROV_RING_SLOTS) {
+			inflight = &bridge->inflight[slot->idx];
+			if (inflight->in_use && inflight->sent) {
+				projfs_reply_event(inflight->qev.token,
+						   slot->result);
+				inflight->in_use = 0;
+				--bridge->ninflight;
+			}
+		}
+		atomic_store(&hdr->head, ++head);
+	}
+}
+
+static void disconnect_provider(struct provider_bridge *bridge)
+{
+	unsigned int i;
+
+	// accept any replies sent before the provider disconnected
+	read_bridge_replies(bridge);
+
+	for (i = 0; i < PROV_RING_SLOTS; ++i)
+		bridge->inflight[i].sent = 0;
+
+	munmap(bridge->shm, sizeof(struct prov_shm));
+	close(bridge->replies_efd);
+	close(bridge->events_efd);
+	close(bridge->conn_fd);
+	bridge->shm = NULL;
+	bridge->conn_fd = -1;
+}
+
+/**
+ * Accept a provider's connection, send it the shared memory region and
+ * eventfds, and send it any events left in flight by a previous provider,
+ * in the order they were originally read.
+ *
+ * @return 0 or an errno
+ */
+static int accept_provider(struct provider_bridge *bridge)
+{
+	struct prov_setup setup;
+	int fds[PROV_SETUP_NFDS];
+	uint64_t min_seq;
+	unsigned int i, idx;
+	int memfd, res;
+
+	bridge->conn_fd = accept4(bridge->listen_fd, NULL, NULL,
+				  SOCK_CLOEXEC);
+	if (bridge->conn_fd == -1)
+		return errno;
+
+	memfd = syscall(SYS_memfd_create, "projfs-provider", MFD_CLOEXEC);
+	if (memfd == -1) {
+		res = errno;
+		goto out_conn;
+	}
+	if (ftruncate(memfd, sizeof(struct prov_shm)) == -1) {
+		res = errno;
+		goto out_memfd;
+	}
+	bridge->shm = mmap(NULL, sizeof(struct prov_shm),
+			   PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (bridge->shm == MAP_FAILED) {
+		res = errno;
+		goto out_memfd;
+	}
+
+	// wake the provider for any events sent before it first reads
+	atomic_store(&bridge->shm->events_hdr.waiting, 1);
+
+	bridge->events_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (bridge->events_efd == -1) {
+		res = errno;
+		goto out_shm;
+	}
+	bridge->replies_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (bridge->replies_efd == -1) {
+		res = errno;
+		goto out_events;
+	}
+
+	setup.magic = PROV_MAGIC;
+	setup.version = PROV_VERSION;
+	setup.nslots = PROV_RING_SLOTS;
+	setup.shm_size = sizeof(struct prov_shm);
+	fds[0] = memfd;
+	fds[1] = bridge->events_efd;
+	fds[2] = bridge->replies_efd;
+	res = send_fds(bridge->conn_fd, &setup, sizeof(setup),
+		       fds, PROV_SETUP_NFDS);
+	if (res != 0)
+		goto out_replies;
+	close(memfd);
+
+	for (;;) {
+		min_seq = UINT64_MAX;
+		idx = PROV_RING_SLOTS;
+		for (i = 0; i < PROV_RING_SLOTS; ++i) {
+			if (bridge->inflight[i].in_use &&
+			    !bridge->inflight[i].sent &&
+			    bridge->inflight[i].seq < min_seq) {
+				min_seq = bridge->inflight[i].seq;
+				idx = i;
+			}
+		}
+		if (idx == PROV_RING_SLOTS)
+			break;
+
+		res = send_event_slot(bridge, idx);
+		if (res != 0) {
+			disconnect_provider(bridge);
+			return res;
+		}
+	}
+
+	return 0;
+
+out_replies:
+	close(bridge->replies_efd);
+out_events:
+	close(bridge->events_efd);
+out_shm:
+	munmap(bridge->shm, sizeof(struct prov_shm));
+	bridge->shm = NULL;
+out_memfd:
+	close(memfd);
+out_conn:
+	close(bridge->conn_fd);
+	bridge->conn_fd = -1;
+	return res;
+}
+
+static void *bridge_loop(void *data)
+{
+	struct provider_bridge *bridge = data;
+	struct pollfd pfds[4];
+	char buf[1];
+	int timeout;
+
+	for (;;) {
+		memset(pfds, 0, sizeof(pfds));
+		pfds[0].fd = bridge->stop_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = (bridge->conn_fd == -1) ? bridge->listen_fd
+						     : bridge->conn_fd;
+		pfds[1].events = POLLIN;
+		pfds[2].fd = -1;
+		pfds[3].fd = -1;
+		timeout = -1;
+
+		if (bridge->conn_fd != -1) {
+			// leave events queued while too many are in flight
+			if (bridge->ninflight < PROV_RING_SLOTS)
+				pfds[2].fd = bridge->event_fd;
+			pfds[2].events = POLLIN;
+			pfds[3].fd = bridge->replies_efd;
+			pfds[3].events = POLLIN;
+			if (!ring_wait(&bridge->shm->replies_hdr))
+				timeout = 0;
+		}
+
+		if (poll(pfds, 4, timeout) == -1 && errno != EINTR)
+			break;
+
+		if (pfds[0].revents != 0)
+			break;
+
+		if (bridge->conn_fd == -1) {
+			if (pfds[1].revents != 0)
+				(void)accept_provider(bridge);
+			continue;
+		}
+
+		// providers send nothing over the socket after setup
+		if (pfds[1].revents != 0 &&
+		    (recv(bridge->conn_fd, buf, sizeof(buf),
+			  MSG_DONTWAIT) != -1 || errno != EAGAIN)) {
+			disconnect_provider(bridge);
+			continue;
+		}
+
+		read_bridge_replies(bridge);
+
+		if (pfds[2].revents != 0 && read_bridge_events(bridge) != 0)
+			disconnect_provider(bridge);
+	}
+
+	return NULL;
+}
+
+/**
+ * @return 1 if a filesystem is listening on the socket at the address
+ */
+static int socket_in_use(const struct sockaddr_un *addr)
+{
+	int fd, res;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		return 0;
+
+	// a full backlog also means the socket is live
+	res = (connect(fd, (const struct sockaddr *)addr,
+		       sizeof(*addr)) == 0 || errno == EAGAIN);
+	close(fd);
+	return res;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// remove any stale socket left by a previous mount, but not a live one
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (socket_in_use(&addr)) {
+			errno = EADDRINUSE;
+			return -1;
+		}
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	// only the user who mounted the filesystem may provide its content
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    chmod(path, S_IRUSR | S_IWUSR) == -1 ||
+	    listen(fd, 1) == -1) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+struct provider_bridge *provider_bridge_start(struct projfs *fs,
+					      const char *path, int event_fd)
+{
+	struct provider_bridge *bridge;
+	int err;
+
+	bridge = calloc(1, sizeof(*bridge));
+	if (bridge == NULL)
+		return NULL;
+
+	bridge->fs = fs;
+	bridge->event_fd = event_fd;
+	bridge->conn_fd = -1;
+
+	bridge->path = strdup(path);
+	if (bridge->path == NULL)
+		goto out_bridge;
+
+	bridge->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (bridge->stop_fd == -1)
+		goto out_path;
+
+	bridge->listen_fd = listen_socket(path);
+	if (bridge->listen_fd == -1)
+		goto out_stop;
+
+	err = pthread_create(&bridge->thread_id, NULL, bridge_loop, bridge);
+	if (err > 0) {
+		errno = err;
+		goto out_listen;
+	}
+
+	return bridge;
+
+out_listen:
+	err = errno;
+	close(bridge->listen_fd);
+	unlink(path);
+	errno = err;
+out_stop:
+	close(bridge->stop_fd);
+out_path:
+	free(bridge->path);
+out_bridge:
+	free(bridge);
+	return NULL;
+}
+
+void provider_bridge_stop(struct provider_bridge *bridge)
+{
+	uint64_t val = 1;
+	unsigned int i;
+
+	if (bridge == NULL)
+		return;
+
+	if (write(bridge->stop_fd, &val, sizeof(val)) == sizeof(val))
+		pthread_join(bridge->thread_id, NULL);
+
+	if (bridge->conn_fd != -1)
+		disconnect_provider(bridge);
+
+	/* senders stopped waiting once the filesystem began stopping, so
+	 * these replies only release the requests
+	 */
+	for (i = 0; i < PROV_RING_SLOTS; ++i) {
+		if (bridge->inflight[i].in_use)
+			projfs_reply_event(bridge->inflight[i].qev.token, -EIO);
+	}
+
+	close(bridge->listen_fd);
+	unlink(bridge->path);
+	close(bridge->stop_fd);
+	free(bridge->path);
+	free(bridge);
+}
+
+struct projfs_provider *projfs_provider_connect(const char *path)
+{
+	struct projfs_provider *prov;
+	struct sockaddr_un addr;
+	struct prov_setup setup;
+	int fds[PROV_SETUP_NFDS];
+	int err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	prov = calloc(1, sizeof(*prov));
+	if (prov == NULL)
+		return NULL;
+
+	prov->sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (prov->sock_fd == -1)
+		goto out_prov;
+	if (connect(prov->sock_fd, (struct sockaddr *)&addr,
+		    sizeof(addr)) == -1)
+		goto out_sock;
+
+	err = recv_fds(prov->sock_fd, &setup, sizeof(setup),
+		       fds, PROV_SETUP_NFDS);
+	if (err > 0) {
+		errno = err;
+		goto out_sock;
+	}
+	if (setup.magic != PROV_MAGIC || setup.version != PROV_VERSION ||
+	    setup.nslots != PROV_RING_SLOTS ||
+	    setup.shm_size != sizeof(struct prov_shm)) {
+		errno = EPROTO;
+		goto out_fds;
+	}
+
+	prov->shm = mmap(NULL, sizeof(struct prov_shm),
+			 PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (prov->shm == MAP_FAILED)
+		goto out_fds;
+	close(fds[0]);
+	prov->events_efd = fds[1];
+	prov->replies_efd = fds[2];
+
+	pthread_mutex_init(&prov->read_mutex, NULL);
+	pthread_mutex_init(&prov->reply_mutex, NULL);
+	return prov;
+
+out_fds:
+	err = errno;
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+	errno = err;
+out_sock:
+	err = errno;
+	close(prov->sock_fd);
+	errno = err;
+out_prov:
+	free(prov);
+	return NULL;
+}
+
+void projfs_provider_disconnect(struct projfs_provider *prov)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROV_RING_SLOTS; ++i) {
+		if (prov->local[i].in_use && prov->local[i].has_fd)
+			close(prov->local[i].qev.event.fd);
+	}
+
+	pthread_mutex_destroy(&prov->reply_mutex);
+	pthread_mutex_destroy(&prov->read_mutex);
+	munmap(prov->shm, sizeof(struct prov_shm));
+	close(prov->replies_efd);
+	close(prov->events_efd);
+	close(prov->sock_fd);
+	free(prov);
+}
+
+int projfs_provider_get_event_fd(struct projfs_provider *prov)
+{
+	return prov->events_efd;
+}
+
+/**
+ * Copy an event from a slot of the event ring into the provider's own
+ * storage, receiving its file descriptor if it has one.
+ *
+ * @return 0 or an errno
+ */
+static int copy_event_slot(struct projfs_provider *prov,
+			   struct prov_event_slot *slot)
+{
+	struct prov_local *local;
+	struct projfs_event *event;
+	uint32_t msg;
+	int res;
+
+	if (slot->idx >= PROV_RING_SLOTS ||
+	    slot->target_off >= PATH_MAX ||
+	    prov->local[slot->idx].in_use)
+		return EPROTO;
+
+	local = &prov->local[slot->idx];
+	event = &local->qev.event;
+	memset(event, 0, sizeof(*event));
+	event->mask = slot->mask;
+	event->pid = slot->pid;
+	event->offset = slot->offset;
+	event->length = slot->length;
+
+	strncpy(local->path, slot->paths, PATH_MAX - 1);
+	local->path[PATH_MAX - 1] = '\0';
+	event->path = local->path;
+	if (slot->target_off > 0) {
+		strncpy(local->target_path, slot->paths + slot->target_off,
+			PATH_MAX - 1);
+		local->target_path[PATH_MAX - 1] = '\0';
+		event->target_path = local->target_path;
+	}
+	if (slot->has_hash) {
+		memcpy(local->content_hash, slot->content_hash,
+		       PROJFS_CONTENT_HASH_SIZE);
+		event->content_hash = local->content_hash;
+	}
+
+	// the descriptor was sent before the slot was published
+	if (slot->has_fd) {
+		res = recv_fds(prov->sock_fd, &msg, sizeof(msg),
+			       &event->fd, 1);
+		if (res != 0)
+			return res;
+		if (msg != slot->idx) {
+			close(event->fd);
+			return EPROTO;
+		}
+	}
+
+	local->qev.type = slot->type;
+	local->qev.token = slot->idx;
+	local->has_fd = slot->has_fd;
+	local->in_use = 1;
+	return 0;
+}
+
+int projfs_provider_read_events(struct projfs_provider *prov,
+				struct projfs_queued_event *events,
+				unsigned int nevents)
+{
+	struct prov_ring_hdr *hdr = &prov->shm->events_hdr;
+	struct prov_event_slot *slot;
+	unsigned int n = 0;
+	uint32_t head;
+	uint64_t val = 1;
+	int res = 0;
+
+	pthread_mutex_lock(&prov->read_mutex);
+	drain_eventfd(prov->events_efd);
+
+	head = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	while (n < nevents) {
+		if (head == atomic_load(&hdr->tail)) {
+			if (ring_wait(hdr))
+				break;
+			continue;
+		}
+
+		slot = &prov->shm->events[head & PROV_RING_MASK];
+		res = copy_event_slot(prov, slot);
+		if (res != 0)
+			break;
+		events[n++] = prov->local[slot->idx].qev;
+		atomic_store(&hdr->head, ++head);
+	}
+
+	// keep the eventfd readable while unread events remain
+	if (n == nevents && head != atomic_load(&hdr->tail) &&
+	    write(prov->events_efd, &val, sizeof(val)) == -1)
+		res = errno;
+	pthread_mutex_unlock(&prov->read_mutex);
+
+	return (res != 0 && n == 0) ? -res : (int)n;
+}
+
+int projfs_provider_reply(struct projfs_provider *prov, uint64_t token,
+			  int result)
+{
+	struct prov_ring_hdr *hdr = &prov->shm->replies_hdr;
+	struct prov_reply_slot *slot;
+	struct prov_local *local;
+	uint32_t tail;
+
+	if (token >= PROV_RING_SLOTS || !prov->local[token].in_use)
+		return EINVAL;
+
+	// the slot may be reused as soon as the reply is published
+	local = &prov->local[token];
+	if (local->has_fd)
+		close(local->qev.event.fd);
+	local->in_use = 0;
+
+	pthread_mutex_lock(&prov->reply_mutex);
+	tail = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+	slot = &prov->shm->replies[tail & PROV_RING_MASK];
+	slot->idx = token;
+	slot->result = result;
+	ring_publish(hdr, prov->replies_efd);
+	pthread_mutex_unlock(&prov->reply_mutex);
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "sha256.h"
+
+/*
+ * A straightforward implementation of SHA-256 as specified in FIPS 180-4,
+ * sufficient for incrementally hashing file content as it is written.
+ *
+ * https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf
+ */
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define ch(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define maj(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+#define bsig0(x) (ror32(x, 2) ^ ror32(x, 13) ^ ror32(x, 22))
+#define bsig1(x) (ror32(x, 6) ^ ror32(x, 11) ^ ror32(x, 25))
+#define ssig0(x) (ror32(x, 7) ^ ror32(x, 18) ^ ((x) >> 3))
+#define ssig1(x) (ror32(x, 17) ^ ror32(x, 19) ^ ((x) >> 10))
+
+static void transform(uint32_t state[8], const unsigned char *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		w[i] = ((uint32_t)block[i * 4] << 24) |
+		       ((uint32_t)block[i * 4 + 1] << 16) |
+		       ((uint32_t)block[i * 4 + 2] << 8) |
+		       ((uint32_t)block[i * 4 + 3]);
+	}
+	for (i = 16; i < 64; ++i)
+		w[i] = ssig1(w[i - 2]) + w[i - 7] + ssig0(w[i - 15]) + w[i - 16];
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (i = 0; i < 64; ++i) {
+		t1 = h + bsig1(e) + ch(e, f, g) + k[i] + w[i];
+		t2 = bsig0(a) + maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t used = ctx->len % SHA256_BLOCK_SIZE;
+	size_t fill;
+
+	ctx->len += len;
+
+	if (used > 0) {
+		fill = SHA256_BLOCK_SIZE - used;
+		if (len < fill) {
+			memcpy(ctx->block + used, p, len);
+			return;
+		}
+		memcpy(ctx->block + used, p, fill);
+		transform(ctx->state, ctx->block);
+		p += fill;
+		len -= fill;
+	}
+
+	// hash whole blocks directly from the caller's buffer
+	while (len >= SHA256_BLOCK_SIZE) {
+		transform(ctx->state, p);
+		p += SHA256_BLOCK_SIZE;
+		len -= SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(ctx->block, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx,
+		  unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	size_t used = ctx->len % SHA256_BLOCK_SIZE;
+	uint64_t bits = ctx->len * 8;
+	int i;
+
+	ctx->block[used++] = 0x80;
+	if (used > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->block + used, 0, SHA256_BLOCK_SIZE - used);
+		transform(ctx->state, ctx->block);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+
+	for (i = 0; i < 8; ++i)
+		ctx->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+	transform(ctx->state, ctx->block);
+
+	for (i = 0; i < 8; ++i) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
@@ -0,0 +1,372 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#define USE_IO_URING 1
+#endif
+
+#include "uring.h"
+
+/*
+ * Bulk operations on the lower filesystem, such as listing a directory
+ * with the attributes of all its entries, would otherwise make one system
+ * call per entry.  Where the kernel supports io_uring, we instead submit
+ * each batch of calls together through a small ring owned by the calling
+ * thread, and wait for all their completions with a single system call.
+ *
+ * We drive the ring directly through its system calls and shared memory,
+ * rather than depend on liburing, since we need only a few operations.
+ * Each thread's ring is created on first use and destroyed when the thread
+ * exits.  If io_uring is unavailable, because of the kernel version or a
+ * seccomp policy, or a given operation is not supported, we fall back to
+ * making the equivalent plain system calls.
+ */
+
+#ifdef USE_IO_URING
+
+#define URING_ENTRIES 32
+
+struct uring {
+	int fd;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	atomic_uint *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	atomic_uint *cq_head;
+	atomic_uint *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static atomic_int uring_disabled;
+
+static void uring_destroy(void *data)
+{
+	struct uring *ring = data;
+
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	free(ring);
+}
+
+/**
+ * @return new ring, or NULL with errno set
+ */
+static struct uring *uring_create(unsigned int entries)
+{
+	struct io_uring_params params;
+	struct uring *ring;
+	int err;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd == -1) {
+		err = errno;
+		goto out_free;
+	}
+
+	ring->sq_len = params.sq_off.array +
+		       params.sq_entries * sizeof(unsigned int);
+	ring->cq_len = params.cq_off.cqes +
+		       params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		err = errno;
+		goto out_close;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			err = errno;
+			goto out_sq;
+		}
+	}
+
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		err = errno;
+		goto out_cq;
+	}
+
+	ring->sq_tail = (atomic_uint *)((char *)ring->sq_ptr +
+					params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr +
+					 params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ptr +
+					  params.sq_off.array);
+	ring->cq_head = (atomic_uint *)((char *)ring->cq_ptr +
+					params.cq_off.head);
+	ring->cq_tail = (atomic_uint *)((char *)ring->cq_ptr +
+					params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr +
+					 params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+					     params.cq_off.cqes);
+	return ring;
+
+out_cq:
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+out_sq:
+	munmap(ring->sq_ptr, ring->sq_len);
+out_close:
+	close(ring->fd);
+out_free:
+	free(ring);
+	errno = err;
+	return NULL;
+}
+
+static void uring_init_key(void)
+{
+	if (pthread_key_create(&uring_key, uring_destroy) > 0)
+		atomic_store(&uring_disabled, 1);
+}
+
+/**
+ * @return calling thread's ring, or NULL if io_uring is unavailable
+ */
+static struct uring *get_thread_uring(void)
+{
+	struct uring *ring;
+
+	pthread_once(&uring_once, uring_init_key);
+	if (atomic_load(&uring_disabled))
+		return NULL;
+
+	ring = pthread_getspecific(uring_key);
+	if (ring != NULL)
+		return ring;
+
+	ring = uring_create(URING_ENTRIES);
+	if (ring == NULL) {
+		// don't retry if the kernel lacks or forbids io_uring
+		if (errno == ENOSYS || errno == EPERM)
+			atomic_store(&uring_disabled, 1);
+		return NULL;
+	}
+
+	if (pthread_setspecific(uring_key, ring) > 0) {
+		uring_destroy(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+/**
+ * Submit the prepared entries and wait for all of them to complete,
+ * recording each result by the index held in its user data.  We must
+ * reap every completion, since the kernel may write to the caller's
+ * buffers until then.
+ *
+ * @return 0, or -1 with errno set if no entries could be submitted
+ */
+static int uring_submit_wait(struct uring *ring, unsigned int n,
+			     int *results)
+{
+	unsigned int submitted = 0, completed = 0;
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+	int res;
+
+	while (completed < n) {
+		res = syscall(__NR_io_uring_enter, ring->fd, n - submitted, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res == -1) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY)
+				continue;
+			if (submitted == 0)
+				return -1;
+			continue;
+		}
+		submitted += res;
+
+		head = atomic_load_explicit(ring->cq_head,
+					    memory_order_relaxed);
+		tail = atomic_load_explicit(ring->cq_tail,
+					    memory_order_acquire);
+		for (; head != tail; ++head, ++completed) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			results[cqe->user_data] = cqe->res;
+		}
+		atomic_store_explicit(ring->cq_head, head,
+				      memory_order_release);
+	}
+
+	return 0;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * Stat up to one ring's worth of entries through io_uring, leaving
+ * EINVAL as the result of any which the kernel could not handle so that
+ * they may be retried with plain system calls.
+ *
+ * @return 0, or -1 with errno set if the ring could not be used
+ */
+static int uring_stat_chunk(struct uring *ring, int dirfd,
+			    const char *const *names, unsigned int n,
+			    struct stat *attrs, int *results)
+{
+	struct statx stxs[URING_ENTRIES];
+	struct io_uring_sqe *sqe;
+	unsigned int i, idx, tail;
+
+	tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+	for (i = 0; i < n; ++i, ++tail) {
+		idx = tail & *ring->sq_mask;
+		sqe = &ring->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = dirfd;
+		sqe->addr = (uintptr_t)names[i];
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (uintptr_t)&stxs[i];
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->user_data = i;
+		ring->sq_array[idx] = idx;
+	}
+	atomic_store_explicit(ring->sq_tail, tail, memory_order_release);
+
+	if (uring_submit_wait(ring, n, results) == -1) {
+		// the kernel has not consumed the entries, so withdraw them
+		atomic_store_explicit(ring->sq_tail, tail - n,
+				      memory_order_release);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		// kernels before 5.6 reject the unknown opcode with EINVAL
+		results[i] = -results[i];
+		if (results[i] == 0)
+			statx_to_stat(&stxs[i], &attrs[i]);
+	}
+	return 0;
+}
+
+#endif /* USE_IO_URING */
+
+/**
+ * Stat a batch of entries of a directory without following symlinks, as
+ * if by fstatat(2), recording in results[i] zero or an errno for each.
+ */
+void uring_stat_batch(int dirfd, const char *const *names, unsigned int n,
+		      struct stat *attrs, int *results)
+{
+	unsigned int i = 0;
+
+#ifdef USE_IO_URING
+	struct uring *ring = get_thread_uring();
+	unsigned int count;
+
+	for (; ring != NULL && i < n; i += count) {
+		count = n - i;
+		if (count > URING_ENTRIES)
+			count = URING_ENTRIES;
+		if (uring_stat_chunk(ring, dirfd, names + i, count,
+				     attrs + i, results + i) == -1)
+			break;
+	}
+
+	// retry any entries the ring could not handle
+	for (count = 0; count < i; ++count) {
+		if (results[count] == EINVAL &&
+		    fstatat(dirfd, names[count], &attrs[count],
+			    AT_SYMLINK_NOFOLLOW) == 0)
+			results[count] = 0;
+	}
+#endif
+
+	for (; i < n; ++i) {
+		results[i] = (fstatat(dirfd, names[i], &attrs[i],
+				      AT_SYMLINK_NOFOLLOW) == -1) ? errno : 0;
+	}
+}
@@ -0,0 +1,118 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workpool.h"
+
+/*
+ * A minimal "parallel for" facility: workpool_run() starts up to nthreads
+ * threads (counting the caller's own thread, which also performs work)
+ * and calls func once for each index in [0, nitems), returning only when
+ * all items have been processed.
+ *
+ * Items are claimed one at a time under a mutex, so callers should size
+ * their items such that each represents a meaningful amount of work (e.g.,
+ * all the entries within one directory), and not a single system call.
+ *
+ * If we fail to start some or all of the requested threads, the remaining
+ * threads (including, in the worst case, only the caller's thread) complete
+ * the work; such failures are therefore not reported.
+ */
+
+struct workpool {
+	pthread_mutex_t mutex;
+	size_t next;
+	size_t nitems;
+	workpool_func_t func;
+	void *data;
+};
+
+static int claim_item(struct workpool *pool, size_t *idx)
+{
+	int claimed = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->next < pool->nitems) {
+		*idx = pool->next++;
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return claimed;
+}
+
+static void *work_loop(void *data)
+{
+	struct workpool *pool = (struct workpool *)data;
+	size_t idx;
+
+	while (claim_item(pool, &idx))
+		pool->func(pool->data, idx);
+
+	return NULL;
+}
+
+void workpool_run(unsigned int nthreads, size_t nitems,
+		  workpool_func_t func, void *data)
+{
+	struct workpool pool;
+	pthread_t *threads;
+	unsigned int i, nstarted = 0;
+	size_t idx;
+
+	if (nthreads > nitems)
+		nthreads = nitems;
+
+	pool.next = 0;
+	pool.nitems = nitems;
+	pool.func = func;
+	pool.data = data;
+
+	if (nthreads <= 1 || pthread_mutex_init(&pool.mutex, NULL) != 0) {
+		for (idx = 0; idx < nitems; ++idx)
+			func(data, idx);
+		return;
+	}
+
+	// the caller's thread serves as one of the workers
+	threads = calloc(nthreads - 1, sizeof(*threads));
+
+	if (threads != NULL) {
+		for (i = 0; i < nthreads - 1; ++i) {
+			if (pthread_create(&threads[i], NULL,
+					   work_loop, &pool) != 0)
+				break;
+			++nstarted;
+		}
+	}
+
+	work_loop(&pool);
+
+	for (i = 0; i < nstarted; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&pool.mutex);
+}
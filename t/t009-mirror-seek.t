@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs filesystem mirroring seek tests
+
+Check that seeking for data and holes reports the extents of a sparse
+lower file.
+'
+
+. ./test-lib.sh
+
+projfs_start test_simple source target || exit 1
+
+test_expect_success 'create sparse source file' '
+	truncate -s 1M source/sparse &&
+	printf data | dd of=source/sparse bs=4096 seek=64 conv=notrunc &&
+	"$TEST_DIRECTORY"/test_seek source/sparse 0 >seek.source &&
+	if "$TEST_DIRECTORY"/test_seek --supported &&
+	   ! grep -q "^0: [0-9]* 1048576\$" seek.source
+	then
+		test_set_prereq SEEK_HOLES
+	fi
+'
+
+test_expect_success SEEK_HOLES 'check seek for data and holes' '
+	"$TEST_DIRECTORY"/test_seek source/sparse \
+		0 262144 266240 1048575 1048576 >seek.source &&
+	"$TEST_DIRECTORY"/test_seek target/sparse \
+		0 262144 266240 1048575 1048576 >seek.target &&
+	test_cmp seek.source seek.target &&
+	grep -q "^1048576: ENXIO ENXIO\$" seek.target
+'
+
+projfs_stop || exit 1
+
+test_done
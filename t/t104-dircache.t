@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs directory cache test
+
+Check that cached directories are removed along with their subdirectories,
+and that entries loaded from a snapshot are validated on first lookup.
+'
+
+. ./test-lib.sh
+
+test_expect_success 'check directory cache operations' '
+	"$TEST_DIRECTORY/test_dircache"
+'
+
+test_done
@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs lower tree walk test
+
+Check that walks of the lower filesystem visit every entry, or only those
+in the selected projection states, and that they report entries whose
+projection state is inconsistent.
+'
+
+. ./test-lib.sh
+
+set_state () {
+	setfattr -h -n user.projection.empty -v "$2" "$1"
+}
+
+test_expect_success 'setup lower tree' '
+	mkdir -p lower/e lower/m/pd lower/.libprojfs-tmp-1-2 &&
+	touch lower/.libprojfs-cache lower/.libprojfs-data \
+		lower/m/.libprojfs-cache &&
+	set_state lower/e y &&
+	touch lower/e/f lower/e/g &&
+	set_state lower/e/f y &&
+	ln -s missing lower/e/l &&
+	echo abc >lower/m/p &&
+	set_state lower/m/p n &&
+	truncate -s 1M lower/m/h &&
+	set_state lower/m/h n &&
+	touch lower/m/v lower/m/bad &&
+	setfattr -n user.projection.version -v 1 lower/m/v &&
+	set_state lower/m/bad x &&
+	set_state lower/m/pd n &&
+	for i in $(test_seq 100)
+	do
+		touch lower/m/n$i || return 1
+	done
+'
+
+test_expect_success 'walk all entries' '
+	"$TEST_DIRECTORY/test_walk" lower 0 4 >walk.out &&
+	test $(wc -l <walk.out) -eq 112 &&
+	test $(grep -c " 0 0 " walk.out) -eq 112 &&
+	grep -q " 0 0 .libprojfs-data\$" walk.out &&
+	grep -q " 0 0 m/.libprojfs-cache\$" walk.out &&
+	! grep -e libprojfs-tmp -e " .libprojfs-cache\$" walk.out
+'
+
+test_expect_success 'walk entries by projection state' '
+	cat >expect.empty <<-EOF &&
+	- 0x1 0 e/f
+	d 0x1 0 e
+	EOF
+	"$TEST_DIRECTORY/test_walk" lower 0x1 4 | sort >walk.out &&
+	test_cmp expect.empty walk.out &&
+	cat >expect.populated <<-EOF &&
+	- 0x2 0 m/h
+	- 0x2 0 m/p
+	d 0x2 0 m/pd
+	EOF
+	"$TEST_DIRECTORY/test_walk" lower 0x2 4 | sort >walk.out &&
+	test_cmp expect.populated walk.out &&
+	"$TEST_DIRECTORY/test_walk" lower 0x4 4 >walk.out &&
+	test $(wc -l <walk.out) -eq 106
+'
+
+test_expect_success 'walk subtree' '
+	cat >expect.subtree <<-EOF &&
+	- 0x1 0 e/f
+	- 0x4 0 e/g
+	- 0x4 0 e/l
+	EOF
+	"$TEST_DIRECTORY/test_walk" lower 0x7 1 e | sort >walk.out &&
+	test_cmp expect.subtree walk.out &&
+	test_must_fail "$TEST_DIRECTORY/test_walk" lower 0 1 ../lower
+'
+
+test_expect_success 'check inconsistent entries' '
+	cat >expect.fsck <<-EOF &&
+	- 0 0x1 m/bad
+	- 0x2 0x2 m/h
+	- 0x4 0x4 m/v
+	- 0x4 0x8 e/g
+	d 0x2 0x1 m/pd
+	EOF
+	"$TEST_DIRECTORY/test_walk" lower 0x100 4 | sort >walk.out &&
+	test_cmp expect.fsck walk.out
+'
+
+test_done
@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs lower directory clone test
+
+Check that clones of a lower directory preserve its content, projection
+states, and file attributes, and that modified directories may be reset
+to empty placeholders instead.
+'
+
+. ./test-lib.sh
+
+set_state () {
+	setfattr -h -n user.projection.empty -v "$2" "$1"
+}
+
+test_expect_success 'setup lower directory' '
+	mkdir -p lower/d1/d2 lower/d3 lower/.libprojfs-tmp-1-2 &&
+	touch lower/.libprojfs-cache &&
+	echo data >lower/d1/d2/.libprojfs-cache &&
+	set_state lower/d3 y &&
+	truncate -s 1K lower/d1/empty &&
+	set_state lower/d1/empty y &&
+	echo populated >lower/d1/populated &&
+	set_state lower/d1/populated n &&
+	setfattr -n user.projection.version -v v1 lower/d1/populated &&
+	echo modified >lower/d1/d2/modified &&
+	chmod 0444 lower/d1/d2/modified &&
+	touch -d "2001-01-01 00:00:00" lower/d1/d2/modified &&
+	ln -s populated lower/d1/link &&
+	for i in $(test_seq 100)
+	do
+		echo $i >lower/d1/f$i && set_state lower/d1/f$i n || return 1
+	done
+'
+
+test_expect_success 'clone lower directory' '
+	"$TEST_DIRECTORY/test_clone" lower clone 0 4 &&
+	"$TEST_DIRECTORY/test_walk" lower 0x7 1 | sort >expect &&
+	"$TEST_DIRECTORY/test_walk" clone 0x7 1 | sort >actual &&
+	test_cmp expect actual &&
+	test ! -e clone/.libprojfs-tmp-1-2 &&
+	test ! -e clone/.libprojfs-cache &&
+	test_cmp lower/d1/d2/.libprojfs-cache clone/d1/d2/.libprojfs-cache &&
+	test_cmp lower/d1/populated clone/d1/populated &&
+	test_cmp lower/d1/f100 clone/d1/f100 &&
+	test $(stat -c %s clone/d1/empty) -eq 1024 &&
+	test "$(getfattr -n user.projection.version --only-values \
+		clone/d1/populated)" = v1 &&
+	test "$(readlink clone/d1/link)" = populated &&
+	test "$(stat -c %a:%Y lower/d1/d2/modified)" = \
+	     "$(stat -c %a:%Y clone/d1/d2/modified)"
+'
+
+test_expect_success 'clone to existing directory fails' '
+	test_must_fail "$TEST_DIRECTORY/test_clone" lower clone 0 4
+'
+
+test_expect_success 'clone lower directory with reset' '
+	cat >expect <<-EOF &&
+	- 0x1 0 d1/empty
+	- 0x2 0 d1/populated
+	- 0x4 0 d1/link
+	d 0x1 0 d1/d2
+	d 0x1 0 d3
+	d 0x4 0 d1
+	EOF
+	"$TEST_DIRECTORY/test_clone" lower reset 1 4 &&
+	"$TEST_DIRECTORY/test_walk" reset 0x7 1 | grep -v " d1/f" | \
+		sort >actual &&
+	test_cmp expect actual
+'
+
+test_done
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Copyright (C) 2018-2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs file content hash tests
+
+Check that projfs reports the SHA-256 digest of a file'"'"'s content with
+close-after-write event notifications when the write-hash option is set,
+and only when the file was written sequentially and not changed through
+any other file descriptor.
+'
+
+. ./test-lib.sh
+
+projfs_start test_handlers source target --write-hash || exit 1
+
+test_expect_success 'test content hash of sequentially written file' '
+	printf abc >target/f1.txt &&
+	test_path_is_file target/f1.txt
+'
+
+test_expect_success 'test content hash of truncated and rewritten file' '
+	echo overwrite >target/f2.txt &&
+	printf abc >target/f2.txt &&
+	test_path_is_file target/f2.txt
+'
+
+test_expect_success 'test no content hash of appended file' '
+	printf ab >target/f3.txt &&
+	printf c >>target/f3.txt &&
+	test_path_is_file target/f3.txt
+'
+
+test_expect_success 'test no content hash of file extended by fallocate' '
+	fallocate -l 3 target/f4.txt &&
+	test_path_is_file target/f4.txt
+'
+
+test_expect_success 'test hole punched by fallocate' '
+	printf abc >target/f5.txt &&
+	fallocate -p -o 1 -l 1 target/f5.txt &&
+	printf "a\000c" >expect &&
+	test_cmp expect target/f5.txt
+'
+
+test_expect_success 'test no content hash of file written elsewhere' '
+	(
+		printf abc &&
+		printf x | dd of=target/f6.txt bs=1 seek=1 conv=notrunc
+	) >target/f6.txt &&
+	printf axc >expect &&
+	test_cmp expect target/f6.txt
+'
+
+test_expect_success 'test no content hash of file truncated elsewhere' '
+	(
+		printf abc &&
+		truncate -s 1 target/f7.txt &&
+		truncate -s 3 target/f7.txt
+	) >target/f7.txt &&
+	printf "a\000\000" >expect &&
+	test_cmp expect target/f7.txt
+'
+
+projfs_stop || exit 1
+
+abc_hash=ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad
+ab_hash=fb8e20fc2e4c3f248c60c39bd652f3c1347298bb977b8b4d5903b85055620603
+ovr_hash=1db598aa5937f66fe186d345cb1eb7a8ceb4c724e90e2759372c8c564d472ab1
+
+test_expect_success 'check content hashes' '
+	grep "content hash for" test_handlers.out >hashes &&
+	cat >expect <<-EOF &&
+	  test content hash for f1.txt: $abc_hash
+	  test content hash for f2.txt: $ovr_hash
+	  test content hash for f2.txt: $abc_hash
+	  test content hash for f3.txt: $ab_hash
+	  test content hash for f5.txt: $abc_hash
+	EOF
+	test_cmp expect hashes
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_handlers.err
+'
+
+test_done
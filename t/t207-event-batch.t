@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Copyright (C) 2018-2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs batched projection event tests
+
+Check that projfs file projection requests are delivered through the
+batch projection handler when the proj-batch option is set.
+'
+
+. ./test-lib.sh
+. "$TEST_DIRECTORY"/test-lib-event.sh
+
+# create an empty placeholder file of the given size
+make_placeholder () {
+	truncate -s "$2" "$1" &&
+	setfattr -n user.projection.empty -v y "$1"
+}
+
+test_expect_success 'setup placeholders' '
+	mkdir source &&
+	make_placeholder source/f1.txt 5 &&
+	make_placeholder source/f2.txt 5
+'
+
+projfs_start test_handlers source target --proj-batch=10 || exit 1
+
+projfs_event_printf batch create_file f1.txt
+test_expect_success 'test batch event handler on file projection' '
+	projfs_event_exec cat target/f1.txt &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f1.txt)" = n
+'
+
+test_expect_success 'test batch event handler on concurrent projections' '
+	cat target/f1.txt target/f2.txt >/dev/null &
+	cat target/f2.txt >/dev/null &&
+	wait &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f2.txt)" = n
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check all event notifications' '
+	grep -v "for f2.txt" test_handlers.out >handlers.out &&
+	test_cmp handlers.out "$EVENT_OUT"
+'
+
+test_expect_success 'check single projection of concurrently read file' '
+	test $(grep -c "batch request for f2.txt" test_handlers.out) -eq 1
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_handlers.err
+'
+
+test_done
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Copyright (C) 2018-2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs chunked projection event tests
+
+Check that projfs file projection requests for large files are split
+into chunk events when the chunk-size option is set.
+'
+
+. ./test-lib.sh
+
+test_expect_success 'setup placeholders' '
+	mkdir source &&
+	truncate -s 10000 source/large.txt &&
+	setfattr -n user.projection.empty -v y source/large.txt &&
+	truncate -s 4096 source/small.txt &&
+	setfattr -n user.projection.empty -v y source/small.txt
+'
+
+projfs_start test_handlers source target \
+	--chunk-size=4 --chunk-threads=1 || exit 1
+
+test_expect_success 'test chunked projection of large file' '
+	cat target/large.txt >/dev/null &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/large.txt)" = n
+'
+
+test_expect_success 'test unchunked projection of small file' '
+	cat target/small.txt >/dev/null &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/small.txt)" = n
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check chunk events' '
+	grep "test chunk for" test_handlers.out >chunks &&
+	cat >expect <<-\EOF &&
+	  test chunk for large.txt: 0+4096
+	  test chunk for large.txt: 4096+4096
+	  test chunk for large.txt: 8192+1808
+	EOF
+	test_cmp expect chunks &&
+	test $(grep -c "projection request for small.txt" \
+		test_handlers.out) -eq 1
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_handlers.err
+'
+
+test_done
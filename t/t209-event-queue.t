@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Copyright (C) 2018-2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs event queue tests
+
+Check that projfs file operation events are queued and delivered through
+the event queue file descriptor when the event-queue option is set, and
+that replies to queued requests are respected.
+'
+
+. ./test-lib.sh
+. "$TEST_DIRECTORY"/test-lib-event.sh
+
+test_expect_success 'setup placeholder' '
+	mkdir source &&
+	truncate -s 5 source/f1.txt &&
+	setfattr -n user.projection.empty -v y source/f1.txt
+'
+
+projfs_start test_handlers source target --event-queue \
+	--retval-file retval || exit 1
+touch retval
+
+projfs_event_printf notify create_dir d1
+test_expect_success 'test queued notification on directory creation' '
+	projfs_event_exec mkdir target/d1 &&
+	test_path_is_dir target/d1
+'
+
+projfs_event_printf proj create_file f1.txt
+test_expect_success 'test queued request on file projection' '
+	projfs_event_exec cat target/f1.txt &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f1.txt)" = n
+'
+
+projfs_event_printf perm delete_file f1.txt
+projfs_event_printf notify delete_file f1.txt
+test_expect_success 'test queued permission granted on file deletion' '
+	projfs_event_exec rm target/f1.txt &&
+	test_path_is_missing target/f1.txt
+'
+
+echo deny > retval
+
+projfs_event_printf perm delete_dir d1
+test_expect_success 'test queued permission denied on directory deletion' '
+	test_must_fail projfs_event_exec rmdir target/d1 &&
+	test_path_is_dir target/d1
+'
+
+rm retval
+projfs_stop || exit 1
+
+test_expect_success 'check all event notifications' '
+	test_cmp test_handlers.out "$EVENT_OUT"
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_handlers.err
+'
+
+test_done
@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# Copyright (C) 2018-2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs out-of-process provider tests
+
+Check that projfs file operation events are delivered to an external
+provider process connected through the provider socket, that the
+filesystem survives the provider being restarted, that a second mount
+cannot take over a live provider socket, and that the filesystem stops
+even while no provider is connected to answer its requests.
+'
+
+. ./test-lib.sh
+. "$TEST_DIRECTORY"/test-lib-event.sh
+
+PROVIDER_SOCKET="$TRASH_DIRECTORY/provider.sock"
+
+start_provider () {
+	"$TEST_DIRECTORY"/test_provider "$PROVIDER_SOCKET" \
+		>>test_provider.out 2>>test_provider.err &
+	provider_pid=$!
+}
+
+stop_provider () {
+	kill "$provider_pid" &&
+	{ wait "$provider_pid" || :; }
+}
+
+test_expect_success 'setup placeholders' '
+	mkdir source &&
+	truncate -s 5 source/f1.txt &&
+	setfattr -n user.projection.empty -v y source/f1.txt &&
+	truncate -s 5 source/f2.txt &&
+	setfattr -n user.projection.empty -v y source/f2.txt &&
+	truncate -s 5 source/f3.txt &&
+	setfattr -n user.projection.empty -v y source/f3.txt
+'
+
+projfs_start test_simple source target \
+	--provider-socket="$PROVIDER_SOCKET" || exit 1
+
+test_expect_success 'test projection waits for provider to connect' '
+	cat target/f1.txt >/dev/null &
+	cat_pid=$! &&
+	start_provider &&
+	wait $cat_pid &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f1.txt)" = n &&
+	grep "projection request for f1.txt" test_provider.out
+'
+
+test_expect_success 'restart provider' '
+	stop_provider &&
+	start_provider
+'
+
+projfs_event_printf notify create_dir d1
+test_expect_success 'test notification through restarted provider' '
+	projfs_event_exec mkdir target/d1 &&
+	test_path_is_dir target/d1
+'
+
+projfs_event_printf proj create_file f2.txt
+test_expect_success 'test projection through restarted provider' '
+	projfs_event_exec cat target/f2.txt &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f2.txt)" = n
+'
+
+test_expect_success 'test second mount refuses live provider socket' '
+	mkdir source2 target2 &&
+	test_must_fail "$TEST_DIRECTORY"/test_simple \
+		--provider-socket="$PROVIDER_SOCKET" source2 target2 \
+		2>second.err &&
+	grep "failed to listen for provider: .*: Address already in use" \
+		second.err &&
+	test -S "$PROVIDER_SOCKET"
+'
+
+projfs_stop || exit 1
+stop_provider
+
+test_expect_success 'check all event notifications' '
+	grep -v "for f1.txt" test_provider.out >provider.out &&
+	test_cmp provider.out "$EVENT_OUT"
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_provider.err &&
+	test_must_be_empty test_simple.err
+'
+
+projfs_start test_simple source target \
+	--provider-socket="$PROVIDER_SOCKET" || exit 1
+
+# start a projection request which no provider will answer
+cat target/f3.txt >/dev/null 2>&1 &
+cat_pid=$!
+sleep 1
+
+test_expect_success 'test stop fails requests awaiting a provider' '
+	projfs_stop &&
+	{ wait $cat_pid; test $? -ne 0; } &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f3.txt)" = y
+'
+
+test_done
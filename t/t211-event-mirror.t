@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs reference mirror provider tests
+
+Check that the reference provider projects the directories, files, and
+symlinks of a source directory, including when file content is split
+into chunks and delivered with simulated latency and bandwidth limits.
+'
+
+. ./test-lib.sh
+
+test_expect_success 'setup content' '
+	mkdir -p content/dir/subdir &&
+	echo text >content/dir/subdir/file.txt &&
+	test_seq 1 20000 >content/large.txt &&
+	ln -s dir/subdir/file.txt content/link
+'
+
+projfs_start test_mirror source target \
+	--source="$TRASH_DIRECTORY/content" --initial || exit 1
+
+test_expect_success 'test mirrored tree matches content' '
+	diff -r content target &&
+	test "$(readlink target/link)" = dir/subdir/file.txt
+'
+
+test_expect_success 'test mirrored files are hydrated' '
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/large.txt)" = n &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/dir/subdir/file.txt)" = n
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_mirror.err
+'
+
+projfs_start test_mirror source2 target2 \
+	--source="$TRASH_DIRECTORY/content" --initial \
+	--chunk-size=4 --latency=10 --bandwidth=1024 || exit 1
+
+test_expect_success 'test chunked and throttled projection' '
+	test_cmp content/large.txt target2/large.txt &&
+	test_cmp content/dir/subdir/file.txt target2/dir/subdir/file.txt
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_mirror.err
+'
+
+test_done
@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs ordered notification lane tests
+
+Check that projfs event notifications are delivered asynchronously but
+in order for the entries of a directory when the notify-lanes option is
+set, that moves across directories are ordered with the events of both
+directories, and that the maximum depth of each lane is logged.
+'
+
+. ./test-lib.sh
+. "$TEST_DIRECTORY"/test-lib-event.sh
+
+HELPER_LOG='test_handlers.log'
+
+test_expect_success 'setup directories' '
+	mkdir -p source/d1 source/d2 source/d3 source/d4
+'
+
+projfs_start test_handlers source target --notify-lanes=4 \
+	--log="$HELPER_LOG" || exit 1
+
+projfs_event_printf notify create_file d1/f1.txt
+projfs_event_printf notify close_file d1/f1.txt
+test_expect_success 'test laned notifications on file creation' '
+	projfs_event_exec touch target/d1/f1.txt &&
+	test_path_is_file target/d1/f1.txt
+'
+
+projfs_event_printf perm rename_file d1/f1.txt d1/f2.txt
+projfs_event_printf notify rename_file d1/f1.txt d1/f2.txt
+test_expect_success 'test laned notification on file rename' '
+	projfs_event_exec mv target/d1/f1.txt target/d1/f2.txt &&
+	test_path_is_file target/d1/f2.txt
+'
+
+projfs_event_printf notify link_file d1/f2.txt d1/l2.txt
+test_expect_success 'test laned notification on file hard link' '
+	projfs_event_exec ln target/d1/f2.txt target/d1/l2.txt &&
+	test_path_is_file target/d1/l2.txt
+'
+
+projfs_event_printf perm delete_file d1/f2.txt
+projfs_event_printf notify delete_file d1/f2.txt
+test_expect_success 'test laned notification on file deletion' '
+	projfs_event_exec rm target/d1/f2.txt &&
+	test_path_is_missing target/d1/f2.txt
+'
+
+test_expect_success 'test concurrent notifications in other directory' '
+	for i in $(test_seq 1 20)
+	do
+		touch target/d2/f$i.txt || return 1
+	done
+'
+
+test_expect_success 'test notifications for move across directories' '
+	for i in $(test_seq 1 20)
+	do
+		touch target/d3/m$i.txt &&
+		mv target/d3/m$i.txt target/d4/m$i.txt &&
+		rm target/d4/m$i.txt || return 1
+	done
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check notifications delivered in order' '
+	grep "$event_msg_notify d1/" test_handlers.out >notify.out &&
+	grep "$event_msg_notify" "$EVENT_OUT" >expect.notify.out &&
+	test_cmp expect.notify.out notify.out
+'
+
+test_expect_success 'check notifications from concurrent directory' '
+	test $(grep -c "$event_msg_notify d2/" test_handlers.out) -eq 40 &&
+	for i in $(test_seq 1 20)
+	do
+		grep -n "$event_msg_notify d2/f$i.txt:" test_handlers.out \
+			>"events.$i" &&
+		test_line_count = 2 "events.$i" &&
+		head -n 1 "events.$i" | grep -q "$event_notify_create_file" &&
+		tail -n 1 "events.$i" | grep -q "$event_notify_close_file" ||
+		return 1
+	done
+'
+
+test_expect_success 'check notifications for move across directories' '
+	for i in $(test_seq 1 20)
+	do
+		grep "$event_msg_notify d[34]/m$i.txt" test_handlers.out \
+			>"moves.$i" &&
+		test_line_count = 4 "moves.$i" &&
+		sed -n 3p "moves.$i" | grep -q "$event_notify_rename_file" &&
+		sed -n 4p "moves.$i" | grep -q "$event_notify_delete_file" ||
+		return 1
+	done
+'
+
+test_expect_success 'check lane depths logged' '
+	test $(grep -c "notification lane [0-3]: max depth" \
+		"$HELPER_LOG") -eq 4
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_handlers.err
+'
+
+test_done
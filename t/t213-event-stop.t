@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs bounded-time shutdown tests
+
+Check that stopping the filesystem with a deadline gives up while a
+projection request is still being handled, and reports that request
+as running, but completes once the handler returns.
+'
+
+. ./test-lib.sh
+
+test_expect_success 'setup content' '
+	mkdir content &&
+	echo text >content/file.txt
+'
+
+projfs_start test_mirror source target \
+	--source="$TRASH_DIRECTORY/content" --initial \
+	--latency=3000 --stop-timeout=200 || exit 1
+
+# start a projection request which will still be in flight when we stop
+cat target/file.txt >/dev/null 2>&1 &
+cat_pid=$!
+sleep 1
+
+projfs_stop || exit 1
+wait $cat_pid || :
+
+test_expect_success 'test stop timed out with a running handler' '
+	head -n 1 test_mirror.out >actual &&
+	echo "stop: timed out; refused 0, dropped 0, running 1" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'test stop completed once handler returned' '
+	tail -n 1 test_mirror.out >actual &&
+	grep "^stop: stopped; refused [0-9]*, dropped 0, running 0\$" actual
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_mirror.err
+'
+
+test_done
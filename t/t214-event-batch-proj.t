@@ -0,0 +1,171 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs placeholder batch tests
+
+Check that a batch applied to a mounted filesystem updates, deletes, and
+creates empty placeholders, and that if any placeholder has been populated
+or modified through the mount, the batch reports each conflict and makes no
+changes, unless an update supplies a matching content version.
+'
+
+. ./test-lib.sh
+
+wait_batch () {
+	for i in $(test_seq 100)
+	do
+		grep -q "^batch: done" test_batch.out && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+get_state () {
+	getfattr -n user.projection.empty --only-values "$1" 2>/dev/null
+}
+
+test_expect_success 'setup placeholders' '
+	mkdir source &&
+	touch source/e1 source/e2 source/p1 source/m1 &&
+	touch source/v1 source/v2 source/v3 &&
+	for f in e1 e2 p1 m1 v1 v2 v3
+	do
+		setfattr -n user.projection.empty -v y source/$f || return 1
+	done &&
+	setfattr -n user.projection.version -v abc source/v1 &&
+	setfattr -n user.projection.version -v abc source/v2 &&
+	cat >conflict.ops <<-EOF &&
+	update e1 10
+	delete e2
+	update p1 20
+	delete m1
+	update v1 30 abc
+	update v2 30 xyz
+	update v3 30 abc
+	create_dir n
+	create_file n/f 5
+	EOF
+	cat >batch.ops <<-EOF
+	update e1 10
+	delete e2
+	update v1 30 abc
+	create_dir n
+	create_file n/f 5
+	EOF
+'
+
+projfs_start test_batch source target \
+	--source="$TRASH_DIRECTORY/conflict.ops" || exit 1
+
+test_expect_success 'populate and modify placeholders' '
+	cat target/p1 target/v1 target/v2 target/v3 >/dev/null &&
+	echo modified >target/m1 &&
+	test "$(get_state source/p1)" = n &&
+	test "$(get_state source/v1)" = n &&
+	test -z "$(get_state source/m1)"
+'
+
+test_expect_success 'apply conflicting batch' '
+	kill -USR1 $projfs_pid &&
+	wait_batch
+'
+
+test_expect_success 'check conflicting batch results' '
+	ebusy=$("$TEST_DIRECTORY"/get_strerror EBUSY) &&
+	ecanceled=$("$TEST_DIRECTORY"/get_strerror ECANCELED) &&
+	cat >expect <<-EOF &&
+	  test batch result for e1: $ecanceled
+	  test batch result for e2: $ecanceled
+	  test batch result for p1: $ebusy
+	  test batch result for m1: $ebusy
+	  test batch result for v1: $ecanceled
+	  test batch result for v2: $ebusy
+	  test batch result for v3: $ebusy
+	  test batch result for n: $ecanceled
+	  test batch result for n/f: $ecanceled
+	batch: done: $ebusy
+	EOF
+	test_cmp expect test_batch.out
+'
+
+test_expect_success 'check no placeholders changed' '
+	test "$(get_state source/e1)" = y &&
+	test $(stat -c %s target/e1) -eq 0 &&
+	test_path_is_file target/e2 &&
+	test_path_is_missing target/n &&
+	test $(stat -c %s target/p1) -eq 0 &&
+	test "$(get_state source/p1)" = n &&
+	echo modified >expect &&
+	test_cmp expect target/m1
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_batch.err
+'
+
+projfs_start test_batch source target \
+	--source="$TRASH_DIRECTORY/batch.ops" || exit 1
+
+test_expect_success 'apply batch' '
+	kill -USR1 $projfs_pid &&
+	wait_batch
+'
+
+test_expect_success 'check batch results' '
+	ok=$("$TEST_DIRECTORY"/get_strerror null) &&
+	cat >expect <<-EOF &&
+	  test batch result for e1: $ok
+	  test batch result for e2: $ok
+	  test batch result for v1: $ok
+	  test batch result for n: $ok
+	  test batch result for n/f: $ok
+	batch: done: $ok
+	EOF
+	test_cmp expect test_batch.out
+'
+
+test_expect_success 'check empty placeholders changed' '
+	test "$(get_state source/e1)" = y &&
+	test "$(get_state source/n)" = y &&
+	test "$(get_state source/n/f)" = y &&
+	test $(stat -c %s target/e1) -eq 10 &&
+	test_path_is_missing target/e2 &&
+	test_path_is_dir target/n &&
+	test $(stat -c %s target/n/f) -eq 5
+'
+
+test_expect_success 'check populated placeholders with versions unchanged' '
+	for f in v1 v2 v3
+	do
+		test $(stat -c %s target/$f) -eq 0 &&
+		test "$(get_state source/$f)" = n || return 1
+	done &&
+	test "$(getfattr -n user.projection.version --only-values \
+		source/v1)" = abc &&
+	test "$(getfattr -n user.projection.version --only-values \
+		source/v2)" = abc
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_batch.err
+'
+
+test_done
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs shared layer argument test
+
+Check that placeholder file content is read from a shared layer when it
+holds a file with a matching content version, and is copied up into the
+lower filesystem when the file is written, and that a file opened from
+the shared layer reports and changes the attributes of its placeholder.
+'
+
+. ./test-lib.sh
+
+HELPER_LOG='test_simple.log'
+
+# create an empty placeholder with the given content version and size
+make_placeholder () {
+	truncate -s "$3" "$1" &&
+	setfattr -n user.projection.empty -v y "$1" &&
+	setfattr -n user.projection.version -v "$2" "$1"
+}
+
+test_expect_success 'setup shared layer and placeholders' '
+	mkdir -p shared source &&
+	printf hello >shared/f1.txt &&
+	setfattr -n user.projection.version -v v1 shared/f1.txt &&
+	printf other >shared/f2.txt &&
+	setfattr -n user.projection.version -v v1 shared/f2.txt &&
+	make_placeholder source/f1.txt v1 5 &&
+	make_placeholder source/f2.txt v2 5 &&
+	printf third >shared/f3.txt &&
+	setfattr -n user.projection.version -v v1 shared/f3.txt &&
+	chmod 0600 shared/f3.txt &&
+	make_placeholder source/f3.txt v1 5 &&
+	chmod 0644 source/f3.txt
+'
+
+projfs_start test_simple source target --log="$HELPER_LOG" \
+	--shared="$TRASH_DIRECTORY/shared" || exit 1
+
+test_expect_success 'read placeholder content from shared layer' '
+	test "$(cat target/f1.txt)" = hello &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f1.txt)" = y
+'
+
+test_expect_success 'ignore shared layer content of other version' '
+	test "$(cat target/f2.txt)" != other &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f2.txt)" = n
+'
+
+test_expect_success 'report placeholder attributes of shared layer file' '
+	stat -c "%i %a" source/f3.txt >expect &&
+	stat -c "%i %a" - <target/f3.txt >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'change placeholder attributes of shared layer file' '
+	touch -d @1000000000 - 1<target/f3.txt &&
+	test $(stat -c %Y source/f3.txt) -eq 1000000000 &&
+	test $(stat -c %Y shared/f3.txt) -ne 1000000000 &&
+	test "$(getfattr -n user.projection.empty --only-values \
+		source/f3.txt)" = y
+'
+
+test_expect_success 'copy up shared layer content on write' '
+	echo " world" >>target/f1.txt &&
+	test "$(cat source/f1.txt)" = "hello world" &&
+	test_must_fail getfattr -n user.projection.empty source/f1.txt
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check shared layer unchanged' '
+	test "$(cat shared/f1.txt)" = hello &&
+	test "$(stat -c %a shared/f3.txt)" = 600
+'
+
+test_done
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs warm start argument test
+
+Check that a cache snapshot is saved in the lower directory on unmount
+when the warm-start option is set, that it is hidden from and cannot be
+replaced through the projected filesystem, as are temporary entries, and
+that its entries are revalidated when it is reloaded.
+'
+
+. ./test-lib.sh
+
+HELPER_LOG='test_simple.log'
+
+count_projected () {
+	grep -c "directory projected .*: $1\$" "$HELPER_LOG"
+}
+
+test_expect_success 'setup placeholder directories' '
+	mkdir -p source/d1/d2 &&
+	setfattr -n user.projection.empty -v y source/d1 &&
+	setfattr -n user.projection.empty -v y source/d1/d2
+'
+
+projfs_start test_simple source target --log="$HELPER_LOG" \
+	--warm-start || exit 1
+
+test_expect_success 'project directories on first mount' '
+	ls target/d1/d2 &&
+	test $(count_projected d1/d2) -eq 1
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check cache snapshot saved' '
+	test_path_is_file source/.libprojfs-cache
+'
+
+projfs_start test_simple source target --log="$HELPER_LOG" \
+	--warm-start || exit 1
+
+test_expect_success 'check cache snapshot hidden' '
+	ls -a target >list &&
+	! grep libprojfs list
+'
+
+test_expect_success 'check cache snapshot inaccessible' '
+	test_must_fail cat target/.libprojfs-cache &&
+	test_must_fail rm target/.libprojfs-cache &&
+	test_must_fail sh -c "echo data >target/.libprojfs-cache" &&
+	echo data >target/file &&
+	test_must_fail mv target/file target/.libprojfs-cache &&
+	test_must_fail ln target/file target/.libprojfs-cache &&
+	rm target/file &&
+	test_path_is_file source/.libprojfs-cache
+'
+
+test_expect_success 'check private names allowed elsewhere' '
+	echo data >target/.libprojfs-data &&
+	echo data >target/d1/.libprojfs-cache &&
+	ls -a target >list &&
+	grep -q "^.libprojfs-data\$" list &&
+	ls -a target/d1 >list &&
+	grep -q "^.libprojfs-cache\$" list &&
+	rm target/.libprojfs-data target/d1/.libprojfs-cache
+'
+
+test_expect_success 'check temporary names refused' '
+	test_must_fail mkdir target/.libprojfs-tmp-1-2 &&
+	test_must_fail touch target/d1/.libprojfs-tmp-1-2 &&
+	echo data >target/file &&
+	test_must_fail mv target/file target/d1/.libprojfs-tmp-1-2 &&
+	rm target/file &&
+	test_path_is_missing source/.libprojfs-tmp-1-2 &&
+	test_path_is_missing source/d1/.libprojfs-tmp-1-2
+'
+
+test_expect_success 'remove leftover temporary entries with directory' '
+	mkdir -p source/d5/.libprojfs-tmp-1-2 &&
+	ls -a target/d5 >list &&
+	! grep libprojfs list &&
+	rmdir target/d5 &&
+	test_path_is_missing source/d5
+'
+
+test_expect_success 'test operations in cached directories' '
+	ls target/d1/d2 &&
+	mkdir target/d1/d2/d3 &&
+	mv target/d1/d2/d3 target/d1/d4 &&
+	rmdir target/d1/d4 &&
+	test $(count_projected d1/d2) -eq 1
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'reset projection state of cached directory' '
+	setfattr -n user.projection.empty -v y source/d1/d2
+'
+
+projfs_start test_simple source target --log="$HELPER_LOG" \
+	--warm-start || exit 1
+
+test_expect_success 'project directory changed since snapshot' '
+	ls target/d1/d2 &&
+	test $(count_projected d1/d2) -eq 2
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check no cache snapshot errors' '
+	! grep "cache snapshot" "$HELPER_LOG"
+'
+
+test_done
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 GitHub, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+test_description='projfs access profile argument test
+
+Check that file hydrations are recorded in an access profile when the
+profile option is set, and that a profile may be replayed to hydrate
+the same files in a new projected filesystem ahead of their use.
+'
+
+. ./test-lib.sh
+
+PROFILE="$TRASH_DIRECTORY/profile"
+
+get_state () {
+	getfattr -n user.projection.empty --only-values "$1"
+}
+
+wait_prefetch () {
+	for i in $(test_seq 100)
+	do
+		grep -q "^prefetch: done" test_mirror.out && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+test_expect_success 'setup content' '
+	mkdir -p content/dir &&
+	echo a >content/a &&
+	echo b >content/b &&
+	echo c >content/dir/c
+'
+
+projfs_start test_mirror source target \
+	--source="$TRASH_DIRECTORY/content" --initial \
+	--profile="$PROFILE" || exit 1
+
+test_expect_success 'hydrate files' '
+	cat target/dir/c target/a
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check files recorded in profile' '
+	printf "dir/c\na\n" >expect &&
+	cut -f3 "$PROFILE" >actual &&
+	test_cmp expect actual &&
+	test "$(cut -f2 "$PROFILE" | sort -u)" = cat
+'
+
+projfs_start test_mirror source2 target2 \
+	--source="$TRASH_DIRECTORY/content" --initial \
+	--prefetch="$PROFILE" || exit 1
+
+test_expect_success 'wait for prefetch' '
+	wait_prefetch
+'
+
+projfs_stop || exit 1
+
+test_expect_success 'check profiled files hydrated' '
+	test "$(get_state source2/a)" = n &&
+	test "$(get_state source2/dir/c)" = n &&
+	test "$(get_state source2/b)" = y
+'
+
+test_expect_success 'check no unexpected error output' '
+	test_must_be_empty test_mirror.err
+'
+
+test_done
@@ -18,8 +18,10 @@
 EVENT_OUT="expect.event.out"
 EVENT_LOG="expect.event.log"
 
+event_msg_proj="test projection request for"
 event_msg_notify="test event notification for"
 event_msg_perm="test permission request for"
+event_msg_batch="test projection batch request for"
 
 event_msg_err="event handler failed"
 
@@ -33,6 +35,10 @@ event_notify_rename_dir="0x0000-400000c0"
 event_notify_create_dir="0x0000-40000100"
 event_notify_delete_dir="0x0000-40000200"
 
+event_proj_create_file="0x0000-00000100"
+
+event_batch_create_file="0x0000-00000100"
+
 event_perm_delete_file="0x0002-00000000"
 event_perm_rename_file="0x0004-00000000"
 
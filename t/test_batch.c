@@ -0,0 +1,152 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_common.h"
+
+#define TEST_BATCH_MAX_OPS 64
+#define TEST_BATCH_MAX_VERSION 64
+
+static const struct {
+	const char *name;
+	unsigned int type;
+} batch_types[] = {
+	{ "create_dir",		PROJFS_BATCH_CREATE_DIR },
+	{ "create_file",	PROJFS_BATCH_CREATE_FILE },
+	{ "update",		PROJFS_BATCH_UPDATE },
+	{ "delete",		PROJFS_BATCH_DELETE },
+	{ NULL,			0 }
+};
+
+/* Read batch operations, one per line as "<type> <path> [<size> [<ver>]]" */
+static unsigned int read_batch_ops(const char *argv0, const char *ops_path,
+				   struct projfs_batch_op *ops,
+				   struct projfs_attr *attrs)
+{
+	char line[PATH_MAX + TEST_BATCH_MAX_VERSION + 64], type[16];
+	char path[PATH_MAX], version[TEST_BATCH_MAX_VERSION];
+	unsigned int nops = 0;
+	long long size;
+	FILE *file;
+	int i, n;
+
+	file = fopen(ops_path, "r");
+	if (file == NULL)
+		test_exit_error(argv0, "unable to open batch file: %s",
+				ops_path);
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		size = 0;
+		n = sscanf(line, "%15s %4095s %lld %63s", type, path, &size,
+			   version);
+		if (n < 2)
+			continue;
+		if (nops == TEST_BATCH_MAX_OPS)
+			test_exit_error(argv0, "too many batch operations");
+
+		for (i = 0; batch_types[i].name != NULL; ++i) {
+			if (strcmp(batch_types[i].name, type) == 0)
+				break;
+		}
+		if (batch_types[i].name == NULL)
+			test_exit_error(argv0, "invalid batch operation: %s",
+					type);
+
+		memset(&ops[nops], 0, sizeof(ops[nops]));
+		ops[nops].type = batch_types[i].type;
+		ops[nops].path = strdup(path);
+		ops[nops].size = size;
+		if (ops[nops].path == NULL)
+			test_exit_error(argv0, "unable to allocate path");
+
+		if (n == 4) {
+			attrs[nops].name = PROJFS_ATTR_VERSION;
+			attrs[nops].value = strdup(version);
+			attrs[nops].size = strlen(version);
+			if (attrs[nops].value == NULL)
+				test_exit_error(argv0,
+						"unable to allocate version");
+			ops[nops].attrs = &attrs[nops];
+			ops[nops].nattrs = 1;
+		}
+		++nops;
+	}
+
+	fclose(file);
+	return nops;
+}
+
+int main(int argc, char *const argv[])
+{
+	const char *lower_path, *mount_path, *ops_path = NULL;
+	struct projfs_batch_op ops[TEST_BATCH_MAX_OPS];
+	struct projfs_attr attrs[TEST_BATCH_MAX_OPS];
+	struct test_mount_args mount_args;
+	struct projfs *fs;
+	unsigned int opt_flags, nops, i;
+	sigset_t sigset;
+	int sig, res;
+
+	test_parse_mount_opts(argc, argv, TEST_OPT_SOURCE,
+			      &lower_path, &mount_path, &mount_args);
+
+	opt_flags = test_get_opts(TEST_OPT_SOURCE, &ops_path);
+	if ((opt_flags & TEST_OPT_SOURCE) == TEST_OPT_NONE)
+		test_exit_error(argv[0], "missing batch file path");
+
+	// block SIGUSR1 in all threads, so only sigwait() receives it
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	fs = test_start_mount(lower_path, mount_path, NULL, 0, NULL,
+			      &mount_args);
+
+	// apply the batch once signalled, so tests may first use the mount
+	if (sigwait(&sigset, &sig) != 0)
+		test_exit_error(argv[0], "unable to wait for signal");
+
+	nops = read_batch_ops(argv[0], ops_path, ops, attrs);
+	res = projfs_batch_proj(fs, ops, nops, 0);
+
+	for (i = 0; i < nops; ++i) {
+		printf("  test batch result for %s: %s\n", ops[i].path,
+		       strerror(ops[i].result));
+		free((char *)ops[i].path);
+		if (ops[i].attrs != NULL)
+			free(ops[i].attrs->value);
+	}
+	printf("batch: done: %s\n", strerror(res));
+	fflush(stdout);
+
+	test_wait_signal();
+	test_stop_mount(fs);
+
+	test_free_opts(&mount_args);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,47 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_common.h"
+
+int main(int argc, char *const argv[])
+{
+	unsigned int flags, nthreads;
+	int res;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <source-path> <target-path> "
+				"<flags> <threads>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	flags = test_parse_long(argv[3], 0);
+	nthreads = test_parse_long(argv[4], 0);
+
+	res = projfs_clone_lowerdir(argv[1], argv[2], flags, nthreads);
+	if (res != 0)
+		test_exit_error(argv[0], "unable to clone %s: %s", argv[1],
+				strerror(res));
+
+	exit(EXIT_SUCCESS);
+}
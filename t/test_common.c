@@ -53,6 +53,8 @@ static const struct retval errno_retvals[] = {
 	{ "allow", 	PROJFS_ALLOW	},
 	{ "deny",	PROJFS_DENY	},
 	{ retval_entry(EBADF)		},
+	{ retval_entry(EBUSY)		},
+	{ retval_entry(ECANCELED)	},
 	{ retval_entry(EINPROGRESS)	},
 	{ retval_entry(EINVAL)		},
 	{ retval_entry(EIO)		},
@@ -71,12 +73,29 @@ static const struct option all_long_opts[] = {
 	{ "retval-file", required_argument, NULL, TEST_OPT_NUM_RETFILE },
 	{ "timeout", required_argument, NULL, TEST_OPT_NUM_TIMEOUT },
 	{ "lock-file", required_argument, NULL, TEST_OPT_NUM_LOCKFILE },
+	{ "source", required_argument, NULL, TEST_OPT_NUM_SOURCE },
+	{ "latency", required_argument, NULL, TEST_OPT_NUM_LATENCY },
+	{ "bandwidth", required_argument, NULL, TEST_OPT_NUM_BANDWIDTH },
+	{ "stop-timeout", required_argument, NULL, TEST_OPT_NUM_STOPTIMEOUT },
+	{ "prefetch", required_argument, NULL, TEST_OPT_NUM_PREFETCH },
 };
 
 static const char *const all_mount_opts[] = {
+	"--chunk-retries=",
+	"--chunk-size=",
+	"--chunk-threads=",
 	"--debug",
+	"--event-queue",
+	"--hot-paths=",
 	"--initial",
 	"--log=",
+	"--notify-lanes=",
+	"--profile=",
+	"--proj-batch=",
+	"--provider-socket=",
+	"--shared=",
+	"--warm-start",
+	"--write-hash",
 	NULL
 };
 
@@ -91,6 +110,11 @@ static const struct opt_usage all_opts_usage[] = {
 	{ "<retval-file>", 1 },
 	{ "<max-seconds>", 1 },
 	{ "<lock-file>", 1 },
+	{ "<source-path>", 1 },
+	{ "<msec>", 1 },
+	{ "<kib-per-sec>", 1 },
+	{ "<msec>", 1 },
+	{ "<profile-path>", 1 },
 };
 
 /* option values */
@@ -98,6 +122,11 @@ static int optval_retval;
 static const char *optval_retfile;
 static long int optval_timeout;
 static const char *optval_lockfile;
+static const char *optval_source;
+static long int optval_latency;
+static long int optval_bandwidth;
+static long int optval_stop_timeout;
+static const char *optval_prefetch;
 
 static unsigned int opt_set_flags = TEST_OPT_NONE;
 
@@ -364,6 +393,43 @@ void test_parse_opts(int argc, char *const argv[], unsigned int opt_flags,
 			opt_set_flags |= TEST_OPT_LOCKFILE;
 			break;
 
+		case TEST_OPT_NUM_SOURCE:
+			optval_source = optarg;
+			opt_set_flags |= TEST_OPT_SOURCE;
+			break;
+
+		case TEST_OPT_NUM_LATENCY:
+			optval_latency = test_parse_long(optarg, 10);
+			if (errno > 0 || optval_latency < 0)
+				test_exit_error(argv[0],
+						"invalid latency: %s",
+						optarg);
+			opt_set_flags |= TEST_OPT_LATENCY;
+			break;
+
+		case TEST_OPT_NUM_BANDWIDTH:
+			optval_bandwidth = test_parse_long(optarg, 10);
+			if (errno > 0 || optval_bandwidth < 0)
+				test_exit_error(argv[0],
+						"invalid bandwidth: %s",
+						optarg);
+			opt_set_flags |= TEST_OPT_BANDWIDTH;
+			break;
+
+		case TEST_OPT_NUM_STOPTIMEOUT:
+			optval_stop_timeout = test_parse_long(optarg, 10);
+			if (errno > 0 || optval_stop_timeout < 0)
+				test_exit_error(argv[0],
+						"invalid stop timeout: %s",
+						optarg);
+			opt_set_flags |= TEST_OPT_STOPTIMEOUT;
+			break;
+
+		case TEST_OPT_NUM_PREFETCH:
+			optval_prefetch = optarg;
+			opt_set_flags |= TEST_OPT_PREFETCH;
+			break;
+
 		case '?':
 			if (optopt > 0) {
 				test_exit_error(argv[0], "invalid option: -%c",
@@ -470,6 +536,36 @@ unsigned int test_get_opts(unsigned int opt_flags, ...)
 					*s = optval_lockfile;
 				break;
 
+			case TEST_OPT_SOURCE:
+				s = va_arg(ap, const char**);
+				if (ret_flag != TEST_OPT_NONE)
+					*s = optval_source;
+				break;
+
+			case TEST_OPT_LATENCY:
+				l = va_arg(ap, long int*);
+				if (ret_flag != TEST_OPT_NONE)
+					*l = optval_latency;
+				break;
+
+			case TEST_OPT_BANDWIDTH:
+				l = va_arg(ap, long int*);
+				if (ret_flag != TEST_OPT_NONE)
+					*l = optval_bandwidth;
+				break;
+
+			case TEST_OPT_STOPTIMEOUT:
+				l = va_arg(ap, long int*);
+				if (ret_flag != TEST_OPT_NONE)
+					*l = optval_stop_timeout;
+				break;
+
+			case TEST_OPT_PREFETCH:
+				s = va_arg(ap, const char**);
+				if (ret_flag != TEST_OPT_NONE)
+					*s = optval_prefetch;
+				break;
+
 			default:
 				errx(EXIT_FAILURE,
 				     "unknown option flag: %u", opt_flag);
@@ -28,12 +28,22 @@
 #define TEST_OPT_NUM_RETFILE	2
 #define TEST_OPT_NUM_TIMEOUT	3
 #define TEST_OPT_NUM_LOCKFILE	4
+#define TEST_OPT_NUM_SOURCE	5
+#define TEST_OPT_NUM_LATENCY	6
+#define TEST_OPT_NUM_BANDWIDTH	7
+#define TEST_OPT_NUM_STOPTIMEOUT	8
+#define TEST_OPT_NUM_PREFETCH	9
 
 #define TEST_OPT_HELP		(0x0001 << TEST_OPT_NUM_HELP)
 #define TEST_OPT_RETVAL		(0x0001 << TEST_OPT_NUM_RETVAL)
 #define TEST_OPT_RETFILE	(0x0001 << TEST_OPT_NUM_RETFILE)
 #define TEST_OPT_TIMEOUT	(0x0001 << TEST_OPT_NUM_TIMEOUT)
 #define TEST_OPT_LOCKFILE	(0x0001 << TEST_OPT_NUM_LOCKFILE)
+#define TEST_OPT_SOURCE		(0x0001 << TEST_OPT_NUM_SOURCE)
+#define TEST_OPT_LATENCY	(0x0001 << TEST_OPT_NUM_LATENCY)
+#define TEST_OPT_BANDWIDTH	(0x0001 << TEST_OPT_NUM_BANDWIDTH)
+#define TEST_OPT_STOPTIMEOUT	(0x0001 << TEST_OPT_NUM_STOPTIMEOUT)
+#define TEST_OPT_PREFETCH	(0x0001 << TEST_OPT_NUM_PREFETCH)
 
 #define TEST_OPT_NONE		0x0000
 
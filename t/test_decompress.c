@@ -0,0 +1,212 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "test_common.h"
+
+#define TEST_DATA_LEN (3 * 1024 * 1024 + 17)
+
+static char *make_data(size_t len)
+{
+	char *data = malloc(len);
+	size_t i;
+
+	if (data == NULL)
+		return NULL;
+	// include runs of zeros and less compressible data
+	for (i = 0; i < len; ++i)
+		data[i] = (i % 4096 < 1024) ? 0 : (char)(i * 7 + i / 13);
+
+	return data;
+}
+
+/**
+ * Create an unlinked placeholder file of the given size and an event
+ * with which to write it.
+ */
+static void make_event(const char *argv0, struct projfs_event *event,
+		       off_t size)
+{
+	char path[] = "/tmp/test_decompress.XXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd == -1 || unlink(path) == -1 || ftruncate(fd, size) == -1)
+		test_exit_error(argv0, "unable to create placeholder file");
+
+	memset(event, 0, sizeof(*event));
+	event->fd = fd;
+}
+
+static void check_content(const char *argv0, struct projfs_event *event,
+			  const char *data, size_t len, const char *desc)
+{
+	char *buf = malloc(len);
+
+	if (buf == NULL)
+		test_exit_error(argv0, "unable to allocate buffer");
+	if (pread(event->fd, buf, len, 0) != (ssize_t)len ||
+	    memcmp(buf, data, len) != 0)
+		test_exit_error(argv0, "incorrect content for %s", desc);
+
+	free(buf);
+	close(event->fd);
+}
+
+static void check_result(const char *argv0, int res, int expected,
+			 const char *desc)
+{
+	if (res != expected) {
+		test_exit_error(argv0, "unexpected result for %s: %s",
+				desc, strerror(res));
+	}
+}
+
+static void test_none(const char *argv0, const char *data, size_t len)
+{
+	struct projfs_event event;
+	int pipe_fds[2];
+	size_t chunk = 4096;
+	int res;
+
+	make_event(argv0, &event, len);
+	res = projfs_write_compressed_buf(&event, data, len,
+					  PROJFS_CODEC_NONE);
+	check_result(argv0, res, 0, "uncompressed buffer");
+	check_content(argv0, &event, data, len, "uncompressed buffer");
+
+	// write a single chunk through a pipe
+	make_event(argv0, &event, len);
+	event.offset = chunk;
+	event.length = chunk;
+	if (pipe(pipe_fds) == -1 ||
+	    write(pipe_fds[1], data + chunk, chunk) != (ssize_t)chunk)
+		test_exit_error(argv0, "unable to write pipe");
+	close(pipe_fds[1]);
+	res = projfs_write_compressed(&event, pipe_fds[0], PROJFS_CODEC_NONE);
+	close(pipe_fds[0]);
+	check_result(argv0, res, 0, "uncompressed chunk");
+	close(event.fd);
+
+	make_event(argv0, &event, len + 1);
+	res = projfs_write_compressed_buf(&event, data, len,
+					  PROJFS_CODEC_NONE);
+	check_result(argv0, res, EIO, "short uncompressed buffer");
+	close(event.fd);
+
+	make_event(argv0, &event, len - 1);
+	res = projfs_write_compressed_buf(&event, data, len,
+					  PROJFS_CODEC_NONE);
+	check_result(argv0, res, EIO, "long uncompressed buffer");
+	close(event.fd);
+
+	make_event(argv0, &event, len);
+	res = projfs_write_compressed_buf(&event, data, len, 0xFF);
+	check_result(argv0, res, EINVAL, "unknown codec");
+	close(event.fd);
+}
+
+#ifdef HAVE_ZLIB
+static void test_zlib(const char *argv0, const char *data, size_t len)
+{
+	struct projfs_event event;
+	char header[32];
+	uLongf zlen = compressBound(len + sizeof(header));
+	unsigned char *zdata = malloc(zlen);
+	char *obj = malloc(len + sizeof(header));
+	int hlen, res;
+
+	if (zdata == NULL || obj == NULL)
+		test_exit_error(argv0, "unable to allocate buffers");
+
+	if (compress(zdata, &zlen, (const Bytef *)data, len) != Z_OK)
+		test_exit_error(argv0, "unable to compress data");
+
+	make_event(argv0, &event, len);
+	res = projfs_write_compressed_buf(&event, zdata, zlen,
+					  PROJFS_CODEC_ZLIB);
+	check_result(argv0, res, 0, "zlib buffer");
+	check_content(argv0, &event, data, len, "zlib buffer");
+
+	make_event(argv0, &event, len);
+	res = projfs_write_compressed_buf(&event, zdata, zlen / 2,
+					  PROJFS_CODEC_ZLIB);
+	check_result(argv0, res, EIO, "truncated zlib buffer");
+	close(event.fd);
+
+	// compress a Git blob object, including its header
+	hlen = sprintf(header, "blob %zu", len) + 1;
+	memcpy(obj, header, hlen);
+	memcpy(obj + hlen, data, len);
+	zlen = compressBound(len + sizeof(header));
+	if (compress(zdata, &zlen, (const Bytef *)obj, len + hlen) != Z_OK)
+		test_exit_error(argv0, "unable to compress object");
+
+	make_event(argv0, &event, len);
+	res = projfs_write_compressed_buf(&event, zdata, zlen,
+					  PROJFS_CODEC_GIT_ZLIB);
+	check_result(argv0, res, 0, "Git object buffer");
+	check_content(argv0, &event, data, len, "Git object buffer");
+
+	make_event(argv0, &event, len + 1);
+	res = projfs_write_compressed_buf(&event, zdata, zlen,
+					  PROJFS_CODEC_GIT_ZLIB);
+	check_result(argv0, res, EIO, "Git object of wrong size");
+	close(event.fd);
+
+	make_event(argv0, &event, len);
+	event.length = len;
+	res = projfs_write_compressed_buf(&event, zdata, zlen,
+					  PROJFS_CODEC_GIT_ZLIB);
+	check_result(argv0, res, EINVAL, "Git object chunk");
+	close(event.fd);
+
+	free(obj);
+	free(zdata);
+}
+#endif /* HAVE_ZLIB */
+
+int main(int argc, char *const argv[])
+{
+	char *data = make_data(TEST_DATA_LEN);
+
+	if (data == NULL)
+		test_exit_error(argv[0], "unable to allocate test data");
+
+	test_none(argv[0], data, TEST_DATA_LEN);
+#ifdef HAVE_ZLIB
+	test_zlib(argv[0], data, TEST_DATA_LEN);
+#endif
+
+	free(data);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,210 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+#define TEST_BASE_LEN (256 * 1024 + 3)
+#define TEST_DELTA_MAX_LEN 1024
+
+struct test_delta {
+	unsigned char data[TEST_DELTA_MAX_LEN];
+	size_t len;
+	char *result;			/* expected content */
+	size_t result_len;
+};
+
+static void add_size(struct test_delta *delta, size_t size)
+{
+	do {
+		unsigned char c = size & 0x7F;
+
+		size >>= 7;
+		delta->data[delta->len++] = c | (size ? 0x80 : 0);
+	} while (size);
+}
+
+static void add_copy(struct test_delta *delta, const char *base,
+		     size_t off, size_t len)
+{
+	size_t cmd = delta->len++;
+	int i;
+
+	delta->data[cmd] = 0x80;
+	for (i = 0; i < 4; ++i) {
+		if ((off >> (i * 8)) & 0xFF) {
+			delta->data[cmd] |= 1 << i;
+			delta->data[delta->len++] = (off >> (i * 8)) & 0xFF;
+		}
+	}
+	// a zero size encodes 0x10000
+	for (i = 0; i < 3 && len != 0x10000; ++i) {
+		if ((len >> (i * 8)) & 0xFF) {
+			delta->data[cmd] |= 1 << (i + 4);
+			delta->data[delta->len++] = (len >> (i * 8)) & 0xFF;
+		}
+	}
+
+	memcpy(delta->result + delta->result_len, base + off, len);
+	delta->result_len += len;
+}
+
+static void add_insert(struct test_delta *delta, const char *data)
+{
+	size_t len = strlen(data);
+
+	delta->data[delta->len++] = len;
+	memcpy(delta->data + delta->len, data, len);
+	delta->len += len;
+
+	memcpy(delta->result + delta->result_len, data, len);
+	delta->result_len += len;
+}
+
+/**
+ * Build a delta in Git's format from a sequence of copy and insert
+ * instructions, along with the content it is expected to produce.
+ */
+static void make_delta(const char *argv0, struct test_delta *delta,
+		       const char *base)
+{
+	unsigned char body[TEST_DELTA_MAX_LEN];
+	size_t body_len;
+
+	delta->result = malloc(2 * TEST_BASE_LEN);
+	if (delta->result == NULL)
+		test_exit_error(argv0, "unable to allocate result buffer");
+	delta->result_len = 0;
+
+	delta->len = 0;
+	add_insert(delta, "leading insert\n");
+	add_copy(delta, base, 100, 5000);
+	add_insert(delta, "middle insert\n");
+	add_copy(delta, base, 0, 0x10000);
+	add_copy(delta, base, 0x12345, 0x20000);
+	add_copy(delta, base, TEST_BASE_LEN - 7, 7);
+	add_insert(delta, "trailing insert\n");
+
+	// prepend the header now that the result size is known
+	memcpy(body, delta->data, delta->len);
+	body_len = delta->len;
+	delta->len = 0;
+	add_size(delta, TEST_BASE_LEN);
+	add_size(delta, delta->result_len);
+	memcpy(delta->data + delta->len, body, body_len);
+	delta->len += body_len;
+}
+
+static int make_file(const char *argv0, const char *data, size_t len)
+{
+	char path[] = "/tmp/test_delta.XXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd == -1 || unlink(path) == -1 || ftruncate(fd, len) == -1)
+		test_exit_error(argv0, "unable to create test file");
+	if (data != NULL && pwrite(fd, data, len, 0) != (ssize_t)len)
+		test_exit_error(argv0, "unable to write test file");
+
+	return fd;
+}
+
+static void check_delta(const char *argv0, int base_fd,
+			const unsigned char *delta, size_t delta_len,
+			const char *result, size_t len, int expected,
+			const char *desc)
+{
+	struct projfs_event event;
+	char *buf;
+	int res;
+
+	memset(&event, 0, sizeof(event));
+	event.fd = make_file(argv0, NULL, len);
+
+	res = projfs_write_delta(&event, base_fd, delta, delta_len);
+	if (res != expected) {
+		test_exit_error(argv0, "unexpected result for %s: %s",
+				desc, strerror(res));
+	}
+
+	if (expected == 0) {
+		buf = malloc(len);
+		if (buf == NULL)
+			test_exit_error(argv0, "unable to allocate buffer");
+		if (pread(event.fd, buf, len, 0) != (ssize_t)len ||
+		    memcmp(buf, result, len) != 0)
+			test_exit_error(argv0, "incorrect content for %s",
+					desc);
+		free(buf);
+	}
+
+	close(event.fd);
+}
+
+int main(int argc, char *const argv[])
+{
+	struct test_delta delta;
+	unsigned char bad[TEST_DELTA_MAX_LEN];
+	char *base;
+	int base_fd;
+	size_t i;
+
+	base = malloc(TEST_BASE_LEN);
+	if (base == NULL)
+		test_exit_error(argv[0], "unable to allocate base buffer");
+	for (i = 0; i < TEST_BASE_LEN; ++i)
+		base[i] = (char)(i * 7 + i / 251);
+	base_fd = make_file(argv[0], base, TEST_BASE_LEN);
+
+	make_delta(argv[0], &delta, base);
+	check_delta(argv[0], base_fd, delta.data, delta.len,
+		    delta.result, delta.result_len, 0, "delta");
+
+	check_delta(argv[0], base_fd, delta.data, delta.len,
+		    delta.result, delta.result_len + 1, EIO,
+		    "delta with wrong result size");
+	check_delta(argv[0], base_fd, delta.data, delta.len - 1,
+		    delta.result, delta.result_len, EIO, "truncated delta");
+
+	// corrupt the base size in the header
+	memcpy(bad, delta.data, delta.len);
+	bad[0] ^= 0x01;
+	check_delta(argv[0], base_fd, bad, delta.len,
+		    delta.result, delta.result_len, EIO,
+		    "delta with wrong base size");
+
+	// replace the trailing insert with the reserved instruction
+	memcpy(bad, delta.data, delta.len);
+	bad[delta.len - strlen("trailing insert\n") - 1] = 0;
+	check_delta(argv[0], base_fd, bad, delta.len,
+		    delta.result, delta.result_len, EIO,
+		    "delta with reserved instruction");
+
+	free(delta.result);
+	free(base);
+	close(base_fd);
+	exit(EXIT_SUCCESS);
+}
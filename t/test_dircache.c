@@ -0,0 +1,171 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE		// for nanosleep() in <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/dircache.h"
+#include "test_common.h"
+
+#define TEST_NUM_PATHS 1000
+
+static const char *const dirs[] = { ".", "a", "a/b", "a/b/c", "d", NULL };
+
+static void check_lookup(const char *argv0, struct dircache *cache,
+			 int dirfd, const char *path, int expected)
+{
+	if (dircache_lookup(cache, dirfd, path) != expected) {
+		test_exit_error(argv0, "lookup of %s: expected %s", path,
+				expected ? "hit" : "miss");
+	}
+}
+
+static void insert_dirs(const char *argv0, struct dircache *cache)
+{
+	unsigned long gen = dircache_gen(cache);
+	int i;
+
+	for (i = 0; dirs[i] != NULL; ++i) {
+		if (dircache_insert(cache, dirs[i], gen) == -1)
+			test_exit_error(argv0, "unable to insert %s", dirs[i]);
+	}
+}
+
+static void test_remove(const char *argv0, int dirfd)
+{
+	struct dircache *cache;
+	unsigned long gen;
+	char path[32];
+	int i;
+
+	cache = dircache_create();
+	if (cache == NULL)
+		test_exit_error(argv0, "unable to create dircache");
+
+	insert_dirs(argv0, cache);
+	check_lookup(argv0, cache, dirfd, "x", 0);
+
+	gen = dircache_gen(cache);
+	dircache_remove(cache, "a/b");
+	check_lookup(argv0, cache, dirfd, "a", 1);
+	check_lookup(argv0, cache, dirfd, "a/b", 0);
+	check_lookup(argv0, cache, dirfd, "a/b/c", 0);
+
+	// insertions which may race with a removal are ignored
+	if (dircache_insert(cache, "a/b", gen) == -1)
+		test_exit_error(argv0, "unable to insert a/b");
+	check_lookup(argv0, cache, dirfd, "a/b", 0);
+
+	// grow the table, then check removal does not match partial names
+	gen = dircache_gen(cache);
+	for (i = 0; i < TEST_NUM_PATHS; ++i) {
+		sprintf(path, "p%d", i);
+		if (dircache_insert(cache, path, gen) == -1)
+			test_exit_error(argv0, "unable to insert %s", path);
+	}
+	dircache_remove(cache, "p1");
+	for (i = 0; i < TEST_NUM_PATHS; ++i) {
+		sprintf(path, "p%d", i);
+		check_lookup(argv0, cache, dirfd, path, i != 1);
+	}
+
+	dircache_destroy(cache);
+}
+
+static void test_snapshot(const char *argv0, int dirfd)
+{
+	struct dircache *cache;
+	struct timespec ts = { 0, 50 * 1000 * 1000 };
+	int fd;
+
+	cache = dircache_create();
+	if (cache == NULL)
+		test_exit_error(argv0, "unable to create dircache");
+	insert_dirs(argv0, cache);
+	// entries for missing directories are not saved
+	if (dircache_insert(cache, "missing", dircache_gen(cache)) == -1)
+		test_exit_error(argv0, "unable to insert missing");
+	if (dircache_save(cache, dirfd, "snapshot") == -1)
+		test_exit_error(argv0, "unable to save snapshot: %s",
+				strerror(errno));
+	dircache_destroy(cache);
+
+	// allow for coarse ctime granularity before changing directories
+	nanosleep(&ts, NULL);
+	if (chmod("d", 0700) == -1 || rmdir("a/b/c") == -1)
+		test_exit_error(argv0, "unable to change directories");
+
+	cache = dircache_create();
+	if (cache == NULL)
+		test_exit_error(argv0, "unable to create dircache");
+	if (dircache_load(cache, dirfd, "snapshot") == -1)
+		test_exit_error(argv0, "unable to load snapshot: %s",
+				strerror(errno));
+	// removing a directory also changes the ctime of its parent
+	check_lookup(argv0, cache, dirfd, ".", 1);
+	check_lookup(argv0, cache, dirfd, "a", 1);
+	check_lookup(argv0, cache, dirfd, "a/b", 0);
+	check_lookup(argv0, cache, dirfd, "a/b/c", 0);
+	check_lookup(argv0, cache, dirfd, "d", 0);
+	check_lookup(argv0, cache, dirfd, "missing", 0);
+
+	if (dircache_load(cache, dirfd, "nonexistent") == -1)
+		test_exit_error(argv0, "missing snapshot not ignored");
+
+	fd = open("invalid", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || write(fd, "PROJFSDC", 8) != 8 ||
+	    ftruncate(fd, 4096) == -1)
+		test_exit_error(argv0, "unable to write invalid snapshot");
+	close(fd);
+	if (dircache_load(cache, dirfd, "invalid") != -1 || errno != EINVAL)
+		test_exit_error(argv0, "invalid snapshot not rejected");
+
+	dircache_destroy(cache);
+}
+
+int main(int argc, char *const argv[])
+{
+	int dirfd, i;
+
+	for (i = 1; dirs[i] != NULL; ++i) {
+		if (mkdir(dirs[i], 0755) == -1 && errno != EEXIST)
+			test_exit_error(argv[0], "unable to create %s",
+					dirs[i]);
+	}
+
+	dirfd = open(".", O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1)
+		test_exit_error(argv[0], "unable to open directory");
+
+	test_remove(argv[0], dirfd);
+	test_snapshot(argv[0], dirfd);
+
+	close(dirfd);
+	exit(EXIT_SUCCESS);
+}
@@ -22,6 +22,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -33,7 +36,7 @@ static int test_handle_event(struct projfs_event *event, const char *desc,
 {
 	unsigned int opt_flags, ret_flags;
 	const char *retfile, *lockfile = NULL;
-	int ret, timeout = 0, fd = 0, res;
+	int ret, timeout = 0, fd = 0, res, i;
 
 	opt_flags = test_get_opts((TEST_OPT_RETVAL | TEST_OPT_RETFILE |
 				   TEST_OPT_TIMEOUT | TEST_OPT_LOCKFILE),
@@ -50,6 +53,19 @@ static int test_handle_event(struct projfs_event *event, const char *desc,
 						     : event->target_path),
 		       event->mask >> 32, event->mask & 0xFFFFFFFF,
 		       event->pid);
+
+		if (event->length != 0) {
+			printf("  test chunk for %s: %jd+%jd\n", event->path,
+			       (intmax_t)event->offset,
+			       (intmax_t)event->length);
+		}
+
+		if (event->content_hash != NULL) {
+			printf("  test content hash for %s: ", event->path);
+			for (i = 0; i < PROJFS_CONTENT_HASH_SIZE; ++i)
+				printf("%02x", event->content_hash[i]);
+			printf("\n");
+		}
 	}
 
 	if (proj) {
@@ -58,7 +74,7 @@ static int test_handle_event(struct projfs_event *event, const char *desc,
 			ret = -EINVAL;
 		}
 
-		// TODO: hydrate file/dir based on projection list
+		// see test_mirror.c for a provider which hydrates content
 	}
 
 	if (lockfile) {
@@ -102,12 +118,116 @@ static int test_perm_event(struct projfs_event *event)
 	return test_handle_event(event, "permission request", 0, 1);
 }
 
+static int test_proj_batch(struct projfs_event *events, int *results,
+			   unsigned int nevents)
+{
+	unsigned int i;
+
+	for (i = 0; i < nevents; ++i) {
+		results[i] = test_handle_event(&events[i],
+					       "projection batch request",
+					       1, 0);
+	}
+
+	return 0;
+}
+
+#define TEST_QUEUE_MAX_EVENTS 16
+
+struct test_queue {
+	struct projfs *fs;
+	int stop_fds[2];		/* pipe to stop reading events */
+	pthread_t thread_id;
+};
+
+/* Read and handle queued events until the stop pipe is written */
+static void *test_read_events(void *data)
+{
+	struct test_queue *queue = data;
+	struct projfs_queued_event events[TEST_QUEUE_MAX_EVENTS];
+	struct pollfd pfds[2];
+	int n, i, res;
+
+	pfds[0].fd = projfs_get_event_fd(queue->fs);
+	pfds[0].events = POLLIN;
+	pfds[1].fd = queue->stop_fds[0];
+	pfds[1].events = POLLIN;
+	pfds[0].revents = pfds[1].revents = 0;
+
+	while (poll(pfds, 2, -1) != -1 || errno == EINTR) {
+		if (pfds[1].revents != 0)
+			break;
+		if (pfds[0].revents == 0)
+			continue;
+
+		n = projfs_read_events(queue->fs, events,
+				       TEST_QUEUE_MAX_EVENTS);
+		for (i = 0; i < n; ++i) {
+			switch (events[i].type) {
+			case PROJFS_EVENT_PROJ:
+				res = test_proj_event(&events[i].event);
+				break;
+			case PROJFS_EVENT_PERM:
+				res = test_perm_event(&events[i].event);
+				break;
+			default:
+				res = test_notify_event(&events[i].event);
+				break;
+			}
+			// tokens of another generation or already answered
+			// must be rejected
+			if (projfs_reply_event(events[i].token ^ (1ULL << 32),
+					       res) != EINVAL ||
+			    projfs_reply_event(events[i].token, res) != 0 ||
+			    projfs_reply_event(events[i].token, res) != EINVAL)
+				fprintf(stderr, "unexpected reply result: "
+					"token %" PRIu64 "\n", events[i].token);
+		}
+	}
+
+	return NULL;
+}
+
+static void test_start_queue(const char *argv0, struct test_queue *queue,
+			     struct projfs *fs)
+{
+	sigset_t newset, oldset;
+	int res;
+
+	queue->fs = fs;
+	if (pipe(queue->stop_fds) == -1)
+		test_exit_error(argv0, "unable to create pipe");
+
+	// leave signals to the main thread, which waits for them
+	sigfillset(&newset);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	res = pthread_create(&queue->thread_id, NULL, test_read_events,
+			     queue);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (res != 0)
+		test_exit_error(argv0, "unable to create thread");
+}
+
+static void test_stop_queue(struct test_queue *queue)
+{
+	char c = 0;
+
+	if (write(queue->stop_fds[1], &c, 1) == 1)
+		pthread_join(queue->thread_id, NULL);
+
+	close(queue->stop_fds[0]);
+	close(queue->stop_fds[1]);
+}
+
 int main(int argc, char *const argv[])
 {
 	const char *lower_path, *mount_path;
 	struct test_mount_args mount_args;
+	struct test_queue queue;
 	struct projfs *fs;
 	struct projfs_handlers handlers = { 0 };
+	int queued;
 
 	test_parse_mount_opts(argc, argv,
 			      (TEST_OPT_RETVAL | TEST_OPT_RETFILE |
@@ -117,11 +237,21 @@ int main(int argc, char *const argv[])
 	handlers.handle_proj_event = &test_proj_event;
 	handlers.handle_notify_event = &test_notify_event;
 	handlers.handle_perm_event = &test_perm_event;
+	handlers.handle_proj_batch = &test_proj_batch;
 
 	fs = test_start_mount(lower_path, mount_path,
 			      &handlers, sizeof(handlers), NULL,
 			      &mount_args);
+
+	// handle events from our own thread if mounted with --event-queue
+	queued = (projfs_get_event_fd(fs) != -1);
+	if (queued)
+		test_start_queue(argv[0], &queue, fs);
+
 	test_wait_signal();
+
+	if (queued)
+		test_stop_queue(&queue);
 	test_stop_mount(fs);
 
 	test_free_opts(&mount_args);
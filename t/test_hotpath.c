@@ -0,0 +1,138 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/hotpath.h"
+#include "test_common.h"
+
+#define TEST_NUM_COLD 1000
+#define TEST_NUM_HOT 1000
+#define TEST_NUM_WARM 500
+#define TEST_SIZE 8
+
+static void check_path(const char *argv0, const struct projfs_hot_path *hp,
+		       const char *op, const char *path, uint64_t count)
+{
+	if (strcmp(hp->op, op) != 0 || strcmp(hp->path, path) != 0) {
+		test_exit_error(argv0, "expected %s %s, got %s %s",
+				op, path, hp->op, hp->path);
+	}
+	// estimates may exceed, but never fall short of, the true count
+	if (hp->count < count) {
+		test_exit_error(argv0, "count of %s %s: %llu < %llu",
+				op, path, (unsigned long long)hp->count,
+				(unsigned long long)count);
+	}
+}
+
+static void free_paths(struct projfs_hot_path *paths, unsigned int npaths)
+{
+	unsigned int i;
+
+	for (i = 0; i < npaths; ++i)
+		free(paths[i].path);
+}
+
+static void test_ranking(const char *argv0)
+{
+	struct projfs_hot_path paths[TEST_SIZE * 2];
+	struct hotpath *hot;
+	unsigned int n, i;
+	char path[32];
+
+	hot = hotpath_create(TEST_SIZE);
+	if (hot == NULL)
+		test_exit_error(argv0, "unable to create hotpath");
+
+	// interleave the heavy hitters with a long tail of cold paths
+	for (i = 0; i < TEST_NUM_COLD; ++i) {
+		sprintf(path, "cold/%u", i);
+		hotpath_add(hot, "open", path, 1);
+		hotpath_add(hot, "open", "hot", 1);
+		if (i % 2 == 0)
+			hotpath_add(hot, "open", "warm", 1);
+	}
+
+	// the same path is tracked separately for each operation
+	hotpath_add(hot, "getattr", "hot", 1);
+
+	n = hotpath_get(hot, paths, TEST_SIZE * 2);
+	if (n != TEST_SIZE)
+		test_exit_error(argv0, "expected %u paths, got %u",
+				TEST_SIZE, n);
+
+	check_path(argv0, &paths[0], "open", "hot", TEST_NUM_HOT);
+	check_path(argv0, &paths[1], "open", "warm", TEST_NUM_WARM);
+	for (i = 1; i < n; ++i) {
+		if (paths[i].count > paths[i - 1].count)
+			test_exit_error(argv0, "paths not in descending order");
+	}
+	free_paths(paths, n);
+
+	// a caller may request fewer than are tracked
+	n = hotpath_get(hot, paths, 1);
+	if (n != 1)
+		test_exit_error(argv0, "expected 1 path, got %u", n);
+	check_path(argv0, &paths[0], "open", "hot", TEST_NUM_HOT);
+	free_paths(paths, n);
+
+	hotpath_destroy(hot);
+}
+
+static void test_weights(const char *argv0)
+{
+	struct projfs_hot_path paths[TEST_SIZE];
+	struct hotpath *hot;
+	unsigned int n;
+
+	hot = hotpath_create(TEST_SIZE);
+	if (hot == NULL)
+		test_exit_error(argv0, "unable to create hotpath");
+
+	n = hotpath_get(hot, paths, TEST_SIZE);
+	if (n != 0)
+		test_exit_error(argv0, "expected no paths, got %u", n);
+
+	// one slow call outweighs many fast ones
+	hotpath_add(hot, "proj", "slow", 50000);
+	for (n = 0; n < 100; ++n)
+		hotpath_add(hot, "proj", "fast", 10);
+
+	n = hotpath_get(hot, paths, TEST_SIZE);
+	if (n != 2)
+		test_exit_error(argv0, "expected 2 paths, got %u", n);
+	check_path(argv0, &paths[0], "proj", "slow", 50000);
+	check_path(argv0, &paths[1], "proj", "fast", 1000);
+	free_paths(paths, n);
+
+	hotpath_destroy(hot);
+}
+
+int main(int argc, char *const argv[])
+{
+	test_ranking(argv[0]);
+	test_weights(argv[0]);
+
+	exit(EXIT_SUCCESS);
+}
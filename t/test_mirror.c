@@ -0,0 +1,346 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE		// for asprintf() in <stdio.h>
+				// and copy_file_range() in <unistd.h>
+
+#include "../include/config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+/*
+ * Reference provider which projects the contents of a source directory,
+ * both as an example of a provider built on the public projection API and
+ * as a benchmark target whose backing store is local and fast, optionally
+ * with simulated per-request latency and bandwidth limits.
+ */
+
+#define TEST_MIRROR_BLOCK_SIZE (64 * 1024)
+
+struct test_mirror {
+	int source_fd;
+	long int latency;		/* milliseconds per request */
+	long int bandwidth;		/* KiB per second, or 0 if unlimited */
+};
+
+static void test_sleep_msec(long int msec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Delay long enough for len bytes to be transferred at the bandwidth limit */
+static void test_throttle(const struct test_mirror *mirror, size_t len)
+{
+	if (mirror->bandwidth > 0)
+		test_sleep_msec(len * 1000 / (mirror->bandwidth * 1024));
+}
+
+static char *test_child_path(const char *path, const char *name)
+{
+	char *child;
+
+	if (strcmp(path, ".") == 0)
+		return strdup(name);
+	if (asprintf(&child, "%s/%s", path, name) == -1)
+		return NULL;
+	return child;
+}
+
+static int test_create_entry(struct projfs *fs, int dir_fd, const char *name,
+			     const char *path)
+{
+	char target[PATH_MAX];
+	struct stat st;
+	ssize_t len;
+
+	if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return errno;
+
+	switch (st.st_mode & S_IFMT) {
+	case S_IFDIR:
+		return projfs_create_proj_dir(fs, path, st.st_mode & 07777,
+					      NULL, 0);
+	case S_IFREG:
+		return projfs_create_proj_file(fs, path, st.st_size,
+					       st.st_mode & 07777, NULL, 0);
+	case S_IFLNK:
+		len = readlinkat(dir_fd, name, target, sizeof(target) - 1);
+		if (len == -1)
+			return errno;
+		target[len] = '\0';
+		return projfs_create_proj_symlink(fs, path, target);
+	default:
+		// other file types cannot be projected, so skip them
+		return 0;
+	}
+}
+
+/* Create placeholders for all the entries of a source directory at once */
+static int test_project_dir(const struct test_mirror *mirror,
+			    struct projfs_event *event)
+{
+	struct dirent *dent;
+	DIR *dir;
+	char *path;
+	int fd, res = 0;
+
+	fd = openat(mirror->source_fd, event->path,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1)
+		return errno;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		res = errno;
+		close(fd);
+		return res;
+	}
+
+	while (res == 0 && (dent = readdir(dir)) != NULL) {
+		if (strcmp(dent->d_name, ".") == 0 ||
+		    strcmp(dent->d_name, "..") == 0)
+			continue;
+
+		path = test_child_path(event->path, dent->d_name);
+		if (path == NULL) {
+			res = ENOMEM;
+			break;
+		}
+
+		res = test_create_entry(event->fs, fd, dent->d_name, path);
+		if (res == EEXIST)
+			res = 0;
+		free(path);
+	}
+
+	closedir(dir);
+	return res;
+}
+
+/* Share the source extents with the placeholder, if the filesystem can */
+static int test_clone_range(int src_fd, int dst_fd, off_t off, off_t len,
+			    off_t size)
+{
+	struct file_clone_range range;
+
+	if (off == 0 && len == size)
+		return ioctl(dst_fd, FICLONE, src_fd);
+
+	range.src_fd = src_fd;
+	range.src_offset = off;
+	range.src_length = (off + len == size) ? 0 : len;
+	range.dest_offset = off;
+	return ioctl(dst_fd, FICLONERANGE, &range);
+}
+
+static ssize_t test_copy_block(int src_fd, int dst_fd, off_t off, size_t len,
+			       char *buf)
+{
+	ssize_t res;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t off_in = off, off_out = off;
+
+	res = copy_file_range(src_fd, &off_in, dst_fd, &off_out, len, 0);
+	if (res != -1 || (errno != ENOSYS && errno != EXDEV &&
+			  errno != EINVAL && errno != EOPNOTSUPP))
+		return res;
+#endif
+
+	res = pread(src_fd, buf, len, off);
+	if (res > 0)
+		res = pwrite(dst_fd, buf, res, off);
+	return res;
+}
+
+/* Hydrate a placeholder file, or one chunk of it, from the source file */
+static int test_project_file(const struct test_mirror *mirror,
+			     struct projfs_event *event)
+{
+	struct stat st;
+	off_t off, end;
+	ssize_t len;
+	char *buf = NULL;
+	int fd, res = 0;
+
+	fd = openat(mirror->source_fd, event->path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return errno;
+	if (fstat(fd, &st) == -1) {
+		res = errno;
+		goto out_close;
+	}
+
+	off = event->offset;
+	end = (event->length == 0) ? st.st_size : off + event->length;
+	if (end > st.st_size)
+		end = st.st_size;
+	if (off >= end)
+		goto out_close;
+
+	// cloning is near-instant, so only try it if bandwidth is unlimited
+	if (mirror->bandwidth == 0 &&
+	    test_clone_range(fd, event->fd, off, end - off, st.st_size) == 0)
+		goto out_close;
+
+	buf = malloc(TEST_MIRROR_BLOCK_SIZE);
+	if (buf == NULL) {
+		res = ENOMEM;
+		goto out_close;
+	}
+
+	while (off < end) {
+		len = end - off;
+		if (len > TEST_MIRROR_BLOCK_SIZE)
+			len = TEST_MIRROR_BLOCK_SIZE;
+
+		len = test_copy_block(fd, event->fd, off, len, buf);
+		if (len <= 0) {
+			res = (len == 0) ? EIO : errno;
+			break;
+		}
+
+		off += len;
+		test_throttle(mirror, len);
+	}
+
+	free(buf);
+out_close:
+	close(fd);
+	return res;
+}
+
+static int test_proj_event(struct projfs_event *event)
+{
+	const struct test_mirror *mirror;
+	int res;
+
+	if ((event->mask & ~PROJFS_ONDIR) != PROJFS_CREATE)
+		return -EINVAL;
+
+	mirror = projfs_get_user_data(event->fs);
+	if (mirror->latency > 0)
+		test_sleep_msec(mirror->latency);
+
+	if (event->mask & PROJFS_ONDIR)
+		res = test_project_dir(mirror, event);
+	else
+		res = test_project_file(mirror, event);
+
+	if (res > 0)
+		fprintf(stderr, "unable to project %s: %s\n", event->path,
+			strerror(res));
+
+	return -res;
+}
+
+/* Stop with a deadline, reporting the outcome of each attempt */
+static void test_stop_mirror(struct projfs *fs, long int timeout)
+{
+	struct projfs_stop_status status;
+	int res;
+
+	do {
+		res = projfs_stop_timeout(fs, timeout, &status);
+		printf("stop: %s; refused %u, dropped %u, running %u\n",
+		       (res == 0) ? "stopped" : "timed out",
+		       status.refused, status.dropped, status.running);
+	} while (res > 0);
+}
+
+int main(int argc, char *const argv[])
+{
+	const char *lower_path, *mount_path, *source_path = NULL;
+	const char *prefetch_path = NULL;
+	struct test_mount_args mount_args;
+	struct test_mirror mirror = { 0 };
+	struct projfs *fs;
+	struct projfs_handlers handlers = { 0 };
+	unsigned int opt_flags;
+	long int stop_timeout;
+	int res;
+
+	test_parse_mount_opts(argc, argv,
+			      (TEST_OPT_SOURCE | TEST_OPT_LATENCY |
+			       TEST_OPT_BANDWIDTH | TEST_OPT_STOPTIMEOUT |
+			       TEST_OPT_PREFETCH),
+			      &lower_path, &mount_path, &mount_args);
+
+	opt_flags = test_get_opts((TEST_OPT_SOURCE | TEST_OPT_LATENCY |
+				   TEST_OPT_BANDWIDTH | TEST_OPT_STOPTIMEOUT |
+				   TEST_OPT_PREFETCH),
+				  &source_path, &mirror.latency,
+				  &mirror.bandwidth, &stop_timeout,
+				  &prefetch_path);
+
+	if ((opt_flags & TEST_OPT_SOURCE) == TEST_OPT_NONE)
+		test_exit_error(argv[0], "missing source path");
+
+	mirror.source_fd = open(source_path, O_RDONLY | O_DIRECTORY);
+	if (mirror.source_fd == -1)
+		test_exit_error(argv[0], "unable to open source: %s: %s",
+				source_path, strerror(errno));
+
+	handlers.handle_proj_event = &test_proj_event;
+
+	fs = test_start_mount(lower_path, mount_path,
+			      &handlers, sizeof(handlers), &mirror,
+			      &mount_args);
+
+	// report once the profiled files are hydrated, so tests may wait
+	if ((opt_flags & TEST_OPT_PREFETCH) != TEST_OPT_NONE) {
+		res = projfs_prefetch_profile(fs, prefetch_path, 0);
+		if (res != 0)
+			test_exit_error(argv[0], "unable to prefetch: %s: %s",
+					prefetch_path, strerror(res));
+		printf("prefetch: done\n");
+		fflush(stdout);
+	}
+
+	test_wait_signal();
+	if ((opt_flags & TEST_OPT_STOPTIMEOUT) != TEST_OPT_NONE)
+		test_stop_mirror(fs, stop_timeout);
+	else
+		test_stop_mount(fs);
+
+	close(mirror.source_fd);
+	test_free_opts(&mount_args);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,100 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_common.h"
+
+#define TEST_PROVIDER_MAX_EVENTS 16
+
+static const char *test_event_desc(unsigned int type)
+{
+	switch (type) {
+	case PROJFS_EVENT_PROJ:
+		return "projection request";
+	case PROJFS_EVENT_PERM:
+		return "permission request";
+	default:
+		return "event notification";
+	}
+}
+
+/*
+ * Out-of-process provider which connects to a filesystem's provider socket
+ * and reports events in the same format as test_handlers, allowing all
+ * requests, until terminated.
+ */
+int main(int argc, char *const argv[])
+{
+	struct projfs_queued_event events[TEST_PROVIDER_MAX_EVENTS];
+	struct projfs_provider *prov;
+	struct projfs_event *event;
+	struct pollfd pfd;
+	char *sock_path;
+	int n, i;
+
+	test_parse_opts(argc, argv, TEST_OPT_NONE, 1, 1, &sock_path, NULL,
+			"<socket-path>");
+
+	// output must not be lost when the provider is killed
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	prov = projfs_provider_connect(sock_path);
+	if (prov == NULL)
+		test_exit_error(argv[0], "unable to connect to %s: %s",
+				sock_path, strerror(errno));
+
+	pfd.fd = projfs_provider_get_event_fd(prov);
+	pfd.events = POLLIN;
+
+	while (poll(&pfd, 1, -1) != -1 || errno == EINTR) {
+		n = projfs_provider_read_events(prov, events,
+						TEST_PROVIDER_MAX_EVENTS);
+		if (n < 0)
+			test_exit_error(argv[0], "unable to read events: %s",
+					strerror(-n));
+
+		for (i = 0; i < n; ++i) {
+			event = &events[i].event;
+			printf("  test %s for %s%s%s: "
+			       "0x%04" PRIx64 "-%08" PRIx64 ", %d\n",
+			       test_event_desc(events[i].type), event->path,
+			       ((event->target_path == NULL) ? "" : ", "),
+			       ((event->target_path == NULL)
+					? "" : event->target_path),
+			       event->mask >> 32, event->mask & 0xFFFFFFFF,
+			       event->pid);
+
+			projfs_provider_reply(prov, events[i].token,
+					      (events[i].type ==
+					       PROJFS_EVENT_PERM)
+						? PROJFS_ALLOW : 0);
+		}
+	}
+
+	projfs_provider_disconnect(prov);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,83 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE		// for SEEK_DATA and SEEK_HOLE in <unistd.h>
+
+#include "../include/config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+static void print_seek(int fd, off_t off, int whence)
+{
+	off_t res;
+
+	res = lseek(fd, off, whence);
+	if (res == -1)
+		printf(" %s", (errno == ENXIO) ? "ENXIO" : strerror(errno));
+	else
+		printf(" %jd", (intmax_t)res);
+}
+
+int main(int argc, char *const argv[])
+{
+	int fd, i;
+
+	// report whether the library forwards lseek(2) to the lower file
+	if (argc == 2 && strcmp(argv[1], "--supported") == 0) {
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+		exit(EXIT_SUCCESS);
+#else
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <file-path> <offset>...\n",
+			argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd == -1)
+		test_exit_error(argv[0], "unable to open file: %s: %s",
+				argv[1], strerror(errno));
+
+	// print the next data and hole offsets from each offset
+	for (i = 2; i < argc; ++i) {
+		off_t off = test_parse_long(argv[i], 0);
+
+		printf("%jd:", (intmax_t)off);
+		print_seek(fd, off, SEEK_DATA);
+		print_seek(fd, off, SEEK_HOLE);
+		printf("\n");
+	}
+
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,106 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/sha256.h"
+#include "test_common.h"
+
+struct sha256_vector {
+	const char *data;
+	size_t repeat;
+	const char *digest;
+};
+
+// test vectors from FIPS 180-4 examples and NIST CSRC
+static const struct sha256_vector vectors[] = {
+	{ "", 1,
+	  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abc", 1,
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "a", 1000000,
+	  "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+	{ NULL, 0, NULL }
+};
+
+// chunk sizes with which to feed data, including ones spanning blocks
+static const size_t chunk_sizes[] = { 1, 3, 63, 64, 65, 1000, 0 };
+
+static void format_digest(const unsigned char *digest, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; ++i)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void test_vector(const char *argv0, const struct sha256_vector *v,
+			size_t chunk_size)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char hex[SHA256_DIGEST_SIZE * 2 + 1];
+	struct sha256_ctx ctx;
+	size_t len = strlen(v->data);
+	size_t total = len * v->repeat;
+	char *data;
+	size_t i, off;
+
+	data = malloc(total + 1);
+	if (data == NULL)
+		test_exit_error(argv0, "unable to allocate test data");
+	for (i = 0; i < v->repeat; ++i)
+		memcpy(data + i * len, v->data, len);
+
+	sha256_init(&ctx);
+	for (off = 0; off < total; off += chunk_size) {
+		size_t n = (total - off < chunk_size) ? total - off
+						      : chunk_size;
+
+		sha256_update(&ctx, data + off, n);
+	}
+	sha256_final(&ctx, digest);
+	free(data);
+
+	format_digest(digest, hex);
+	if (strcmp(hex, v->digest) != 0) {
+		test_exit_error(argv0, "incorrect digest for \"%s\" x %zu "
+				       "in chunks of %zu: %s; expected %s",
+				v->data, v->repeat, chunk_size,
+				hex, v->digest);
+	}
+}
+
+int main(int argc, char *const argv[])
+{
+	const struct sha256_vector *v;
+	const size_t *chunk_size;
+
+	for (v = vectors; v->data != NULL; ++v) {
+		for (chunk_size = chunk_sizes; *chunk_size > 0; ++chunk_size)
+			test_vector(argv[0], v, *chunk_size);
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,135 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE		// for AT_SYMLINK_NOFOLLOW in <fcntl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lib/uring.h"
+#include "test_common.h"
+
+// more than one ring's worth, so batches are split
+#define TEST_NUM_NAMES 100
+#define TEST_NUM_THREADS 4
+
+static char names_buf[TEST_NUM_NAMES][16];
+static const char *names[TEST_NUM_NAMES];
+
+static int check_batch(int dirfd)
+{
+	struct stat attrs[TEST_NUM_NAMES], st;
+	int results[TEST_NUM_NAMES];
+	int i, err;
+
+	uring_stat_batch(dirfd, names, TEST_NUM_NAMES, attrs, results);
+
+	for (i = 0; i < TEST_NUM_NAMES; ++i) {
+		err = (fstatat(dirfd, names[i], &st,
+			       AT_SYMLINK_NOFOLLOW) == -1) ? errno : 0;
+		if (results[i] != err)
+			return -1;
+		if (err == 0 &&
+		    (attrs[i].st_ino != st.st_ino ||
+		     attrs[i].st_mode != st.st_mode ||
+		     attrs[i].st_size != st.st_size ||
+		     attrs[i].st_dev != st.st_dev ||
+		     attrs[i].st_mtim.tv_sec != st.st_mtim.tv_sec ||
+		     attrs[i].st_mtim.tv_nsec != st.st_mtim.tv_nsec))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *check_thread(void *data)
+{
+	int *dirfd = data;
+
+	return (check_batch(*dirfd) == -1) ? data : NULL;
+}
+
+int main(int argc, char *const argv[])
+{
+	pthread_t threads[TEST_NUM_THREADS];
+	void *res;
+	int dirfd, fd, i;
+
+	// a mix of files, directories, symlinks, and missing entries
+	for (i = 0; i < TEST_NUM_NAMES; ++i) {
+		sprintf(names_buf[i], "n%d", i);
+		names[i] = names_buf[i];
+
+		switch (i % 4) {
+		case 0:
+			fd = open(names[i], O_WRONLY | O_CREAT | O_TRUNC,
+				  0644);
+			if (fd == -1 || ftruncate(fd, i) == -1)
+				test_exit_error(argv[0], "unable to create %s",
+						names[i]);
+			close(fd);
+			break;
+		case 1:
+			if (mkdir(names[i], 0755) == -1 && errno != EEXIST)
+				test_exit_error(argv[0], "unable to create %s",
+						names[i]);
+			break;
+		case 2:
+			if (symlink("missing", names[i]) == -1 &&
+			    errno != EEXIST)
+				test_exit_error(argv[0], "unable to create %s",
+						names[i]);
+			break;
+		default:
+			// leave the remaining names as missing entries
+			break;
+		}
+	}
+
+	dirfd = open(".", O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1)
+		test_exit_error(argv[0], "unable to open directory");
+
+	if (check_batch(dirfd) == -1)
+		test_exit_error(argv[0], "batch results differ from fstatat");
+
+	// each thread uses its own ring
+	for (i = 0; i < TEST_NUM_THREADS; ++i) {
+		if (pthread_create(&threads[i], NULL, check_thread,
+				   &dirfd) > 0)
+			test_exit_error(argv[0], "unable to create thread");
+	}
+	for (i = 0; i < TEST_NUM_THREADS; ++i) {
+		pthread_join(threads[i], &res);
+		if (res != NULL)
+			test_exit_error(argv[0], "thread results differ "
+					"from fstatat");
+	}
+
+	close(dirfd);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,76 @@
+/* Linux Projected Filesystem
+   Copyright (C) 2019 GitHub, Inc.
+
+   See the NOTICE file distributed with this library for additional
+   information regarding copyright ownership.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library, in the file COPYING; if not,
+   see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "test_common.h"
+
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// callbacks run concurrently, so keep each output line intact
+static int test_walk_entry(const struct projfs_walk_entry *entry, void *data)
+{
+	(void)data;
+
+	pthread_mutex_lock(&output_mutex);
+	printf("%c %#x %#x %s\n", S_ISDIR(entry->st->st_mode) ? 'd' : '-',
+	       entry->state, entry->problems, entry->path);
+	pthread_mutex_unlock(&output_mutex);
+
+	return 0;
+}
+
+int main(int argc, char *const argv[])
+{
+	const char *subtree = NULL;
+	unsigned int filter, nthreads;
+	struct projfs *fs;
+	int res;
+
+	if (argc < 4 || argc > 5) {
+		fprintf(stderr, "Usage: %s <lower-path> <filter> <threads> "
+				"[<subtree>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	filter = test_parse_long(argv[2], 0);
+	nthreads = test_parse_long(argv[3], 0);
+	if (argc == 5)
+		subtree = argv[4];
+
+	// the walk reads the lower directory, so no mount is needed
+	fs = projfs_new(argv[1], argv[1], NULL, 0, NULL, 0, NULL);
+	if (fs == NULL)
+		test_exit_error(argv[0], "unable to create filesystem");
+
+	res = projfs_walk(fs, subtree, filter, test_walk_entry, NULL,
+			  nthreads);
+	if (res != 0)
+		test_exit_error(argv[0], "unable to walk %s: %s",
+				(subtree == NULL) ? "." : subtree,
+				strerror(res));
+
+	projfs_stop(fs);
+	exit(EXIT_SUCCESS);
+}